@@ -0,0 +1,239 @@
+#include "AnimationValidator.hpp"
+
+#include <float.h>
+
+#include <algorithm>
+#include <ppl.h>
+
+#include "CharacterManager.hpp"
+
+double GetPreciseTime(void);
+
+bool AnimationValidator::GetPenetrationDepth(Box& A, Box& B, float& Depth)
+{
+	vec3 Offset = B.Center - A.Center;
+
+	vec3 Axes[15];
+	int AxisCount = 0;
+
+	for (int i = 0; i < 3; i++) {
+		Axes[AxisCount++] = A.Axes[i];
+		Axes[AxisCount++] = B.Axes[i];
+	}
+
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++) {
+
+			vec3 Axis = cross(A.Axes[i], B.Axes[j]);
+
+			// parallel edges, already covered by the face axes
+			float Length = length(Axis);
+			if (Length > 0.00001f)
+				Axes[AxisCount++] = Axis / Length;
+		}
+
+	Depth = FLT_MAX;
+
+	for (int Index = 0; Index < AxisCount; Index++) {
+
+		vec3& Axis = Axes[Index];
+
+		float RadiusA = 0, RadiusB = 0;
+
+		for (int i = 0; i < 3; i++) {
+			RadiusA += A.HalfSize[i] * fabs(dot(A.Axes[i], Axis));
+			RadiusB += B.HalfSize[i] * fabs(dot(B.Axes[i], Axis));
+		}
+
+		float Overlap = RadiusA + RadiusB - fabs(dot(Offset, Axis));
+		if (Overlap < 0)
+			return false;
+
+		Depth = std::min(Depth, Overlap);
+	}
+
+	return true;
+}
+
+float AnimationValidator::GetFloorDepth(Box& A, float FloorZ)
+{
+	float Extent = 0;
+
+	for (int i = 0; i < 3; i++)
+		Extent += A.HalfSize[i] * fabs(A.Axes[i].z);
+
+	return FloorZ - (A.Center.z - Extent);
+}
+
+void AnimationValidator::ValidateSample(vector<CharacterSerializedState*>& Keyframes, vector<int32>& BoneIDs, float Length, int32 Sample,
+	PhysicsManager::BoneFilterCallback& Filter, float FloorZ, vector<quat>& Rotations, vector<mat4>& WorldTransforms, vector<Box>& Boxes, vector<SampleHit>& Hits)
+{
+	Character* Char = CharacterManager::GetInstance().GetCharacter();
+
+	CharacterSerializedState *PrevState, *NextState;
+	float t;
+
+	SerializationManager::GetStatesAndTFromSortedStates(Keyframes, std::min(Sample / SampleRate, Length), Length, PrevState, NextState, t);
+
+	CharacterSerializedState State;
+	SerializationManager::InterpolateStates(*PrevState, *NextState, t, State);
+
+	Rotations.assign(Char->Bones.size(), quat(1, 0, 0, 0));
+
+	for (size_t Index = 0; Index < State.Bones.size() && Index < BoneIDs.size(); Index++)
+		if (BoneIDs[Index] >= 0)
+			Rotations[BoneIDs[Index]] = State.Bones[Index].Rotation;
+
+	Char->CalculateWorldTransforms(State.Position, Rotations, WorldTransforms);
+
+	Boxes.resize(Char->Bones.size());
+
+	for (Bone* Bone : Char->Bones) {
+
+		mat4 Transform = WorldTransforms[Bone->ID] * Bone->MiddleTranslation;
+
+		Box& B = Boxes[Bone->ID];
+		B.Center = Transform[3];
+		B.Axes = mat3(Transform);
+		B.HalfSize = Bone->Size * 0.5f;
+		B.Radius = length(B.HalfSize);
+
+		float Depth = GetFloorDepth(B, FloorZ);
+		if (Depth > PenetrationTolerance)
+			Hits.push_back({ Sample, FloorPenetration, Bone->ID, Bone->ID, Depth });
+	}
+
+	uint32 BoneCount = (uint32)Boxes.size();
+
+	for (uint32 ID0 = 0; ID0 < BoneCount; ID0++)
+		for (uint32 ID1 = ID0 + 1; ID1 < BoneCount; ID1++) {
+
+			if (Filter.IsPairExcluded(ID0, ID1))
+				continue;
+
+			Box& A = Boxes[ID0];
+			Box& B = Boxes[ID1];
+
+			if (distance(A.Center, B.Center) > A.Radius + B.Radius)
+				continue;
+
+			float Depth;
+			if (GetPenetrationDepth(A, B, Depth) && Depth > PenetrationTolerance)
+				Hits.push_back({ Sample, BonePenetration, ID0, ID1, Depth });
+		}
+}
+
+void AnimationValidator::Validate(vector<ValidationIssue>& Issues)
+{
+	Issues.clear();
+
+	double StartTime = GetPreciseTime();
+
+	Character* Char = CharacterManager::GetInstance().GetCharacter();
+
+	vector<CharacterSerializedState> Keyframes;
+	SerializationManager::GetInstance().GetSortedKeyframes(Keyframes);
+
+	if (Keyframes.empty())
+		return;
+
+	vector<CharacterSerializedState*> SortedStates;
+	for (CharacterSerializedState& Keyframe : Keyframes)
+		SortedStates.push_back(&Keyframe);
+
+	// interpolation pairs bones by index, like playback does
+	vector<int32> BoneIDs;
+	for (SerializedBone& SerializedBone : Keyframes.front().Bones) {
+
+		Bone* Bone = Char->FindBone(SerializedBone.Name);
+		BoneIDs.push_back(Bone != nullptr ? Bone->ID : -1);
+	}
+
+	float Length = SerializationManager::GetInstance().GetAnimationLength();
+
+	PhysicsManager& Physics = PhysicsManager::GetInstance();
+	float FloorZ = Physics.GetFloorPosition().z + Physics.GetFloorSize().z * 0.5f;
+
+	PhysicsManager::BoneFilterCallback Filter;
+	Filter.Build(Char);
+
+	int32 SampleCount = (int32)(Length * SampleRate) + 1;
+	int32 ChunkCount = (SampleCount + SamplesPerChunk - 1) / SamplesPerChunk;
+
+	concurrency::combinable<vector<SampleHit>> ChunkHits;
+
+	concurrency::parallel_for(int32(0), ChunkCount, [&](int32 Chunk) {
+
+		vector<quat> Rotations;
+		vector<mat4> WorldTransforms;
+		vector<Box> Boxes;
+
+		vector<SampleHit>& Hits = ChunkHits.local();
+
+		int32 EndSample = std::min((Chunk + 1) * SamplesPerChunk, SampleCount);
+
+		for (int32 Sample = Chunk * SamplesPerChunk; Sample < EndSample; Sample++)
+			ValidateSample(SortedStates, BoneIDs, Length, Sample, Filter, FloorZ, Rotations, WorldTransforms, Boxes, Hits);
+	});
+
+	vector<SampleHit> Hits;
+
+	ChunkHits.combine_each([&Hits](vector<SampleHit>& ChunkHit) {
+		Hits.insert(Hits.end(), ChunkHit.begin(), ChunkHit.end());
+	});
+
+	sort(Hits.begin(), Hits.end(), [](const SampleHit& a, const SampleHit& b) {
+		if (a.Type != b.Type)
+			return a.Type < b.Type;
+		if (a.ID0 != b.ID0)
+			return a.ID0 < b.ID0;
+		if (a.ID1 != b.ID1)
+			return a.ID1 < b.ID1;
+		return a.Sample < b.Sample;
+	});
+
+	for (size_t Index = 0; Index < Hits.size(); Index++) {
+
+		SampleHit& Hit = Hits[Index];
+
+		if (Index > 0) {
+
+			SampleHit& Previous = Hits[Index - 1];
+			ValidationIssue& Last = Issues.back();
+
+			if (Previous.Type == Hit.Type && Previous.ID0 == Hit.ID0 && Previous.ID1 == Hit.ID1 && Previous.Sample + 1 == Hit.Sample) {
+
+				Last.EndTime = Hit.Sample / SampleRate;
+				Last.MaxDepth = std::max(Last.MaxDepth, Hit.Depth);
+				continue;
+			}
+		}
+
+		ValidationIssue Issue;
+		Issue.Type = Hit.Type;
+		Issue.Bone0 = Char->Bones[Hit.ID0];
+		Issue.Bone1 = Hit.Type == BonePenetration ? Char->Bones[Hit.ID1] : nullptr;
+		Issue.StartTime = Hit.Sample / SampleRate;
+		Issue.EndTime = Issue.StartTime;
+		Issue.MaxDepth = Hit.Depth;
+
+		Issues.push_back(Issue);
+	}
+
+	sort(Issues.begin(), Issues.end(), [](const ValidationIssue& a, const ValidationIssue& b) {
+		return a.StartTime < b.StartTime;
+	});
+
+	for (ValidationIssue& Issue : Issues) {
+
+		if (Issue.Type == FloorPenetration)
+			printf("%.3f - %.3f s: %ls below the floor by %.1f mm\n", Issue.StartTime, Issue.EndTime,
+				Issue.Bone0->GetName().c_str(), Issue.MaxDepth * 1000.0f);
+		else
+			printf("%.3f - %.3f s: %ls and %ls interpenetrate by %.1f mm\n", Issue.StartTime, Issue.EndTime,
+				Issue.Bone0->GetName().c_str(), Issue.Bone1->GetName().c_str(), Issue.MaxDepth * 1000.0f);
+	}
+
+	printf("Validated %d samples of %d keyframes in %.1f ms, %d issues\n", SampleCount, (int32)Keyframes.size(),
+		(GetPreciseTime() - StartTime) * 1000.0, (int32)Issues.size());
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Character.hpp"
+#include "PhysicsManager.hpp"
+#include "SerializationManager.hpp"
+
+using namespace std;
+using namespace glm;
+
+typedef enum ValidationIssueType {
+	BonePenetration,
+	FloorPenetration
+} ValidationIssueType;
+
+typedef struct ValidationIssue {
+	ValidationIssueType Type;
+	// Bone1 is null for the floor
+	Bone *Bone0, *Bone1;
+	// animation positions in seconds, consecutive samples are merged
+	float StartTime, EndTime;
+	float MaxDepth;
+} ValidationIssue;
+
+// Samples the whole animation and finds poses where bones interpenetrate or go below the floor.
+// Bone pairs are skipped by the same rules as the broadphase filter. Boxes are tested with the
+// separating axis theorem, the time range is split into chunks validated in parallel.
+typedef class AnimationValidator {
+private:
+	AnimationValidator(void) { };
+
+	const float SampleRate = 120.0f;
+	const int32 SamplesPerChunk = 32;
+
+	// boxes touching at rest are not reported
+	const float PenetrationTolerance = 0.002f;
+
+	typedef struct Box {
+		vec3 Center, HalfSize;
+		// columns are the box axes
+		mat3 Axes;
+		// radius of the bounding sphere, rejects most pairs before the axis tests
+		float Radius;
+	} Box;
+
+	typedef struct SampleHit {
+		int32 Sample;
+		ValidationIssueType Type;
+		uint32 ID0, ID1;
+		float Depth;
+	} SampleHit;
+
+	static bool GetPenetrationDepth(Box& A, Box& B, float& Depth);
+	static float GetFloorDepth(Box& A, float FloorZ);
+
+	void ValidateSample(vector<CharacterSerializedState*>& Keyframes, vector<int32>& BoneIDs, float Length, int32 Sample,
+		PhysicsManager::BoneFilterCallback& Filter, float FloorZ, vector<quat>& Rotations, vector<mat4>& WorldTransforms, vector<Box>& Boxes, vector<SampleHit>& Hits);
+public:
+	static AnimationValidator& GetInstance(void) {
+		static AnimationValidator Instance;
+
+		return Instance;
+	}
+
+	AnimationValidator(AnimationValidator const&) = delete;
+	void operator=(AnimationValidator const&) = delete;
+
+	void Validate(vector<ValidationIssue>& Issues);
+} AnimationValidator;
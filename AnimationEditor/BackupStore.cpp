@@ -0,0 +1,358 @@
+#include "BackupStore.hpp"
+
+#include <stddef.h>
+#include <string.h>
+
+#include <bcrypt.h>
+
+#include <algorithm>
+#include <ppl.h>
+#include <unordered_set>
+
+#include "ProjectFile.hpp"
+
+const wchar_t* BackupStore::Extension = L".aeb";
+
+wstring BackupStore::GetDirectory(const wstring ProjectFileName)
+{
+	return ProjectFileName + L".backups";
+}
+
+wstring BackupStore::GetObjectName(const ObjectKey& Key)
+{
+	wchar_t Name[sizeof(Key.Hash) * 2 + 1];
+
+	for (size_t Index = 0; Index < sizeof(Key.Hash); Index++)
+		swprintf(Name + Index * 2, 3, L"%02x", Key.Hash[Index]);
+
+	return Name;
+}
+
+wstring BackupStore::GetObjectFileName(const wstring Directory, const wstring ObjectName)
+{
+	return Directory + L"\\objects\\" + ObjectName + ProjectFile::Extension;
+}
+
+bool BackupStore::GetKey(const uint8* Data, uint64 Size, ObjectKey& Key)
+{
+	// an object with the same key is reused without comparing its contents
+	BCRYPT_ALG_HANDLE Algorithm;
+	if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&Algorithm, BCRYPT_SHA256_ALGORITHM, nullptr, 0)))
+		return false;
+
+	BCRYPT_HASH_HANDLE Hash;
+	bool Result = BCRYPT_SUCCESS(BCryptCreateHash(Algorithm, &Hash, nullptr, 0, nullptr, 0, 0));
+
+	if (Result) {
+
+		// BCryptHashData takes at most 4 GB at a time
+		for (uint64 Offset = 0; Offset < Size && Result; Offset += MAXULONG) {
+			ULONG Length = Size - Offset < MAXULONG ? (ULONG)(Size - Offset) : MAXULONG;
+			Result = BCRYPT_SUCCESS(BCryptHashData(Hash, (PUCHAR)(Data + Offset), Length, 0));
+		}
+
+		Result = Result && BCRYPT_SUCCESS(BCryptFinishHash(Hash, Key.Hash, sizeof(Key.Hash), 0));
+
+		BCryptDestroyHash(Hash);
+	}
+
+	BCryptCloseAlgorithmProvider(Algorithm, 0);
+
+	return Result;
+}
+
+bool BackupStore::IsManifest(const wstring FileName)
+{
+	FILE* File = _wfopen(FileName.c_str(), L"rb");
+	if (File == nullptr)
+		return false;
+
+	uint32 FileMagic = 0;
+	size_t Count = fread(&FileMagic, sizeof(FileMagic), 1, File);
+	fclose(File);
+
+	return Count == 1 && FileMagic == Magic;
+}
+
+wstring BackupStore::GetProjectFileName(const wstring ManifestFileName)
+{
+	size_t LastSlashPos = ManifestFileName.find_last_of(L"\\/");
+	wstring Directory = LastSlashPos != string::npos ? ManifestFileName.substr(0, LastSlashPos) : L"";
+
+	// a manifest moved out of its store is restored next to itself
+	size_t SuffixLength = wcslen(L".backups");
+	if (Directory.size() <= SuffixLength || Directory.compare(Directory.size() - SuffixLength, SuffixLength, L".backups") != 0)
+		return ManifestFileName + ProjectFile::Extension;
+
+	return Directory.substr(0, Directory.size() - SuffixLength);
+}
+
+bool BackupStore::ReadManifest(const wstring FileName, ManifestHeader& Header, vector<wstring>* ObjectNames)
+{
+	FILE* File = _wfopen(FileName.c_str(), L"rb");
+	if (File == nullptr)
+		return false;
+
+	bool IsValid = fread(&Header, sizeof(Header), 1, File) == 1 && Header.Magic == Magic &&
+		(Header.Version == Version || Header.Version == Version1);
+
+	if (IsValid && ObjectNames != nullptr) {
+
+		ObjectNames->clear();
+
+		for (uint32 Index = 0; Index < Header.HistoryCount && IsValid; Index++) {
+
+			if (Header.Version == Version1) {
+
+				Version1ObjectKey Key;
+				IsValid = fread(&Key, sizeof(Key), 1, File) == 1;
+
+				wchar_t Name[33];
+				swprintf(Name, 33, L"%016llx%016llx", Key.High, Key.Low);
+
+				ObjectNames->push_back(Name);
+			}
+			else {
+
+				ObjectKey Key;
+				IsValid = fread(&Key, sizeof(Key), 1, File) == 1;
+
+				ObjectNames->push_back(GetObjectName(Key));
+			}
+		}
+	}
+
+	fclose(File);
+
+	return IsValid;
+}
+
+void BackupStore::FindManifests(const wstring Directory, vector<wstring>& FileNames)
+{
+	WIN32_FIND_DATAW FindData;
+
+	HANDLE Find = FindFirstFileW((Directory + L"\\*" + Extension).c_str(), &FindData);
+	if (Find == INVALID_HANDLE_VALUE)
+		return;
+
+	do {
+		if (!(FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+			FileNames.push_back(Directory + L"\\" + FindData.cFileName);
+	} while (FindNextFileW(Find, &FindData));
+
+	FindClose(Find);
+
+	// names are the time the backup was taken, fixed width
+	sort(FileNames.begin(), FileNames.end());
+}
+
+void BackupStore::Prune(const wstring Directory, uint32 MaxCount)
+{
+	vector<wstring> Manifests;
+	FindManifests(Directory, Manifests);
+
+	if (Manifests.size() <= MaxCount)
+		return;
+
+	size_t DeleteCount = Manifests.size() - MaxCount;
+
+	for (size_t Index = 0; Index < DeleteCount; Index++)
+		DeleteFileW(Manifests[Index].c_str());
+
+	unordered_set<wstring> Referenced;
+
+	for (size_t Index = DeleteCount; Index < Manifests.size(); Index++) {
+
+		ManifestHeader Header;
+		vector<wstring> ObjectNames;
+
+		// an unreadable manifest may still refer to anything, nothing is collected
+		if (!ReadManifest(Manifests[Index], Header, &ObjectNames))
+			return;
+
+		for (wstring& ObjectName : ObjectNames)
+			Referenced.insert(GetObjectFileName(Directory, ObjectName));
+	}
+
+	WIN32_FIND_DATAW FindData;
+
+	HANDLE Find = FindFirstFileW((Directory + L"\\objects\\*").c_str(), &FindData);
+	if (Find == INVALID_HANDLE_VALUE)
+		return;
+
+	do {
+		wstring FileName = Directory + L"\\objects\\" + FindData.cFileName;
+
+		if (!(FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && Referenced.find(FileName) == Referenced.end())
+			DeleteFileW(FileName.c_str());
+	} while (FindNextFileW(Find, &FindData));
+
+	FindClose(Find);
+}
+
+bool BackupStore::Add(const wstring ProjectFileName, const vector<uint8>& Image, SerializeSerializedState& State, bool IsCompressed, uint32 MaxCount)
+{
+	wstring Directory = GetDirectory(ProjectFileName);
+
+	if ((!CreateDirectoryW(Directory.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS) ||
+		(!CreateDirectoryW((Directory + L"\\objects").c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS))
+		return false;
+
+	vector<ObjectKey> Keys;
+
+	// without the project state the image of a history only changes with the history and the bone names
+	vector<vector<uint8>> Objects;
+	ProjectFile::Split(Image, Objects);
+
+	for (vector<uint8>& Buffer : Objects) {
+
+		ObjectKey Key;
+		if (!GetKey(Buffer.data(), Buffer.size(), Key))
+			return false;
+
+		Keys.push_back(Key);
+
+		wstring ObjectFileName = GetObjectFileName(Directory, GetObjectName(Key));
+
+		if (GetFileAttributesW(ObjectFileName.c_str()) != INVALID_FILE_ATTRIBUTES)
+			continue;
+
+		wstring TempFileName = ObjectFileName + L".tmp";
+
+		if (!ProjectFile::SaveBuffer(Buffer, TempFileName, IsCompressed) ||
+			!MoveFileEx(TempFileName.c_str(), ObjectFileName.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+
+			DeleteFileW(TempFileName.c_str());
+			return false;
+		}
+	}
+
+	ManifestHeader Header = {};
+	Header.Magic = Magic;
+	Header.Version = Version;
+	Header.HistoryCount = (uint32)Objects.size();
+
+	Header.AnimationPosition = State.AnimationPosition;
+	Header.AnimationLength = State.AnimationLength;
+	Header.PlaySpeed = State.PlaySpeed;
+	Header.KinematicModeFlag = State.KinematicModeFlag;
+	Header.PlayAnimaionFlag = State.PlayAnimaionFlag;
+	Header.LoopAnimationFlag = State.LoopAnimationFlag;
+
+	vector<wstring> Manifests;
+	FindManifests(Directory, Manifests);
+
+	if (!Manifests.empty()) {
+
+		ManifestHeader LastHeader;
+		vector<wstring> LastObjectNames;
+
+		bool IsSame = ReadManifest(Manifests.back(), LastHeader, &LastObjectNames) && LastObjectNames.size() == Keys.size() &&
+			memcmp(&LastHeader.HistoryCount, &Header.HistoryCount, sizeof(ManifestHeader) - offsetof(ManifestHeader, HistoryCount)) == 0;
+
+		for (size_t Index = 0; Index < Keys.size() && IsSame; Index++)
+			IsSame = LastObjectNames[Index] == GetObjectName(Keys[Index]);
+
+		if (IsSame)
+			return true;
+	}
+
+	FILETIME Time;
+	GetSystemTimeAsFileTime(&Time);
+	Header.Time = ((uint64)Time.dwHighDateTime << 32) | Time.dwLowDateTime;
+
+	SYSTEMTIME SystemTime;
+	FileTimeToSystemTime(&Time, &SystemTime);
+
+	wchar_t Name[32];
+	swprintf(Name, 32, L"%04d%02d%02d-%02d%02d%02d-%03d", SystemTime.wYear, SystemTime.wMonth, SystemTime.wDay,
+		SystemTime.wHour, SystemTime.wMinute, SystemTime.wSecond, SystemTime.wMilliseconds);
+
+	wstring ManifestFileName = Directory + L"\\" + Name + Extension;
+	wstring TempFileName = ManifestFileName + L".tmp";
+
+	// objects go first, a manifest never refers to one that isn't written
+	FILE* File = _wfopen(TempFileName.c_str(), L"wb");
+	if (File == nullptr)
+		return false;
+
+	bool Result = fwrite(&Header, sizeof(Header), 1, File) == 1 &&
+		(Keys.empty() || fwrite(Keys.data(), sizeof(ObjectKey), Keys.size(), File) == Keys.size());
+	fclose(File);
+
+	Result = Result && MoveFileEx(TempFileName.c_str(), ManifestFileName.c_str(), MOVEFILE_REPLACE_EXISTING);
+
+	if (!Result) {
+		DeleteFileW(TempFileName.c_str());
+		return false;
+	}
+
+	Prune(Directory, MaxCount);
+
+	return true;
+}
+
+void BackupStore::List(const wstring ProjectFileName, vector<BackupInfo>& Backups)
+{
+	vector<wstring> Manifests;
+	FindManifests(GetDirectory(ProjectFileName), Manifests);
+
+	for (auto Iterator = Manifests.rbegin(); Iterator != Manifests.rend(); Iterator++) {
+
+		ManifestHeader Header;
+		if (!ReadManifest(*Iterator, Header, nullptr))
+			continue;
+
+		BackupInfo Info;
+		Info.FileName = *Iterator;
+		Info.Time = Header.Time;
+		Info.HistoryCount = Header.HistoryCount;
+
+		Backups.push_back(Info);
+	}
+}
+
+bool BackupStore::Restore(const wstring ManifestFileName, vector<SerializedStateHistory>& Histories, SerializeSerializedState& State)
+{
+	ManifestHeader Header;
+	vector<wstring> ObjectNames;
+
+	if (!ReadManifest(ManifestFileName, Header, &ObjectNames)) {
+		printf("%ls is not a valid backup\n", ManifestFileName.c_str());
+		return false;
+	}
+
+	wstring Directory = ManifestFileName.substr(0, ManifestFileName.find_last_of(L"\\/"));
+
+	vector<vector<SerializedStateHistory>> Objects(ObjectNames.size());
+	vector<uint8> IsObjectValid(ObjectNames.size(), 0);
+
+	// objects are independent project files
+	concurrency::parallel_for((size_t)0, ObjectNames.size(), [&](size_t Index) {
+
+		SerializeSerializedState ObjectState;
+
+		IsObjectValid[Index] = ProjectFile::Load(GetObjectFileName(Directory, ObjectNames[Index]), Objects[Index], ObjectState) &&
+			Objects[Index].size() == 1;
+	});
+
+	if (find(IsObjectValid.begin(), IsObjectValid.end(), 0) != IsObjectValid.end()) {
+		printf("%ls refers to missing histories\n", ManifestFileName.c_str());
+		return false;
+	}
+
+	Histories.clear();
+
+	for (vector<SerializedStateHistory>& Object : Objects)
+		Histories.push_back(std::move(Object[0]));
+
+	State = {};
+	State.AnimationPosition = Header.AnimationPosition;
+	State.AnimationLength = Header.AnimationLength;
+	State.PlaySpeed = Header.PlaySpeed;
+	State.KinematicModeFlag = Header.KinematicModeFlag != 0;
+	State.PlayAnimaionFlag = Header.PlayAnimaionFlag != 0;
+	State.LoopAnimationFlag = Header.LoopAnimationFlag != 0;
+
+	return true;
+}
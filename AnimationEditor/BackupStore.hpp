@@ -0,0 +1,84 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "SerializationManager.hpp"
+
+#pragma comment (lib, "bcrypt.lib")
+
+using namespace std;
+
+// Versioned backups of a project in a directory next to it, named after the project file plus
+// ".backups". Every history is stored once as a project file of its own under objects\, named
+// by the SHA-256 of its uncompressed image, so a history that didn't change between two
+// backups is shared by them as long as the bone names of the project stay the same. A backup is a manifest named after the UTC time it was taken:
+//   ManifestHeader
+//   ObjectKey[HistoryCount], the histories in order
+// Version 1 manifests refer to their objects by two 64-bit FNV-1a hashes instead, they are
+// still restored but no new object is shared with them.
+// Objects and manifests are written to a temporary file and renamed, an object only when it
+// isn't there yet. Listing reads the manifest headers only.
+typedef class BackupStore {
+private:
+	static const uint32 Magic = 0x31424541; // "AEB1"
+	static const uint32 Version = 2;
+	static const uint32 Version1 = 1;
+
+#pragma pack(push, 1)
+	typedef struct ObjectKey {
+		// SHA-256
+		uint8 Hash[32];
+	} ObjectKey;
+
+	typedef struct Version1ObjectKey {
+		uint64 Low, High;
+	} Version1ObjectKey;
+
+	typedef struct ManifestHeader {
+		uint32 Magic, Version;
+		// FILETIME, UTC
+		uint64 Time;
+		uint32 HistoryCount;
+
+		float AnimationPosition, AnimationLength, PlaySpeed;
+		uint8 KinematicModeFlag, PlayAnimaionFlag, LoopAnimationFlag, Padding;
+	} ManifestHeader;
+#pragma pack(pop)
+
+	static wstring GetDirectory(const wstring ProjectFileName);
+	// objects are named by their key in hex
+	static wstring GetObjectName(const ObjectKey& Key);
+	static wstring GetObjectFileName(const wstring Directory, const wstring ObjectName);
+
+	static bool GetKey(const uint8* Data, uint64 Size, ObjectKey& Key);
+
+	// ObjectNames, when given, receives the objects of the backup
+	static bool ReadManifest(const wstring FileName, ManifestHeader& Header, vector<wstring>* ObjectNames);
+	// manifest file names, oldest first
+	static void FindManifests(const wstring Directory, vector<wstring>& FileNames);
+
+	// deletes the oldest manifests past MaxCount and the objects no manifest refers to anymore
+	static void Prune(const wstring Directory, uint32 MaxCount);
+public:
+	typedef struct BackupInfo {
+		wstring FileName;
+		// FILETIME, UTC
+		uint64 Time;
+		uint32 HistoryCount;
+	} BackupInfo;
+
+	static const wchar_t* Extension;
+
+	// checks the header only
+	static bool IsManifest(const wstring FileName);
+	// the project a manifest was taken from
+	static wstring GetProjectFileName(const wstring ManifestFileName);
+
+	// Image is the project as written by ProjectFile::Write, its histories are stored without being encoded
+	// again; nothing is added when the histories are the same as in the newest backup
+	static bool Add(const wstring ProjectFileName, const vector<uint8>& Image, SerializeSerializedState& State, bool IsCompressed, uint32 MaxCount);
+	// newest first
+	static void List(const wstring ProjectFileName, vector<BackupInfo>& Backups);
+	static bool Restore(const wstring ManifestFileName, vector<SerializedStateHistory>& Histories, SerializeSerializedState& State);
+} BackupStore;
@@ -0,0 +1,201 @@
+#include "BlockCompressor.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+
+uint32 BlockCompressor::Read32(const uint8* Data)
+{
+	uint32 Result;
+	memcpy(&Result, Data, sizeof(Result));
+
+	return Result;
+}
+
+uint32 BlockCompressor::Hash(uint32 Sequence)
+{
+	// Knuth's multiplicative hash
+	return (Sequence * 2654435761u) >> (32 - HashBits);
+}
+
+uint8* BlockCompressor::WriteLength(uint8* Destination, size_t Length)
+{
+	while (Length >= 255) {
+		*Destination++ = 255;
+		Length -= 255;
+	}
+
+	*Destination++ = (uint8)Length;
+
+	return Destination;
+}
+
+bool BlockCompressor::ReadLength(const uint8*& Source, const uint8* SourceEnd, size_t& Length)
+{
+	uint8 Byte;
+
+	do {
+		if (Source == SourceEnd)
+			return false;
+
+		Byte = *Source++;
+		Length += Byte;
+	} while (Byte == 255);
+
+	return true;
+}
+
+size_t BlockCompressor::GetMaxCompressedSize(size_t Size)
+{
+	return Size + Size / 255 + 16;
+}
+
+size_t BlockCompressor::Compress(const uint8* Source, size_t Size, uint8* Destination)
+{
+	// positions are stored plus one, 0 is an empty slot
+	vector<uint32> Table((size_t)1 << HashBits, 0);
+
+	uint8* Output = Destination;
+
+	size_t Position = 0, Anchor = 0;
+
+	if (Size > MatchSearchLimit) {
+
+		size_t SearchEnd = Size - MatchSearchLimit;
+		size_t MatchEnd = Size - LastLiterals;
+
+		// the step grows while nothing matches, incompressible data passes through quickly
+		uint32 Misses = 0;
+
+		while (Position < SearchEnd) {
+
+			uint32 Sequence = Read32(Source + Position);
+			uint32& Slot = Table[Hash(Sequence)];
+
+			size_t Candidate = Slot;
+			Slot = (uint32)Position + 1;
+
+			if (Candidate == 0 || Position - (Candidate - 1) > MaxOffset || Read32(Source + Candidate - 1) != Sequence) {
+				Position += 1 + (Misses++ >> 6);
+				continue;
+			}
+
+			Misses = 0;
+
+			size_t Match = Candidate - 1;
+
+			// matches also run backwards into the pending literals
+			while (Position > Anchor && Match > 0 && Source[Position - 1] == Source[Match - 1]) {
+				Position--;
+				Match--;
+			}
+
+			size_t Length = MinMatch;
+			while (Position + Length < MatchEnd && Source[Match + Length] == Source[Position + Length])
+				Length++;
+
+			size_t LiteralLength = Position - Anchor;
+			size_t MatchLength = Length - MinMatch;
+
+			uint8* Token = Output++;
+			*Token = (uint8)((LiteralLength >= 15 ? 15 : LiteralLength) << 4);
+
+			if (LiteralLength >= 15)
+				Output = WriteLength(Output, LiteralLength - 15);
+
+			memcpy(Output, Source + Anchor, LiteralLength);
+			Output += LiteralLength;
+
+			uint16 Offset = (uint16)(Position - Match);
+			memcpy(Output, &Offset, sizeof(Offset));
+			Output += sizeof(Offset);
+
+			*Token |= (uint8)(MatchLength >= 15 ? 15 : MatchLength);
+
+			if (MatchLength >= 15)
+				Output = WriteLength(Output, MatchLength - 15);
+
+			Position += Length;
+			Anchor = Position;
+
+			// the positions skipped inside the match are worth finding again
+			if (Position - 2 < SearchEnd)
+				Table[Hash(Read32(Source + Position - 2))] = (uint32)(Position - 2) + 1;
+		}
+	}
+
+	size_t LiteralLength = Size - Anchor;
+
+	uint8* Token = Output++;
+	*Token = (uint8)((LiteralLength >= 15 ? 15 : LiteralLength) << 4);
+
+	if (LiteralLength >= 15)
+		Output = WriteLength(Output, LiteralLength - 15);
+
+	memcpy(Output, Source + Anchor, LiteralLength);
+	Output += LiteralLength;
+
+	return Output - Destination;
+}
+
+bool BlockCompressor::Decompress(const uint8* Source, size_t Size, uint8* Destination, size_t RawSize)
+{
+	const uint8* SourceEnd = Source + Size;
+
+	uint8* Output = Destination;
+	uint8* OutputEnd = Destination + RawSize;
+
+	while (Source < SourceEnd) {
+
+		uint8 Token = *Source++;
+
+		size_t LiteralLength = Token >> 4;
+		if (LiteralLength == 15 && !ReadLength(Source, SourceEnd, LiteralLength))
+			return false;
+
+		if (LiteralLength > (size_t)(SourceEnd - Source) || LiteralLength > (size_t)(OutputEnd - Output))
+			return false;
+
+		memcpy(Output, Source, LiteralLength);
+		Source += LiteralLength;
+		Output += LiteralLength;
+
+		// the last sequence has no match
+		if (Source == SourceEnd)
+			break;
+
+		if (SourceEnd - Source < 2)
+			return false;
+
+		uint16 Offset;
+		memcpy(&Offset, Source, sizeof(Offset));
+		Source += sizeof(Offset);
+
+		size_t MatchLength = Token & 15;
+		if (MatchLength == 15 && !ReadLength(Source, SourceEnd, MatchLength))
+			return false;
+
+		MatchLength += MinMatch;
+
+		if (Offset == 0 || Offset > Output - Destination || MatchLength > (size_t)(OutputEnd - Output))
+			return false;
+
+		const uint8* Match = Output - Offset;
+
+		// an overlapping match repeats the last Offset bytes, every copy can take all that is already written
+		for (size_t Copied = 0; Copied < MatchLength; ) {
+
+			size_t Count = std::min(MatchLength - Copied, Copied + Offset);
+			memcpy(Output + Copied, Match, Count);
+
+			Copied += Count;
+		}
+
+		Output += MatchLength;
+	}
+
+	return Output == OutputEnd;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <glm/glm.hpp>
+
+using namespace glm;
+
+// LZ77 compression of independent blocks in the LZ4 block format: a token with the literal and
+// match lengths, the literals, a 16-bit match offset, length bytes past 15. Matches are found
+// through a single hash table probe, so compressing stays close to memcpy speed and decoding
+// is plain copies.
+typedef class BlockCompressor {
+private:
+	static const size_t MinMatch = 4;
+	// the format keeps the tail of a block literal
+	static const size_t LastLiterals = 5;
+	static const size_t MatchSearchLimit = 12;
+	static const size_t MaxOffset = 65535;
+
+	static const uint32 HashBits = 14;
+
+	static uint32 Read32(const uint8* Data);
+	static uint32 Hash(uint32 Sequence);
+
+	static uint8* WriteLength(uint8* Destination, size_t Length);
+	static bool ReadLength(const uint8*& Source, const uint8* SourceEnd, size_t& Length);
+public:
+	static size_t GetMaxCompressedSize(size_t Size);
+
+	// Destination holds at least GetMaxCompressedSize(Size) bytes, returns the bytes written
+	static size_t Compress(const uint8* Source, size_t Size, uint8* Destination);
+	// false unless Source decodes to exactly RawSize bytes
+	static bool Decompress(const uint8* Source, size_t Size, uint8* Destination, size_t RawSize);
+} BlockCompressor;
@@ -6,6 +6,9 @@
 
 Character::Character(void)
 {
+	// bone IDs double as indices into Bones
+	NextBoneID = 0;
+
 	GenerateBones();
 	UpdateWorldTranforms();
 	UpdateFloorZ();
@@ -138,6 +141,21 @@ void Character::UpdateRotationsFromWorldTransforms(void)
 	this->Position = Pelvis->UpdateRotationFromWorldTransform(mat4(1.0f));
 }
 
+void Character::CalculateWorldTransforms(vec3 Position, const vector<quat>& Rotations, vector<mat4>& WorldTransforms)
+{
+	WorldTransforms.resize(Bones.size());
+
+	// same composition as Bone::UpdateWorldTransform, bones are ordered parents first
+	for (Bone* Bone : Bones) {
+
+		mat4 ParentModel = Bone->Parent != nullptr ?
+			WorldTransforms[Bone->Parent->ID] * translate(mat4(1.0f), Bone->Offset * Bone->Parent->Size) :
+			translate(mat4(1.0f), Position);
+
+		WorldTransforms[Bone->ID] = ParentModel * mat4_cast(Rotations[Bone->ID]);
+	}
+}
+
 void Character::UpdateFloorZ(void)
 {
 	FloorZ = 0;
@@ -216,6 +234,9 @@ Bone::Bone(uint32 ID, wstring Name, vec3 Offset, vec3 Tail, vec3 Size, vec3 LowL
 
 	this->LogicalDirection = LogicalDirection;
 
+	this->PhysicBody = nullptr;
+	this->PhysicConstraint = nullptr;
+
 	this->Parent = Parent;
 	if (Parent != nullptr) {
 		Parent->Childs.push_back(this);
@@ -4,6 +4,7 @@
 #include <vector>
 
 #include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
 
 #include <btBulletDynamicsCommon.h>
 
@@ -83,6 +84,9 @@ public:
 	void UpdateWorldTranforms(void);
 	void UpdateRotationsFromWorldTransforms(void);
 
+	// world transforms of a pose that is not applied to the bones, indexed by bone ID
+	void CalculateWorldTransforms(vec3 Position, const vector<quat>& Rotations, vector<mat4>& WorldTransforms);
+
 	void UpdateFloorZ(void);
 
 	void Reset(void);
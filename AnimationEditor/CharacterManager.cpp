@@ -50,4 +50,43 @@ void CharacterManager::Deserialize(CharacterSerializedState& State)
 	}
 
 	PhysicsManager::GetInstance().SyncWorldWithCharacter();
+}
+
+void CharacterManager::Mirror(CharacterSerializedState& State)
+{
+	Character* Char = GetCharacter();
+
+	vector<SerializedBone*> SerializedBones(Char->Bones.size(), nullptr);
+	vector<vec3> Angles(Char->Bones.size());
+
+	for (SerializedBone& SerializedBone : State.Bones) {
+
+		Bone* Bone = Char->FindBone(SerializedBone.Name);
+		if (Bone == nullptr)
+			continue;
+
+		SerializedBones[Bone->ID] = &SerializedBone;
+		Angles[Bone->ID] = PhysicsManager::GetInstance().GetAnglesFromRotation(Bone, mat4_cast(SerializedBone.Rotation));
+	}
+
+	// same rules as PhysicsManager::MirrorCharacter
+	for (Bone* CurrentBone : Char->Bones) {
+
+		if (SerializedBones[CurrentBone->ID] == nullptr)
+			continue;
+
+		vec3 MirroredAngles;
+
+		if (CurrentBone->Side == Bone::Center)
+			MirroredAngles = Angles[CurrentBone->ID] * vec3(-1, 1, 1);
+		else {
+			Bone* OtherBone = Char->FindOtherBone(CurrentBone);
+			if (OtherBone == nullptr || SerializedBones[OtherBone->ID] == nullptr)
+				continue;
+
+			MirroredAngles = Angles[OtherBone->ID] * vec3(-1, 1, -1);
+		}
+
+		SerializedBones[CurrentBone->ID]->Rotation = quat_cast(PhysicsManager::GetInstance().GetRotationFromAngles(CurrentBone, MirroredAngles));
+	}
 }
\ No newline at end of file
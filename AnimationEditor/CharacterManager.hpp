@@ -32,4 +32,7 @@ public:
 	void Serialize(CharacterSerializedState& State);
 	void Deserialize(CharacterSerializedState& State);
 
+	// mirrors a stored pose without touching the character, safe to call from any thread
+	void Mirror(CharacterSerializedState& State);
+
 } CharacterManager;
\ No newline at end of file
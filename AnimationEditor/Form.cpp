@@ -9,10 +9,14 @@
 #include "InputManager.hpp"
 #include "PoseManager.hpp"
 #include "CharacterManager.hpp"
+#include "RecordingManager.hpp"
 #include "ExternalGUI.hpp"
 #include "shader.hpp"
 
+// replays run without a window, there is nothing to update then
 #define CheckFormUpdateBlock(PendingFlag) \
+	if (WindowHandle == NULL) \
+		return; \
 	if (UpdateBlockCounter != 0) { \
 		PendingFlag = true; \
 		return; \
@@ -151,6 +155,7 @@ LRESULT CALLBACK Form::WndProcCallback(HWND hWnd, UINT message, WPARAM wParam, L
 	case WM_DESTROY: {
 
 		SerializationManager::GetInstance().Autosave(false);
+		SerializationManager::GetInstance().Shutdown();
 
 		PostQuitMessage(0);
 		break;
@@ -180,6 +185,8 @@ void Form::ButtonCallback(const wstring Name)
 			Char->Position = vec3(0, 0, Char->Position.z);
 			Char->UpdateWorldTranforms();
 			PhysicsManager::GetInstance().SyncWorldWithCharacter();
+
+			RecordingManager::GetInstance().RecordState();
 		}
 		else
 		if (Name == DELETE_STATE) {
@@ -194,9 +201,16 @@ void Form::ButtonCallback(const wstring Name)
 		else
 		if (Name == MIRROR_STATE) {
 
-			SerializationManager::GetInstance().PushStateFrame(L"Mirror");
+			// with shift held the whole animation is mirrored
+			if (GetKeyState(VK_SHIFT) < 0)
+				SerializationManager::GetInstance().MirrorAllHistories();
+			else {
+				SerializationManager::GetInstance().PushStateFrame(L"Mirror");
+
+				PhysicsManager::GetInstance().MirrorCharacter();
 
-			PhysicsManager::GetInstance().MirrorCharacter();
+				RecordingManager::GetInstance().RecordState();
+			}
 		}
 	}
 
@@ -469,7 +483,7 @@ void Form::UpdateBlocking(void)
 	}
 
 	BlockingInfo Blocking = PoseManager::GetInstance().GetBoneBlocking(Selection.Bone);
-	vec3 Angles = PhysicsManager::GetInstance().GetBoneAngles(Selection.Bone);
+	const PhysicsManager::JointDescriptor& Joint = PhysicsManager::GetInstance().GetJointDescriptor(Selection.Bone);
 
 	aegSetEnabled(X_POS, true);
 	aegSetEnabled(Y_POS, true);
@@ -479,7 +493,7 @@ void Form::UpdateBlocking(void)
 	aegSetChecked(Y_POS, Blocking.YPos);
 	aegSetChecked(Z_POS, Blocking.ZPos);
 
-	if (!isnan(Angles.x)) {
+	if (Joint.IsFree[0]) {
 		aegSetEnabled(X_AXIS, true);
 		aegSetChecked(X_AXIS, Blocking.XAxis);
 	}
@@ -488,7 +502,7 @@ void Form::UpdateBlocking(void)
 		aegSetChecked(X_AXIS, false);
 	}
 
-	if (!isnan(Angles.y)) {
+	if (Joint.IsFree[1]) {
 		aegSetEnabled(Y_AXIS, true);
 		aegSetChecked(Y_AXIS, Blocking.YAxis);
 	}
@@ -497,7 +511,7 @@ void Form::UpdateBlocking(void)
 		aegSetChecked(Y_AXIS, false);
 	}
 
-	if (!isnan(Angles.z)) {
+	if (Joint.IsFree[2]) {
 		aegSetEnabled(Z_AXIS, true);
 		aegSetChecked(Z_AXIS, Blocking.ZAxis);
 	}
@@ -6,6 +6,9 @@
 #include "PoseManager.hpp"
 #include "CharacterManager.hpp"
 #include "Form.hpp"
+#include "AnimationValidator.hpp"
+#include "RecordingManager.hpp"
+#include "SettleBaker.hpp"
 
 void InputManager::Initialize(void) {
 
@@ -157,6 +160,31 @@ void InputManager::CancelSelection(void) {
 	Form::GetInstance().UpdatePositionAndAngles();
 }
 
+void InputManager::ApplyMarquee(void) {
+
+	vector<Bone*> Bones;
+	Render::GetInstance().GetBonesInScreenRect(MarqueeX, MarqueeY, MouseX, MouseY, Bones);
+
+	if (Bones.empty())
+		return;
+
+	SerializationManager::GetInstance().PushStateFrame(L"ApplyMarquee");
+	PoseManager::GetInstance().ToggleBonesBlocking(Bones);
+}
+
+bool InputManager::GetMarquee(LONG& x1, LONG& y1, LONG& x2, LONG& y2)
+{
+	if (!IsMarqueeActive)
+		return false;
+
+	x1 = MarqueeX;
+	y1 = MarqueeY;
+	x2 = MouseX;
+	y2 = MouseY;
+
+	return true;
+}
+
 void InputManager::ProcessCameraMovement(double dt)
 {
 	const float Speed = 1.0f;
@@ -225,6 +253,8 @@ void InputManager::ChangeBoneAngles(Bone* Bone, vec3 Angles)
 
 	PhysicsManager::GetInstance().SetBoneAngles(Bone, Angles);
 
+	RecordingManager::GetInstance().RecordAngles(Bone, Angles);
+
 	mat4 CurrentM = Bone->WorldTransform * Bone->MiddleTranslation;
 
 	if (Selection.HaveBone()) {
@@ -298,12 +328,29 @@ void InputManager::ProcessKeyboardInput(double dt) {
 
 		if (WasPressed(VK_LBUTTON) && IsInteractionMode()) {
 
-			SerializationManager::GetInstance().PushStateFrame(L"ProcessKeyboardInput VK_LBUTTON");
-			SelectBoneAtScreenPoint(MouseX, MouseY);
+			if (State == None && IsPressed(VK_LCONTROL)) {
+
+				IsMarqueeActive = true;
+				MarqueeX = MouseX;
+				MarqueeY = MouseY;
+			}
+			else {
+				SerializationManager::GetInstance().PushStateFrame(L"ProcessKeyboardInput VK_LBUTTON");
+				SelectBoneAtScreenPoint(MouseX, MouseY);
+			}
+		}
+
+		if (IsMarqueeActive && !IsPressed(VK_LBUTTON)) {
+
+			IsMarqueeActive = false;
+			ApplyMarquee();
 		}
 
 		if (WasPressed(VK_ESCAPE)) {
 
+			if (IsMarqueeActive)
+				IsMarqueeActive = false;
+			else
 			if (State == None)
 				CancelSelection();
 			else
@@ -383,6 +430,8 @@ void InputManager::ProcessKeyboardInput(double dt) {
 				Char->UpdateWorldTranforms();
 
 				PhysicsManager::GetInstance().SyncWorldWithCharacter();
+
+				RecordingManager::GetInstance().RecordState();
 			}
 		}
 
@@ -393,6 +442,32 @@ void InputManager::ProcessKeyboardInput(double dt) {
 			PoseManager::GetInstance().UnblockAllBones();
 		}
 
+		// drops the current pose with gravity, shift bakes many thrown variations into files of their own
+		if (WasPressed('G')) {
+
+			CharacterSerializedState Start;
+			CharacterManager::GetInstance().Serialize(Start);
+
+			bool IsBulk = IsPressed(VK_SHIFT);
+
+			vector<SettleVariation> Variations = SettleBaker::GetInstance().GenerateVariations(IsBulk ? SettleBaker::GetInstance().BulkVariationCount : 1);
+			vector<SettleResult> Results;
+
+			SettleBaker::GetInstance().Bake(Start, Variations, Results);
+
+			if (IsBulk) {
+				for (size_t Index = 0; Index < Results.size(); Index++)
+					SerializationManager::GetInstance().SaveKeyframesToFile(Results[Index].Keyframes, L".settle" + to_wstring(Index + 1));
+			}
+			else {
+				// the first keyframe is the current pose itself
+				vector<CharacterSerializedState>& Keyframes = Results.front().Keyframes;
+				Keyframes.erase(Keyframes.begin());
+
+				SerializationManager::GetInstance().AddKeyframes(Keyframes);
+			}
+		}
+
 		if (WasPressed('K') && Selection.HaveBone()) {
 
 			SerializationManager::GetInstance().PushStateFrame(L"ProcessKeyboardInput K");
@@ -431,6 +506,19 @@ void InputManager::ProcessKeyboardInput(double dt) {
 		}
 	}
 
+	// checks the whole animation for bones inside each other or below the floor
+	if (WasPressed('T')) {
+
+		vector<ValidationIssue> Issues;
+		AnimationValidator::GetInstance().Validate(Issues);
+	}
+
+	if (IsPressed(VK_LCONTROL) && WasPressed('E'))
+		SerializationManager::GetInstance().ExportToXML();
+
+	if (IsPressed(VK_LCONTROL) && WasPressed('B'))
+		SerializationManager::GetInstance().ListBackups();
+
 	if (WasPressed(VK_RBUTTON)) {
 
 		IsCameraMode = true;
@@ -468,7 +556,7 @@ void InputManager::ProcessMouseFormEvent(LONG x, LONG y) {
 
 	if (!SerializationManager::GetInstance().IsInKinematicMode()) {
 
-		if (State == None && IsPressed(VK_LBUTTON))
+		if (State == None && IsPressed(VK_LBUTTON) && !IsMarqueeActive)
 			SelectBoneAtScreenPoint(MouseX, MouseY);
 
 		if (State == InverseKinematic && !WasMoving && !IsCameraMode && Selection.HaveBone()) {
@@ -42,6 +42,10 @@ private:
 	LONG MouseX, MouseY;
 	bool IsInFocus, IsMouseLockEnforced, IsCameraMode, WasMoving;
 	int SkipMouseFormEventCount;
+
+	// ctrl + drag rectangle in screen space, bones inside toggle their blocking on release
+	bool IsMarqueeActive;
+	LONG MarqueeX, MarqueeY;
 	ULONGLONG MouseUnlockTime;
 
 	InputState State;
@@ -62,6 +66,7 @@ private:
 	bool IsInteractionMode(void);
 	void SelectBoneAtScreenPoint(LONG x, LONG y);
 	void CancelSelection(void);
+	void ApplyMarquee(void);
 	void ProcessCameraMovement(double dt);
 
 	void SetWorldPointToScreePoint(LONG x, LONG y);
@@ -96,6 +101,7 @@ public:
 	InputState GetState(void);
 	InputSelection GetSelection(void);
 	vec3 GetPlaneNormal(void);
+	bool GetMarquee(LONG& x1, LONG& y1, LONG& x2, LONG& y2);
 	void ChangeBoneAngles(Bone* Bone, vec3 Angles);
 	void SetupInverseKinematic(Bone* Bone, vec3 LocalPoint, vec3 DestWorldPoint, bool IsAutomatic);
 
@@ -0,0 +1,362 @@
+#include "MultiBodyBackend.hpp"
+
+#define GLM_ENABLE_EXPERIMENTAL
+#include <glm/gtx/euler_angles.hpp>
+
+#include "PhysicsManager.hpp"
+
+MultiBodyBackend::MultiBodyBackend(btMultiBodyDynamicsWorld* World, Character* Char)
+{
+	this->World = World;
+
+	Bone* Root = Char->Pelvis;
+
+	Body = new btMultiBody(CountLinks(Char), Root->Mass, GetBoxInertia(Root->Size, Root->Mass), false, false);
+
+	CreateLinks(Char);
+
+	Body->finalizeMultiDof();
+
+	Body->setHasSelfCollision(true);
+	Body->setLinearDamping(1);
+	Body->setAngularDamping(1);
+
+	World->addMultiBody(Body);
+
+	CreateColliders(Char);
+	CreateLimits(Char);
+
+	SyncWithCharacter(Char);
+}
+
+int MultiBodyBackend::GetJointAxes(Bone* Bone, int Axes[3])
+{
+	// same composition order as PhysicsManager::SetBoneAngles
+	const PhysicsManager::JointDescriptor& Joint = PhysicsManager::GetInstance().GetJointDescriptor(Bone);
+
+	for (int Index = 0; Index < Joint.AxisCount; Index++)
+		Axes[Index] = Joint.AxisOrder[Index];
+
+	return Joint.AxisCount;
+}
+
+int MultiBodyBackend::CountLinks(Character* Char)
+{
+	int Result = 0;
+
+	for (Bone* Bone : Char->Bones) {
+
+		if (Bone->Parent == nullptr)
+			continue;
+
+		int Axes[3];
+		Result += std::max(GetJointAxes(Bone, Axes), 1);
+	}
+
+	return Result;
+}
+
+void MultiBodyBackend::CreateLinks(Character* Char)
+{
+	Joints.resize(Char->Bones.size());
+
+	int NextLink = 0;
+
+	// bones are stored parents first, so parent links always exist at this point
+	for (Bone* Bone : Char->Bones) {
+
+		BoneJoint& Joint = Joints[Bone->ID];
+
+		Joint = {};
+		Joint.BodyLink = -1;
+		for (int Axis = 0; Axis < 3; Axis++)
+			Joint.AxisLinks[Axis] = -1;
+
+		if (Bone->Parent == nullptr)
+			continue;
+
+		int ParentLink = Joints[Bone->Parent->ID].BodyLink;
+
+		btVector3 ParentComToPivot = GLMToBullet(Bone->ParentJointLocalPoint);
+		btVector3 PivotToCom = GLMToBullet(-Bone->JointLocalPoint);
+		btVector3 Inertia = GetBoxInertia(Bone->Size, Bone->Mass);
+
+		Joint.AxisCount = GetJointAxes(Bone, Joint.AxisOrder);
+
+		if (Joint.AxisCount == 0) {
+
+			Body->setupFixed(NextLink, Bone->Mass, Inertia, ParentLink, btQuaternion::getIdentity(), ParentComToPivot, PivotToCom);
+
+			Joint.BodyLink = NextLink++;
+			continue;
+		}
+
+		// intermediate links only carry a rotation, they sit at the pivot and have no collider
+		float DummyMass = Bone->Mass * DummyLinkMassFactor;
+		btVector3 DummyInertia = GetBoxInertia(Bone->Size, DummyMass);
+
+		for (int Index = 0; Index < Joint.AxisCount; Index++) {
+
+			int Axis = Joint.AxisOrder[Index];
+
+			bool IsFirstLink = Index == 0;
+			bool IsBodyLink = Index == Joint.AxisCount - 1;
+
+			// editor angles rotate around negative axes, see PhysicsManager::SetBoneAngles
+			btVector3 JointAxis(0, 0, 0);
+			JointAxis[Axis] = -1;
+
+			Body->setupRevolute(NextLink,
+				IsBodyLink ? Bone->Mass : DummyMass,
+				IsBodyLink ? Inertia : DummyInertia,
+				ParentLink, btQuaternion::getIdentity(), JointAxis,
+				IsFirstLink ? ParentComToPivot : btVector3(0, 0, 0),
+				IsBodyLink ? PivotToCom : btVector3(0, 0, 0),
+				true);
+
+			Joint.AxisLinks[Axis] = NextLink;
+
+			ParentLink = NextLink++;
+		}
+
+		Joint.BodyLink = ParentLink;
+	}
+}
+
+void MultiBodyBackend::CreateColliders(Character* Char)
+{
+	for (Bone* Bone : Char->Bones) {
+
+		int Link = Joints[Bone->ID].BodyLink;
+
+		vec3 HalfSize = Bone->Size * 0.5f;
+
+		btMultiBodyLinkCollider* Collider = new btMultiBodyLinkCollider(Body, Link);
+		Collider->setCollisionShape(new btBoxShape(GLMToBullet(HalfSize)));
+		Collider->setUserPointer((void*)Bone);
+		Collider->setUserIndex(Bone->ID);
+		Collider->setFriction(1.0);
+		Collider->setRestitution(0.0);
+
+		World->addCollisionObject(Collider, btBroadphaseProxy::DefaultFilter, btBroadphaseProxy::AllFilter);
+
+		if (Link == -1)
+			Body->setBaseCollider(Collider);
+		else
+			Body->getLink(Link).m_collider = Collider;
+	}
+}
+
+void MultiBodyBackend::CreateLimits(Character* Char)
+{
+	for (Bone* Bone : Char->Bones) {
+
+		BoneJoint& Joint = Joints[Bone->ID];
+
+		for (int Axis = 0; Axis < 3; Axis++) {
+
+			int Link = Joint.AxisLinks[Axis];
+			if (Link == -1)
+				continue;
+
+			Joint.Limits[Axis] = new btMultiBodyJointLimitConstraint(Body, Link, Bone->LowLimit[Axis], Bone->HighLimit[Axis]);
+			Joint.Limits[Axis]->finalizeMultiDof();
+
+			World->addMultiBodyConstraint(Joint.Limits[Axis]);
+		}
+	}
+}
+
+btVector3 MultiBodyBackend::GetBoxInertia(vec3 Size, float Mass)
+{
+	btVector3 Inertia;
+
+	btBoxShape Shape(GLMToBullet(Size * 0.5f));
+	Shape.calculateLocalInertia(Mass, Inertia);
+
+	return Inertia;
+}
+
+btTransform MultiBodyBackend::GetLinkWorldTransform(int Link)
+{
+	if (Link == -1)
+		return Body->getBaseWorldTransform();
+	else
+		return Body->getLink(Link).m_collider->getWorldTransform();
+}
+
+vec3 MultiBodyBackend::GetRotationAngles(BoneJoint& Joint, mat4 Rotation)
+{
+	float T1, T2, T3;
+
+	int Outer = Joint.AxisCount == 3 ? Joint.AxisOrder[0] : 2;
+	int Middle = Joint.AxisCount == 3 ? Joint.AxisOrder[1] : 1;
+
+	if (Outer == 2 && Middle == 0) {
+		extractEulerAngleZXY(Rotation, T1, T2, T3);
+		return -vec3(T2, T3, T1);
+	}
+	else
+	if (Outer == 1 && Middle == 2) {
+		extractEulerAngleYZX(Rotation, T1, T2, T3);
+		return -vec3(T3, T1, T2);
+	}
+	else {
+		extractEulerAngleZYX(Rotation, T1, T2, T3);
+		return -vec3(T3, T2, T1);
+	}
+}
+
+void MultiBodyBackend::UpdateCollisionObjects(void)
+{
+	Body->forwardKinematics(ScratchRotations, ScratchVectors);
+	Body->updateCollisionObjectWorldTransforms(ScratchRotations, ScratchVectors);
+}
+
+void MultiBodyBackend::RefreshLocks(void)
+{
+	for (BoneJoint& Joint : Joints) {
+
+		if (Joint.Lock == nullptr)
+			continue;
+
+		btTransform Transform = GetLinkWorldTransform(Joint.BodyLink);
+
+		Joint.Lock->setPivotInB(Transform.getOrigin());
+		Joint.Lock->setFrameInB(Transform.getBasis());
+	}
+}
+
+mat4 MultiBodyBackend::GetBoneWorldTransform(Bone* Bone)
+{
+	return BulletToGLM(GetLinkWorldTransform(Joints[Bone->ID].BodyLink)) * inverse(Bone->MiddleTranslation);
+}
+
+vec3 MultiBodyBackend::GetBoneAngles(Bone* Bone)
+{
+	BoneJoint& Joint = Joints[Bone->ID];
+
+	vec3 Result = vec3(nanf(""));
+
+	for (int Axis = 0; Axis < 3; Axis++)
+		if (Joint.AxisLinks[Axis] != -1)
+			Result[Axis] = Body->getJointPos(Joint.AxisLinks[Axis]);
+
+	return Result;
+}
+
+void MultiBodyBackend::UpdateBoneConstraint(Bone* Bone, bool XBlocked, bool YBlocked, bool ZBlocked)
+{
+	BoneJoint& Joint = Joints[Bone->ID];
+
+	bool Blocked[3] = { XBlocked, YBlocked, ZBlocked };
+
+	for (int Axis = 0; Axis < 3; Axis++) {
+
+		btMultiBodyJointLimitConstraint* Limit = Joint.Limits[Axis];
+		if (Limit == nullptr)
+			continue;
+
+		if (Blocked[Axis]) {
+
+			btScalar Angle = Body->getJointPos(Joint.AxisLinks[Axis]);
+
+			Limit->setLowerBound(Angle);
+			Limit->setUpperBound(Angle);
+		}
+		else {
+			Limit->setLowerBound(Bone->LowLimit[Axis]);
+			Limit->setUpperBound(Bone->HighLimit[Axis]);
+		}
+	}
+}
+
+void MultiBodyBackend::SetBoneLocked(Bone* Bone, bool IsLocked)
+{
+	BoneJoint& Joint = Joints[Bone->ID];
+
+	if (IsLocked == (Joint.Lock != nullptr))
+		return;
+
+	if (IsLocked) {
+
+		// same effect as a zero mass body in the rigid body backend: the bone is held in world space
+		btTransform Transform = GetLinkWorldTransform(Joint.BodyLink);
+
+		Joint.Lock = new btMultiBodyFixedConstraint(Body, Joint.BodyLink, (btRigidBody*)nullptr,
+			btVector3(0, 0, 0), Transform.getOrigin(), btMatrix3x3::getIdentity(), Transform.getBasis());
+		Joint.Lock->finalizeMultiDof();
+
+		World->addMultiBodyConstraint(Joint.Lock);
+	}
+	else {
+		World->removeMultiBodyConstraint(Joint.Lock);
+		delete Joint.Lock;
+		Joint.Lock = nullptr;
+	}
+}
+
+void MultiBodyBackend::SyncWithCharacter(Character* Char)
+{
+	Char->UpdateWorldTranforms();
+
+	vector<mat4> Rotations, WorldTransforms;
+
+	for (Bone* Bone : Char->Bones) {
+		Rotations.push_back(Bone->Rotation);
+		WorldTransforms.push_back(Bone->WorldTransform);
+	}
+
+	SyncWithPose(Char, Rotations, WorldTransforms);
+}
+
+void MultiBodyBackend::SyncWithPose(Character* Char, const vector<mat4>& Rotations, const vector<mat4>& WorldTransforms)
+{
+	Bone* Root = Char->Pelvis;
+
+	Body->setBaseWorldTransform(GLMToBullet(WorldTransforms[Root->ID] * Root->MiddleTranslation));
+	Body->setBaseVel(btVector3(0, 0, 0));
+	Body->setBaseOmega(btVector3(0, 0, 0));
+
+	for (Bone* Bone : Char->Bones) {
+
+		BoneJoint& Joint = Joints[Bone->ID];
+		if (Joint.AxisCount == 0)
+			continue;
+
+		vec3 Angles = GetRotationAngles(Joint, Rotations[Bone->ID]);
+
+		for (int Axis = 0; Axis < 3; Axis++) {
+
+			int Link = Joint.AxisLinks[Axis];
+			if (Link == -1)
+				continue;
+
+			Body->setJointPos(Link, Angles[Axis]);
+			Body->setJointVel(Link, 0);
+		}
+	}
+
+	UpdateCollisionObjects();
+
+	RefreshLocks();
+}
+
+btMultiBodyPoint2Point* MultiBodyBackend::AddPinpoint(Bone* Bone, vec3 LocalPoint, vec3 WorldPoint)
+{
+	btMultiBodyPoint2Point* Constraint = new btMultiBodyPoint2Point(Body, Joints[Bone->ID].BodyLink, (btRigidBody*)nullptr,
+		GLMToBullet(LocalPoint), GLMToBullet(WorldPoint));
+
+	Constraint->setMaxAppliedImpulse(PinpointMaxImpulse);
+	Constraint->finalizeMultiDof();
+
+	World->addMultiBodyConstraint(Constraint);
+
+	return Constraint;
+}
+
+void MultiBodyBackend::RemovePinpoint(btMultiBodyPoint2Point* Constraint)
+{
+	World->removeMultiBodyConstraint(Constraint);
+	delete Constraint;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <btBulletDynamicsCommon.h>
+#include <BulletDynamics/Featherstone/btMultiBody.h>
+#include <BulletDynamics/Featherstone/btMultiBodyDynamicsWorld.h>
+#include <BulletDynamics/Featherstone/btMultiBodyLinkCollider.h>
+#include <BulletDynamics/Featherstone/btMultiBodyJointLimitConstraint.h>
+#include <BulletDynamics/Featherstone/btMultiBodyFixedConstraint.h>
+#include <BulletDynamics/Featherstone/btMultiBodyPoint2Point.h>
+
+#include "Character.hpp"
+
+using namespace std;
+using namespace glm;
+
+// Reduced-coordinate (Featherstone) skeleton: the pelvis is the floating base, every other bone is a chain
+// of revolute links (one per free axis) ending in the link that carries the bone collider, so joints are
+// exact by construction and only limits, locks and pinpoints go through the constraint solver.
+typedef class MultiBodyBackend {
+private:
+	typedef struct BoneJoint {
+		// link carrying the bone collider, -1 for the base
+		int BodyLink;
+		// link driving each editor axis (X, Y, Z), -1 if the axis is not a degree of freedom
+		int AxisLinks[3];
+		// editor axes from the outermost to the innermost link, matches Bone::Rotation composition
+		int AxisOrder[3];
+		int AxisCount;
+
+		btMultiBodyJointLimitConstraint* Limits[3];
+		btMultiBodyFixedConstraint* Lock;
+	} BoneJoint;
+
+	const float DummyLinkMassFactor = 0.01f;
+	const float PinpointMaxImpulse = 0.5f;
+
+	btMultiBodyDynamicsWorld* World;
+	btMultiBody* Body;
+
+	vector<BoneJoint> Joints;
+
+	btAlignedObjectArray<btQuaternion> ScratchRotations;
+	btAlignedObjectArray<btVector3> ScratchVectors;
+
+	int GetJointAxes(Bone* Bone, int Axes[3]);
+	int CountLinks(Character* Char);
+
+	void CreateLinks(Character* Char);
+	void CreateColliders(Character* Char);
+	void CreateLimits(Character* Char);
+
+	btVector3 GetBoxInertia(vec3 Size, float Mass);
+	btTransform GetLinkWorldTransform(int Link);
+	vec3 GetRotationAngles(BoneJoint& Joint, mat4 Rotation);
+
+	void UpdateCollisionObjects(void);
+	void RefreshLocks(void);
+public:
+	MultiBodyBackend(btMultiBodyDynamicsWorld* World, Character* Char);
+
+	mat4 GetBoneWorldTransform(Bone* Bone);
+
+	vec3 GetBoneAngles(Bone* Bone);
+	void UpdateBoneConstraint(Bone* Bone, bool XBlocked, bool YBlocked, bool ZBlocked);
+	void SetBoneLocked(Bone* Bone, bool IsLocked);
+
+	void SyncWithCharacter(Character* Char);
+	// same with the rotations and world transforms given by bone ID instead of read from the character
+	void SyncWithPose(Character* Char, const vector<mat4>& Rotations, const vector<mat4>& WorldTransforms);
+
+	btMultiBodyPoint2Point* AddPinpoint(Bone* Bone, vec3 LocalPoint, vec3 WorldPoint);
+	void RemovePinpoint(btMultiBodyPoint2Point* Constraint);
+} MultiBodyBackend;
@@ -2,30 +2,124 @@
 
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include <string.h>
 
+#include <algorithm>
+#include <unordered_map>
+
+#define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtx/euler_angles.hpp>
+
+#include <BulletDynamics/Featherstone/btMultiBodyConstraintSolver.h>
+#include <LinearMath/btQuickprof.h>
 
 #include "CharacterManager.hpp"
+#include "MultiBodyBackend.hpp"
+
+double GetPreciseTime(void) {
+
+	LARGE_INTEGER Counter, Frequency;
+
+	QueryPerformanceCounter(&Counter);
+	QueryPerformanceFrequency(&Frequency);
+
+	return (double)Counter.QuadPart / (double)Frequency.QuadPart;
+}
+
+void PhysicsManager::SetBroadphase(BroadphaseType Type)
+{
+	SelectedBroadphase = Type;
+}
+
+PhysicsManager::BroadphaseType PhysicsManager::GetBroadphase(void)
+{
+	return SelectedBroadphase;
+}
 
-void PhysicsManager::Initialize(void)
+void PhysicsManager::Initialize(bool UseMultiBody)
 {
-	btBroadphaseInterface* Broadphase = new btDbvtBroadphase();
+	const float FloorSize2D = 4.0f, FloorHeight = 100.0f;
+
+	btBroadphaseInterface* Broadphase;
+
+	if (SelectedBroadphase == SweepAndPruneBroadphase) {
+
+		// the floor and anything above it in reach of the rig, bounds outside are clamped and only cost pairs
+		float FloorZ = CharacterManager::GetInstance().GetCharacter()->FloorZ;
+
+		Broadphase = new btAxisSweep3(btVector3(-FloorSize2D, -FloorSize2D, FloorZ - FloorHeight), btVector3(FloorSize2D, FloorSize2D, FloorZ + FloorSize2D));
+	}
+	else
+		Broadphase = new btDbvtBroadphase();
 
 	btDefaultCollisionConfiguration* CollisionConfiguration = new btDefaultCollisionConfiguration();
 	btCollisionDispatcher* Dispatcher = new btCollisionDispatcher(CollisionConfiguration);
 
-	btSequentialImpulseConstraintSolver* Solver = new btSequentialImpulseConstraintSolver;
+	if (UseMultiBody) {
 
-	World = new btDiscreteDynamicsWorld(Dispatcher, Broadphase, Solver, CollisionConfiguration);
-	World->setGravity(btVector3(0, 0, 0));
+		btMultiBodyConstraintSolver* Solver = new btMultiBodyConstraintSolver;
+
+		World = new btMultiBodyDynamicsWorld(Dispatcher, Broadphase, Solver, CollisionConfiguration);
+
+		TargetFPS = MULTIBODY_PHYSICS_FPS;
+		MinFPS = MULTIBODY_PHYSICS_FPS / 4;
+		TargetIterations = MultiBodySolverIterations;
+	}
+	else {
 
-	btOverlapFilterCallback* filterCallback = new YourOwnFilterCallback();
-	World->getPairCache()->setOverlapFilterCallback(filterCallback);
+		btSequentialImpulseConstraintSolver* Solver = new btSequentialImpulseConstraintSolver;
+
+		World = new btDiscreteDynamicsWorld(Dispatcher, Broadphase, Solver, CollisionConfiguration);
+
+		// bounds of sleeping bones are updated when they are moved by the editor
+		World->setForceUpdateAllAabbs(false);
+
+		TargetFPS = PHYSICS_FPS;
+		MinFPS = PHYSICS_FPS / 10;
+		TargetIterations = SolverIterations;
+	}
+
+	CurrentFPS = TargetFPS;
+	CurrentIterations = TargetIterations;
+
+	if (TickBudget == 0)
+		TickBudget = DefaultTickBudget;
 
 	btContactSolverInfo& SolverInfo = World->getSolverInfo();
-	SolverInfo.m_numIterations = 30;
+	SolverInfo.m_numIterations = CurrentIterations;
+
+	World->setGravity(btVector3(0, 0, 0));
 
-	CreateFloor(4.0f, 100.0f);
+	Filter = new BoneFilterCallback();
+	Filter->Build(CharacterManager::GetInstance().GetCharacter());
+	World->getPairCache()->setOverlapFilterCallback(Filter);
+
+	BroadphaseProfileDepth = -1;
+	btSetCustomEnterProfileZoneFunc(EnterProfileZone);
+	btSetCustomLeaveProfileZoneFunc(LeaveProfileZone);
+
+	InitializeCriticalSection(&WorldMutex);
+	WorldLockDepth = 0;
+
+	PhysicsThread = nullptr;
+	PendingTickTime = 0;
+	SampledPinpoint = nullptr;
+
+	// until the first move settles
+	PredictionLatency = MaxPredictionTime;
+
+	WritePoseIndex = 0;
+	ReadyPoseIndex = 1;
+	ReadPoseIndex = 2;
+
+	PoseSequence = 0;
+	SyncedPoseSequence = 0;
+
+	PostedWriteSequence = 0;
+	AppliedWriteSequence = 0;
+
+	CreateFloor(FloorSize2D, FloorHeight);
 
 	CreatePhysicsForCharacter();
 }
@@ -39,120 +133,177 @@ void PhysicsManager::CreatePhysicsForCharacter(void) {
 		float Volume = Bone->Size.x * Bone->Size.y * Bone->Size.z;
 		const float Density = 1900;
 		Bone->Mass = Density * Volume;
+	}
+
+	BuildJointDescriptors(Char);
+
+	if (World->getWorldType() == BT_DISCRETE_DYNAMICS_WORLD) {
+
+		for (Bone* Bone : Char->Bones) {
 
-		mat4 Transform = Bone->WorldTransform * Bone->MiddleTranslation;
+			mat4 Transform = Bone->WorldTransform * Bone->MiddleTranslation;
 
-		Bone->PhysicBody = AddDynamicBox(Transform, Bone->Size, Bone->Mass);
-		Bone->PhysicBody->setUserPointer((void*)Bone);
+			Bone->PhysicBody = AddDynamicBox(Transform, Bone->Size, Bone->Mass);
+			Bone->PhysicBody->setUserPointer((void*)Bone);
+			Bone->PhysicBody->setUserIndex(Bone->ID);
+			Bone->PhysicBody->setDamping(1, 1);
+		}
+
+		CreatePinpointSlots();
 	}
+	else
+		MultiBody = new MultiBodyBackend((btMultiBodyDynamicsWorld*)World, Char);
 
 	for (Bone* Child : Char->Bones)
 		UpdateBoneConstraint(Child, false, false, false);
 }
 
+bool PhysicsManager::IsMultiBody(void)
+{
+	return MultiBody != nullptr;
+}
+
 void PhysicsManager::ChangeObjectMass(btRigidBody* Body, float NewMass)
 {
-	World->removeRigidBody(Body);
+	// bones are always registered as dynamic bodies, a zero mass only makes them static for the solver,
+	// so there is no need to remove and add the body again and rebuild its broadphase pairs
+	btVector3 Inertia(0, 0, 0);
+	if (NewMass > 0)
+		Body->getCollisionShape()->calculateLocalInertia(NewMass, Inertia);
 
-	btVector3 Inertia;
-	Body->getCollisionShape()->calculateLocalInertia(NewMass, Inertia);
 	Body->setMassProps(NewMass, Inertia);
+	Body->updateInertiaTensor();
 
-	//Add the rigid body to the dynamics world
-	World->addRigidBody(Body);
+	// pairs where neither body is awake are skipped by the narrowphase, constraints between
+	// two static bodies never get an island, so a blocked subtree costs the solver nothing
+	if (NewMass > 0)
+		Body->activate(true);
+	else
+		Body->forceActivationState(ISLAND_SLEEPING);
 }
 
-void PhysicsManager::UpdateBoneConstraint(Bone* Child, bool XAxisBlocked, bool YAxisBlocked, bool ZAxisBlocked)
+void PhysicsManager::SetBoneBlocking(Bone* Bone, bool IsFullyBlocked, vec3 LinearFactor, bool XAxisBlocked, bool YAxisBlocked, bool ZAxisBlocked)
 {
-	Bone* Parent = Child->Parent;
-	if (Parent == nullptr) {
+	PendingBlocking Blocking;
 
-		Child->PhysicBody->setAngularFactor(GLMToBullet({ XAxisBlocked ? 0 : 1, YAxisBlocked ? 0 : 1, ZAxisBlocked ? 0 : 1 }));
+	Blocking.IsPending = true;
+	Blocking.IsFullyBlocked = IsFullyBlocked;
+	Blocking.LinearFactor = LinearFactor;
+	Blocking.XAxisBlocked = XAxisBlocked;
+	Blocking.YAxisBlocked = YAxisBlocked;
+	Blocking.ZAxisBlocked = ZAxisBlocked;
+
+	if (BlockingTransactionCounter == 0) {
+		PostBoneBlocking(Bone, Blocking);
 		return;
 	}
 
-	btVector3 BulletChildLocalPoint = GLMToBullet(Child->JointLocalPoint);
-	btVector3 BulletParentLocalPoint = GLMToBullet(Child->ParentJointLocalPoint);
+	if (PendingBlockings.size() <= (size_t)Bone->ID)
+		PendingBlockings.resize(Bone->ID + 1);
 
-	btTransform BulletChildFrame;
-	BulletChildFrame.setIdentity();
-	BulletChildFrame.setOrigin(BulletChildLocalPoint);
+	PendingBlockings[Bone->ID] = Blocking;
+}
 
-	btTransform BulletParentFrame;
-	BulletParentFrame.setIdentity();
-	BulletParentFrame.setOrigin(BulletParentLocalPoint);
+void PhysicsManager::ApplyBoneBlocking(Bone* Bone, PendingBlocking& Blocking)
+{
+	if (MultiBody != nullptr)
+		// joints can't drift apart, so locking the link in world space replaces the zero mass trick
+		MultiBody->SetBoneLocked(Bone, Blocking.IsFullyBlocked);
+	else {
+		btRigidBody* Body = Bone->PhysicBody;
 
-	vec3 LowLimit = Child->LowLimit;
-	vec3 HighLimit = Child->HighLimit;
+		if (Blocking.IsFullyBlocked != (Body->getInvMass() == 0))
+			ChangeObjectMass(Body, Blocking.IsFullyBlocked ? 0 : Bone->Mass);
 
-	if (Child->IsFixed()) {
+		Body->setLinearFactor(GLMToBullet(Blocking.LinearFactor));
 
-		if (Child->PhysicConstraint == nullptr) {
+		// new limits may have to be solved, static bodies stay asleep
+		Body->activate();
+	}
 
-			btFixedConstraint* Constraint = new btFixedConstraint(*Parent->PhysicBody, *Child->PhysicBody, BulletParentFrame, BulletChildFrame);
+	// always applied, blocked axes are limited to the current angle
+	UpdateBoneConstraint(Bone, Blocking.XAxisBlocked, Blocking.YAxisBlocked, Blocking.ZAxisBlocked);
+}
 
-			Child->PhysicConstraint = Constraint;
-			World->addConstraint(Child->PhysicConstraint, true);
-		}
+void PhysicsManager::PostBoneBlocking(Bone* Bone, PendingBlocking& Blocking)
+{
+	if (PhysicsThread == nullptr) {
+		ApplyBoneBlocking(Bone, Blocking);
+		return;
 	}
-	else
-	if (Child->IsOnlyXRotation())
-	{
-		btHingeConstraint* Constraint;
-		
-		if (Child->PhysicConstraint == nullptr) {
-			Constraint = new btHingeConstraint(*Parent->PhysicBody, *Child->PhysicBody, BulletParentLocalPoint, BulletChildLocalPoint,
-				btVector3(1, 0, 0), btVector3(1, 0, 0));
 
-			Child->PhysicConstraint = Constraint;
-			World->addConstraint(Child->PhysicConstraint, true);
-		}
-		else
-			Constraint = (btHingeConstraint*)Child->PhysicConstraint;
+	PhysicsCommand Command = {};
+	Command.Type = BlockingCommand;
+	Command.TargetBone = Bone;
+	Command.Blocking = Blocking;
 
-		if (XAxisBlocked) {
+	PostCommand(Command);
+}
 
-			btScalar Angle = Constraint->getHingeAngle();
+void PhysicsManager::CommitBlockingTransaction(void)
+{
+	Character* Char = CharacterManager::GetInstance().GetCharacter();
 
-			Constraint->setLimit(Angle, Angle);
-		}
-		else
-			Constraint->setLimit(LowLimit.x, HighLimit.x);
+	for (Bone* Bone : Char->Bones) {
+
+		if (PendingBlockings.size() <= (size_t)Bone->ID)
+			break;
+
+		PendingBlocking& Blocking = PendingBlockings[Bone->ID];
+		if (!Blocking.IsPending)
+			continue;
+
+		PostBoneBlocking(Bone, Blocking);
+
+		Blocking.IsPending = false;
 	}
-	else
-	if (Child->IsOnlyYRotation())
-	{
-		btHingeConstraint* Constraint;
-		
+}
+
+void PhysicsManager::UpdateBoneConstraint(Bone* Child, bool XAxisBlocked, bool YAxisBlocked, bool ZAxisBlocked)
+{
+	Child->XAxisBlocked = XAxisBlocked;
+	Child->YAxisBlocked = YAxisBlocked;
+	Child->ZAxisBlocked = ZAxisBlocked;
+
+	if (MultiBody != nullptr) {
+		MultiBody->UpdateBoneConstraint(Child, XAxisBlocked, YAxisBlocked, ZAxisBlocked);
+		return;
+	}
+
+	JointDescriptor& Joint = Joints[Child->ID];
+
+	bool Blocked[3] = { XAxisBlocked, YAxisBlocked, ZAxisBlocked };
+
+	Bone* Parent = Child->Parent;
+
+	switch (Joint.Kind) {
+	case RootJoint:
+
+		Child->PhysicBody->setAngularFactor(GLMToBullet({ XAxisBlocked ? 0 : 1, YAxisBlocked ? 0 : 1, ZAxisBlocked ? 0 : 1 }));
+		break;
+
+	case FixedJoint:
+
 		if (Child->PhysicConstraint == nullptr) {
 
-			Constraint = new btHingeConstraint(*Parent->PhysicBody, *Child->PhysicBody, BulletParentLocalPoint, BulletChildLocalPoint,
-				btVector3(0, 1, 0), btVector3(0, 1, 0));
-			
+			btFixedConstraint* Constraint = new btFixedConstraint(*Parent->PhysicBody, *Child->PhysicBody, Joint.ParentFrame, Joint.ChildFrame);
+
 			Child->PhysicConstraint = Constraint;
 			World->addConstraint(Child->PhysicConstraint, true);
 		}
-		else
-			Constraint = (btHingeConstraint*)Child->PhysicConstraint;
-		
-		if (YAxisBlocked) {
+		break;
 
-			btScalar Angle = Constraint->getHingeAngle();
+	case HingeJoint: {
 
-			Constraint->setLimit(Angle, Angle);
-		}
-		else
-			Constraint->setLimit(LowLimit.y, HighLimit.y);
-	}
-	else
-	if (Child->IsOnlyZRotation())
-	{
 		btHingeConstraint* Constraint;
-		
+
 		if (Child->PhysicConstraint == nullptr) {
 
-			Constraint = new btHingeConstraint(*Parent->PhysicBody, *Child->PhysicBody, BulletParentLocalPoint, BulletChildLocalPoint,
-				btVector3(0, 0, 1), btVector3(0, 0, 1));
+			btVector3 Axis(0, 0, 0);
+			Axis[Joint.HingeAxis] = 1;
+
+			Constraint = new btHingeConstraint(*Parent->PhysicBody, *Child->PhysicBody, Joint.ParentFrame.getOrigin(), Joint.ChildFrame.getOrigin(),
+				Axis, Axis);
 
 			Child->PhysicConstraint = Constraint;
 			World->addConstraint(Child->PhysicConstraint, true);
@@ -160,25 +311,24 @@ void PhysicsManager::UpdateBoneConstraint(Bone* Child, bool XAxisBlocked, bool Y
 		else
 			Constraint = (btHingeConstraint*)Child->PhysicConstraint;
 
-		if (ZAxisBlocked) {
+		if (Blocked[Joint.HingeAxis]) {
 
 			btScalar Angle = Constraint->getHingeAngle();
 
 			Constraint->setLimit(Angle, Angle);
 		}
 		else
-			Constraint->setLimit(LowLimit.z, HighLimit.z);
+			Constraint->setLimit(Joint.LowLimit[Joint.HingeAxis], Joint.HighLimit[Joint.HingeAxis]);
+		break;
 	}
-	else
-	// generic 6DOF 
-	{
-		ApplyGimbalLockFix(LowLimit, HighLimit, BulletParentFrame, BulletChildFrame, XAxisBlocked, YAxisBlocked, ZAxisBlocked);
+
+	case GenericJoint: {
 
 		btGeneric6DofSpring2Constraint* Constraint;
 
 		if (Child->PhysicConstraint == nullptr) {
 
-			Constraint = new btGeneric6DofSpring2Constraint(*Parent->PhysicBody, *Child->PhysicBody, BulletParentFrame, BulletChildFrame);
+			Constraint = new btGeneric6DofSpring2Constraint(*Parent->PhysicBody, *Child->PhysicBody, Joint.ParentFrame, Joint.ChildFrame);
 
 			Constraint->setLinearLowerLimit(btVector3(0, 0, 0));
 			Constraint->setLinearUpperLimit(btVector3(0, 0, 0));
@@ -192,38 +342,41 @@ void PhysicsManager::UpdateBoneConstraint(Bone* Child, bool XAxisBlocked, bool Y
 		else
 			Constraint = (btGeneric6DofSpring2Constraint*)Child->PhysicConstraint;
 
+		// limits are in constraint axes, blocked flags in editor axes
+		vec3 LowLimit = Joint.LowLimit;
+		vec3 HighLimit = Joint.HighLimit;
+
 		if (XAxisBlocked || YAxisBlocked || ZAxisBlocked) {
 
 			Constraint->calculateTransforms();
 
-			vec3 CurrentAngles = { Constraint->getAngle(0), Constraint->getAngle(1), Constraint->getAngle(2) };
-
-			if (XAxisBlocked) {
-				LowLimit.x = CurrentAngles.x;
-				HighLimit.x = CurrentAngles.x;
-			}
+			for (int Axis = 0; Axis < 3; Axis++) {
 
-			if (YAxisBlocked) {
-				LowLimit.y = CurrentAngles.y;
-				HighLimit.y = CurrentAngles.y;
-			}
+				if (!Blocked[Joint.AxisRemap[Axis]])
+					continue;
 
-			if (ZAxisBlocked) {
-				LowLimit.z = CurrentAngles.z;
-				HighLimit.z = CurrentAngles.z;
+				LowLimit[Axis] = Constraint->getAngle(Axis);
+				HighLimit[Axis] = LowLimit[Axis];
 			}
 		}
 
 		Constraint->setAngularLowerLimit(GLMToBullet(LowLimit));
 		Constraint->setAngularUpperLimit(GLMToBullet(HighLimit));
+		break;
+	}
 	}
 }
 
 vec3 PhysicsManager::GetBoneAngles(Bone* Bone)
 {
+	if (PhysicsThread != nullptr)
+		return AcquirePose().Angles[Bone->ID];
+
 	float NaN = nanf("");
 
-	if (Bone->PhysicConstraint == nullptr) {
+	JointDescriptor& Joint = Joints[Bone->ID];
+
+	if (Joint.Kind == RootJoint) {
 
 		quat Q = quat_cast(Bone->Rotation);
 		vec3 angles = -eulerAngles(Q);
@@ -231,53 +384,95 @@ vec3 PhysicsManager::GetBoneAngles(Bone* Bone)
 		return angles;
 	}
 
-	if (Bone->IsFixed())
-		return vec3(NaN); // ?
-	else 
-	if (Bone->IsOnlyXRotation()) {
+	if (MultiBody != nullptr)
+		return MultiBody->GetBoneAngles(Bone);
+
+	switch (Joint.Kind) {
+	case HingeJoint: {
 
 		btHingeConstraint* Constraint = (btHingeConstraint*)Bone->PhysicConstraint;
 
-		return { Constraint->getHingeAngle(), NaN, NaN };
+		vec3 Angles = vec3(NaN);
+		Angles[Joint.HingeAxis] = Constraint->getHingeAngle();
+
+		return Angles;
 	}
-	else
-	if (Bone->IsOnlyYRotation()) {
+	case GenericJoint: {
 
-		btHingeConstraint* Constraint = (btHingeConstraint*)Bone->PhysicConstraint;
+		btGeneric6DofSpring2Constraint* Constraint = (btGeneric6DofSpring2Constraint*)Bone->PhysicConstraint;
 
-		return { NaN, Constraint->getHingeAngle(), NaN };
-	}
-	else
-	if (Bone->IsOnlyZRotation()) {
+		Constraint->calculateTransforms();
 
-		btHingeConstraint* Constraint = (btHingeConstraint*)Bone->PhysicConstraint;
+		vec3 Angles;
+		for (int Axis = 0; Axis < 3; Axis++)
+			Angles[Joint.AxisRemap[Axis]] = Joint.AxisSign[Axis] * Constraint->getAngle(Axis);
 
-		return { NaN, NaN, Constraint->getHingeAngle() };
+		return Angles;
 	}
-	else {
+	default:
+		return vec3(NaN);
+	}
+}
 
-		btGeneric6DofSpring2Constraint* Constraint = (btGeneric6DofSpring2Constraint*)Bone->PhysicConstraint;
+void PhysicsManager::GetAllBoneAngles(vector<vec3>& Angles)
+{
+	Character* Char = CharacterManager::GetInstance().GetCharacter();
 
-		Constraint->calculateTransforms();
+	Angles.resize(Char->Bones.size());
+
+	float NaN = nanf("");
+
+	// no per bone dispatch, the descriptors already say where each constraint axis goes
+	for (Bone* Bone : Char->Bones) {
+
+		JointDescriptor& Joint = Joints[Bone->ID];
+		vec3& Result = Angles[Bone->ID];
+
+		Result = vec3(NaN);
+
+		// same as Bone::Rotation of the root, but read from the world so the physics thread can publish it
+		if (Joint.Kind == RootJoint)
+			Result = -eulerAngles(quat_cast(mat3(GetBoneWorldTransform(Bone))));
+		else
+		if (MultiBody != nullptr)
+			Result = MultiBody->GetBoneAngles(Bone);
+		else
+		if (Joint.Kind == HingeJoint)
+			Result[Joint.HingeAxis] = ((btHingeConstraint*)Bone->PhysicConstraint)->getHingeAngle();
+		else
+		if (Joint.Kind == GenericJoint) {
 
-		vec3 CurrentAngles = { Constraint->getAngle(0), Constraint->getAngle(1), Constraint->getAngle(2) };
+			btGeneric6DofSpring2Constraint* Constraint = (btGeneric6DofSpring2Constraint*)Bone->PhysicConstraint;
 
-		ReverseGimbalLockFix(Bone->LowLimit, Bone->HighLimit, CurrentAngles);
+			Constraint->calculateTransforms();
 
-		return CurrentAngles;
+			for (int Axis = 0; Axis < 3; Axis++)
+				Result[Joint.AxisRemap[Axis]] = Joint.AxisSign[Axis] * Constraint->getAngle(Axis);
+		}
 	}
 }
 
 void PhysicsManager::SetBoneAngles(Bone* Bone, vec3 Angles)
 {
-	bool SavedXAxisBlocked, SavedYAxisBlocked, SavedZAxisBlocked;
+	SetBoneAngles(vector<BoneAngles>{ { Bone, Angles } });
+}
+
+void PhysicsManager::SetBoneAngles(const vector<BoneAngles>& Targets)
+{
+	for (const BoneAngles& Target : Targets)
+		Target.TargetBone->Rotation = GetRotationFromAngles(Target.TargetBone, Target.Angles);
 
-	SavedXAxisBlocked = Bone->XAxisBlocked;
-	SavedYAxisBlocked = Bone->YAxisBlocked;
-	SavedZAxisBlocked = Bone->ZAxisBlocked;
+	// limits of blocked axes follow the new angles
+	vector<Bone*> ConstrainedBones;
 
-	UpdateBoneConstraint(Bone, false, false, false);
+	for (const BoneAngles& Target : Targets)
+		ConstrainedBones.push_back(Target.TargetBone);
 
+	PostCharacterPose(ConstrainedBones);
+}
+
+mat4 PhysicsManager::GetRotationFromAngles(Bone* Bone, vec3 Angles)
+{
 	Angles = clamp(Angles, Bone->LowLimit, Bone->HighLimit);
 
 	mat4 RotationX, RotationY, RotationZ;
@@ -297,24 +492,54 @@ void PhysicsManager::SetBoneAngles(Bone* Bone, vec3 Angles)
 	else
 		RotationZ = mat4(1.0f);
 
-	GimbalLockFixType FixType;
-
-	if (Bone->Parent != nullptr)
-		FixType = GetGimbalLockFixType(Bone->LowLimit, Bone->HighLimit);
-	else
-		FixType = None;
+	GimbalLockFixType FixType = Joints[Bone->ID].FixType;
 
 	if (FixType == XtoY)
-		Bone->Rotation = RotationZ * RotationX * RotationY;
+		return RotationZ * RotationX * RotationY;
 	else
 	if (FixType == ZtoY)
-		Bone->Rotation = RotationY * RotationZ * RotationX;
+		return RotationY * RotationZ * RotationX;
 	else
-		Bone->Rotation = RotationZ * RotationY * RotationX;
+		return RotationZ * RotationY * RotationX;
+}
+
+vec3 PhysicsManager::GetAnglesFromRotation(Bone* Bone, mat4 Rotation)
+{
+	float NaN = nanf("");
+
+	JointDescriptor& Joint = Joints[Bone->ID];
+
+	// same convention as GetBoneAngles
+	if (Joint.Kind == RootJoint)
+		return -eulerAngles(quat_cast(Rotation));
+
+	if (Joint.Kind == FixedJoint)
+		return vec3(NaN);
+
+	float T1, T2, T3;
+	vec3 Angles;
+
+	// inverse of the composition order in GetRotationFromAngles, angles rotate around negative axes
+	switch (Joint.FixType) {
+	case XtoY:
+		extractEulerAngleZXY(Rotation, T1, T2, T3);
+		Angles = -vec3(T2, T3, T1);
+		break;
+	case ZtoY:
+		extractEulerAngleYZX(Rotation, T1, T2, T3);
+		Angles = -vec3(T3, T1, T2);
+		break;
+	default:
+		extractEulerAngleZYX(Rotation, T1, T2, T3);
+		Angles = -vec3(T3, T2, T1);
+		break;
+	}
 
-	SyncWorldWithCharacter();
+	for (int Axis = 0; Axis < 3; Axis++)
+		if (!Joint.IsFree[Axis])
+			Angles[Axis] = NaN;
 
-	UpdateBoneConstraint(Bone, SavedXAxisBlocked, SavedYAxisBlocked, SavedZAxisBlocked);
+	return Angles;
 }
 
 PhysicsManager::GimbalLockFixType PhysicsManager::GetGimbalLockFixType(vec3 LowLimit, vec3 HighLimit)
@@ -344,16 +569,109 @@ PhysicsManager::GimbalLockFixType PhysicsManager::GetGimbalLockFixType(vec3 LowL
 	}
 }
 
-void PhysicsManager::ApplyGimbalLockFix(vec3& LowLimit, vec3& HighLimit, btTransform& ParentFrame, btTransform& ChildFrame,
-	bool& XBlocked, bool& YBlocked, bool &ZBlocked)
+void PhysicsManager::BuildJointDescriptors(Character* Char)
+{
+	Joints.resize(Char->Bones.size());
+
+	for (Bone* Bone : Char->Bones) {
+
+		JointDescriptor& Joint = Joints[Bone->ID];
+
+		Joint = {};
+		Joint.FixType = None;
+		Joint.HingeAxis = -1;
+
+		for (int Axis = 0; Axis < 3; Axis++) {
+			Joint.AxisRemap[Axis] = Axis;
+			Joint.AxisSign[Axis] = 1;
+		}
+
+		Joint.LowLimit = Bone->LowLimit;
+		Joint.HighLimit = Bone->HighLimit;
+
+		Joint.ParentFrame.setIdentity();
+		Joint.ParentFrame.setOrigin(GLMToBullet(Bone->ParentJointLocalPoint));
+
+		Joint.ChildFrame.setIdentity();
+		Joint.ChildFrame.setOrigin(GLMToBullet(Bone->JointLocalPoint));
+
+		if (Bone->Parent == nullptr) {
+
+			Joint.Kind = RootJoint;
+			Joint.IsFree[0] = Joint.IsFree[1] = Joint.IsFree[2] = true;
+		}
+		else
+		if (Bone->IsFixed())
+			Joint.Kind = FixedJoint;
+		else
+		if (Bone->IsOnlyXRotation() || Bone->IsOnlyYRotation() || Bone->IsOnlyZRotation()) {
+
+			Joint.Kind = HingeJoint;
+			Joint.HingeAxis = Bone->IsOnlyXRotation() ? 0 : (Bone->IsOnlyYRotation() ? 1 : 2);
+			Joint.IsFree[Joint.HingeAxis] = true;
+		}
+		else {
+
+			Joint.Kind = GenericJoint;
+			Joint.IsFree[0] = Joint.IsFree[1] = Joint.IsFree[2] = true;
+		}
+
+		// single axis joints keep the same rotation order as before, any order is exact for them
+		if (Joint.Kind != RootJoint)
+			Joint.FixType = GetGimbalLockFixType(Bone->LowLimit, Bone->HighLimit);
+
+		if (Joint.Kind == GenericJoint)
+			ApplyGimbalLockFix(Joint);
+
+		if (Joint.Kind == HingeJoint) {
+
+			Joint.AxisOrder[0] = Joint.HingeAxis;
+			Joint.AxisCount = 1;
+		}
+		else
+		if (Joint.Kind != FixedJoint) {
+
+			// matches the composition in GetRotationFromAngles
+			if (Joint.FixType == XtoY) {
+				// Z * X * Y
+				Joint.AxisOrder[0] = 2;
+				Joint.AxisOrder[1] = 0;
+				Joint.AxisOrder[2] = 1;
+			}
+			else
+			if (Joint.FixType == ZtoY) {
+				// Y * Z * X
+				Joint.AxisOrder[0] = 1;
+				Joint.AxisOrder[1] = 2;
+				Joint.AxisOrder[2] = 0;
+			}
+			else {
+				// Z * Y * X
+				Joint.AxisOrder[0] = 2;
+				Joint.AxisOrder[1] = 1;
+				Joint.AxisOrder[2] = 0;
+			}
+
+			Joint.AxisCount = 3;
+		}
+	}
+}
+
+const PhysicsManager::JointDescriptor& PhysicsManager::GetJointDescriptor(Bone* Bone)
 {
-	GimbalLockFixType FixType = GetGimbalLockFixType(LowLimit, HighLimit);
+	return Joints[Bone->ID];
+}
+
+void PhysicsManager::ApplyGimbalLockFix(JointDescriptor& Joint)
+{
+	vec3& LowLimit = Joint.LowLimit;
+	vec3& HighLimit = Joint.HighLimit;
 
 	// switch Y -> X
-	if (FixType == XtoY) {
+	if (Joint.FixType == XtoY) {
 
-		ParentFrame.getBasis().setEulerYPR(M_PI_2, 0, 0);
-		ChildFrame.getBasis().setEulerYPR(M_PI_2, 0, 0);
+		Joint.ParentFrame.getBasis().setEulerYPR(M_PI_2, 0, 0);
+		Joint.ChildFrame.getBasis().setEulerYPR(M_PI_2, 0, 0);
 
 		swap(LowLimit.x, LowLimit.y);
 		swap(HighLimit.x, HighLimit.y);
@@ -362,14 +680,17 @@ void PhysicsManager::ApplyGimbalLockFix(vec3& LowLimit, vec3& HighLimit, btTrans
 		LowLimit.y = -LowLimit.y;
 		HighLimit.y = -HighLimit.y;
 
-		swap(XBlocked, YBlocked);
+		// constraint X is editor Y, constraint Y is negated editor X
+		Joint.AxisRemap[0] = 1;
+		Joint.AxisRemap[1] = 0;
+		Joint.AxisSign[1] = -1;
 	}
 	else
 	// switch Y -> Z
-	if (FixType == ZtoY) {
+	if (Joint.FixType == ZtoY) {
 
-		ParentFrame.getBasis().setEulerYPR(0, 0, -M_PI_2);
-		ChildFrame.getBasis().setEulerYPR(0, 0, -M_PI_2);
+		Joint.ParentFrame.getBasis().setEulerYPR(0, 0, -M_PI_2);
+		Joint.ChildFrame.getBasis().setEulerYPR(0, 0, -M_PI_2);
 
 		swap(LowLimit.z, LowLimit.y);
 		swap(HighLimit.z, HighLimit.y);
@@ -378,24 +699,10 @@ void PhysicsManager::ApplyGimbalLockFix(vec3& LowLimit, vec3& HighLimit, btTrans
 		LowLimit.y = -LowLimit.y;
 		HighLimit.y = -HighLimit.y;
 
-		swap(ZBlocked, YBlocked);
-	}
-}
-
-void PhysicsManager::ReverseGimbalLockFix(vec3 LowLimit, vec3 HighLimit, vec3& Angles)
-{
-	GimbalLockFixType FixType = GetGimbalLockFixType(LowLimit, HighLimit);
-
-	if (FixType == XtoY) {
-
-		Angles.y = -Angles.y;
-		swap(Angles.x, Angles.y);
-	}
-	else
-	if (FixType == ZtoY) {
-
-		Angles.y = -Angles.y;
-		swap(Angles.z, Angles.y);
+		// constraint Z is editor Y, constraint Y is negated editor Z
+		Joint.AxisRemap[2] = 1;
+		Joint.AxisRemap[1] = 2;
+		Joint.AxisSign[1] = -1;
 	}
 }
 
@@ -410,79 +717,837 @@ void PhysicsManager::CreateFloor(float FloorSize2D, float FloorHeight)
 	Floor->setUserPointer((void*)SOLID_ID);
 }
 
-void PhysicsManager::Tick(double dt) {
+void PhysicsManager::Tick(double dt)
+{
+	if (PhysicsThread == nullptr) {
+		StepWorld(dt);
+		return;
+	}
+
+	PhysicsCommand Command = {};
+	Command.Type = TickCommand;
+	Command.dt = dt;
+
+	PostCommand(Command);
+}
+
+void PhysicsManager::StepWorld(double dt)
+{
+	ProfileThreadID = GetCurrentThreadId();
+
+	ScheduleSteps(dt);
+
+	double StepDt = 1.0 / (double)CurrentFPS;
 
 	PhysicsTime += dt;
 
-	uint64 StepCount = (uint64)(PhysicsTime * PHYSICS_FPS);
+	uint64 StepCount = (uint64)(PhysicsTime * CurrentFPS);
+
+	// never spend more than the budget allows (especially useful after breakpoint wake up)
+	uint64 MaxStepCount = MaxStepsPerTick;
+	if (IterationCost > 0)
+		MaxStepCount = std::min(MaxStepCount, (uint64)std::max(TickBudget / (IterationCost * CurrentIterations), 1.0));
+
+	uint64 DroppedCount = 0;
 
-	// skip steps (especially useful after breakpoint wake up)
-	if (DoneStepCount + MaxStepsPerTick < StepCount)
-		DoneStepCount = StepCount - MaxStepsPerTick;
+	if (StepCount > MaxStepCount) {
 
-	for (; DoneStepCount < StepCount; DoneStepCount++) {
+		DroppedCount = StepCount - MaxStepCount;
+		StepCount = MaxStepCount;
+
+		// dropped steps are lost, not postponed
+		PhysicsTime = StepCount * StepDt;
+	}
+
+	PhysicsTime -= StepCount * StepDt;
+
+	DroppedStepCount += DroppedCount;
+
+	LastStepCount = StepCount;
+
+	double StepStartTime = GetPreciseTime();
+	double StepEndTime = GetClockTime();
+
+	for (uint64 Step = 0; Step < StepCount; Step++) {
+
+		// steps cover the time that passed up to now, the last one ends at StepEndTime
+		UpdatePredictedPinpoints(StepEndTime - (StepCount - Step - 1) * StepDt);
 
 		if (PreSolveCallback != nullptr)
 			PreSolveCallback();
 
-		World->stepSimulation(fixed_dt, 0, fixed_dt);
+		World->stepSimulation(StepDt, 0, StepDt);
 
 		if (PostSolveCallback != nullptr)
 			PostSolveCallback();
 	}
 
-	SyncCharacterWithWorld();
-}
-
-void PhysicsManager::SyncCharacterWithWorld(void) {
+	double StepTime = GetPreciseTime() - StepStartTime;
 
-	Character* Char = CharacterManager::GetInstance().GetCharacter();
+	UpdateIterationCost(StepCount, StepTime);
+	UpdateStatistics(dt, StepCount, DroppedCount, StepTime);
 
-	// apply changes to bones
-	for (Bone* Bone : Char->Bones)
-		Bone->WorldTransform = GetBoneWorldTransform(Bone);
+	// the physics thread never writes the character, the GUI picks up the published pose instead
+	if (PhysicsThread == nullptr)
+		SyncCharacterWithWorld();
 
-	Char->UpdateRotationsFromWorldTransforms();
+	UpdateBoneSpeed(dt);
 }
 
-void PhysicsManager::SyncWorldWithCharacter(void)
+void PhysicsManager::StartThread(void)
 {
-	Character* Char = CharacterManager::GetInstance().GetCharacter();
-	Char->UpdateWorldTranforms();
+	WakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	IsStopping = false;
 
-	// apply changes to bones
-	for (Bone* Bone : Char->Bones)
-		Bone->PhysicBody->setWorldTransform(GLMToBullet(Bone->WorldTransform * Bone->MiddleTranslation));
+	PublishPose();
+
+	PhysicsThread = CreateThread(NULL, 0, PhysicsStaticThreadProc, nullptr, 0, nullptr);
+	if (PhysicsThread == 0)
+		printf("Failed to create a thread\n");
 }
 
-void PhysicsManager::MirrorCharacter(void)
+void PhysicsManager::StopThread(void)
 {
-	Character* Char = CharacterManager::GetInstance().GetCharacter();
+	if (PhysicsThread == nullptr)
+		return;
 
-	for (Bone* CurrentBone : Char->Bones) {
+	PhysicsCommand Command = {};
+	Command.Type = StopCommand;
 
-		vec3 Angles = GetBoneAngles(CurrentBone);
+	PostCommand(Command);
 
-		if (CurrentBone->Side == Bone::Center) {
+	WaitForSingleObject(PhysicsThread, INFINITE);
+	CloseHandle(PhysicsThread);
 
-			Angles *= vec3(-1, 1, 1);
+	PhysicsThread = nullptr;
+}
 
-			SetBoneAngles(CurrentBone, Angles);
-		}
-		else
-		if (CurrentBone->Side == Bone::Left) {
-			Bone* OtherBone = Char->FindOtherBone(CurrentBone);
-			if (OtherBone != nullptr) {
+bool PhysicsManager::IsThreaded(void)
+{
+	return PhysicsThread != nullptr;
+}
+
+DWORD PhysicsManager::PhysicsStaticThreadProc(LPVOID lpThreadParameter)
+{
+	PhysicsManager::GetInstance().PhysicsThreadProc();
+	return 0;
+}
+
+void PhysicsManager::PhysicsThreadProc(void)
+{
+	while (true) {
+
+		WaitForSingleObject(WakeEvent, INFINITE);
+
+		WorldLock Lock;
+
+		if (IsStopping)
+			break;
+
+		if (PendingTickTime > 0) {
+
+			StepWorld(PendingTickTime);
+			PendingTickTime = 0;
+
+			if (SampledPinpoint != nullptr)
+				MeasurePinpointError(*SampledPinpoint);
+
+			SampledPinpoint = nullptr;
+		}
+	}
+}
+
+void PhysicsManager::PostCommand(PhysicsCommand& Command)
+{
+	Commands.enqueue(Command);
+
+	SetEvent(WakeEvent);
+}
+
+void PhysicsManager::PostWriteCommand(PhysicsCommand& Command)
+{
+	if (PhysicsThread == nullptr) {
+
+		if (Command.Type == PoseCommand)
+			SyncWorldWithPose(*Command.Pose);
+		else
+			ApplySnapshot(*Command.Snapshot);
+
+		return;
+	}
+
+	Command.WriteSequence = ++PostedWriteSequence;
+
+	PostCommand(Command);
+}
+
+void PhysicsManager::ProcessCommands(void)
+{
+	PhysicsCommand Command;
+
+	while (Commands.try_dequeue(Command)) {
+
+		switch (Command.Type) {
+		case TickCommand:
+			// ticks that piled up during a slow solve are stepped together
+			PendingTickTime += Command.dt;
+			break;
+		case PinpointCommand:
+			if (Command.IsPredicted)
+				PredictPinpointTarget(*Command.TargetPinpoint, Command.TargetBone, Command.LocalPoint, Command.WorldPoint, Command.Time);
+			ApplyPinpoint(*Command.TargetPinpoint, Command.TargetBone, Command.LocalPoint, Command.WorldPoint);
+			break;
+		case BlockingCommand:
+			ApplyBoneBlocking(Command.TargetBone, Command.Blocking);
+			break;
+		case PoseCommand:
+			SyncWorldWithPose(*Command.Pose);
+			AppliedWriteSequence = Command.WriteSequence;
+			break;
+		case SnapshotCommand:
+			ApplySnapshot(*Command.Snapshot);
+			AppliedWriteSequence = Command.WriteSequence;
+			break;
+		case SampleCommand:
+			SampledPinpoint = Command.TargetPinpoint;
+			break;
+		case StopCommand:
+			IsStopping = true;
+			break;
+		}
+	}
+}
+
+void PhysicsManager::LockWorld(void)
+{
+	EnterCriticalSection(&WorldMutex);
+
+	if (WorldLockDepth++ == 0)
+		ProcessCommands();
+}
+
+void PhysicsManager::UnlockWorld(void)
+{
+	// published after every batch of commands and steps, the GUI never waits for it
+	if (WorldLockDepth == 1 && PhysicsThread != nullptr)
+		PublishPose();
+
+	WorldLockDepth--;
+
+	LeaveCriticalSection(&WorldMutex);
+}
+
+void PhysicsManager::PublishPose(void)
+{
+	Character* Char = CharacterManager::GetInstance().GetCharacter();
+
+	PublishedPose& Pose = Poses[WritePoseIndex];
+
+	Pose.Sequence = ++PoseSequence;
+	Pose.WriteSequence = AppliedWriteSequence;
+
+	Pose.WorldTransforms.resize(Char->Bones.size());
+	for (Bone* Bone : Char->Bones)
+		Pose.WorldTransforms[Bone->ID] = GetBoneWorldTransform(Bone);
+
+	GetAllBoneAngles(Pose.Angles);
+
+	CaptureSnapshot(Pose.Snapshot);
+
+	WritePoseIndex = InterlockedExchange(&ReadyPoseIndex, WritePoseIndex | FreshPoseFlag) & ~FreshPoseFlag;
+}
+
+PhysicsManager::PublishedPose& PhysicsManager::AcquirePose(void)
+{
+	if (ReadyPoseIndex & FreshPoseFlag)
+		ReadPoseIndex = InterlockedExchange(&ReadyPoseIndex, ReadPoseIndex) & ~FreshPoseFlag;
+
+	return Poses[ReadPoseIndex];
+}
+
+bool PhysicsManager::SyncCharacterWithPublishedPose(void)
+{
+	// synchronous stepping already wrote the character
+	if (PhysicsThread == nullptr)
+		return false;
+
+	PublishedPose& Pose = AcquirePose();
+
+	// the character already has changes this pose was stepped without
+	if (Pose.Sequence == SyncedPoseSequence || !IsPoseCurrent(Pose))
+		return false;
+
+	SyncedPoseSequence = Pose.Sequence;
+
+	Character* Char = CharacterManager::GetInstance().GetCharacter();
+
+	for (Bone* Bone : Char->Bones)
+		Bone->WorldTransform = Pose.WorldTransforms[Bone->ID];
+
+	Char->UpdateRotationsFromWorldTransforms();
+
+	return true;
+}
+
+bool PhysicsManager::IsPoseCurrent(PublishedPose& Pose)
+{
+	return Pose.WriteSequence == PostedWriteSequence;
+}
+
+void PhysicsManager::ScheduleSteps(double dt)
+{
+	bool IsSettled = PendingPinpointError < SettledPinpointError && BoneSpeed < SettledBoneSpeed;
+
+	PendingPinpointError = 0;
+
+	int FPS = IsSettled ? MinFPS : TargetFPS;
+	int Iterations = TargetIterations;
+
+	if (IterationCost > 0 && dt > 0) {
+
+		// cost of one iteration of one step, measured on previous ticks
+		double TickCost = dt * FPS * Iterations * IterationCost;
+
+		// spend the budget on sub-steps first, solver iterations are cheaper to lose
+		if (TickCost > TickBudget)
+			Iterations = std::max((int)(TickBudget / (dt * FPS * IterationCost)), MinSolverIterations);
+
+		TickCost = dt * FPS * Iterations * IterationCost;
+
+		if (TickCost > TickBudget)
+			FPS = std::max((int)(TickBudget / (dt * Iterations * IterationCost)), MinFPS);
+	}
+
+	// changing the rate keeps the accumulated time, only its granularity changes
+	CurrentFPS = FPS;
+
+	if (Iterations != CurrentIterations) {
+
+		CurrentIterations = Iterations;
+
+		World->getSolverInfo().m_numIterations = CurrentIterations;
+	}
+}
+
+void PhysicsManager::UpdateIterationCost(uint64 StepCount, double StepTime)
+{
+	if (StepCount == 0)
+		return;
+
+	double Cost = StepTime / (StepCount * CurrentIterations);
+
+	if (IterationCost == 0)
+		IterationCost = Cost;
+	else
+		IterationCost += (Cost - IterationCost) * 0.1;
+}
+
+void PhysicsManager::UpdateBoneSpeed(double dt)
+{
+	if (dt <= 0)
+		return;
+
+	Character* Char = CharacterManager::GetInstance().GetCharacter();
+
+	LastBonePositions.resize(Char->Bones.size());
+
+	BoneSpeed = 0;
+
+	for (Bone* Bone : Char->Bones) {
+
+		vec3 Position = GetBoneWorldTransform(Bone)[3];
+
+		BoneSpeed = std::max(BoneSpeed, distance(Position, LastBonePositions[Bone->ID]) / (float)dt);
+
+		LastBonePositions[Bone->ID] = Position;
+	}
+}
+
+void PhysicsManager::SetTickBudget(double Seconds)
+{
+	TickBudget = Seconds;
+}
+
+uint64 PhysicsManager::GetDroppedStepCount(void)
+{
+	return DroppedStepCount;
+}
+
+uint64 PhysicsManager::GetLastStepCount(void)
+{
+	return LastStepCount;
+}
+
+const PhysicsManager::RunStatistics& PhysicsManager::GetRunStatistics(void)
+{
+	return Run;
+}
+
+void PhysicsManager::ResetRunStatistics(void)
+{
+	Run = {};
+}
+
+void PhysicsManager::SetFixedClock(double Seconds)
+{
+	IsClockFixed = true;
+	FixedClockTime = Seconds;
+}
+
+double PhysicsManager::GetClockTime(void)
+{
+	if (IsClockFixed)
+		return FixedClockTime;
+
+	return GetPreciseTime();
+}
+
+void PhysicsManager::UpdateStatistics(double dt, uint64 StepCount, uint64 DroppedCount, double StepTime)
+{
+	StatisticsTime += dt;
+	StatisticsStepCount += StepCount;
+	StatisticsDroppedStepCount += DroppedCount;
+	StatisticsIterationSum += StepCount * CurrentIterations;
+	StatisticsStepTime += StepTime;
+
+	Run.StepCount += StepCount;
+	Run.StepTime += StepTime;
+	Run.PairSum += StepCount * World->getPairCache()->getNumOverlappingPairs();
+
+	if (StatisticsTime < StatisticsInterval)
+		return;
+
+	// only interesting while something is being solved or the budget is exceeded
+	if (StatisticsStepCount > 0 && (StatisticsErrorCount > 0 || StatisticsDroppedStepCount > 0)) {
+
+		int32 AwakeCount = 0;
+
+		Character* Char = CharacterManager::GetInstance().GetCharacter();
+		for (Bone* Bone : Char->Bones)
+			if (MultiBody != nullptr || Bone->PhysicBody->isActive())
+				AwakeCount++;
+
+		printf("Physics: %s, %d/%d bones awake, %.0f Hz, %.1f iterations, %.1f us per step (broadphase %.1f us, %d pairs), %.1f ms per second, %llu steps dropped (%llu total), IK error %.2f mm, IK settles in %.1f steps\n",
+			MultiBody != nullptr ? "multibody" : "rigid bodies",
+			AwakeCount, (int32)Char->Bones.size(),
+			StatisticsStepCount / StatisticsTime,
+			StatisticsIterationSum / (double)StatisticsStepCount,
+			StatisticsStepTime / StatisticsStepCount * 1000000.0,
+			StatisticsBroadphaseTime / StatisticsStepCount * 1000000.0,
+			World->getPairCache()->getNumOverlappingPairs(),
+			StatisticsStepTime / StatisticsTime * 1000.0,
+			StatisticsDroppedStepCount, DroppedStepCount,
+			StatisticsErrorCount > 0 ? StatisticsErrorSum / StatisticsErrorCount * 1000.0 : 0.0,
+			StatisticsConvergedCount > 0 ? StatisticsConvergenceStepSum / (double)StatisticsConvergedCount : 0.0);
+	}
+
+	StatisticsTime = 0;
+	StatisticsStepCount = 0;
+	StatisticsDroppedStepCount = 0;
+	StatisticsIterationSum = 0;
+	StatisticsStepTime = 0;
+	StatisticsBroadphaseTime = 0;
+	StatisticsErrorSum = 0;
+	StatisticsErrorCount = 0;
+	StatisticsConvergedCount = 0;
+	StatisticsConvergenceStepSum = 0;
+}
+
+void PhysicsManager::SyncCharacterWithWorld(void) {
+
+	Character* Char = CharacterManager::GetInstance().GetCharacter();
+
+	// apply changes to bones
+	for (Bone* Bone : Char->Bones)
+		Bone->WorldTransform = GetBoneWorldTransform(Bone);
+
+	Char->UpdateRotationsFromWorldTransforms();
+}
+
+void PhysicsManager::SyncWorldWithCharacter(void)
+{
+	PostCharacterPose({});
+}
+
+void PhysicsManager::PostCharacterPose(const vector<Bone*>& ConstrainedBones)
+{
+	Character* Char = CharacterManager::GetInstance().GetCharacter();
+
+	Char->UpdateWorldTranforms();
+
+	// copied here, the physics thread doesn't read the character
+	shared_ptr<CharacterPose> Pose = make_shared<CharacterPose>();
+
+	for (Bone* Bone : Char->Bones) {
+		Pose->Rotations.push_back(Bone->Rotation);
+		Pose->WorldTransforms.push_back(Bone->WorldTransform);
+	}
+
+	Pose->ConstrainedBones = ConstrainedBones;
+
+	PhysicsCommand Command = {};
+	Command.Type = PoseCommand;
+	Command.Pose = Pose;
+
+	PostWriteCommand(Command);
+}
+
+void PhysicsManager::SyncWorldWithPose(CharacterPose& Pose)
+{
+	Character* Char = CharacterManager::GetInstance().GetCharacter();
+
+	if (MultiBody != nullptr)
+		MultiBody->SyncWithPose(Char, Pose.Rotations, Pose.WorldTransforms);
+	else {
+
+		// apply changes to bones
+		for (Bone* Bone : Char->Bones) {
+
+			btRigidBody* Body = Bone->PhysicBody;
+
+			Body->setWorldTransform(GLMToBullet(Pose.WorldTransforms[Bone->ID] * Bone->MiddleTranslation));
+			Body->activate();
+
+			// sleeping bodies don't get their bounds updated by the world
+			World->updateSingleAabb(Body);
+		}
+	}
+
+	for (Bone* Bone : Pose.ConstrainedBones)
+		UpdateBoneConstraint(Bone, Bone->XAxisBlocked, Bone->YAxisBlocked, Bone->ZAxisBlocked);
+}
+
+void PhysicsManager::CreateSnapshot(PhysicsSnapshot& Snapshot)
+{
+	if (PhysicsThread == nullptr) {
+		CaptureSnapshot(Snapshot);
+		return;
+	}
+
+	PublishedPose& Pose = AcquirePose();
+
+	// restoring it would undo what was posted since, the state is rebuilt from the character instead
+	if (IsPoseCurrent(Pose))
+		Snapshot = Pose.Snapshot;
+	else
+		Snapshot = {};
+}
+
+void PhysicsManager::CaptureSnapshot(PhysicsSnapshot& Snapshot)
+{
+	Snapshot.Bodies.clear();
+	Snapshot.Manifolds.clear();
+	Snapshot.Contacts.clear();
+	Snapshot.Pinpoints.clear();
+
+	// multibody state is fully defined by the pose, it is rebuilt from the character instead
+	if (MultiBody != nullptr)
+		return;
+
+	Character* Char = CharacterManager::GetInstance().GetCharacter();
+
+	Snapshot.Bodies.resize(Char->Bones.size());
+
+	for (Bone* Bone : Char->Bones) {
+
+		PhysicsSnapshot::BodyState& State = Snapshot.Bodies[Bone->ID];
+		btRigidBody* Body = Bone->PhysicBody;
+
+		State.Transform = Body->getWorldTransform();
+		State.LinearVelocity = Body->getLinearVelocity();
+		State.AngularVelocity = Body->getAngularVelocity();
+		State.LinearFactor = Body->getLinearFactor();
+		State.AngularFactor = Body->getAngularFactor();
+		State.IsStatic = Body->getInvMass() == 0;
+
+		GetConstraintLimits(Bone->PhysicConstraint, State.LowLimit, State.HighLimit);
+
+		State.XAxisBlocked = Bone->XAxisBlocked;
+		State.YAxisBlocked = Bone->YAxisBlocked;
+		State.ZAxisBlocked = Bone->ZAxisBlocked;
+	}
+
+	btDispatcher* Dispatcher = World->getDispatcher();
+
+	for (int Index = 0; Index < Dispatcher->getNumManifolds(); Index++) {
+
+		btPersistentManifold* Manifold = Dispatcher->getManifoldByIndexInternal(Index);
+
+		int32 BodyID0 = GetSnapshotBodyID(Manifold->getBody0());
+		int32 BodyID1 = GetSnapshotBodyID(Manifold->getBody1());
+
+		if (BodyID0 == InvalidSnapshotID || BodyID1 == InvalidSnapshotID)
+			continue;
+
+		PhysicsSnapshot::ManifoldState State;
+
+		State.BodyID0 = BodyID0;
+		State.BodyID1 = BodyID1;
+		State.FirstContact = (uint32)Snapshot.Contacts.size();
+		State.ContactCount = Manifold->getNumContacts();
+
+		for (int PointIndex = 0; PointIndex < Manifold->getNumContacts(); PointIndex++) {
+
+			btManifoldPoint& Point = Manifold->getContactPoint(PointIndex);
+
+			PhysicsSnapshot::ContactState Contact;
+
+			Contact.LocalPointA = Point.m_localPointA;
+			Contact.LocalPointB = Point.m_localPointB;
+			Contact.NormalWorldOnB = Point.m_normalWorldOnB;
+			Contact.LateralFrictionDir1 = Point.m_lateralFrictionDir1;
+			Contact.LateralFrictionDir2 = Point.m_lateralFrictionDir2;
+			Contact.Distance = Point.m_distance1;
+			Contact.AppliedImpulse = Point.m_appliedImpulse;
+			Contact.AppliedImpulseLateral1 = Point.m_appliedImpulseLateral1;
+			Contact.AppliedImpulseLateral2 = Point.m_appliedImpulseLateral2;
+
+			Snapshot.Contacts.push_back(Contact);
+		}
+
+		if (State.ContactCount > 0)
+			Snapshot.Manifolds.push_back(State);
+	}
+
+	Snapshot.Pinpoints.resize(PinpointSlots.size());
+
+	for (size_t Index = 0; Index < PinpointSlots.size(); Index++) {
+
+		PhysicsSnapshot::PinpointState& State = Snapshot.Pinpoints[Index];
+		PinpointSlot& Slot = PinpointSlots[Index];
+
+		State.IsUsed = Slot.IsUsed;
+		State.LocalPoint = Slot.Constraint->getPivotInB();
+		State.WorldPoint = Slot.DummyBody->getWorldTransform().getOrigin();
+	}
+}
+
+bool PhysicsManager::CanRestoreSnapshot(PhysicsSnapshot& Snapshot)
+{
+	Character* Char = CharacterManager::GetInstance().GetCharacter();
+
+	return MultiBody == nullptr && !Snapshot.Bodies.empty() && Snapshot.Bodies.size() == Char->Bones.size();
+}
+
+void PhysicsManager::RestoreSnapshot(PhysicsSnapshot& Snapshot)
+{
+	PhysicsCommand Command = {};
+	Command.Type = SnapshotCommand;
+	Command.Snapshot = make_shared<PhysicsSnapshot>(Snapshot);
 
-				vec3 OtherAngles = GetBoneAngles(OtherBone);
+	PostWriteCommand(Command);
+}
+
+void PhysicsManager::ApplySnapshot(PhysicsSnapshot& Snapshot)
+{
+	Character* Char = CharacterManager::GetInstance().GetCharacter();
+
+	for (Bone* Bone : Char->Bones) {
+
+		PhysicsSnapshot::BodyState& State = Snapshot.Bodies[Bone->ID];
+		btRigidBody* Body = Bone->PhysicBody;
+
+		if (State.IsStatic != (Body->getInvMass() == 0))
+			ChangeObjectMass(Body, State.IsStatic ? 0 : Bone->Mass);
+
+		Body->setWorldTransform(State.Transform);
+		Body->setInterpolationWorldTransform(State.Transform);
+		Body->setLinearVelocity(State.LinearVelocity);
+		Body->setAngularVelocity(State.AngularVelocity);
+		Body->setInterpolationLinearVelocity(State.LinearVelocity);
+		Body->setInterpolationAngularVelocity(State.AngularVelocity);
+		Body->setLinearFactor(State.LinearFactor);
+		Body->setAngularFactor(State.AngularFactor);
+		Body->activate();
+
+		World->updateSingleAabb(Body);
+
+		SetConstraintLimits(Bone->PhysicConstraint, State.LowLimit, State.HighLimit);
+
+		Bone->XAxisBlocked = State.XAxisBlocked;
+		Bone->YAxisBlocked = State.YAxisBlocked;
+		Bone->ZAxisBlocked = State.ZAxisBlocked;
+	}
+
+	RestoreContacts(Snapshot);
+	RestorePinpoints(Snapshot);
+
+	// the physics thread publishes the pose instead
+	if (PhysicsThread == nullptr)
+		SyncCharacterWithWorld();
+}
+
+void PhysicsManager::RestoreContacts(PhysicsSnapshot& Snapshot)
+{
+	btDispatcher* Dispatcher = World->getDispatcher();
+
+	unordered_map<uint64, btPersistentManifold*> Manifolds;
+	Manifolds.reserve(Dispatcher->getNumManifolds());
+
+	// contacts that didn't exist in the snapshot would carry stale impulses
+	for (int Index = 0; Index < Dispatcher->getNumManifolds(); Index++) {
+
+		btPersistentManifold* Manifold = Dispatcher->getManifoldByIndexInternal(Index);
+
+		int32 BodyID0 = GetSnapshotBodyID(Manifold->getBody0());
+		int32 BodyID1 = GetSnapshotBodyID(Manifold->getBody1());
+
+		if (BodyID0 == InvalidSnapshotID || BodyID1 == InvalidSnapshotID)
+			continue;
+
+		Manifold->clearManifold();
+		Manifolds[GetSnapshotPairKey(BodyID0, BodyID1)] = Manifold;
+	}
+
+	// manifolds are only created by the broadphase, pairs that aren't overlapping yet start cold
+	for (PhysicsSnapshot::ManifoldState& State : Snapshot.Manifolds) {
+
+		auto Found = Manifolds.find(GetSnapshotPairKey(State.BodyID0, State.BodyID1));
+
+		if (Found == Manifolds.end())
+			continue;
+
+		btPersistentManifold* Manifold = Found->second;
+		const btCollisionObject* Body0 = Manifold->getBody0();
+		const btCollisionObject* Body1 = Manifold->getBody1();
+
+		for (uint32 Index = State.FirstContact; Index < State.FirstContact + State.ContactCount; Index++) {
+
+			PhysicsSnapshot::ContactState& Contact = Snapshot.Contacts[Index];
+
+			btManifoldPoint Point(Contact.LocalPointA, Contact.LocalPointB, Contact.NormalWorldOnB, Contact.Distance);
+
+			Point.m_positionWorldOnA = Body0->getWorldTransform() * Contact.LocalPointA;
+			Point.m_positionWorldOnB = Body1->getWorldTransform() * Contact.LocalPointB;
+			Point.m_combinedFriction = Body0->getFriction() * Body1->getFriction();
+			Point.m_combinedRestitution = Body0->getRestitution() * Body1->getRestitution();
+			Point.m_lateralFrictionDir1 = Contact.LateralFrictionDir1;
+			Point.m_lateralFrictionDir2 = Contact.LateralFrictionDir2;
+			Point.m_appliedImpulse = Contact.AppliedImpulse;
+			Point.m_appliedImpulseLateral1 = Contact.AppliedImpulseLateral1;
+			Point.m_appliedImpulseLateral2 = Contact.AppliedImpulseLateral2;
+
+			Manifold->addManifoldPoint(Point);
+		}
+	}
+}
+
+void PhysicsManager::RestorePinpoints(PhysicsSnapshot& Snapshot)
+{
+	if (Snapshot.Pinpoints.size() != PinpointSlots.size())
+		return;
+
+	// slots are owned by the pinpoints posted before the snapshot, only the ones used on both sides are restored
+	for (size_t Index = 0; Index < PinpointSlots.size(); Index++) {
+
+		PhysicsSnapshot::PinpointState& State = Snapshot.Pinpoints[Index];
+		PinpointSlot& Slot = PinpointSlots[Index];
+
+		if (!State.IsUsed || !Slot.IsUsed)
+			continue;
+
+		btTransform Target;
+		Target.setIdentity();
+		Target.setOrigin(State.WorldPoint);
+
+		Slot.Constraint->setPivotB(State.LocalPoint);
+		Slot.DummyBody->setWorldTransform(Target);
+		Slot.DummyBody->setInterpolationWorldTransform(Target);
+	}
+}
+
+int32 PhysicsManager::GetSnapshotBodyID(const btCollisionObject* Object)
+{
+	const void* UserPointer = Object->getUserPointer();
+
+	if (UserPointer == SOLID_ID)
+		return FloorSnapshotID;
+
+	if (UserPointer == nullptr || UserPointer == NON_SOLID_ID)
+		return InvalidSnapshotID;
+
+	return ((Bone*)UserPointer)->ID;
+}
+
+uint64 PhysicsManager::GetSnapshotPairKey(int32 BodyID0, int32 BodyID1)
+{
+	return ((uint64)(uint32)BodyID0 << 32) | (uint32)BodyID1;
+}
+
+void PhysicsManager::GetConstraintLimits(btTypedConstraint* Constraint, btVector3& LowLimit, btVector3& HighLimit)
+{
+	LowLimit.setZero();
+	HighLimit.setZero();
+
+	if (Constraint == nullptr)
+		return;
+
+	if (Constraint->getConstraintType() == HINGE_CONSTRAINT_TYPE) {
+
+		btHingeConstraint* Hinge = (btHingeConstraint*)Constraint;
+
+		LowLimit.setX(Hinge->getLowerLimit());
+		HighLimit.setX(Hinge->getUpperLimit());
+	}
+	else
+	if (Constraint->getConstraintType() == D6_SPRING_2_CONSTRAINT_TYPE) {
+
+		btGeneric6DofSpring2Constraint* Generic = (btGeneric6DofSpring2Constraint*)Constraint;
+
+		Generic->getAngularLowerLimit(LowLimit);
+		Generic->getAngularUpperLimit(HighLimit);
+	}
+}
+
+void PhysicsManager::SetConstraintLimits(btTypedConstraint* Constraint, const btVector3& LowLimit, const btVector3& HighLimit)
+{
+	if (Constraint == nullptr)
+		return;
+
+	if (Constraint->getConstraintType() == HINGE_CONSTRAINT_TYPE)
+		((btHingeConstraint*)Constraint)->setLimit(LowLimit.x(), HighLimit.x());
+	else
+	if (Constraint->getConstraintType() == D6_SPRING_2_CONSTRAINT_TYPE) {
+
+		btGeneric6DofSpring2Constraint* Generic = (btGeneric6DofSpring2Constraint*)Constraint;
+
+		Generic->setAngularLowerLimit(LowLimit);
+		Generic->setAngularUpperLimit(HighLimit);
+	}
+}
+
+void PhysicsManager::MirrorCharacter(void)
+{
+	Character* Char = CharacterManager::GetInstance().GetCharacter();
+
+	// every angle is read before any bone is moved
+	vector<vec3> Angles;
+
+	if (PhysicsThread == nullptr)
+		GetAllBoneAngles(Angles);
+	else
+		Angles = AcquirePose().Angles;
+
+	vector<BoneAngles> Targets;
+
+	for (Bone* CurrentBone : Char->Bones) {
+
+		if (CurrentBone->Side == Bone::Center)
+			Targets.push_back({ CurrentBone, Angles[CurrentBone->ID] * vec3(-1, 1, 1) });
+		else
+		if (CurrentBone->Side == Bone::Left) {
+			Bone* OtherBone = Char->FindOtherBone(CurrentBone);
+			if (OtherBone != nullptr) {
 
 				vec3 MirrorVector = vec3(-1, 1, -1);
 
-				SetBoneAngles(CurrentBone, OtherAngles * MirrorVector);
-				SetBoneAngles(OtherBone, Angles * MirrorVector);
+				Targets.push_back({ CurrentBone, Angles[OtherBone->ID] * MirrorVector });
+				Targets.push_back({ OtherBone, Angles[CurrentBone->ID] * MirrorVector });
 			}
 		}
 	}
+
+	SetBoneAngles(Targets);
 }
 
 btRigidBody* PhysicsManager::AddDynamicBox(mat4 Transform, vec3 Size, float Mass)
@@ -509,7 +1574,7 @@ btRigidBody* PhysicsManager::AddDynamicBox(mat4 Transform, vec3 Size, float Mass
 	Body->setFriction(1.0);
 	Body->setRestitution(0.0);
 
-	Body->setActivationState(DISABLE_DEACTIVATION);
+	Body->setSleepingThresholds(SleepingThreshold, SleepingThreshold);
 
 	World->addRigidBody(Body);
 
@@ -531,78 +1596,251 @@ vec3 PhysicsManager::GetFloorSize(void)
 	return FloorSize;
 }
 
-void PhysicsManager::GetBoneFromRay(vec3 RayStart, vec3 RayDirection, Bone*& TouchedBone, vec3& WorldPoint, vec3& WorldNormal) {
+void PhysicsManager::SetPinpoint(Pinpoint& P, Bone* Bone, vec3 LocalPoint, vec3 WorldPoint)
+{
+	QueuePinpoint(P, Bone, LocalPoint, WorldPoint, false);
+}
 
-	vec3 StartPoint = RayStart;
-	vec3 EndPoint = StartPoint + RayDirection * 1000.0f;
+void PhysicsManager::PostPinpoint(Pinpoint& P, Bone* Bone, vec3 LocalPoint, vec3 WorldPoint)
+{
+	QueuePinpoint(P, Bone, LocalPoint, WorldPoint, true);
+}
 
-	btCollisionWorld::ClosestRayResultCallback RayCallback(GLMToBullet(StartPoint), GLMToBullet(EndPoint));
+void PhysicsManager::QueuePinpoint(Pinpoint& P, Bone* Bone, vec3 LocalPoint, vec3 WorldPoint, bool IsPredicted)
+{
+	// stamped here, the physics thread may get to it a tick later
+	double Time = GetClockTime();
 
-	World->rayTest(GLMToBullet(StartPoint), GLMToBullet(EndPoint), RayCallback);
+	P.SrcBone = Bone;
+	P.SrcLocalPoint = LocalPoint;
+	P.DestWorldPoint = WorldPoint;
 
-	TouchedBone = NULL;
-	WorldPoint = {};
-	WorldNormal = {};
+	if (PhysicsThread == nullptr) {
 
-	if (RayCallback.hasHit()) {
+		if (IsPredicted)
+			PredictPinpointTarget(P, Bone, LocalPoint, WorldPoint, Time);
 
-		Bone* Selected = (Bone*)RayCallback.m_collisionObject->getUserPointer();
-		if (Selected != nullptr && Selected != SOLID_ID && Selected != NON_SOLID_ID) {
+		ApplyPinpoint(P, Bone, LocalPoint, WorldPoint);
 
-			TouchedBone = Selected;
-			WorldPoint = BulletToGLM(RayCallback.m_hitPointWorld);
-			WorldNormal = BulletToGLM(RayCallback.m_hitNormalWorld);
-		}
+		// a pinpoint the world couldn't take stays inactive, threaded the GUI keeps it and only the message tells
+		P.SrcBone = P.AppliedBone;
+		return;
 	}
+
+	PhysicsCommand Command = {};
+	Command.Type = PinpointCommand;
+	Command.TargetPinpoint = &P;
+	Command.TargetBone = Bone;
+	Command.LocalPoint = LocalPoint;
+	Command.WorldPoint = WorldPoint;
+	Command.Time = Time;
+	Command.IsPredicted = IsPredicted;
+
+	PostCommand(Command);
 }
 
-void PhysicsManager::SetPinpoint(Pinpoint& P, btRigidBody* Body, vec3 LocalPoint, vec3 WorldPoint)
+void PhysicsManager::ApplyPinpoint(Pinpoint& P, Bone* Bone, vec3 LocalPoint, vec3 WorldPoint)
 {
-	if (Body != P.SrcBody && P.Constraint != nullptr) {
-		World->removeConstraint(P.Constraint);
-		delete P.Constraint;
-		P.Constraint = nullptr;
+	if (MultiBody != nullptr) {
+
+		// multibody pivots on the link side are fixed at creation
+		if (P.MultiBodyConstraint != nullptr && (Bone != P.AppliedBone || LocalPoint != P.AppliedLocalPoint)) {
+			MultiBody->RemovePinpoint(P.MultiBodyConstraint);
+			P.MultiBodyConstraint = nullptr;
+		}
+
+		P.AppliedBone = Bone;
+		P.AppliedLocalPoint = LocalPoint;
+		P.AppliedWorldPoint = WorldPoint;
+
+		if (Bone == nullptr)
+			return;
+
+		if (P.MultiBodyConstraint == nullptr)
+			P.MultiBodyConstraint = MultiBody->AddPinpoint(Bone, LocalPoint, WorldPoint);
+		else
+			MovePinpointTarget(P, WorldPoint);
+
+		return;
 	}
 
-	P.SrcBody = Body;
+	if (Bone != P.AppliedBone && P.Slot != nullptr) {
+		ReleasePinpointSlot(P.Slot);
+		P.Slot = nullptr;
+	}
 
-	if (Body == nullptr) {
+	P.AppliedBone = Bone;
 
-		if (P.DummyBody != nullptr) {
-			World->removeRigidBody(P.DummyBody);
-			delete P.DummyBody;
-			P.DummyBody = nullptr;
-		}
+	if (Bone == nullptr)
+		return;
 
+	if (P.Slot == nullptr)
+		P.Slot = AcquirePinpointSlot(Bone);
+
+	// every slot of the bone is taken by other pinpoints, this one stays inactive
+	if (P.Slot == nullptr) {
+		printf("No free pinpoint slot left for the bone\n");
+
+		P.AppliedBone = nullptr;
 		return;
 	}
 
-	if (P.DummyBody == nullptr) {
-		P.DummyBody = AddStaticBox(mat4(1.0f), {});
-		P.DummyBody->setUserPointer((void*)NON_SOLID_ID);
+	P.AppliedLocalPoint = LocalPoint;
+	P.AppliedWorldPoint = WorldPoint;
+
+	P.Slot->Constraint->setPivotB(GLMToBullet(P.AppliedLocalPoint));
+
+	MovePinpointTarget(P, P.AppliedWorldPoint);
+
+	// waking the bone wakes its whole island
+	P.AppliedBone->PhysicBody->activate();
+}
+
+void PhysicsManager::SetTargetPrediction(bool IsEnabled)
+{
+	IsPredictionDisabled = !IsEnabled;
+}
+
+bool PhysicsManager::IsTargetPredictionEnabled(void)
+{
+	return !IsPredictionDisabled;
+}
+
+void PhysicsManager::PredictPinpointTarget(Pinpoint& P, Bone* Bone, vec3 LocalPoint, vec3 WorldPoint, double Time)
+{
+	// a new grab starts without a trajectory
+	if (Bone == nullptr || Bone != P.AppliedBone || LocalPoint != P.AppliedLocalPoint || !P.IsPredicted)
+		P.TargetVelocity = vec3(0);
+	else {
+
+		double dt = Time - P.TargetTime;
+
+		if (dt > 0) {
+
+			vec3 Velocity = (WorldPoint - P.AppliedWorldPoint) / (float)dt;
+
+			// a held mouse keeps reposting the same point, so the velocity decays on its own
+			P.TargetVelocity += (Velocity - P.TargetVelocity) * TargetVelocitySmoothing;
+		}
+	}
+
+	if (Bone != P.AppliedBone || WorldPoint != P.AppliedWorldPoint) {
+		P.StepsSinceMove = 0;
+		P.IsConverging = Bone != nullptr;
 	}
 
-	if (P.Constraint == nullptr) {
+	P.TargetTime = Time;
+	P.IsPredicted = Bone != nullptr;
 
-		P.Constraint = new btPoint2PointConstraint(*P.DummyBody, *P.SrcBody, GLMToBullet(vec3(0, 0, 0)), GLMToBullet(vec3(0, 0, 0)));
+	auto Iterator = find(PredictedPinpoints.begin(), PredictedPinpoints.end(), &P);
 
-		P.Constraint->setParam(BT_CONSTRAINT_STOP_CFM, 0.5f);
-		P.Constraint->setParam(BT_CONSTRAINT_STOP_ERP, 0.1f);
+	if (P.IsPredicted && Iterator == PredictedPinpoints.end())
+		PredictedPinpoints.push_back(&P);
+	else
+	if (!P.IsPredicted && Iterator != PredictedPinpoints.end())
+		PredictedPinpoints.erase(Iterator);
+}
 
-		World->addConstraint(P.Constraint);
+void PhysicsManager::MovePinpointTarget(Pinpoint& P, vec3 WorldPoint)
+{
+	if (P.MultiBodyConstraint != nullptr)
+		P.MultiBodyConstraint->setPivotInB(GLMToBullet(WorldPoint));
+	else
+	if (P.Slot != nullptr) {
+
+		mat4 DestTransform = translate(mat4(1.0f), WorldPoint);
+		P.Slot->DummyBody->setWorldTransform(GLMToBullet(DestTransform));
 	}
+}
 
-	P.SrcLocalPoint = LocalPoint;
-	P.DestWorldPoint = WorldPoint;
+void PhysicsManager::UpdatePredictedPinpoints(double Time)
+{
+	for (Pinpoint* P : PredictedPinpoints) {
+
+		if (P->AppliedBone == nullptr)
+			continue;
+
+		vec3 Target = P->AppliedWorldPoint;
 
-	P.Constraint->setPivotB(GLMToBullet(P.SrcLocalPoint));
+		double Age = Time - P->TargetTime;
 
-	mat4 DestTransform = translate(mat4(1.0f), P.DestWorldPoint);
-	P.DummyBody->setWorldTransform(GLMToBullet(DestTransform));
+		if (!IsPredictionDisabled && Age < MaxPredictionTime) {
+
+			// the step ends at Time, the pose it produces is only reached once the solver caught up
+			double Lead = std::max(Age, 0.0) + PredictionLatency;
+
+			Target += P->TargetVelocity * (float)Lead;
+
+			// the first step after a move starts the bone at the target speed instead of from rest
+			if (P->StepsSinceMove == 0 && P->Slot != nullptr) {
+
+				btRigidBody* Body = P->AppliedBone->PhysicBody;
+
+				if (Body->getInvMass() != 0)
+					Body->setLinearVelocity(GLMToBullet(P->TargetVelocity) * Body->getLinearFactor());
+			}
+		}
+
+		MovePinpointTarget(*P, Target);
+
+		P->StepsSinceMove++;
+	}
+}
+
+void PhysicsManager::SamplePinpointError(Pinpoint& P)
+{
+	if (PhysicsThread == nullptr) {
+		MeasurePinpointError(P);
+		return;
+	}
+
+	// measured by the physics thread right after its next step
+	PhysicsCommand Command = {};
+	Command.Type = SampleCommand;
+	Command.TargetPinpoint = &P;
+
+	PostCommand(Command);
+}
+
+void PhysicsManager::MeasurePinpointError(Pinpoint& P)
+{
+	if (P.AppliedBone == nullptr)
+		return;
+
+	vec3 SrcWorldPoint = GetBoneWorldTransform(P.AppliedBone) * P.AppliedBone->MiddleTranslation * vec4(P.AppliedLocalPoint, 1);
+
+	float Error = distance(SrcWorldPoint, P.AppliedWorldPoint);
+
+	PendingPinpointError = std::max(PendingPinpointError, Error);
+
+	if (P.IsConverging && Error < SettledPinpointError) {
+
+		P.IsConverging = false;
+
+		StatisticsConvergedCount++;
+		StatisticsConvergenceStepSum += P.StepsSinceMove;
+
+		Run.ConvergedCount++;
+		Run.ConvergenceStepSum += P.StepsSinceMove;
+
+		double Latency = std::min(P.StepsSinceMove / (double)CurrentFPS, MaxPredictionTime);
+
+		PredictionLatency += (Latency - PredictionLatency) * PredictionLatencySmoothing;
+	}
+
+	StatisticsErrorSum += Error;
+	StatisticsErrorCount++;
+
+	Run.ErrorSum += Error;
+	Run.ErrorCount++;
+	Run.MaxError = std::max(Run.MaxError, (double)Error);
 }
 
 mat4 PhysicsManager::GetBoneWorldTransform(Bone* Bone)
 {
+	if (MultiBody != nullptr)
+		return MultiBody->GetBoneWorldTransform(Bone);
+
 	btTransform BulletTransfrom = Bone->PhysicBody->getWorldTransform();
 
 	mat4 WorldTransform = BulletToGLM(BulletTransfrom) * inverse(Bone->MiddleTranslation);
@@ -612,32 +1850,80 @@ mat4 PhysicsManager::GetBoneWorldTransform(Bone* Bone)
 
 // Collision filter
 
-bool PhysicsManager::YourOwnFilterCallback::needBroadphaseCollision(btBroadphaseProxy* proxy0, btBroadphaseProxy* proxy1) const
+void PhysicsManager::BoneFilterCallback::Build(Character* Char)
 {
-	btCollisionObject* obj0 = static_cast<btCollisionObject*>(proxy0->m_clientObject);
-	btCollisionObject* obj1 = static_cast<btCollisionObject*>(proxy1->m_clientObject);
+	BoneCount = (uint32)Char->Bones.size();
+	RowWords = (BoneCount + 63) / 64;
 
-	Bone* Bone0 = (Bone*)obj0->getUserPointer();
-	Bone* Bone1 = (Bone*)obj1->getUserPointer();
+	ExcludedPairs.assign(BoneCount * RowWords, 0);
 
-	// some wierd shit
-	if (Bone0 == nullptr || Bone1 == nullptr)
+	// parent->child boxes always overlap at the joint
+	for (Bone* Bone : Char->Bones)
+		if (Bone->Parent != nullptr)
+			ExcludePair(Bone->ID, Bone->Parent->ID);
+}
+
+void PhysicsManager::BoneFilterCallback::ExcludePair(uint32 ID0, uint32 ID1)
+{
+	ExcludedPairs[ID0 * RowWords + ID1 / 64] |= 1ull << (ID1 % 64);
+	ExcludedPairs[ID1 * RowWords + ID0 / 64] |= 1ull << (ID0 % 64);
+}
+
+bool PhysicsManager::BoneFilterCallback::IsPairExcluded(uint32 ID0, uint32 ID1) const
+{
+	return (ExcludedPairs[ID0 * RowWords + ID1 / 64] >> (ID1 % 64)) & 1;
+}
+
+bool PhysicsManager::BoneFilterCallback::needBroadphaseCollision(btBroadphaseProxy* Proxy0, btBroadphaseProxy* Proxy1) const
+{
+	if ((Proxy0->m_collisionFilterGroup & Proxy1->m_collisionFilterMask) == 0 || (Proxy1->m_collisionFilterGroup & Proxy0->m_collisionFilterMask) == 0)
 		return false;
 
-	// either one is solid
-	if (Bone0 == PhysicsManager::GetInstance().SOLID_ID || Bone1 == PhysicsManager::GetInstance().SOLID_ID)
+	// bone and floor
+	if ((Proxy0->m_collisionFilterGroup & Proxy1->m_collisionFilterGroup & PhysicsManager::GetInstance().BoneFilter) == 0)
 		return true;
 
-	// either one is non solid
-	if (Bone0 == PhysicsManager::GetInstance().NON_SOLID_ID || Bone1 == PhysicsManager::GetInstance().NON_SOLID_ID)
-		return false;
+	int ID0 = static_cast<btCollisionObject*>(Proxy0->m_clientObject)->getUserIndex();
+	int ID1 = static_cast<btCollisionObject*>(Proxy1->m_clientObject)->getUserIndex();
 
-	// if we have parent->child collision - filter it out
-	if (Bone0->Parent == Bone1 || Bone1->Parent == Bone0)
+	// body is being created, the pair is found again once its ID is set
+	if (ID0 < 0 || ID1 < 0 || (uint32)ID0 >= BoneCount || (uint32)ID1 >= BoneCount)
 		return false;
 
-	// non parent bones = collision
-	return true;
+	return !IsPairExcluded(ID0, ID1);
+}
+
+void PhysicsManager::EnterProfileZone(const char* Name)
+{
+	PhysicsManager& Manager = PhysicsManager::GetInstance();
+
+	if (GetCurrentThreadId() != Manager.ProfileThreadID)
+		return;
+
+	if (Manager.BroadphaseProfileDepth < 0 && (strcmp(Name, "updateAabbs") == 0 || strcmp(Name, "calculateOverlappingPairs") == 0)) {
+		Manager.BroadphaseProfileDepth = Manager.ProfileDepth;
+		Manager.BroadphaseStartTime = GetPreciseTime();
+	}
+
+	Manager.ProfileDepth++;
+}
+
+void PhysicsManager::LeaveProfileZone(void)
+{
+	PhysicsManager& Manager = PhysicsManager::GetInstance();
+
+	if (GetCurrentThreadId() != Manager.ProfileThreadID)
+		return;
+
+	Manager.ProfileDepth--;
+
+	if (Manager.ProfileDepth == Manager.BroadphaseProfileDepth) {
+		double Time = GetPreciseTime() - Manager.BroadphaseStartTime;
+
+		Manager.StatisticsBroadphaseTime += Time;
+		Manager.Run.BroadphaseTime += Time;
+		Manager.BroadphaseProfileDepth = -1;
+	}
 }
 
 // Bullet <-> GLM conversion utils
@@ -696,9 +1982,62 @@ namespace psm {
 
 }
 
+// Pinpoint pool
+
+void PhysicsManager::CreatePinpointSlots(void)
+{
+	Character* Char = CharacterManager::GetInstance().GetCharacter();
+
+	PinpointSlots.resize(Char->Bones.size() * PinpointSlotsPerBone);
+
+	for (Bone* Bone : Char->Bones)
+		for (int32 Index = 0; Index < PinpointSlotsPerBone; Index++) {
+
+			PinpointSlot& Slot = PinpointSlots[Bone->ID * PinpointSlotsPerBone + Index];
+
+			// the dummy body only anchors the constraint, the solver treats it as fixed without it being in the world
+			Slot.DummyBody = new btRigidBody(0, nullptr, nullptr);
+			Slot.DummyBody->setUserPointer((void*)NON_SOLID_ID);
+
+			Slot.Constraint = new btPoint2PointConstraint(*Slot.DummyBody, *Bone->PhysicBody, GLMToBullet(vec3(0, 0, 0)), GLMToBullet(vec3(0, 0, 0)));
+
+			Slot.Constraint->setParam(BT_CONSTRAINT_STOP_CFM, 0.5f);
+			Slot.Constraint->setParam(BT_CONSTRAINT_STOP_ERP, 0.1f);
+
+			// disabled constraints don't merge islands and get no solver rows
+			Slot.Constraint->setEnabled(false);
+			Slot.IsUsed = false;
+
+			World->addConstraint(Slot.Constraint);
+		}
+}
+
+PhysicsManager::PinpointSlot* PhysicsManager::AcquirePinpointSlot(Bone* Bone)
+{
+	for (int32 Index = 0; Index < PinpointSlotsPerBone; Index++) {
+
+		PinpointSlot& Slot = PinpointSlots[Bone->ID * PinpointSlotsPerBone + Index];
+		if (Slot.IsUsed)
+			continue;
+
+		Slot.IsUsed = true;
+		Slot.Constraint->setEnabled(true);
+
+		return &Slot;
+	}
+
+	return nullptr;
+}
+
+void PhysicsManager::ReleasePinpointSlot(PinpointSlot* Slot)
+{
+	Slot->Constraint->setEnabled(false);
+	Slot->IsUsed = false;
+}
+
 // Pinpoint
 
 bool PhysicsManager::Pinpoint::IsActive(void)
 {
-	return Constraint != nullptr;
+	return SrcBone != nullptr;
 }
@@ -4,10 +4,14 @@
 #include <windows.h>
 
 #include <functional>
+#include <memory>
 
 #include <glm/glm.hpp>
 
 #include <btBulletDynamicsCommon.h>
+#include <BulletDynamics/Featherstone/btMultiBodyPoint2Point.h>
+
+#include "concurrentqueue.h"
 
 #include "Character.hpp"
 
@@ -22,34 +26,162 @@ namespace psm {
 using namespace std;
 using namespace glm;
 using namespace psm;
+using namespace moodycamel;
+
+class MultiBodyBackend;
+
+// Runtime copy of the rigid body state, lets undo and history switching resume without re-deriving
+// masses, limits and contacts. Never written to disk, records are plain data indexed by bone ID.
+typedef struct PhysicsSnapshot {
+
+	typedef struct BodyState {
+		btTransform Transform;
+		btVector3 LinearVelocity, AngularVelocity, LinearFactor, AngularFactor;
+		// applied constraint limits, hinges use only X
+		btVector3 LowLimit, HighLimit;
+		bool IsStatic, XAxisBlocked, YAxisBlocked, ZAxisBlocked;
+	} BodyState;
+
+	typedef struct ContactState {
+		btVector3 LocalPointA, LocalPointB, NormalWorldOnB, LateralFrictionDir1, LateralFrictionDir2;
+		btScalar Distance, AppliedImpulse, AppliedImpulseLateral1, AppliedImpulseLateral2;
+	} ContactState;
+
+	// contacts of one body pair, a range of Contacts
+	typedef struct ManifoldState {
+		int32 BodyID0, BodyID1;
+		uint32 FirstContact, ContactCount;
+	} ManifoldState;
+
+	// pivot on the bone and target of a pinpoint slot
+	typedef struct PinpointState {
+		bool IsUsed;
+		btVector3 LocalPoint, WorldPoint;
+	} PinpointState;
+
+	vector<BodyState> Bodies;
+	// warm start impulses of the contact manifolds
+	vector<ManifoldState> Manifolds;
+	vector<ContactState> Contacts;
+	// indexed like the pinpoint slots
+	vector<PinpointState> Pinpoints;
+} PhysicsSnapshot;
 
 typedef class PhysicsManager {
+public:
+	// pairs of bones that never collide (parent and child), shared with the offline worlds
+	typedef struct BoneFilterCallback : public btOverlapFilterCallback {
+		uint32 BoneCount, RowWords;
+		// bit per bone pair (by bone ID), set for pairs that never collide
+		vector<uint64> ExcludedPairs;
+
+		void Build(Character* Char);
+		void ExcludePair(uint32 ID0, uint32 ID1);
+		bool IsPairExcluded(uint32 ID0, uint32 ID1) const;
+
+		// return true when pairs need collision
+		virtual bool needBroadphaseCollision(btBroadphaseProxy* Proxy0, btBroadphaseProxy* Proxy1) const;
+	} BoneFilterCallback;
+
+	typedef enum BroadphaseType {
+		DynamicTreeBroadphase,
+		SweepAndPruneBroadphase
+	} BroadphaseType;
+
+	// totals since the last reset, a replay reports them for the configuration it ran with
+	typedef struct RunStatistics {
+		uint64 StepCount, PairSum, ErrorCount, ConvergedCount, ConvergenceStepSum;
+		double StepTime, BroadphaseTime, ErrorSum, MaxError;
+	} RunStatistics;
 private:
 	PhysicsManager(void) { };
 
+	// the multibody rates and iterations are starting points, they were not measured against the rigid body ones
 #if _DEBUG
 	const int PHYSICS_FPS = 100;
+	const int MULTIBODY_PHYSICS_FPS = 60;
 #else
 	const int PHYSICS_FPS = 2000;
+	const int MULTIBODY_PHYSICS_FPS = 240;
 #endif
 
-	const double fixed_dt = 1.0 / (double)PHYSICS_FPS;
+	const int SolverIterations = 30;
+	const int MultiBodySolverIterations = 8;
+	const int MinSolverIterations = 4;
 
 	const int MaxStepsPerTick = 34;
 
+	// default CPU time stepSimulation may take per tick (half of a 60 Hz frame)
+	const double DefaultTickBudget = 0.008;
+
+	// below these the pose is considered settled and the coarsest step rate is enough
+	const float SettledPinpointError = 0.001f;
+	const float SettledBoneSpeed = 0.01f;
+
+	// resting islands fall asleep and leave the solver, fully blocked bones sleep right away
+	const float SleepingThreshold = 0.01f;
+
 	const void* SOLID_ID = (void*)1;
 	const void* NON_SOLID_ID = (void*)2;
 
-	struct YourOwnFilterCallback : public btOverlapFilterCallback
-	{
-		// return true when pairs need collision
-		virtual bool needBroadphaseCollision(btBroadphaseProxy* proxy0, btBroadphaseProxy* proxy1) const;
-	};
+	// Collision filter
+
+	// bones are added as regular dynamic bodies and the floor as a static one, so Bullet's own groups apply
+	const int BoneFilter = btBroadphaseProxy::DefaultFilter;
+	const int FloorFilter = btBroadphaseProxy::StaticFilter;
+
+	BoneFilterCallback* Filter;
+
+	BroadphaseType SelectedBroadphase;
+
+	// Broadphase profiling, fed by Bullet profile zones
+
+	int32 ProfileDepth, BroadphaseProfileDepth;
+	double BroadphaseStartTime;
+	// zones of other threads (offline worlds) are ignored
+	DWORD ProfileThreadID;
+
+	static void EnterProfileZone(const char* Name);
+	static void LeaveProfileZone(void);
 
 	// Integration
 
+	// simulation time not yet covered by steps
 	double PhysicsTime;
-	uint64 DoneStepCount;
+	uint64 DroppedStepCount, LastStepCount;
+
+	// replays pin the clock that stamps targets, live sessions use the wall clock
+	bool IsClockFixed;
+	double FixedClockTime;
+
+	double GetClockTime(void);
+
+	// Scheduling
+
+	int TargetFPS, MinFPS, TargetIterations;
+	int CurrentFPS, CurrentIterations;
+
+	double TickBudget, IterationCost;
+
+	float PendingPinpointError, BoneSpeed;
+	vector<vec3> LastBonePositions;
+
+	void ScheduleSteps(double dt);
+	void UpdateIterationCost(uint64 StepCount, double StepTime);
+	void UpdateBoneSpeed(double dt);
+
+	// Statistics
+
+	const double StatisticsInterval = 5.0;
+
+	double StatisticsTime, StatisticsStepTime, StatisticsBroadphaseTime, StatisticsErrorSum;
+	uint64 StatisticsStepCount, StatisticsErrorCount, StatisticsDroppedStepCount, StatisticsIterationSum;
+	// steps from the last target move until the pinpoint error settles
+	uint64 StatisticsConvergedCount, StatisticsConvergenceStepSum;
+
+	RunStatistics Run;
+
+	void UpdateStatistics(double dt, uint64 StepCount, uint64 DroppedCount, double StepTime);
 
 	// Floor
 
@@ -59,26 +191,66 @@ private:
 
 	btDiscreteDynamicsWorld* World;
 
+	// not null when the skeleton is simulated as a reduced-coordinate multibody
+	MultiBodyBackend* MultiBody;
+
 	btRigidBody* AddDynamicBox(mat4 Transform, vec3 Size, float Mass);
 	btRigidBody* AddStaticBox(mat4 Transform, vec3 Size);
 
 	// Tick Utils
 
+	void StepWorld(double dt);
 	void SyncCharacterWithWorld(void);
 
 	void CreateFloor(float FloorSize2D, float FloorHeight);
 	void CreatePhysicsForCharacter(void);
 
-	typedef enum GimbalLockFixType {
-		None,
-		XtoY,
-		ZtoY
-	} GimbalLockFixType;
+	// Pinpoint pool
+
+	// a bone can be pulled by its own pinpoint and by the IK pinpoint at the same time
+	const int32 PinpointSlotsPerBone = 2;
+
+	typedef struct PinpointSlot {
+		btPoint2PointConstraint* Constraint;
+		btRigidBody* DummyBody;
+		bool IsUsed;
+	} PinpointSlot;
+
+	// created with the bones and kept disabled in the world, indexed by bone ID * PinpointSlotsPerBone
+	vector<PinpointSlot> PinpointSlots;
+
+	void CreatePinpointSlots(void);
+	// null when every slot of the bone is in use
+	PinpointSlot* AcquirePinpointSlot(Bone* Bone);
+	void ReleasePinpointSlot(PinpointSlot* Slot);
+
+	// Blocking transactions
+
+	typedef struct PendingBlocking {
+		bool IsPending, IsFullyBlocked, XAxisBlocked, YAxisBlocked, ZAxisBlocked;
+		vec3 LinearFactor;
+	} PendingBlocking;
+
+	int32 BlockingTransactionCounter;
+	// indexed by bone ID, only the last change of each bone is applied
+	vector<PendingBlocking> PendingBlockings;
+
+	void ApplyBoneBlocking(Bone* Bone, PendingBlocking& Blocking);
+	void PostBoneBlocking(Bone* Bone, PendingBlocking& Blocking);
+	void CommitBlockingTransaction(void);
+
+	// Snapshots
+
+	const int32 FloorSnapshotID = -1;
+	const int32 InvalidSnapshotID = -2;
+
+	int32 GetSnapshotBodyID(const btCollisionObject* Object);
+	uint64 GetSnapshotPairKey(int32 BodyID0, int32 BodyID1);
+	void GetConstraintLimits(btTypedConstraint* Constraint, btVector3& LowLimit, btVector3& HighLimit);
+	void SetConstraintLimits(btTypedConstraint* Constraint, const btVector3& LowLimit, const btVector3& HighLimit);
+	void RestoreContacts(PhysicsSnapshot& Snapshot);
+	void RestorePinpoints(PhysicsSnapshot& Snapshot);
 
-	GimbalLockFixType GetGimbalLockFixType(vec3 LowLimit, vec3 HighLimit);
-	void ApplyGimbalLockFix(vec3& LowLimit, vec3& HighLimit, btTransform& ParentFrame, btTransform& ChildFrame,
-		bool& XBlocked, bool& YBlocked, bool &ZBlocked);
-	void ReverseGimbalLockFix(vec3 LowLimit, vec3 HighLimit, vec3& Angles);
 public:
 	static PhysicsManager& GetInstance(void) {
 		static PhysicsManager Instance;
@@ -89,39 +261,280 @@ public:
 	PhysicsManager(PhysicsManager const&) = delete;
 	void operator=(PhysicsManager const&) = delete;
 
-	void Initialize(void);
+	// takes effect on Initialize, the dynamic AABB tree unless set
+	void SetBroadphase(BroadphaseType Type);
+	BroadphaseType GetBroadphase(void);
+
+	void Initialize(bool UseMultiBody);
 	void Tick(double dt);
 
+	// moves stepping off the GUI thread, everything before this call runs synchronously
+	void StartThread(void);
+	void StopThread(void);
+	bool IsThreaded(void);
+
+	// copies the newest published pose into the character, returns false if nothing changed
+	bool SyncCharacterWithPublishedPose(void);
+
+	bool IsMultiBody(void);
+
+	void SetTickBudget(double Seconds);
+	uint64 GetDroppedStepCount(void);
+	uint64 GetLastStepCount(void);
+
+	const RunStatistics& GetRunStatistics(void);
+	void ResetRunStatistics(void);
+
+	// stamps targets and their prediction with Seconds instead of the wall clock
+	void SetFixedClock(double Seconds);
+
 	function<void(void)> PreSolveCallback, PostSolveCallback;
 
 	vec3 GetFloorPosition(void);
 	vec3 GetFloorSize(void);
 
 	void ChangeObjectMass(btRigidBody* Body, float NewMass);
-
-	void GetBoneFromRay(vec3 RayStart, vec3 RayDirection, Bone*& TouchedBone, vec3& WorldPoint, vec3& WorldNormal);
+	void SetBoneBlocking(Bone* Bone, bool IsFullyBlocked, vec3 LinearFactor, bool XAxisBlocked, bool YAxisBlocked, bool ZAxisBlocked);
+
+	// defers SetBoneBlocking until the outermost transaction ends
+	typedef struct BlockingTransaction {
+		BlockingTransaction(void) {
+			PhysicsManager::GetInstance().BlockingTransactionCounter++;
+		}
+		~BlockingTransaction(void) {
+			int32 Counter = --PhysicsManager::GetInstance().BlockingTransactionCounter;
+			if (Counter == 0)
+				PhysicsManager::GetInstance().CommitBlockingTransaction();
+		}
+	} BlockingTransaction;
 
 	typedef struct Pinpoint {
 		friend class PhysicsManager;
 	private:
-		btPoint2PointConstraint* Constraint;
-		btRigidBody* DummyBody;
+		PinpointSlot* Slot;
+		btMultiBodyPoint2Point* MultiBodyConstraint;
+
+		// what the world holds, only touched by the side that steps it
+		Bone* AppliedBone;
+		vec3 AppliedLocalPoint, AppliedWorldPoint;
+
+		// target motion, only tracked for pinpoints moved through PostPinpoint
+		vec3 TargetVelocity;
+		double TargetTime;
+		bool IsPredicted, IsConverging;
+		uint64 StepsSinceMove;
 	public:
-		btRigidBody* SrcBody;
+		// as last set, the world follows once the physics thread gets to it
+		Bone* SrcBone;
 		vec3 SrcLocalPoint, DestWorldPoint;
 
 		bool IsActive(void);
 	} Pinpoint;
 
-	void SetPinpoint(Pinpoint& P, btRigidBody* Body, vec3 LocalPoint, vec3 WorldPoint);
+	// both are queued when threaded, PostPinpoint also predicts the motion of a dragged target (the IK one)
+	void SetPinpoint(Pinpoint& P, Bone* Bone, vec3 LocalPoint, vec3 WorldPoint);
+	void PostPinpoint(Pinpoint& P, Bone* Bone, vec3 LocalPoint, vec3 WorldPoint);
+	void SamplePinpointError(Pinpoint& P);
 
-	static mat4 GetBoneWorldTransform(Bone* Bone);
+	// extrapolates posted targets from their recent motion, on by default
+	void SetTargetPrediction(bool IsEnabled);
+	bool IsTargetPredictionEnabled(void);
+private:
+	// Target prediction
+
+	// a target older than this is a drag that stopped and falls back to the real point,
+	// the solver latency added on top of its age is capped to it as well
+	const double MaxPredictionTime = 0.05;
+	const float TargetVelocitySmoothing = 0.5f;
+	const double PredictionLatencySmoothing = 0.2;
+
+	bool IsPredictionDisabled;
+	// time a moved target takes to settle, targets are extrapolated this far past the step they are solved in
+	double PredictionLatency;
+	vector<Pinpoint*> PredictedPinpoints;
+
+	void QueuePinpoint(Pinpoint& P, Bone* Bone, vec3 LocalPoint, vec3 WorldPoint, bool IsPredicted);
+	void ApplyPinpoint(Pinpoint& P, Bone* Bone, vec3 LocalPoint, vec3 WorldPoint);
+	void PredictPinpointTarget(Pinpoint& P, Bone* Bone, vec3 LocalPoint, vec3 WorldPoint, double Time);
+	void MovePinpointTarget(Pinpoint& P, vec3 WorldPoint);
+	void UpdatePredictedPinpoints(double Time);
+
+	// Physics thread
+
+	// the character as the GUI left it, indexed by bone ID
+	typedef struct CharacterPose {
+		vector<mat4> Rotations, WorldTransforms;
+		// bones whose blocked axes are limited to their new angles
+		vector<Bone*> ConstrainedBones;
+	} CharacterPose;
+
+	typedef enum PhysicsCommandType {
+		TickCommand,
+		PinpointCommand,
+		BlockingCommand,
+		PoseCommand,
+		SnapshotCommand,
+		SampleCommand,
+		StopCommand
+	} PhysicsCommandType;
+
+	typedef struct PhysicsCommand {
+		PhysicsCommandType Type;
+
+		double dt;
+
+		Pinpoint* TargetPinpoint;
+		Bone* TargetBone;
+		vec3 LocalPoint, WorldPoint;
+		double Time;
+		bool IsPredicted;
+
+		PendingBlocking Blocking;
+
+		// pose and snapshot commands change the pose the GUI sees, they are numbered
+		uint64 WriteSequence;
+		shared_ptr<CharacterPose> Pose;
+		shared_ptr<PhysicsSnapshot> Snapshot;
+	} PhysicsCommand;
+
+	HANDLE PhysicsThread, WakeEvent;
+	bool IsStopping;
+
+	// filled by the GUI thread, only applied under the world lock
+	ConcurrentQueue<PhysicsCommand> Commands;
+
+	// only the physics thread takes it, the GUI reads published poses and posts commands instead
+	typedef struct WorldLock {
+		WorldLock(void) {
+			PhysicsManager::GetInstance().LockWorld();
+		}
+		~WorldLock(void) {
+			PhysicsManager::GetInstance().UnlockWorld();
+		}
+	} WorldLock;
+
+	CRITICAL_SECTION WorldMutex;
+	int32 WorldLockDepth;
+
+	// posted by the GUI and applied by the physics thread, a pose older than the last one posted is not synced
+	uint64 PostedWriteSequence, AppliedWriteSequence;
+
+	void LockWorld(void);
+	void UnlockWorld(void);
+
+	// accumulated by tick commands until the physics thread gets to step
+	double PendingTickTime;
+	Pinpoint* SampledPinpoint;
+
+	void PostCommand(PhysicsCommand& Command);
+	void PostWriteCommand(PhysicsCommand& Command);
+	void ProcessCommands(void);
+	void MeasurePinpointError(Pinpoint& P);
+
+	static DWORD WINAPI PhysicsStaticThreadProc(LPVOID lpThreadParameter);
+	void PhysicsThreadProc(void);
+
+	// Published poses
+
+	typedef struct PublishedPose {
+		uint64 Sequence, WriteSequence;
+		// indexed by bone ID
+		vector<mat4> WorldTransforms;
+		vector<vec3> Angles;
+		PhysicsSnapshot Snapshot;
+	} PublishedPose;
+
+	// triple buffered: the writer fills one slot, the GUI reads another and the third holds the
+	// newest complete pose, so neither side ever waits for the other
+	const LONG FreshPoseFlag = 4;
+
+	PublishedPose Poses[3];
+	int32 WritePoseIndex, ReadPoseIndex;
+	volatile LONG ReadyPoseIndex;
+
+	uint64 PoseSequence, SyncedPoseSequence;
+
+	void PublishPose(void);
+	PublishedPose& AcquirePose(void);
+	// false while the GUI has posted changes the newest pose doesn't have yet
+	bool IsPoseCurrent(PublishedPose& Pose);
+public:
+	mat4 GetBoneWorldTransform(Bone* Bone);
+
+	typedef enum GimbalLockFixType {
+		None,
+		XtoY,
+		ZtoY
+	} GimbalLockFixType;
+
+	typedef enum JointKind {
+		RootJoint,
+		FixedJoint,
+		HingeJoint,
+		GenericJoint
+	} JointKind;
+
+	// Everything the joint code used to re-derive from the bone limits on every call
+	typedef struct JointDescriptor {
+		JointKind Kind;
+		GimbalLockFixType FixType;
+
+		// editor axis of a hinge joint
+		int32 HingeAxis;
+		// editor axis driven by each generic constraint axis, and the sign of that axis
+		int32 AxisRemap[3];
+		float AxisSign[3];
+		// editor axes from the outermost to the innermost rotation of Bone::Rotation
+		int32 AxisOrder[3];
+		int32 AxisCount;
+		// editor axes that are degrees of freedom (all of them for the root)
+		bool IsFree[3];
+
+		// constraint frames and limits with the gimbal lock fix applied
+		btTransform ParentFrame, ChildFrame;
+		vec3 LowLimit, HighLimit;
+	} JointDescriptor;
+private:
+	// built once per rig, indexed by bone ID
+	vector<JointDescriptor> Joints;
+
+	void BuildJointDescriptors(Character* Char);
+	void ApplyGimbalLockFix(JointDescriptor& Joint);
+public:
+	GimbalLockFixType GetGimbalLockFixType(vec3 LowLimit, vec3 HighLimit);
+	const JointDescriptor& GetJointDescriptor(Bone* Bone);
 
 	void UpdateBoneConstraint(Bone* Child, bool XBlocked, bool YBlocked, bool ZBlocked);
+	// from the published pose when threaded
 	vec3 GetBoneAngles(Bone* Bone);
+	// reads every joint in one pass, indexed by bone ID; the world itself, so only on the side that steps it
+	void GetAllBoneAngles(vector<vec3>& Angles);
 	void SetBoneAngles(Bone* Bone, vec3 Angles);
 
+	typedef struct BoneAngles {
+		Bone* TargetBone;
+		vec3 Angles;
+	} BoneAngles;
+
+	// composes all rotations first, then runs FK and syncs the world once
+	void SetBoneAngles(const vector<BoneAngles>& Targets);
+
+	// pure conversions between editor angles and Bone::Rotation, safe to call from any thread
+	mat4 GetRotationFromAngles(Bone* Bone, vec3 Angles);
+	vec3 GetAnglesFromRotation(Bone* Bone, mat4 Rotation);
+
+	// queued when threaded, like the blocking and pinpoint changes
 	void SyncWorldWithCharacter(void);
 
+	// taken from the published pose when threaded, empty if that pose misses changes already posted
+	void CreateSnapshot(PhysicsSnapshot& Snapshot);
+	bool CanRestoreSnapshot(PhysicsSnapshot& Snapshot);
+	void RestoreSnapshot(PhysicsSnapshot& Snapshot);
+
 	void MirrorCharacter(void);
+private:
+	void PostCharacterPose(const vector<Bone*>& ConstrainedBones);
+	void SyncWorldWithPose(CharacterPose& Pose);
+	void CaptureSnapshot(PhysicsSnapshot& Snapshot);
+	void ApplySnapshot(PhysicsSnapshot& Snapshot);
 } PhysicsManager;
\ No newline at end of file
@@ -0,0 +1,385 @@
+#include "PickingTree.hpp"
+
+#include <algorithm>
+#include <float.h>
+
+#include <glm/gtc/matrix_access.hpp>
+
+// SSE utils, the W lane is always ignored
+
+static inline __m128 LoadVector(vec3 V)
+{
+	return _mm_set_ps(0, V.z, V.y, V.x);
+}
+
+static inline float GetLane(__m128 V, int Lane)
+{
+	float Lanes[4];
+	_mm_storeu_ps(Lanes, V);
+
+	return Lanes[Lane];
+}
+
+static inline float HorizontalMin3(__m128 V)
+{
+	__m128 Y = _mm_shuffle_ps(V, V, _MM_SHUFFLE(1, 1, 1, 1));
+	__m128 Z = _mm_shuffle_ps(V, V, _MM_SHUFFLE(2, 2, 2, 2));
+
+	return _mm_cvtss_f32(_mm_min_ss(_mm_min_ss(V, Y), Z));
+}
+
+static inline float HorizontalMax3(__m128 V)
+{
+	__m128 Y = _mm_shuffle_ps(V, V, _MM_SHUFFLE(1, 1, 1, 1));
+	__m128 Z = _mm_shuffle_ps(V, V, _MM_SHUFFLE(2, 2, 2, 2));
+
+	return _mm_cvtss_f32(_mm_max_ss(_mm_max_ss(V, Y), Z));
+}
+
+static inline float Dot3(__m128 A, __m128 B)
+{
+	__m128 V = _mm_mul_ps(A, B);
+	__m128 Y = _mm_shuffle_ps(V, V, _MM_SHUFFLE(1, 1, 1, 1));
+	__m128 Z = _mm_shuffle_ps(V, V, _MM_SHUFFLE(2, 2, 2, 2));
+
+	return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(V, Y), Z));
+}
+
+static inline __m128 Abs(__m128 V)
+{
+	return _mm_andnot_ps(_mm_set1_ps(-0.0f), V);
+}
+
+static inline __m128 ToBoxSpace(const __m128 InverseAxes[3], __m128 V)
+{
+	__m128 X = _mm_shuffle_ps(V, V, _MM_SHUFFLE(0, 0, 0, 0));
+	__m128 Y = _mm_shuffle_ps(V, V, _MM_SHUFFLE(1, 1, 1, 1));
+	__m128 Z = _mm_shuffle_ps(V, V, _MM_SHUFFLE(2, 2, 2, 2));
+
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(InverseAxes[0], X), _mm_mul_ps(InverseAxes[1], Y)), _mm_mul_ps(InverseAxes[2], Z));
+}
+
+// PickingTree
+
+PickingTree::PickingTree(Character* Char)
+{
+	this->Char = Char;
+
+	Boxes.resize(Char->Bones.size());
+
+	vector<int32> Indices;
+
+	for (Bone* Bone : Char->Bones) {
+		UpdateBox(Boxes[Bone->ID], Bone);
+		Indices.push_back(Bone->ID);
+	}
+
+	Nodes.reserve(Boxes.size() * 2);
+
+	if (!Indices.empty())
+		BuildNode(Indices, 0, (int32)Indices.size(), -1);
+}
+
+int32 PickingTree::BuildNode(vector<int32>& Indices, int32 Begin, int32 End, int32 Parent)
+{
+	int32 Index = (int32)Nodes.size();
+
+	Nodes.push_back({});
+	Nodes[Index].Parent = Parent;
+	Nodes[Index].Left = -1;
+	Nodes[Index].Right = -1;
+	Nodes[Index].BoxIndex = -1;
+
+	if (End - Begin == 1) {
+
+		Box& B = Boxes[Indices[Begin]];
+
+		B.Leaf = Index;
+		Nodes[Index].BoxIndex = Indices[Begin];
+
+		UpdateLeafBounds(Nodes[Index], B);
+
+		return Index;
+	}
+
+	// median split along the widest axis of the box centers
+	vec3 Min = vec3(FLT_MAX), Max = vec3(-FLT_MAX);
+
+	for (int32 Position = Begin; Position < End; Position++) {
+
+		vec3 Center = Boxes[Indices[Position]].Transform[3];
+
+		Min = glm::min(Min, Center);
+		Max = glm::max(Max, Center);
+	}
+
+	vec3 Size = Max - Min;
+
+	int Axis = 0;
+	if (Size.y > Size[Axis])
+		Axis = 1;
+	if (Size.z > Size[Axis])
+		Axis = 2;
+
+	int32 Middle = (Begin + End) / 2;
+
+	nth_element(Indices.begin() + Begin, Indices.begin() + Middle, Indices.begin() + End, [this, Axis](int32 A, int32 B) {
+		return Boxes[A].Transform[3][Axis] < Boxes[B].Transform[3][Axis];
+	});
+
+	int32 Left = BuildNode(Indices, Begin, Middle, Index);
+	int32 Right = BuildNode(Indices, Middle, End, Index);
+
+	Node& N = Nodes[Index];
+
+	N.Left = Left;
+	N.Right = Right;
+	N.Min = _mm_min_ps(Nodes[Left].Min, Nodes[Right].Min);
+	N.Max = _mm_max_ps(Nodes[Left].Max, Nodes[Right].Max);
+
+	return Index;
+}
+
+void PickingTree::UpdateBox(Box& B, Bone* Bone)
+{
+	B.Transform = Bone->WorldTransform * Bone->MiddleTranslation;
+
+	mat3 Rotation = mat3(B.Transform);
+	vec3 HalfSize = Bone->Size * 0.5f;
+
+	// the inverse of a rotation is its transpose
+	for (int Axis = 0; Axis < 3; Axis++)
+		B.InverseAxes[Axis] = LoadVector(row(Rotation, Axis));
+
+	B.Center = LoadVector(vec3(B.Transform[3]));
+	B.HalfSize = LoadVector(HalfSize);
+	B.Extent = LoadVector(abs(Rotation[0]) * HalfSize.x + abs(Rotation[1]) * HalfSize.y + abs(Rotation[2]) * HalfSize.z);
+}
+
+void PickingTree::UpdateLeafBounds(Node& N, Box& B)
+{
+	N.Min = _mm_sub_ps(B.Center, B.Extent);
+	N.Max = _mm_add_ps(B.Center, B.Extent);
+}
+
+void PickingTree::Refit(void)
+{
+	bool IsChanged = false;
+
+	for (Bone* Bone : Char->Bones) {
+
+		Box& B = Boxes[Bone->ID];
+
+		if (Bone->WorldTransform * Bone->MiddleTranslation == B.Transform)
+			continue;
+
+		UpdateBox(B, Bone);
+		UpdateLeafBounds(Nodes[B.Leaf], B);
+
+		// once an ancestor is dirty, all of its ancestors are too
+		for (int32 Index = Nodes[B.Leaf].Parent; Index != -1 && !Nodes[Index].IsDirty; Index = Nodes[Index].Parent)
+			Nodes[Index].IsDirty = true;
+
+		IsChanged = true;
+	}
+
+	if (!IsChanged)
+		return;
+
+	// children are stored after their parents, walking backwards refits them first
+	for (int32 Index = (int32)Nodes.size() - 1; Index >= 0; Index--) {
+
+		Node& N = Nodes[Index];
+		if (!N.IsDirty)
+			continue;
+
+		N.Min = _mm_min_ps(Nodes[N.Left].Min, Nodes[N.Right].Min);
+		N.Max = _mm_max_ps(Nodes[N.Left].Max, Nodes[N.Right].Max);
+		N.IsDirty = false;
+	}
+}
+
+bool PickingTree::CastRay(PickingRay Ray, PickingHit& Hit)
+{
+	Refit();
+
+	return FindClosestHit(Ray, Hit);
+}
+
+void PickingTree::CastRays(const vector<PickingRay>& Rays, vector<PickingHit>& Hits)
+{
+	Refit();
+
+	Hits.resize(Rays.size());
+
+	for (size_t Index = 0; Index < Rays.size(); Index++) {
+
+		PickingRay Ray = Rays[Index];
+
+		FindClosestHit(Ray, Hits[Index]);
+	}
+}
+
+bool PickingTree::FindClosestHit(PickingRay& Ray, PickingHit& Hit)
+{
+	Hit.TouchedBone = nullptr;
+	Hit.Distance = FLT_MAX;
+	Hit.WorldPoint = {};
+	Hit.WorldNormal = {};
+
+	if (Nodes.empty())
+		return false;
+
+	__m128 Start = LoadVector(Ray.Start);
+	__m128 Direction = LoadVector(Ray.Direction);
+	__m128 InverseDirection = _mm_div_ps(_mm_set1_ps(1.0f), Direction);
+
+	int HitAxis = 0;
+
+	int32 Stack[64];
+	int32 StackSize = 0;
+
+	Stack[StackSize++] = 0;
+
+	while (StackSize > 0) {
+
+		Node& N = Nodes[Stack[--StackSize]];
+
+		if (!IntersectRayBounds(Start, InverseDirection, N.Min, N.Max, Hit.Distance))
+			continue;
+
+		if (N.Left != -1) {
+			Stack[StackSize++] = N.Left;
+			Stack[StackSize++] = N.Right;
+			continue;
+		}
+
+		float Distance;
+		int Axis;
+
+		if (IntersectRayBox(Start, Direction, Boxes[N.BoxIndex], Distance, Axis) && Distance < Hit.Distance) {
+
+			Hit.TouchedBone = Char->Bones[N.BoxIndex];
+			Hit.Distance = Distance;
+			HitAxis = Axis;
+		}
+	}
+
+	if (Hit.TouchedBone == nullptr)
+		return false;
+
+	mat3 Rotation = mat3(Boxes[Hit.TouchedBone->ID].Transform);
+
+	// the entered face looks against the ray
+	vec3 Normal = Rotation[HitAxis];
+	if (dot(Normal, Ray.Direction) > 0)
+		Normal = -Normal;
+
+	Hit.WorldPoint = Ray.Start + Ray.Direction * Hit.Distance;
+	Hit.WorldNormal = Normal;
+
+	return true;
+}
+
+void PickingTree::QueryVolume(const vector<vec4>& Planes, vector<Bone*>& Result)
+{
+	Refit();
+
+	if (Nodes.empty())
+		return;
+
+	vector<__m128> SimdPlanes;
+	for (vec4 Plane : Planes)
+		SimdPlanes.push_back(_mm_set_ps(Plane.w, Plane.z, Plane.y, Plane.x));
+
+	__m128 Half = _mm_set1_ps(0.5f);
+
+	int32 Stack[64];
+	int32 StackSize = 0;
+
+	Stack[StackSize++] = 0;
+
+	while (StackSize > 0) {
+
+		Node& N = Nodes[Stack[--StackSize]];
+
+		__m128 Center = _mm_mul_ps(_mm_add_ps(N.Min, N.Max), Half);
+		__m128 Extent = _mm_mul_ps(_mm_sub_ps(N.Max, N.Min), Half);
+
+		bool IsOutside = false;
+
+		for (__m128 Plane : SimdPlanes)
+			if (IsOutsidePlane(Center, Dot3(Extent, Abs(Plane)), Plane)) {
+				IsOutside = true;
+				break;
+			}
+
+		if (IsOutside)
+			continue;
+
+		if (N.Left != -1) {
+			Stack[StackSize++] = N.Left;
+			Stack[StackSize++] = N.Right;
+			continue;
+		}
+
+		// the bounds may touch the volume while the box itself doesn't
+		Box& B = Boxes[N.BoxIndex];
+
+		for (__m128 Plane : SimdPlanes)
+			if (IsOutsidePlane(B.Center, Dot3(Abs(ToBoxSpace(B.InverseAxes, Plane)), B.HalfSize), Plane)) {
+				IsOutside = true;
+				break;
+			}
+
+		if (!IsOutside)
+			Result.push_back(Char->Bones[N.BoxIndex]);
+	}
+}
+
+bool PickingTree::IntersectRayBounds(__m128 Start, __m128 InverseDirection, __m128 Min, __m128 Max, float MaxDistance)
+{
+	__m128 T0 = _mm_mul_ps(_mm_sub_ps(Min, Start), InverseDirection);
+	__m128 T1 = _mm_mul_ps(_mm_sub_ps(Max, Start), InverseDirection);
+
+	float Near = HorizontalMax3(_mm_min_ps(T0, T1));
+	float Far = HorizontalMin3(_mm_max_ps(T0, T1));
+
+	return Near <= Far && Far >= 0 && Near <= MaxDistance;
+}
+
+bool PickingTree::IntersectRayBox(__m128 Start, __m128 Direction, Box& B, float& Distance, int& Axis)
+{
+	__m128 LocalStart = ToBoxSpace(B.InverseAxes, _mm_sub_ps(Start, B.Center));
+	__m128 LocalDirection = ToBoxSpace(B.InverseAxes, Direction);
+	__m128 InverseDirection = _mm_div_ps(_mm_set1_ps(1.0f), LocalDirection);
+
+	__m128 T0 = _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(_mm_setzero_ps(), B.HalfSize), LocalStart), InverseDirection);
+	__m128 T1 = _mm_mul_ps(_mm_sub_ps(B.HalfSize, LocalStart), InverseDirection);
+
+	__m128 Near = _mm_min_ps(T0, T1);
+
+	float NearDistance = HorizontalMax3(Near);
+	float FarDistance = HorizontalMin3(_mm_max_ps(T0, T1));
+
+	// rays starting inside a box don't pick it
+	if (NearDistance > FarDistance || NearDistance < 0)
+		return false;
+
+	Axis = 0;
+	if (GetLane(Near, 1) == NearDistance)
+		Axis = 1;
+	if (GetLane(Near, 2) == NearDistance)
+		Axis = 2;
+
+	Distance = NearDistance;
+
+	return true;
+}
+
+bool PickingTree::IsOutsidePlane(__m128 Center, float Radius, __m128 Plane)
+{
+	float Side = Dot3(Center, Plane) + GetLane(Plane, 3);
+
+	return Side < -Radius;
+}
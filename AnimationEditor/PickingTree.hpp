@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vector>
+
+#include <xmmintrin.h>
+
+#include <glm/glm.hpp>
+
+#include "Character.hpp"
+
+using namespace std;
+using namespace glm;
+
+typedef struct PickingRay {
+	vec3 Start, Direction;
+} PickingRay;
+
+typedef struct PickingHit {
+	Bone* TouchedBone;
+	float Distance;
+	vec3 WorldPoint, WorldNormal;
+} PickingHit;
+
+// Bounding volume hierarchy over the bone boxes of one character, used for mouse picking instead of
+// the physics world. Boxes are taken from WorldTransform * MiddleTranslation and Size, the hierarchy
+// is built once per rig and only refitted (changed bones and their ancestors) before queries.
+typedef class PickingTree {
+private:
+	typedef struct Node {
+		__m128 Min, Max;
+		// children are always stored after their parent, leaves have Left == -1
+		int32 Left, Right, Parent;
+		int32 BoxIndex;
+		bool IsDirty;
+	} Node;
+
+	typedef struct Box {
+		// columns of the inverse box rotation, transform world offsets into box space
+		__m128 InverseAxes[3];
+		__m128 Center, HalfSize;
+		// half size of the world aligned bounds
+		__m128 Extent;
+
+		mat4 Transform;
+		int32 Leaf;
+	} Box;
+
+	Character* Char;
+
+	vector<Node> Nodes;
+	vector<Box> Boxes;
+
+	int32 BuildNode(vector<int32>& Indices, int32 Begin, int32 End, int32 Parent);
+
+	void UpdateBox(Box& B, Bone* Bone);
+	void UpdateLeafBounds(Node& N, Box& B);
+
+	bool FindClosestHit(PickingRay& Ray, PickingHit& Hit);
+
+	static bool IntersectRayBounds(__m128 Start, __m128 InverseDirection, __m128 Min, __m128 Max, float MaxDistance);
+	static bool IntersectRayBox(__m128 Start, __m128 Direction, Box& B, float& Distance, int& Axis);
+	static bool IsOutsidePlane(__m128 Center, float Radius, __m128 Plane);
+public:
+	PickingTree(Character* Char);
+
+	void Refit(void);
+
+	bool CastRay(PickingRay Ray, PickingHit& Hit);
+	void CastRays(const vector<PickingRay>& Rays, vector<PickingHit>& Hits);
+
+	// bones whose box is at least partially inside the convex volume, planes point inside
+	void QueryVolume(const vector<vec4>& Planes, vector<Bone*>& Result);
+} PickingTree;
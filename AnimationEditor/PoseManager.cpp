@@ -5,6 +5,7 @@
 #include "CharacterManager.hpp"
 #include "InputManager.hpp"
 #include "Form.hpp"
+#include "RecordingManager.hpp"
 
 using namespace psm;
 
@@ -18,7 +19,6 @@ void PoseManager::Initialize(void) {
 
 		Bone->PoseCtx = new PoseContext();
 		Bone->PoseCtx->Blocking = BlockingInfo::GetAllUnblocked();
-		Bone->PhysicBody->setDamping(1, 1);
 	}
 }
 
@@ -27,19 +27,30 @@ void PoseManager::Tick(double dt) {
 	if (SerializationManager::GetInstance().IsInKinematicMode())
 		return;
 
+	RecordingManager::GetInstance().RecordTick(dt);
+
 	PhysicsManager::GetInstance().Tick(dt);
 
+	PhysicsManager::GetInstance().SamplePinpointError(IKPinpoint);
+
+	// with threaded physics this is the newest finished pose, a slow solve just leaves it unchanged
+	PhysicsManager::GetInstance().SyncCharacterWithPublishedPose();
+
 	Form::GetInstance().UpdatePositionAndAngles();
 }
 
 void PoseManager::InverseKinematic(Bone* Bone, vec3 LocalPoint, vec3 WorldDestPoint) {
 
-	PhysicsManager::GetInstance().SetPinpoint(IKPinpoint, Bone->PhysicBody, LocalPoint, WorldDestPoint);
+	RecordingManager::GetInstance().RecordInverseKinematic(Bone, LocalPoint, WorldDestPoint);
+
+	PhysicsManager::GetInstance().PostPinpoint(IKPinpoint, Bone, LocalPoint, WorldDestPoint);
 }
 
 void PoseManager::CancelInverseKinematic(void)
 {
-	PhysicsManager::GetInstance().SetPinpoint(IKPinpoint, nullptr, {}, {});
+	RecordingManager::GetInstance().RecordInverseKinematic(nullptr, {}, {});
+
+	PhysicsManager::GetInstance().PostPinpoint(IKPinpoint, nullptr, {}, {});
 }
 
 BlockingInfo PoseManager::GetBoneBlocking(Bone* Bone)
@@ -56,11 +67,11 @@ void PoseManager::SetBoneBlocking(Bone* Bone, BlockingInfo Blocking)
 
 	Bone->PoseCtx->Blocking = Blocking;
 
-	PhysicsManager::GetInstance().ChangeObjectMass(Bone->PhysicBody, Blocking.IsFullyBlocked() ? 0 : Bone->Mass);
-
-	Bone->PhysicBody->setLinearFactor(GLMToBullet({ Blocking.XPos ? 1 : 0, Blocking.YPos ? 1 : 0, Blocking.ZPos ? 1 : 0 }));
+	RecordingManager::GetInstance().RecordBlocking(Bone, Blocking);
 
-	PhysicsManager::GetInstance().UpdateBoneConstraint(Bone, !Blocking.XAxis, !Blocking.YAxis, !Blocking.ZAxis);
+	PhysicsManager::GetInstance().SetBoneBlocking(Bone, Blocking.IsFullyBlocked(),
+		{ Blocking.XPos ? 1 : 0, Blocking.YPos ? 1 : 0, Blocking.ZPos ? 1 : 0 },
+		!Blocking.XAxis, !Blocking.YAxis, !Blocking.ZAxis);
 
 	Form::GetInstance().UpdateBlocking();
 }
@@ -74,17 +85,22 @@ void PoseManager::ConstrainBonePosition(Bone* Bone, vec3 WorldPoint)
 {
 	vec3 LocalPoint = inverse(Bone->WorldTransform * Bone->MiddleTranslation) * vec4(WorldPoint, 1);
 
-	PhysicsManager::GetInstance().SetPinpoint(Bone->PoseCtx->Pinpoint, Bone->PhysicBody, LocalPoint, WorldPoint);
+	RecordingManager::GetInstance().RecordPositionConstraint(Bone, true, WorldPoint);
+
+	PhysicsManager::GetInstance().SetPinpoint(Bone->PoseCtx->Pinpoint, Bone, LocalPoint, WorldPoint);
 }
 
 void PoseManager::RemoveBonePositionConstraint(Bone* Bone)
 {
+	RecordingManager::GetInstance().RecordPositionConstraint(Bone, false, {});
+
 	PhysicsManager::GetInstance().SetPinpoint(Bone->PoseCtx->Pinpoint, nullptr, {}, {});
 }
 
 void PoseManager::BlockEverythingExceptThisBranch(Bone* Parent, Bone* Exception)
 {
 	Form::UpdateLock Lock;
+	PhysicsManager::BlockingTransaction Transaction;
 
 	if (Parent == nullptr)
 		return;
@@ -106,6 +122,9 @@ void PoseManager::BlockEverythingExceptThisBranch(Bone* Parent, Bone* Exception)
 
 void PoseManager::UnblockAllBones(void)
 {
+	Form::UpdateLock Lock;
+	PhysicsManager::BlockingTransaction Transaction;
+
 	Character* Char = CharacterManager::GetInstance().GetCharacter();
 
 	BlockingInfo AllUnblocked = BlockingInfo::GetAllUnblocked();
@@ -114,6 +133,24 @@ void PoseManager::UnblockAllBones(void)
 		SetBoneBlocking(Bone, AllUnblocked);
 }
 
+void PoseManager::ToggleBonesBlocking(const vector<Bone*>& Bones)
+{
+	Form::UpdateLock Lock;
+	PhysicsManager::BlockingTransaction Transaction;
+
+	// the whole group is blocked unless all of it already is
+	bool IsAllBlocked = true;
+
+	for (Bone* Bone : Bones)
+		if (!GetBoneBlocking(Bone).IsFullyBlocked())
+			IsAllBlocked = false;
+
+	BlockingInfo Blocking = IsAllBlocked ? BlockingInfo::GetAllUnblocked() : BlockingInfo::GetAllBlocked();
+
+	for (Bone* Bone : Bones)
+		SetBoneBlocking(Bone, Blocking);
+}
+
 void PoseManager::Serialize(PoseSerializedState& State)
 {
 	State.Contexts.clear();
@@ -141,12 +178,16 @@ void PoseManager::Serialize(PoseSerializedState& State)
 	}
 }
 
-void PoseManager::Deserialize(PoseSerializedState& State)
+void PoseManager::Deserialize(PoseSerializedState& State, PhysicsSnapshot& Snapshot)
 {
 	Form::UpdateLock Lock;
+	PhysicsManager::BlockingTransaction Transaction;
 
 	Character* Char = CharacterManager::GetInstance().GetCharacter();
 
+	// the snapshot already holds masses, limits and velocities matching this blocking
+	bool RestoreSnapshot = PhysicsManager::GetInstance().CanRestoreSnapshot(Snapshot);
+
 	for (Bone* Bone : Char->Bones) {
 
 		SerializedPoseContext SerializedContext = {};
@@ -173,12 +214,18 @@ void PoseManager::Deserialize(PoseSerializedState& State)
 		Blocking.YAxis = SerializedContext.Blocking.YAxis;
 		Blocking.ZAxis = SerializedContext.Blocking.ZAxis;
 
-		SetBoneBlocking(Bone, Blocking);
+		if (RestoreSnapshot)
+			Bone->PoseCtx->Blocking = Blocking;
+		else
+			SetBoneBlocking(Bone, Blocking);
 
-		PhysicsManager::GetInstance().SetPinpoint(Bone->PoseCtx->Pinpoint, SerializedContext.IsActive ? Bone->PhysicBody : nullptr, 
+		PhysicsManager::GetInstance().SetPinpoint(Bone->PoseCtx->Pinpoint, SerializedContext.IsActive ? Bone : nullptr, 
 			SerializedContext.SrcLocalPoint, SerializedContext.DestWorldPoint);
 	}
 
+	if (RestoreSnapshot)
+		PhysicsManager::GetInstance().RestoreSnapshot(Snapshot);
+
 	Form::GetInstance().FullUpdate();
 }
 
@@ -61,7 +61,8 @@ public:
 
 	void BlockEverythingExceptThisBranch(Bone* Parent, Bone* Exception);
 	void UnblockAllBones(void);
+	void ToggleBonesBlocking(const vector<Bone*>& Bones);
 
 	void Serialize(PoseSerializedState& State);
-	void Deserialize(PoseSerializedState& State);
+	void Deserialize(PoseSerializedState& State, PhysicsSnapshot& Snapshot);
 } PoseManager;
\ No newline at end of file
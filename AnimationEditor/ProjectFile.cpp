@@ -0,0 +1,1075 @@
+#include "ProjectFile.hpp"
+
+#include <stddef.h>
+#include <string.h>
+
+#include <algorithm>
+#include <ppl.h>
+#include <unordered_set>
+
+#include "BlockCompressor.hpp"
+
+const wchar_t* ProjectFile::Extension = L".aep";
+
+SRWLOCK ProjectFile::LoadedImagesLock = SRWLOCK_INIT;
+vector<weak_ptr<ProjectFile::LoadedImage>> ProjectFile::LoadedImages;
+
+uint32 ProjectFile::GetKeyframeSize(uint32 BoneCount)
+{
+	return (uint32)(sizeof(StateRecord) + BoneCount * (sizeof(BoneRecord) + sizeof(ContextRecord)));
+}
+
+bool ProjectFile::IsRangeInside(uint64 Offset, uint64 Count, uint64 RecordSize, uint64 Size)
+{
+	return Offset <= Size && Count <= (Size - Offset) / RecordSize;
+}
+
+bool ProjectFile::IsProjectFile(const wstring FileName)
+{
+	FILE* File = _wfopen(FileName.c_str(), L"rb");
+	if (File == nullptr)
+		return false;
+
+	uint32 FileMagic = 0;
+	size_t Count = fread(&FileMagic, sizeof(FileMagic), 1, File);
+	fclose(File);
+
+	return Count == 1 && (FileMagic == Magic || FileMagic == CompressedMagic);
+}
+
+void ProjectFile::WriteRotation(const quat& Rotation, BoneRecord& Record)
+{
+	Record.Rotation[0] = Rotation.x;
+	Record.Rotation[1] = Rotation.y;
+	Record.Rotation[2] = Rotation.z;
+	Record.Rotation[3] = Rotation.w;
+}
+
+void ProjectFile::WriteContext(const SerializedPoseContext& Context, ContextRecord& Record)
+{
+	Record.Flags = ContextPresent;
+	Record.Flags |= Context.Blocking.XAxis ? ContextXAxis : 0;
+	Record.Flags |= Context.Blocking.YAxis ? ContextYAxis : 0;
+	Record.Flags |= Context.Blocking.ZAxis ? ContextZAxis : 0;
+	Record.Flags |= Context.Blocking.XPos ? ContextXPos : 0;
+	Record.Flags |= Context.Blocking.YPos ? ContextYPos : 0;
+	Record.Flags |= Context.Blocking.ZPos ? ContextZPos : 0;
+	Record.Flags |= Context.IsActive ? ContextActive : 0;
+
+	memcpy(Record.SrcLocalPoint, &Context.SrcLocalPoint, sizeof(Record.SrcLocalPoint));
+	memcpy(Record.DestWorldPoint, &Context.DestWorldPoint, sizeof(Record.DestWorldPoint));
+}
+
+void ProjectFile::ReadContext(const ContextRecord& Record, SerializedPoseContext& Context)
+{
+	Context.Blocking.XAxis = (Record.Flags & ContextXAxis) != 0;
+	Context.Blocking.YAxis = (Record.Flags & ContextYAxis) != 0;
+	Context.Blocking.ZAxis = (Record.Flags & ContextZAxis) != 0;
+	Context.Blocking.XPos = (Record.Flags & ContextXPos) != 0;
+	Context.Blocking.YPos = (Record.Flags & ContextYPos) != 0;
+	Context.Blocking.ZPos = (Record.Flags & ContextZPos) != 0;
+	Context.IsActive = (Record.Flags & ContextActive) != 0;
+	Context.SrcLocalPoint = vec3(Record.SrcLocalPoint[0], Record.SrcLocalPoint[1], Record.SrcLocalPoint[2]);
+	Context.DestWorldPoint = vec3(Record.DestWorldPoint[0], Record.DestWorldPoint[1], Record.DestWorldPoint[2]);
+}
+
+bool ProjectFile::WriteState(const SingleSerializedState& State, const SingleSerializedState* Base, const unordered_map<wstring, int32>& NameIndices, uint32 BoneCount, vector<uint8>& Buffer)
+{
+	vector<uint32> ChangedBones, ChangedContexts;
+
+	bool IsKeyframe = Base == nullptr || !SerializedStateStack::GetChanges(*Base, State, ChangedBones, ChangedContexts);
+
+	size_t RecordSize = IsKeyframe ? GetKeyframeSize(BoneCount) :
+		sizeof(StateRecord) + ChangedBones.size() * sizeof(BoneChangeRecord) + ChangedContexts.size() * sizeof(ContextChangeRecord);
+
+	size_t Offset = Buffer.size();
+	Buffer.resize(Offset + RecordSize, 0);
+
+	uint8* Record = Buffer.data() + Offset;
+	StateRecord* S = (StateRecord*)Record;
+
+	S->IsKeyframe = IsKeyframe;
+	S->ChangedBoneCount = (uint32)ChangedBones.size();
+	S->ChangedContextCount = (uint32)ChangedContexts.size();
+
+	S->PendingID = (uint32)State.PendingID;
+	S->HaveCharState = State.HaveCharState;
+	S->HaveInputState = State.HaveInputState;
+	S->HavePoseState = State.HavePoseState;
+	S->HaveRenderState = State.HaveRenderState;
+
+	const CharacterSerializedState& CharState = State.CharState;
+
+	S->AnimationTimestamp = CharState.AnimationTimestamp;
+	memcpy(S->Position, &CharState.Position, sizeof(S->Position));
+
+	const InputSerializedState& InputState = State.InputState;
+
+	S->InputState = InputState.State;
+	S->PlaneMode = InputState.PlaneMode;
+	S->InputBone = InputState.BoneName.empty() ? -1 : NameIndices.at(InputState.BoneName);
+	memcpy(S->LocalPoint, &InputState.LocalPoint, sizeof(S->LocalPoint));
+	memcpy(S->WorldPoint, &InputState.WorldPoint, sizeof(S->WorldPoint));
+
+	const RenderSerializedState& RenderState = State.RenderState;
+
+	memcpy(S->CameraPosition, &RenderState.CameraPosition, sizeof(S->CameraPosition));
+	S->CameraAngleX = RenderState.CameraAngleX;
+	S->CameraAngleZ = RenderState.CameraAngleZ;
+
+	const vector<SerializedBone>& Bones = CharState.Bones;
+	const vector<SerializedPoseContext>& Contexts = State.PoseState.Contexts;
+
+	if (IsKeyframe) {
+
+		BoneRecord* BoneRecords = (BoneRecord*)(Record + sizeof(StateRecord));
+		ContextRecord* ContextRecords = (ContextRecord*)(Record + sizeof(StateRecord) + BoneCount * sizeof(BoneRecord));
+
+		for (const SerializedBone& Bone : Bones)
+			WriteRotation(Bone.Rotation, BoneRecords[NameIndices.at(Bone.Name)]);
+
+		for (const SerializedPoseContext& Context : Contexts)
+			WriteContext(Context, ContextRecords[NameIndices.at(Context.BoneName)]);
+	}
+	else {
+
+		BoneChangeRecord* BoneChanges = (BoneChangeRecord*)(Record + sizeof(StateRecord));
+		ContextChangeRecord* ContextChanges = (ContextChangeRecord*)(Record + sizeof(StateRecord) + ChangedBones.size() * sizeof(BoneChangeRecord));
+
+		for (size_t Index = 0; Index < ChangedBones.size(); Index++) {
+
+			const SerializedBone& Bone = Bones[ChangedBones[Index]];
+
+			BoneChanges[Index].Name = NameIndices.at(Bone.Name);
+			WriteRotation(Bone.Rotation, BoneChanges[Index].Bone);
+		}
+
+		for (size_t Index = 0; Index < ChangedContexts.size(); Index++) {
+
+			const SerializedPoseContext& Context = Contexts[ChangedContexts[Index]];
+
+			ContextChanges[Index].Name = NameIndices.at(Context.BoneName);
+			WriteContext(Context, ContextChanges[Index].Context);
+		}
+	}
+
+	return IsKeyframe;
+}
+
+bool ProjectFile::ReadState(SingleSerializedState& State, const SingleSerializedState* Base, vector<wstring>& Names, const uint8* Data, uint64 Size, uint64& Offset)
+{
+	uint32 BoneCount = (uint32)Names.size();
+
+	if (!IsRangeInside(Offset, 1, sizeof(StateRecord), Size))
+		return false;
+
+	const uint8* Record = Data + Offset;
+	const StateRecord* S = (const StateRecord*)Record;
+
+	uint64 RecordSize = S->IsKeyframe ? GetKeyframeSize(BoneCount) :
+		sizeof(StateRecord) + (uint64)S->ChangedBoneCount * sizeof(BoneChangeRecord) + (uint64)S->ChangedContextCount * sizeof(ContextChangeRecord);
+
+	if (!IsRangeInside(Offset, 1, RecordSize, Size) || (!S->IsKeyframe && Base == nullptr))
+		return false;
+
+	Offset += RecordSize;
+
+	State = {};
+
+	// bones and contexts are read whatever the flags say, the records after this one change them
+	if (S->IsKeyframe) {
+
+		const BoneRecord* Bones = (const BoneRecord*)(Record + sizeof(StateRecord));
+		const ContextRecord* Contexts = (const ContextRecord*)(Record + sizeof(StateRecord) + BoneCount * sizeof(BoneRecord));
+
+		State.CharState.Bones.reserve(BoneCount);
+
+		for (uint32 Index = 0; Index < BoneCount; Index++) {
+
+			const BoneRecord& B = Bones[Index];
+			if (B.Rotation[0] == 0 && B.Rotation[1] == 0 && B.Rotation[2] == 0 && B.Rotation[3] == 0)
+				continue;
+
+			SerializedBone Bone;
+			Bone.Name = Names[Index];
+			Bone.Rotation.x = B.Rotation[0];
+			Bone.Rotation.y = B.Rotation[1];
+			Bone.Rotation.z = B.Rotation[2];
+			Bone.Rotation.w = B.Rotation[3];
+
+			State.CharState.Bones.push_back(Bone);
+		}
+
+		State.PoseState.Contexts.reserve(BoneCount);
+
+		for (uint32 Index = 0; Index < BoneCount; Index++) {
+
+			const ContextRecord& C = Contexts[Index];
+			if ((C.Flags & ContextPresent) == 0)
+				continue;
+
+			SerializedPoseContext Context;
+			Context.BoneName = Names[Index];
+			ReadContext(C, Context);
+
+			State.PoseState.Contexts.push_back(Context);
+		}
+	}
+	else {
+
+		const BoneChangeRecord* BoneChanges = (const BoneChangeRecord*)(Record + sizeof(StateRecord));
+		const ContextChangeRecord* ContextChanges = (const ContextChangeRecord*)(Record + sizeof(StateRecord) + S->ChangedBoneCount * sizeof(BoneChangeRecord));
+
+		State.CharState.Bones = Base->CharState.Bones;
+		State.PoseState.Contexts = Base->PoseState.Contexts;
+
+		for (uint32 Index = 0; Index < S->ChangedBoneCount; Index++) {
+
+			const BoneChangeRecord& Change = BoneChanges[Index];
+			if (Change.Name >= BoneCount)
+				return false;
+
+			auto Bone = find_if(State.CharState.Bones.begin(), State.CharState.Bones.end(),
+				[&](const SerializedBone& Candidate) { return Candidate.Name == Names[Change.Name]; });
+
+			if (Bone == State.CharState.Bones.end())
+				return false;
+
+			Bone->Rotation.x = Change.Bone.Rotation[0];
+			Bone->Rotation.y = Change.Bone.Rotation[1];
+			Bone->Rotation.z = Change.Bone.Rotation[2];
+			Bone->Rotation.w = Change.Bone.Rotation[3];
+		}
+
+		for (uint32 Index = 0; Index < S->ChangedContextCount; Index++) {
+
+			const ContextChangeRecord& Change = ContextChanges[Index];
+			if (Change.Name >= BoneCount)
+				return false;
+
+			auto Context = find_if(State.PoseState.Contexts.begin(), State.PoseState.Contexts.end(),
+				[&](const SerializedPoseContext& Candidate) { return Candidate.BoneName == Names[Change.Name]; });
+
+			if (Context == State.PoseState.Contexts.end())
+				return false;
+
+			ReadContext(Change.Context, *Context);
+		}
+	}
+
+	State.PendingID = (SerializationPendingID)S->PendingID;
+	State.HaveCharState = S->HaveCharState != 0;
+	State.HaveInputState = S->HaveInputState != 0;
+	State.HavePoseState = S->HavePoseState != 0;
+	State.HaveRenderState = S->HaveRenderState != 0;
+
+	if (State.HaveCharState) {
+
+		CharacterSerializedState& CharState = State.CharState;
+
+		CharState.AnimationTimestamp = S->AnimationTimestamp;
+		CharState.Position = vec3(S->Position[0], S->Position[1], S->Position[2]);
+	}
+
+	if (State.HaveInputState) {
+
+		InputSerializedState& InputState = State.InputState;
+
+		InputState.State = S->InputState;
+		InputState.PlaneMode = S->PlaneMode;
+		if (S->InputBone >= 0 && (uint32)S->InputBone < BoneCount)
+			InputState.BoneName = Names[S->InputBone];
+		InputState.LocalPoint = vec3(S->LocalPoint[0], S->LocalPoint[1], S->LocalPoint[2]);
+		InputState.WorldPoint = vec3(S->WorldPoint[0], S->WorldPoint[1], S->WorldPoint[2]);
+	}
+
+	if (State.HaveRenderState) {
+
+		RenderSerializedState& RenderState = State.RenderState;
+
+		RenderState.CameraPosition = vec3(S->CameraPosition[0], S->CameraPosition[1], S->CameraPosition[2]);
+		RenderState.CameraAngleX = S->CameraAngleX;
+		RenderState.CameraAngleZ = S->CameraAngleZ;
+	}
+
+	return true;
+}
+
+uint32 ProjectFile::GetChecksum(const uint8* Data, uint64 Size)
+{
+	// FNV-1a
+	uint32 Result = 2166136261u;
+
+	for (uint64 Index = 0; Index < Size; Index++)
+		Result = (Result ^ Data[Index]) * 16777619u;
+
+	return Result;
+}
+
+uint32 ProjectFile::SetChecksum(vector<uint8>& Buffer)
+{
+	FileHeader* Header = (FileHeader*)Buffer.data();
+
+	Header->Checksum = 0;
+	Header->Checksum = GetChecksum(Buffer.data(), Buffer.size());
+
+	return Header->Checksum;
+}
+
+void ProjectFile::Write(vector<SerializedStateHistory>& Histories, SerializeSerializedState& State, vector<uint8>& Buffer)
+{
+	// names met by each history in order, merged in history order so the table doesn't depend on the threads
+	vector<vector<wstring>> HistoryNames(Histories.size());
+
+	concurrency::parallel_for((size_t)0, Histories.size(), [&Histories, &HistoryNames](size_t Index) {
+
+		unordered_set<wstring> Seen;
+		vector<wstring>& Names = HistoryNames[Index];
+
+		auto AddNames = [&Seen, &Names](const SingleSerializedState& S) {
+
+			auto AddName = [&Seen, &Names](const wstring& Name) {
+				if (!Name.empty() && Seen.insert(Name).second)
+					Names.push_back(Name);
+			};
+
+			for (const SerializedBone& Bone : S.CharState.Bones)
+				AddName(Bone.Name);
+
+			for (const SerializedPoseContext& Context : S.PoseState.Contexts)
+				AddName(Context.BoneName);
+
+			AddName(S.InputState.BoneName);
+		};
+
+		SerializedStateHistory& History = Histories[Index];
+
+		History.PreviousStates.ForEach(AddNames);
+		AddNames(History.CurrentState);
+		History.FutureStates.ForEach(AddNames);
+	});
+
+	// bone name table, in the order the names are first met
+	unordered_map<wstring, int32> NameIndices;
+	vector<wstring> Names;
+
+	for (vector<wstring>& Met : HistoryNames) {
+		for (wstring& Name : Met) {
+			if (NameIndices.find(Name) == NameIndices.end()) {
+				NameIndices[Name] = (int32)Names.size();
+				Names.push_back(Name);
+			}
+		}
+	}
+
+	uint32 BoneCount = (uint32)Names.size();
+
+	uint64 NameCharCount = 0;
+	for (wstring& Name : Names)
+		NameCharCount += Name.size();
+
+	auto Align = [](uint64 Offset) {
+		return (Offset + 7) & ~7ull;
+	};
+
+	FileHeader Header = {};
+	Header.Magic = Magic;
+	Header.Version = Version;
+	Header.BoneCount = BoneCount;
+	Header.HistoryCount = (uint32)Histories.size();
+
+	Header.NamesOffset = Align(sizeof(FileHeader));
+	Header.HistoriesOffset = Align(Header.NamesOffset + BoneCount * sizeof(NameRecord) + NameCharCount * sizeof(uint16));
+	Header.StatesOffset = Align(Header.HistoriesOffset + Histories.size() * sizeof(HistoryRecord));
+
+	Header.AnimationPosition = State.AnimationPosition;
+	Header.AnimationLength = State.AnimationLength;
+	Header.PlaySpeed = State.PlaySpeed;
+	Header.KinematicModeFlag = State.KinematicModeFlag;
+	Header.PlayAnimaionFlag = State.PlayAnimaionFlag;
+	Header.LoopAnimationFlag = State.LoopAnimationFlag;
+
+	// state records are appended as they are encoded
+	Buffer.assign((size_t)Header.StatesOffset, 0);
+
+	memcpy(Buffer.data(), &Header, sizeof(Header));
+
+	NameRecord* NameRecords = (NameRecord*)(Buffer.data() + Header.NamesOffset);
+	uint64 NameOffset = Header.NamesOffset + BoneCount * sizeof(NameRecord);
+
+	for (uint32 Index = 0; Index < BoneCount; Index++) {
+
+		NameRecords[Index].Offset = NameOffset;
+		NameRecords[Index].Length = (uint32)Names[Index].size();
+
+		// wchar_t is UTF-16 on Windows
+		memcpy(Buffer.data() + NameOffset, Names[Index].data(), Names[Index].size() * sizeof(uint16));
+		NameOffset += Names[Index].size() * sizeof(uint16);
+	}
+
+	const unordered_map<wstring, int32>& Indices = NameIndices;
+
+	auto WriteStack = [&Indices, BoneCount](const SerializedStateStack& Stack, vector<uint8>& States) {
+
+		SingleSerializedState Previous;
+		// records since the last keyframe, 0 before the first one
+		uint32 Distance = 0;
+
+		Stack.ForEach([&](const SingleSerializedState& S) {
+
+			bool UsePrevious = Distance != 0 && Distance < SerializedStateStack::KeyframeInterval;
+
+			Distance = WriteState(S, UsePrevious ? &Previous : nullptr, Indices, BoneCount, States) ? 1 : Distance + 1;
+
+			Previous.CharState.Bones = S.CharState.Bones;
+			Previous.PoseState.Contexts = S.PoseState.Contexts;
+		});
+	};
+
+	// every history is encoded into its own buffer, offsets are relative to it until they are joined
+	vector<vector<uint8>> HistoryStates(Histories.size());
+	vector<HistoryRecord> HistoryRecords(Histories.size());
+
+	concurrency::parallel_for((size_t)0, Histories.size(), [&](size_t Index) {
+
+		SerializedStateHistory& History = Histories[Index];
+		vector<uint8>& States = HistoryStates[Index];
+
+		HistoryRecord& Record = HistoryRecords[Index];
+		Record = {};
+		Record.PreviousCount = (uint32)History.PreviousStates.Size();
+		Record.FutureCount = (uint32)History.FutureStates.Size();
+		Record.IsDeleted = History.IsDeleted;
+
+		Record.StatesOffset = 0;
+		WriteStack(History.PreviousStates, States);
+
+		Record.CurrentOffset = States.size();
+		WriteState(History.CurrentState, nullptr, Indices, BoneCount, States);
+
+		Record.FutureOffset = States.size();
+		WriteStack(History.FutureStates, States);
+
+		Record.EndOffset = States.size();
+	});
+
+	size_t Size = Buffer.size();
+	for (vector<uint8>& States : HistoryStates)
+		Size += States.size();
+
+	Buffer.reserve(Size);
+
+	for (size_t Index = 0; Index < Histories.size(); Index++) {
+
+		HistoryRecord& Record = HistoryRecords[Index];
+
+		uint64 Base = Buffer.size();
+		Record.StatesOffset += Base;
+		Record.CurrentOffset += Base;
+		Record.FutureOffset += Base;
+		Record.EndOffset += Base;
+
+		Buffer.insert(Buffer.end(), HistoryStates[Index].begin(), HistoryStates[Index].end());
+
+		// released as soon as it's copied
+		vector<uint8>().swap(HistoryStates[Index]);
+	}
+
+	if (!HistoryRecords.empty())
+		memcpy(Buffer.data() + Header.HistoriesOffset, HistoryRecords.data(), HistoryRecords.size() * sizeof(HistoryRecord));
+}
+
+void ProjectFile::Split(const vector<uint8>& Buffer, vector<vector<uint8>>& Images)
+{
+	const FileHeader* Header = (const FileHeader*)Buffer.data();
+	const HistoryRecord* HistoryRecords = (const HistoryRecord*)(Buffer.data() + Header->HistoriesOffset);
+
+	FileHeader ImageHeader = {};
+	ImageHeader.Magic = Magic;
+	ImageHeader.Version = Version;
+	ImageHeader.BoneCount = Header->BoneCount;
+	ImageHeader.HistoryCount = 1;
+
+	// the names are at the same offsets, only the history table shrinks
+	ImageHeader.NamesOffset = Header->NamesOffset;
+	ImageHeader.HistoriesOffset = Header->HistoriesOffset;
+	ImageHeader.StatesOffset = (Header->HistoriesOffset + sizeof(HistoryRecord) + 7) & ~7ull;
+
+	Images.resize(Header->HistoryCount);
+
+	concurrency::parallel_for((uint32)0, Header->HistoryCount, [&](uint32 Index) {
+
+		HistoryRecord Record = HistoryRecords[Index];
+		vector<uint8>& Image = Images[Index];
+
+		Image.assign((size_t)ImageHeader.StatesOffset, 0);
+		memcpy(Image.data(), &ImageHeader, sizeof(ImageHeader));
+		memcpy(Image.data() + Header->NamesOffset, Buffer.data() + Header->NamesOffset, (size_t)(Header->HistoriesOffset - Header->NamesOffset));
+
+		Image.insert(Image.end(), Buffer.begin() + (size_t)Record.StatesOffset, Buffer.begin() + (size_t)Record.EndOffset);
+
+		uint64 Base = Record.StatesOffset - ImageHeader.StatesOffset;
+		Record.StatesOffset -= Base;
+		Record.CurrentOffset -= Base;
+		Record.FutureOffset -= Base;
+		Record.EndOffset -= Base;
+
+		memcpy(Image.data() + ImageHeader.HistoriesOffset, &Record, sizeof(Record));
+	});
+}
+
+bool ProjectFile::WriteCompressed(FILE* File, const vector<uint8>& Buffer)
+{
+	CompressedHeader Header = {};
+	Header.Magic = CompressedMagic;
+	Header.BlockSize = CompressedBlockSize;
+	Header.RawSize = Buffer.size();
+	Header.BlockCount = (uint32)((Buffer.size() + CompressedBlockSize - 1) / CompressedBlockSize);
+
+	if (fwrite(&Header, sizeof(Header), 1, File) != 1)
+		return false;
+
+	// reused for every block, the compressed file is never in memory as a whole
+	vector<uint8> Block(sizeof(BlockHeader) + BlockCompressor::GetMaxCompressedSize(CompressedBlockSize));
+
+	for (size_t Offset = 0; Offset < Buffer.size(); Offset += CompressedBlockSize) {
+
+		BlockHeader* Record = (BlockHeader*)Block.data();
+		Record->RawSize = (uint32)std::min((size_t)CompressedBlockSize, Buffer.size() - Offset);
+		Record->StoredSize = (uint32)BlockCompressor::Compress(Buffer.data() + Offset, Record->RawSize, Block.data() + sizeof(BlockHeader));
+
+		if (Record->StoredSize >= Record->RawSize) {
+			Record->StoredSize = Record->RawSize;
+			memcpy(Block.data() + sizeof(BlockHeader), Buffer.data() + Offset, Record->RawSize);
+		}
+
+		size_t BlockSize = sizeof(BlockHeader) + Record->StoredSize;
+
+		if (fwrite(Block.data(), 1, BlockSize, File) != BlockSize)
+			return false;
+	}
+
+	return true;
+}
+
+bool ProjectFile::ReadCompressed(const uint8* Data, uint64 Size, vector<uint8>& Buffer)
+{
+	if (Size < sizeof(CompressedHeader))
+		return false;
+
+	const CompressedHeader* Header = (const CompressedHeader*)Data;
+
+	if (Header->Magic != CompressedMagic || Header->BlockSize == 0 ||
+		Header->RawSize / Header->BlockSize + (Header->RawSize % Header->BlockSize != 0 ? 1 : 0) != Header->BlockCount)
+		return false;
+
+	// blocks are located first so they can be decompressed independently
+	vector<uint64> Offsets;
+	uint64 Offset = sizeof(CompressedHeader), RawOffset = 0;
+
+	for (uint32 Index = 0; Index < Header->BlockCount; Index++) {
+
+		if (!IsRangeInside(Offset, 1, sizeof(BlockHeader), Size))
+			return false;
+
+		const BlockHeader* Block = (const BlockHeader*)(Data + Offset);
+
+		uint32 RawSize = (uint32)std::min((uint64)Header->BlockSize, Header->RawSize - RawOffset);
+
+		if (Block->RawSize != RawSize || Block->StoredSize > Block->RawSize || !IsRangeInside(Offset + sizeof(BlockHeader), Block->StoredSize, 1, Size))
+			return false;
+
+		Offsets.push_back(Offset);
+
+		Offset += sizeof(BlockHeader) + Block->StoredSize;
+		RawOffset += RawSize;
+	}
+
+	Buffer.resize((size_t)Header->RawSize);
+
+	vector<uint8> IsBlockValid(Offsets.size(), 0);
+
+	concurrency::parallel_for(size_t(0), Offsets.size(), [&](size_t Index) {
+
+		const BlockHeader* Block = (const BlockHeader*)(Data + Offsets[Index]);
+		const uint8* Source = Data + Offsets[Index] + sizeof(BlockHeader);
+		uint8* Destination = Buffer.data() + (size_t)Index * Header->BlockSize;
+
+		if (Block->StoredSize == Block->RawSize) {
+			memcpy(Destination, Source, Block->RawSize);
+			IsBlockValid[Index] = 1;
+		}
+		else
+			IsBlockValid[Index] = BlockCompressor::Decompress(Source, Block->StoredSize, Destination, Block->RawSize);
+	});
+
+	return find(IsBlockValid.begin(), IsBlockValid.end(), 0) == IsBlockValid.end();
+}
+
+bool ProjectFile::SaveBuffer(const vector<uint8>& Buffer, const wstring FileName, bool IsCompressed)
+{
+	FILE* File = _wfopen(FileName.c_str(), L"wb");
+	if (File == nullptr)
+		return false;
+
+	bool Result = IsCompressed ? WriteCompressed(File, Buffer) : fwrite(Buffer.data(), 1, Buffer.size(), File) == Buffer.size();
+	fclose(File);
+
+	return Result;
+}
+
+bool ProjectFile::Load(const wstring FileName, vector<SerializedStateHistory>& Histories, SerializeSerializedState& State, uint32* Checksum, bool* IsOutdated)
+{
+	// the file stays mapped after loading, saving still has to be able to rename it
+	HANDLE File = CreateFileW(FileName.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (File == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER FileSize;
+	if (!GetFileSizeEx(File, &FileSize) || FileSize.QuadPart < (LONGLONG)sizeof(CompressedHeader)) {
+		CloseHandle(File);
+		return false;
+	}
+
+	HANDLE Mapping = CreateFileMappingW(File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(File);
+
+	if (Mapping == nullptr)
+		return false;
+
+	const uint8* Base = (const uint8*)MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(Mapping);
+
+	if (Base == nullptr)
+		return false;
+
+	// the undo stacks are decoded from it when they are first needed, the view is unmapped with the last of them
+	shared_ptr<LoadedImage> Image = make_shared<LoadedImage>();
+	Image->FileName = FileName;
+	Image->Data = Base;
+	Image->Size = (uint64)FileSize.QuadPart;
+	Image->View = Base;
+	InitializeSRWLock(&Image->Lock);
+
+	bool IsValid = true;
+
+	if (((const CompressedHeader*)Base)->Magic == CompressedMagic) {
+
+		IsValid = ReadCompressed(Base, Image->Size, Image->Buffer);
+
+		// only the decompressed buffer is kept
+		UnmapViewOfFile(Image->View);
+		Image->View = nullptr;
+
+		Image->Data = Image->Buffer.data();
+		Image->Size = Image->Buffer.size();
+	}
+
+	IsValid = IsValid && ReadImage(Image->Data, Image->Size, Image, Histories, State);
+
+	const FileHeader* Header = (const FileHeader*)Image->Data;
+	uint64 Size = Image->Size;
+
+	// older versions don't keep it, the journal of one refers to the checksum of the whole file
+	if (IsValid && Checksum != nullptr)
+		*Checksum = Header->Version == Version ? Header->Checksum : GetChecksum(Image->Data, Size);
+
+	bool IsNewer = Size >= offsetof(FileHeader, Checksum) && Header->Magic == Magic && Header->Version > Version;
+
+	if (IsValid && IsOutdated != nullptr)
+		*IsOutdated = Header->Version != Version;
+
+	if (IsNewer)
+		printf("%ls was saved by a newer version (%u) of the editor\n", FileName.c_str(), Header->Version);
+	else
+	if (!IsValid)
+		printf("%ls is not a valid project file\n", FileName.c_str());
+
+	if (Image->View != nullptr) {
+
+		AcquireSRWLockExclusive(&LoadedImagesLock);
+
+		LoadedImages.erase(remove_if(LoadedImages.begin(), LoadedImages.end(), [](const weak_ptr<LoadedImage>& Entry) { return Entry.expired(); }), LoadedImages.end());
+		LoadedImages.push_back(Image);
+
+		ReleaseSRWLockExclusive(&LoadedImagesLock);
+	}
+
+	return IsValid;
+}
+
+void ProjectFile::Unmap(const wstring FileName)
+{
+	AcquireSRWLockExclusive(&LoadedImagesLock);
+
+	for (weak_ptr<LoadedImage>& Entry : LoadedImages) {
+
+		shared_ptr<LoadedImage> Image = Entry.lock();
+		if (Image == nullptr || _wcsicmp(Image->FileName.c_str(), FileName.c_str()) != 0)
+			continue;
+
+		AcquireSRWLockExclusive(&Image->Lock);
+
+		// the offsets the stacks keep stay valid in the copy
+		Image->Buffer.assign(Image->View, Image->View + Image->Size);
+
+		UnmapViewOfFile(Image->View);
+		Image->View = nullptr;
+		Image->Data = Image->Buffer.data();
+
+		ReleaseSRWLockExclusive(&Image->Lock);
+
+		Entry.reset();
+	}
+
+	ReleaseSRWLockExclusive(&LoadedImagesLock);
+}
+
+ProjectFile::LoadedImage::~LoadedImage(void)
+{
+	if (View != nullptr)
+		UnmapViewOfFile(View);
+}
+
+bool ProjectFile::ReadStack(const uint8* Data, uint64 Size, vector<wstring>& Names, uint32 Count, uint64& Offset, SerializedStateStack& Stack)
+{
+	SingleSerializedState Previous;
+
+	for (uint32 Index = 0; Index < Count; Index++) {
+
+		SingleSerializedState Frame;
+		if (!ReadState(Frame, Index != 0 ? &Previous : nullptr, Names, Data, Size, Offset))
+			return false;
+
+		Previous.CharState.Bones = Frame.CharState.Bones;
+		Previous.PoseState.Contexts = Frame.PoseState.Contexts;
+
+		Stack.Push(std::move(Frame));
+	}
+
+	return true;
+}
+
+bool ProjectFile::Read(const uint8* Data, uint64 Size, vector<SerializedStateHistory>& Histories, SerializeSerializedState& State)
+{
+	return ReadImage(Data, Size, nullptr, Histories, State);
+}
+
+bool ProjectFile::ReadImage(const uint8* Base, uint64 Size, shared_ptr<LoadedImage> Image, vector<SerializedStateHistory>& Histories, SerializeSerializedState& State)
+{
+	// a version 3 header ends before the checksum
+	if (Size < offsetof(FileHeader, Checksum))
+		return false;
+
+	const FileHeader* Header = (const FileHeader*)Base;
+
+	if (Header->Magic == Magic && Header->Version == Version1)
+		return ReadVersion1(Base, Size, Histories, State);
+	else
+	if (Header->Magic == Magic && Header->Version == Version2)
+		return ReadVersion2(Base, Size, Histories, State);
+
+	bool IsValid = Header->Magic == Magic && (Header->Version == Version ? Size >= sizeof(FileHeader) : Header->Version == Version3) &&
+		IsRangeInside(Header->HistoriesOffset, Header->HistoryCount, sizeof(HistoryRecord), Size) &&
+		Header->StatesOffset <= Size;
+
+	shared_ptr<vector<wstring>> Names = make_shared<vector<wstring>>();
+
+	IsValid = IsValid && ReadNames(Base, Size, Header->NamesOffset, Header->BoneCount, *Names);
+
+	if (IsValid) {
+
+		const HistoryRecord* HistoryRecords = (const HistoryRecord*)(Base + Header->HistoriesOffset);
+
+		// the records of a stack end where the next part of its history begins
+		auto ReadStackRange = [&Names, Base, &Image](uint32 Count, uint64 Begin, uint64 End, SerializedStateStack& Stack) {
+
+			if (Image == nullptr) {
+				uint64 Offset = Begin;
+				return ReadStack(Base, End, *Names, Count, Offset, Stack) && Offset == End;
+			}
+
+			Stack.SetPending(Count, [Image, Names, Count, Begin, End](SerializedStateStack& Loaded) {
+
+				uint64 Offset = Begin;
+
+				AcquireSRWLockShared(&Image->Lock);
+				bool IsStackValid = ReadStack(Image->Data, End, *Names, Count, Offset, Loaded) && Offset == End;
+				ReleaseSRWLockShared(&Image->Lock);
+
+				if (!IsStackValid) {
+
+					printf("Some undo states of the project file are damaged\n");
+
+					// the stack keeps its size, undoing into a damaged state changes nothing
+					while (Loaded.Size() < Count)
+						Loaded.Push(SingleSerializedState());
+				}
+			});
+
+			return true;
+		};
+
+		Histories.clear();
+		Histories.resize(Header->HistoryCount);
+
+		vector<uint8> IsHistoryValid(Header->HistoryCount, 0);
+
+		// every history has its own range of the file, they are decoded in parallel
+		concurrency::parallel_for((uint32)0, Header->HistoryCount, [&](uint32 Index) {
+
+			const HistoryRecord& Record = HistoryRecords[Index];
+
+			SerializedStateHistory& History = Histories[Index];
+			History.IsDeleted = Record.IsDeleted != 0;
+
+			uint64 Offset = Record.CurrentOffset;
+
+			IsHistoryValid[Index] = Header->StatesOffset <= Record.StatesOffset && Record.StatesOffset <= Record.CurrentOffset &&
+				Record.CurrentOffset <= Record.FutureOffset && Record.FutureOffset <= Record.EndOffset && Record.EndOffset <= Size &&
+				ReadState(History.CurrentState, nullptr, *Names, Base, Record.FutureOffset, Offset) && Offset == Record.FutureOffset &&
+				ReadStackRange(Record.PreviousCount, Record.StatesOffset, Record.CurrentOffset, History.PreviousStates) &&
+				ReadStackRange(Record.FutureCount, Record.FutureOffset, Record.EndOffset, History.FutureStates);
+		});
+
+		IsValid = find(IsHistoryValid.begin(), IsHistoryValid.end(), 0) == IsHistoryValid.end();
+
+		State = {};
+		State.AnimationPosition = Header->AnimationPosition;
+		State.AnimationLength = Header->AnimationLength;
+		State.PlaySpeed = Header->PlaySpeed;
+		State.KinematicModeFlag = Header->KinematicModeFlag != 0;
+		State.PlayAnimaionFlag = Header->PlayAnimaionFlag != 0;
+		State.LoopAnimationFlag = Header->LoopAnimationFlag != 0;
+	}
+
+	if (!IsValid)
+		Histories.clear();
+
+	return IsValid;
+}
+
+bool ProjectFile::ReadNames(const uint8* Base, uint64 Size, uint64 NamesOffset, uint32 BoneCount, vector<wstring>& Names)
+{
+	if (!IsRangeInside(NamesOffset, BoneCount, sizeof(NameRecord), Size))
+		return false;
+
+	const NameRecord* NameRecords = (const NameRecord*)(Base + NamesOffset);
+
+	for (uint32 Index = 0; Index < BoneCount; Index++) {
+
+		const NameRecord& Name = NameRecords[Index];
+
+		if (!IsRangeInside(Name.Offset, Name.Length, sizeof(uint16), Size))
+			return false;
+
+		Names.push_back(wstring((const wchar_t*)(Base + Name.Offset), Name.Length));
+	}
+
+	return true;
+}
+
+// Older versions
+
+void ProjectFile::ReadVersion1State(SingleSerializedState& State, vector<wstring>& Names, const uint8* Record)
+{
+	uint32 BoneCount = (uint32)Names.size();
+
+	const Version1StateRecord* S = (const Version1StateRecord*)Record;
+	const BoneRecord* Bones = (const BoneRecord*)(Record + sizeof(Version1StateRecord));
+	const ContextRecord* Contexts = (const ContextRecord*)(Record + sizeof(Version1StateRecord) + BoneCount * sizeof(BoneRecord));
+
+	State = {};
+
+	State.PendingID = (SerializationPendingID)S->PendingID;
+	State.HaveCharState = S->HaveCharState != 0;
+	State.HaveInputState = S->HaveInputState != 0;
+	State.HavePoseState = S->HavePoseState != 0;
+	State.HaveRenderState = S->HaveRenderState != 0;
+
+	if (State.HaveCharState) {
+
+		CharacterSerializedState& CharState = State.CharState;
+
+		CharState.AnimationTimestamp = S->AnimationTimestamp;
+		CharState.Position = vec3(S->Position[0], S->Position[1], S->Position[2]);
+
+		CharState.Bones.reserve(BoneCount);
+
+		for (uint32 Index = 0; Index < BoneCount; Index++) {
+
+			const BoneRecord& B = Bones[Index];
+			if (B.Rotation[0] == 0 && B.Rotation[1] == 0 && B.Rotation[2] == 0 && B.Rotation[3] == 0)
+				continue;
+
+			SerializedBone Bone;
+			Bone.Name = Names[Index];
+			Bone.Rotation.x = B.Rotation[0];
+			Bone.Rotation.y = B.Rotation[1];
+			Bone.Rotation.z = B.Rotation[2];
+			Bone.Rotation.w = B.Rotation[3];
+
+			CharState.Bones.push_back(Bone);
+		}
+	}
+
+	if (State.HaveInputState) {
+
+		InputSerializedState& InputState = State.InputState;
+
+		InputState.State = S->InputState;
+		InputState.PlaneMode = S->PlaneMode;
+		if (S->InputBone >= 0 && (uint32)S->InputBone < BoneCount)
+			InputState.BoneName = Names[S->InputBone];
+		InputState.LocalPoint = vec3(S->LocalPoint[0], S->LocalPoint[1], S->LocalPoint[2]);
+		InputState.WorldPoint = vec3(S->WorldPoint[0], S->WorldPoint[1], S->WorldPoint[2]);
+	}
+
+	if (State.HavePoseState) {
+
+		State.PoseState.Contexts.reserve(BoneCount);
+
+		for (uint32 Index = 0; Index < BoneCount; Index++) {
+
+			const ContextRecord& C = Contexts[Index];
+			if ((C.Flags & ContextPresent) == 0)
+				continue;
+
+			SerializedPoseContext Context;
+			Context.BoneName = Names[Index];
+			ReadContext(C, Context);
+
+			State.PoseState.Contexts.push_back(Context);
+		}
+	}
+
+	if (State.HaveRenderState) {
+
+		RenderSerializedState& RenderState = State.RenderState;
+
+		RenderState.CameraPosition = vec3(S->CameraPosition[0], S->CameraPosition[1], S->CameraPosition[2]);
+		RenderState.CameraAngleX = S->CameraAngleX;
+		RenderState.CameraAngleZ = S->CameraAngleZ;
+	}
+}
+
+bool ProjectFile::ReadVersion1(const uint8* Base, uint64 Size, vector<SerializedStateHistory>& Histories, SerializeSerializedState& State)
+{
+	if (Size < sizeof(Version1Header))
+		return false;
+
+	const Version1Header* Header = (const Version1Header*)Base;
+
+	uint64 StateSize = sizeof(Version1StateRecord) + (uint64)Header->BoneCount * (sizeof(BoneRecord) + sizeof(ContextRecord));
+
+	vector<wstring> Names;
+
+	bool IsValid = Header->StateSize == StateSize &&
+		IsRangeInside(Header->HistoriesOffset, Header->HistoryCount, sizeof(Version1HistoryRecord), Size) &&
+		IsRangeInside(Header->StatesOffset, Header->StateCount, StateSize, Size) &&
+		ReadNames(Base, Size, Header->NamesOffset, Header->BoneCount, Names);
+
+	if (!IsValid)
+		return false;
+
+	const Version1HistoryRecord* HistoryRecords = (const Version1HistoryRecord*)(Base + Header->HistoriesOffset);
+	const uint8* States = Base + Header->StatesOffset;
+
+	Histories.clear();
+	Histories.resize(Header->HistoryCount);
+
+	for (uint32 Index = 0; Index < Header->HistoryCount; Index++) {
+
+		const Version1HistoryRecord& Record = HistoryRecords[Index];
+
+		if ((uint64)Record.FirstState + Record.PreviousCount + 1 + Record.FutureCount > Header->StateCount) {
+			Histories.clear();
+			return false;
+		}
+
+		SerializedStateHistory& History = Histories[Index];
+		History.IsDeleted = Record.IsDeleted != 0;
+
+		uint64 StateIndex = Record.FirstState;
+
+		for (uint32 Frame = 0; Frame < Record.PreviousCount; Frame++) {
+
+			SingleSerializedState PreviousState;
+			ReadVersion1State(PreviousState, Names, States + StateIndex++ * StateSize);
+
+			History.PreviousStates.Push(std::move(PreviousState));
+		}
+
+		ReadVersion1State(History.CurrentState, Names, States + StateIndex++ * StateSize);
+
+		for (uint32 Frame = 0; Frame < Record.FutureCount; Frame++) {
+
+			SingleSerializedState FutureState;
+			ReadVersion1State(FutureState, Names, States + StateIndex++ * StateSize);
+
+			History.FutureStates.Push(std::move(FutureState));
+		}
+	}
+
+	State = {};
+	State.AnimationPosition = Header->AnimationPosition;
+	State.AnimationLength = Header->AnimationLength;
+	State.PlaySpeed = Header->PlaySpeed;
+	State.KinematicModeFlag = Header->KinematicModeFlag != 0;
+	State.PlayAnimaionFlag = Header->PlayAnimaionFlag != 0;
+	State.LoopAnimationFlag = Header->LoopAnimationFlag != 0;
+
+	return true;
+}
+
+bool ProjectFile::ReadVersion2(const uint8* Base, uint64 Size, vector<SerializedStateHistory>& Histories, SerializeSerializedState& State)
+{
+	const FileHeader* Header = (const FileHeader*)Base;
+
+	vector<wstring> Names;
+
+	bool IsValid = IsRangeInside(Header->HistoriesOffset, Header->HistoryCount, sizeof(Version2HistoryRecord), Size) &&
+		Header->StatesOffset <= Size &&
+		ReadNames(Base, Size, Header->NamesOffset, Header->BoneCount, Names);
+
+	if (!IsValid)
+		return false;
+
+	const Version2HistoryRecord* HistoryRecords = (const Version2HistoryRecord*)(Base + Header->HistoriesOffset);
+
+	Histories.clear();
+	Histories.resize(Header->HistoryCount);
+
+	vector<uint8> IsHistoryValid(Header->HistoryCount, 0);
+
+	// the stacks and the current state follow each other, a history ends where its records do
+	concurrency::parallel_for((uint32)0, Header->HistoryCount, [&](uint32 Index) {
+
+		const Version2HistoryRecord& Record = HistoryRecords[Index];
+
+		SerializedStateHistory& History = Histories[Index];
+		History.IsDeleted = Record.IsDeleted != 0;
+
+		uint64 Offset = Record.StatesOffset;
+
+		IsHistoryValid[Index] = Header->StatesOffset <= Record.StatesOffset &&
+			ReadStack(Base, Size, Names, Record.PreviousCount, Offset, History.PreviousStates) &&
+			ReadState(History.CurrentState, nullptr, Names, Base, Size, Offset) &&
+			ReadStack(Base, Size, Names, Record.FutureCount, Offset, History.FutureStates);
+	});
+
+	if (find(IsHistoryValid.begin(), IsHistoryValid.end(), 0) != IsHistoryValid.end()) {
+		Histories.clear();
+		return false;
+	}
+
+	State = {};
+	State.AnimationPosition = Header->AnimationPosition;
+	State.AnimationLength = Header->AnimationLength;
+	State.PlaySpeed = Header->PlaySpeed;
+	State.KinematicModeFlag = Header->KinematicModeFlag != 0;
+	State.PlayAnimaionFlag = Header->PlayAnimaionFlag != 0;
+	State.LoopAnimationFlag = Header->LoopAnimationFlag != 0;
+
+	return true;
+}
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "SerializationManager.hpp"
+
+using namespace std;
+
+// Versioned binary container of a project, the default format; XML stays as import and export.
+// Layout, little endian, offsets from the start of the file:
+//   FileHeader
+//   NameRecord[BoneCount] followed by the UTF-16 bone names they point to
+//   HistoryRecord[HistoryCount]
+//   state records: a keyframe is a StateRecord, BoneRecord[BoneCount] and ContextRecord[BoneCount],
+//   any other state a StateRecord with BoneChangeRecords and ContextChangeRecords for what changed
+//   since the state before it
+// Bones of every state are stored by their index in the name table. A history owns consecutive
+// state records from its StatesOffset: its previous states, the current one, then its future
+// states; the current state and the first of each stack are keyframes. Loading decodes the
+// current states only; an uncompressed file stays mapped, and a compressed one decompressed in
+// memory, until every undo stack is first used. A file that is about to be replaced is copied out
+// of its view first, see Unmap. The checksum the journal refers to the file by is
+// kept in the header, so loading only touches the pages it decodes.
+// A compressed file is a CompressedHeader and BlockCount blocks, each a BlockHeader and up to
+// BlockSize bytes of the layout above compressed by BlockCompressor, or stored when that doesn't
+// shrink them. Blocks don't depend on each other and are decompressed in parallel.
+// Files of older versions are still read and saved in the current version.
+typedef class ProjectFile {
+private:
+	static const uint32 Magic = 0x31504541; // "AEP1"
+	static const uint32 Version = 4;
+
+	// fixed-size keyframes only, StateCount records of StateSize bytes from StatesOffset
+	static const uint32 Version1 = 1;
+	// same records as the current version, but a history only knows where its records begin
+	static const uint32 Version2 = 2;
+	// the current layout without the checksum in the header, it's taken over the whole file instead
+	static const uint32 Version3 = 3;
+
+	static const uint32 CompressedMagic = 0x315A4541; // "AEZ1"
+	static const uint32 CompressedBlockSize = 1024 * 1024;
+
+#pragma pack(push, 1)
+	typedef struct FileHeader {
+		uint32 Magic, Version;
+		uint32 BoneCount, HistoryCount;
+		uint64 NamesOffset, HistoriesOffset, StatesOffset;
+
+		float AnimationPosition, AnimationLength, PlaySpeed;
+		uint8 KinematicModeFlag, PlayAnimaionFlag, LoopAnimationFlag, Padding;
+
+		// of the whole file while this is zero, set by SetChecksum before the file is saved
+		uint32 Checksum;
+	} FileHeader;
+
+	typedef struct NameRecord {
+		uint64 Offset;
+		uint32 Length;
+	} NameRecord;
+
+	typedef struct HistoryRecord {
+		// the previous states, the current one, the future states and the end of the last
+		uint64 StatesOffset, CurrentOffset, FutureOffset, EndOffset;
+		uint32 PreviousCount, FutureCount;
+		uint8 IsDeleted, Padding[7];
+	} HistoryRecord;
+
+	typedef struct StateRecord {
+		uint8 IsKeyframe, Padding[3];
+		// 0 for a keyframe
+		uint32 ChangedBoneCount, ChangedContextCount;
+
+		uint32 PendingID;
+		uint8 HaveCharState, HaveInputState, HavePoseState, HaveRenderState;
+
+		uint32 AnimationTimestamp;
+		float Position[3];
+
+		uint32 InputState, PlaneMode;
+		// index into the name table, -1 without a bone
+		int32 InputBone;
+		float LocalPoint[3], WorldPoint[3];
+
+		float CameraPosition[3], CameraAngleX, CameraAngleZ;
+	} StateRecord;
+
+	typedef struct BoneRecord {
+		// x, y, z, w; all zero when the state has no such bone
+		float Rotation[4];
+	} BoneRecord;
+
+	typedef enum ContextFlags {
+		ContextPresent = 1 << 0,
+		ContextXAxis = 1 << 1,
+		ContextYAxis = 1 << 2,
+		ContextZAxis = 1 << 3,
+		ContextXPos = 1 << 4,
+		ContextYPos = 1 << 5,
+		ContextZPos = 1 << 6,
+		ContextActive = 1 << 7
+	} ContextFlags;
+
+	typedef struct ContextRecord {
+		uint8 Flags, Padding[3];
+		float SrcLocalPoint[3], DestWorldPoint[3];
+	} ContextRecord;
+
+	// Name is an index into the name table
+	typedef struct BoneChangeRecord {
+		uint32 Name;
+		BoneRecord Bone;
+	} BoneChangeRecord;
+
+	typedef struct ContextChangeRecord {
+		uint32 Name;
+		ContextRecord Context;
+	} ContextChangeRecord;
+
+	typedef struct CompressedHeader {
+		uint32 Magic, BlockSize;
+		uint64 RawSize;
+		uint32 BlockCount;
+	} CompressedHeader;
+
+	typedef struct BlockHeader {
+		// StoredSize equals RawSize for a stored block
+		uint32 RawSize, StoredSize;
+	} BlockHeader;
+
+	typedef struct Version1Header {
+		uint32 Magic, Version;
+		uint32 BoneCount, HistoryCount, StateCount, StateSize;
+		uint64 NamesOffset, HistoriesOffset, StatesOffset;
+
+		float AnimationPosition, AnimationLength, PlaySpeed;
+		uint8 KinematicModeFlag, PlayAnimaionFlag, LoopAnimationFlag, Padding;
+	} Version1Header;
+
+	typedef struct Version1HistoryRecord {
+		// index of the first state record
+		uint32 FirstState, PreviousCount, FutureCount;
+		uint8 IsDeleted, Padding[3];
+	} Version1HistoryRecord;
+
+	// followed by BoneRecord[BoneCount] and ContextRecord[BoneCount]
+	typedef struct Version1StateRecord {
+		uint32 PendingID;
+		uint8 HaveCharState, HaveInputState, HavePoseState, HaveRenderState;
+
+		uint32 AnimationTimestamp;
+		float Position[3];
+
+		uint32 InputState, PlaneMode;
+		int32 InputBone;
+		float LocalPoint[3], WorldPoint[3];
+
+		float CameraPosition[3], CameraAngleX, CameraAngleZ;
+	} Version1StateRecord;
+
+	typedef struct Version2HistoryRecord {
+		uint64 StatesOffset;
+		uint32 PreviousCount, FutureCount;
+		uint8 IsDeleted, Padding[3];
+	} Version2HistoryRecord;
+#pragma pack(pop)
+
+	static uint32 GetKeyframeSize(uint32 BoneCount);
+	// Count records of RecordSize from Offset end within Size; offsets and counts come from the file,
+	// so the offset is checked before anything is added to it
+	static bool IsRangeInside(uint64 Offset, uint64 Count, uint64 RecordSize, uint64 Size);
+
+	static void WriteRotation(const quat& Rotation, BoneRecord& Record);
+	static void WriteContext(const SerializedPoseContext& Context, ContextRecord& Record);
+	static void ReadContext(const ContextRecord& Record, SerializedPoseContext& Context);
+
+	// appends the record of State, a keyframe unless Base is given and has the same bones; returns whether it's a keyframe
+	static bool WriteState(const SingleSerializedState& State, const SingleSerializedState* Base, const unordered_map<wstring, int32>& NameIndices, uint32 BoneCount, vector<uint8>& Buffer);
+	// reads the record at Offset and moves past it, Base is the state before it in the same stack
+	static bool ReadState(SingleSerializedState& State, const SingleSerializedState* Base, vector<wstring>& Names, const uint8* Data, uint64 Size, uint64& Offset);
+	static bool ReadStack(const uint8* Data, uint64 Size, vector<wstring>& Names, uint32 Count, uint64& Offset, SerializedStateStack& Stack);
+	static bool ReadNames(const uint8* Base, uint64 Size, uint64 NamesOffset, uint32 BoneCount, vector<wstring>& Names);
+
+	static void ReadVersion1State(SingleSerializedState& State, vector<wstring>& Names, const uint8* Record);
+	static bool ReadVersion1(const uint8* Base, uint64 Size, vector<SerializedStateHistory>& Histories, SerializeSerializedState& State);
+	static bool ReadVersion2(const uint8* Base, uint64 Size, vector<SerializedStateHistory>& Histories, SerializeSerializedState& State);
+
+	// a loaded file the pending undo stacks decode from, freed with the last of them
+	typedef struct LoadedImage {
+		wstring FileName;
+
+		const uint8* Data;
+		uint64 Size;
+
+		// the mapped file, null once it's copied into Buffer or for a compressed file decompressed there
+		const uint8* View;
+		vector<uint8> Buffer;
+
+		// stacks decode under it shared, Unmap takes it exclusively to move Data
+		SRWLOCK Lock;
+
+		~LoadedImage(void);
+	} LoadedImage;
+
+	// images that may still be mapped, expired ones are dropped when another is added
+	static SRWLOCK LoadedImagesLock;
+	static vector<weak_ptr<LoadedImage>> LoadedImages;
+
+	// with Image the undo stacks are left pending on it, Base being its contents
+	static bool ReadImage(const uint8* Base, uint64 Size, shared_ptr<LoadedImage> Image, vector<SerializedStateHistory>& Histories, SerializeSerializedState& State);
+
+	// compresses one block at a time into the file
+	static bool WriteCompressed(FILE* File, const vector<uint8>& Buffer);
+	static bool ReadCompressed(const uint8* Data, uint64 Size, vector<uint8>& Buffer);
+public:
+	static const wchar_t* Extension;
+
+	// checks the header only, anything else is taken for XML; compressed files are project files too
+	static bool IsProjectFile(const wstring FileName);
+
+	static uint32 GetChecksum(const uint8* Data, uint64 Size);
+	// stores the checksum of a container written by Write in its header and returns it
+	static uint32 SetChecksum(vector<uint8>& Buffer);
+
+	// the whole container in memory, also used for the records of the journal; Read decodes everything
+	static void Write(vector<SerializedStateHistory>& Histories, SerializeSerializedState& State, vector<uint8>& Buffer);
+	static bool Read(const uint8* Data, uint64 Size, vector<SerializedStateHistory>& Histories, SerializeSerializedState& State);
+	// a container of each history of one written by Write, without the project state; the states are
+	// copied as they are, so the containers keep its whole name table
+	static void Split(const vector<uint8>& Buffer, vector<vector<uint8>>& Images);
+
+	// a container already written by Write
+	static bool SaveBuffer(const vector<uint8>& Buffer, const wstring FileName, bool IsCompressed);
+	// Checksum, when given, receives the one the journal refers to the file by;
+	// IsOutdated, when given, is set for files of an older version, they should be saved again
+	static bool Load(const wstring FileName, vector<SerializedStateHistory>& Histories, SerializeSerializedState& State, uint32* Checksum = nullptr, bool* IsOutdated = nullptr);
+	// copies what's left mapped of FileName into memory, a mapped file can't be replaced by a rename
+	// once it has been renamed itself
+	static void Unmap(const wstring FileName);
+} ProjectFile;
@@ -0,0 +1,233 @@
+#include "ProjectJournal.hpp"
+
+#include <string.h>
+
+#include <unordered_map>
+
+#include "ProjectFile.hpp"
+
+const wchar_t* ProjectJournal::Extension = L".aej";
+
+bool ProjectJournal::Start(const wstring FileName, uint32 SnapshotChecksum, vector<int32>& IDs)
+{
+	JournalHeader Header = {};
+	Header.Magic = Magic;
+	Header.Version = Version;
+	Header.SnapshotChecksum = SnapshotChecksum;
+	Header.HistoryCount = (uint32)IDs.size();
+
+	FILE* File = _wfopen(FileName.c_str(), L"wb");
+	if (File == nullptr)
+		return false;
+
+	bool Result = fwrite(&Header, sizeof(Header), 1, File) == 1;
+	if (Result && !IDs.empty())
+		Result = fwrite(IDs.data(), sizeof(int32), IDs.size(), File) == IDs.size();
+
+	fclose(File);
+
+	return Result;
+}
+
+void ProjectJournal::WriteCommit(vector<SerializedStateHistory>& Histories, vector<int32>& Order, SerializeSerializedState& State, vector<uint8>& Commits)
+{
+	vector<uint8> Image;
+	ProjectFile::Write(Histories, State, Image);
+
+	size_t DeltasOffset = sizeof(CommitHeader) + sizeof(CommitRecord);
+	size_t OrderOffset = DeltasOffset + Histories.size() * sizeof(HistoryDelta);
+	size_t ImageOffset = OrderOffset + Order.size() * sizeof(int32);
+
+	size_t CommitOffset = Commits.size();
+	Commits.resize(CommitOffset + ImageOffset + Image.size());
+
+	uint8* Buffer = Commits.data() + CommitOffset;
+	size_t BufferSize = Commits.size() - CommitOffset;
+
+	CommitRecord* Record = (CommitRecord*)(Buffer + sizeof(CommitHeader));
+	Record->HistoryCount = (uint32)Histories.size();
+	Record->OrderCount = (uint32)Order.size();
+
+	HistoryDelta* Deltas = (HistoryDelta*)(Buffer + DeltasOffset);
+
+	for (size_t Index = 0; Index < Histories.size(); Index++) {
+
+		HistoryJournalState& Journal = Histories[Index].Journal;
+
+		Deltas[Index].ID = Histories[Index].ID;
+		Deltas[Index].PreviousDropped = Journal.Previous.Dropped;
+		Deltas[Index].PreviousKept = Journal.Previous.Kept;
+		Deltas[Index].FutureDropped = Journal.Future.Dropped;
+		Deltas[Index].FutureKept = Journal.Future.Kept;
+	}
+
+	if (!Order.empty())
+		memcpy(Buffer + OrderOffset, Order.data(), Order.size() * sizeof(int32));
+
+	memcpy(Buffer + ImageOffset, Image.data(), Image.size());
+
+	CommitHeader* Header = (CommitHeader*)Buffer;
+	Header->Size = (uint32)(BufferSize - sizeof(CommitHeader));
+	Header->Checksum = ProjectFile::GetChecksum(Buffer + sizeof(CommitHeader), Header->Size);
+}
+
+bool ProjectJournal::Append(const wstring FileName, const vector<uint8>& Commits)
+{
+	FILE* File = _wfopen(FileName.c_str(), L"ab");
+	if (File == nullptr)
+		return false;
+
+	bool Result = fwrite(Commits.data(), 1, Commits.size(), File) == Commits.size();
+	fclose(File);
+
+	return Result;
+}
+
+bool ProjectJournal::CanApplyFrames(SerializedStateStack& Frames, uint32 Dropped, uint32 Kept)
+{
+	return (uint64)Dropped + Kept <= Frames.Size();
+}
+
+void ProjectJournal::ApplyFrames(SerializedStateStack& Frames, uint32 Dropped, uint32 Kept, SerializedStateStack& NewFrames)
+{
+	Frames.Truncate(Dropped + Kept);
+	Frames.RemoveFront(Dropped);
+	Frames.Append(NewFrames);
+}
+
+uint32 ProjectJournal::Replay(const wstring FileName, uint32 SnapshotChecksum, vector<SerializedStateHistory>& Histories, SerializeSerializedState& State)
+{
+	FILE* File = _wfopen(FileName.c_str(), L"rb");
+	if (File == nullptr)
+		return 0;
+
+	vector<uint8> Data;
+
+	const size_t ChunkSize = 64 * 1024;
+
+	while (true) {
+
+		size_t Size = Data.size();
+		Data.resize(Size + ChunkSize);
+
+		size_t Count = fread(Data.data() + Size, 1, ChunkSize, File);
+		Data.resize(Size + Count);
+
+		if (Count < ChunkSize)
+			break;
+	}
+
+	fclose(File);
+
+	if (Data.size() < sizeof(JournalHeader))
+		return 0;
+
+	JournalHeader* Header = (JournalHeader*)Data.data();
+
+	// a journal left from an older project file doesn't apply
+	if (Header->Magic != Magic || Header->Version != Version || Header->SnapshotChecksum != SnapshotChecksum ||
+		Header->HistoryCount != Histories.size() || sizeof(JournalHeader) + (uint64)Header->HistoryCount * sizeof(int32) > Data.size())
+		return 0;
+
+	const int32* IDs = (const int32*)(Data.data() + sizeof(JournalHeader));
+
+	unordered_map<int32, SerializedStateHistory> HistoriesByID;
+	vector<int32> Order(IDs, IDs + Header->HistoryCount);
+
+	for (size_t Index = 0; Index < Histories.size(); Index++)
+		HistoriesByID[IDs[Index]] = std::move(Histories[Index]);
+
+	uint64 Offset = sizeof(JournalHeader) + (uint64)Header->HistoryCount * sizeof(int32);
+	uint32 CommitCount = 0;
+
+	while (Offset + sizeof(CommitHeader) + sizeof(CommitRecord) <= Data.size()) {
+
+		CommitHeader* Commit = (CommitHeader*)(Data.data() + Offset);
+
+		const uint8* Payload = Data.data() + Offset + sizeof(CommitHeader);
+
+		if (Offset + sizeof(CommitHeader) + Commit->Size > Data.size() || Commit->Size < sizeof(CommitRecord) ||
+			ProjectFile::GetChecksum(Payload, Commit->Size) != Commit->Checksum)
+			break;
+
+		const CommitRecord* Record = (const CommitRecord*)Payload;
+
+		uint64 OrderOffset = sizeof(CommitRecord) + (uint64)Record->HistoryCount * sizeof(HistoryDelta);
+		uint64 ImageOffset = OrderOffset + (uint64)Record->OrderCount * sizeof(int32);
+
+		if (ImageOffset > Commit->Size)
+			break;
+
+		const HistoryDelta* Deltas = (const HistoryDelta*)(Payload + sizeof(CommitRecord));
+		const int32* CommitOrder = (const int32*)(Payload + OrderOffset);
+
+		vector<SerializedStateHistory> Changes;
+		SerializeSerializedState CommitState;
+
+		if (!ProjectFile::Read(Payload + ImageOffset, Commit->Size - ImageOffset, Changes, CommitState) || Changes.size() != Record->HistoryCount)
+			break;
+
+		// the whole commit is checked before anything is applied
+		bool IsValid = true;
+
+		for (uint32 Index = 0; Index < Record->HistoryCount && IsValid; Index++) {
+
+			const HistoryDelta& Delta = Deltas[Index];
+
+			auto History = HistoriesByID.find(Delta.ID);
+
+			if (History == HistoriesByID.end())
+				IsValid = Delta.PreviousKept == 0 && Delta.FutureKept == 0;
+			else
+				IsValid = CanApplyFrames(History->second.PreviousStates, Delta.PreviousDropped, Delta.PreviousKept) &&
+					CanApplyFrames(History->second.FutureStates, Delta.FutureDropped, Delta.FutureKept);
+		}
+
+		for (uint32 Index = 0; Index < Record->OrderCount && IsValid; Index++) {
+
+			bool IsChanged = false;
+			for (uint32 DeltaIndex = 0; DeltaIndex < Record->HistoryCount && !IsChanged; DeltaIndex++)
+				IsChanged = Deltas[DeltaIndex].ID == CommitOrder[Index];
+
+			IsValid = IsChanged || HistoriesByID.find(CommitOrder[Index]) != HistoriesByID.end();
+		}
+
+		if (!IsValid)
+			break;
+
+		for (uint32 Index = 0; Index < Record->HistoryCount; Index++) {
+
+			const HistoryDelta& Delta = Deltas[Index];
+			SerializedStateHistory& Change = Changes[Index];
+
+			SerializedStateHistory& History = HistoriesByID[Delta.ID];
+
+			ApplyFrames(History.PreviousStates, Delta.PreviousDropped, Delta.PreviousKept, Change.PreviousStates);
+			ApplyFrames(History.FutureStates, Delta.FutureDropped, Delta.FutureKept, Change.FutureStates);
+
+			History.CurrentState = std::move(Change.CurrentState);
+			History.IsDeleted = Change.IsDeleted;
+		}
+
+		Order.assign(CommitOrder, CommitOrder + Record->OrderCount);
+
+		// histories left out of the order were erased for good
+		unordered_map<int32, SerializedStateHistory> Kept;
+		for (int32 ID : Order)
+			Kept[ID] = std::move(HistoriesByID[ID]);
+
+		HistoriesByID = std::move(Kept);
+
+		State = CommitState;
+
+		Offset += sizeof(CommitHeader) + Commit->Size;
+		CommitCount++;
+	}
+
+	Histories.clear();
+
+	for (int32 ID : Order)
+		Histories.push_back(std::move(HistoriesByID[ID]));
+
+	return CommitCount;
+}
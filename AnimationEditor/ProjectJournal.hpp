@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "SerializationManager.hpp"
+
+using namespace std;
+
+// Append-only log of the autosaves made since the project file was last written in full.
+// Layout, little endian:
+//   JournalHeader, int32 IDs[HistoryCount] of the histories of the project file in its order
+//   commits: CommitHeader, then Size bytes of CommitRecord, HistoryDelta[HistoryCount],
+//   int32 Order[OrderCount] and a project file image of the changed histories holding
+//   only the undo frames added since the previous commit
+// A commit torn by a crash fails its checksum and ends the replay there.
+typedef class ProjectJournal {
+private:
+	static const uint32 Magic = 0x314A4541; // "AEJ1"
+	static const uint32 Version = 1;
+
+#pragma pack(push, 1)
+	typedef struct JournalHeader {
+		uint32 Magic, Version;
+		// of the project file the journal continues
+		uint32 SnapshotChecksum;
+		uint32 HistoryCount;
+	} JournalHeader;
+
+	typedef struct CommitHeader {
+		// Checksum covers the Size bytes that follow
+		uint32 Size, Checksum;
+	} CommitHeader;
+
+	typedef struct CommitRecord {
+		uint32 HistoryCount, OrderCount;
+	} CommitRecord;
+
+	// the journaled frames still kept by a changed history, the image holds the rest
+	typedef struct HistoryDelta {
+		int32 ID;
+		uint32 PreviousDropped, PreviousKept, FutureDropped, FutureKept;
+	} HistoryDelta;
+#pragma pack(pop)
+
+	static bool CanApplyFrames(SerializedStateStack& Frames, uint32 Dropped, uint32 Kept);
+	static void ApplyFrames(SerializedStateStack& Frames, uint32 Dropped, uint32 Kept, SerializedStateStack& NewFrames);
+public:
+	static const wchar_t* Extension;
+
+	// truncates the journal, IDs are of the histories just written to the project file, in its order
+	static bool Start(const wstring FileName, uint32 SnapshotChecksum, vector<int32>& IDs);
+
+	// adds a commit to Commits; Histories are the changed ones with only the frames past Journal.Previous.Kept
+	// and Journal.Future.Kept, Order has the IDs of all histories
+	static void WriteCommit(vector<SerializedStateHistory>& Histories, vector<int32>& Order, SerializeSerializedState& State, vector<uint8>& Commits);
+	// one write for any number of commits
+	static bool Append(const wstring FileName, const vector<uint8>& Commits);
+
+	// applies the commits to the histories loaded from the project file, returns how many there were
+	static uint32 Replay(const wstring FileName, uint32 SnapshotChecksum, vector<SerializedStateHistory>& Histories, SerializeSerializedState& State);
+} ProjectJournal;
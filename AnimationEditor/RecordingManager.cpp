@@ -0,0 +1,509 @@
+#include "RecordingManager.hpp"
+
+#include <algorithm>
+
+#include <glm/gtc/quaternion.hpp>
+
+#include <tixml2ex.h>
+
+#include "CharacterManager.hpp"
+#include "PhysicsManager.hpp"
+
+double GetPreciseTime(void);
+
+wstring s2ws(const string& str);
+string ws2s(const wstring& wstr);
+float attribute_float_value(XMLElement* Element, const char* AttributeName, float DefaultValue);
+bool attribute_bool_value(XMLElement* Element, const char* AttributeName, bool DefaultValue);
+
+void RecordingManager::StartRecording(const wstring FileName)
+{
+	RecordingFileName = FileName;
+	IsRecordingFlag = true;
+
+	Events.clear();
+
+	CharacterManager::GetInstance().Serialize(InitialCharState);
+	PoseManager::GetInstance().Serialize(InitialPoseState);
+}
+
+void RecordingManager::StopRecording(void)
+{
+	if (!IsRecordingFlag)
+		return;
+
+	IsRecordingFlag = false;
+
+	CharacterManager::GetInstance().Serialize(FinalCharState);
+
+	SaveToFile(RecordingFileName);
+
+	printf("Recorded %d events to %ls\n", (int32)Events.size(), RecordingFileName.c_str());
+}
+
+bool RecordingManager::IsRecording(void)
+{
+	return IsRecordingFlag;
+}
+
+void RecordingManager::AddEvent(RecordedEvent& Event)
+{
+	if (IsRecordingFlag)
+		Events.push_back(Event);
+}
+
+void RecordingManager::RecordTick(double dt)
+{
+	if (!IsRecordingFlag)
+		return;
+
+	RecordedEvent Event = {};
+	Event.Type = TickEvent;
+	Event.dt = dt;
+
+	AddEvent(Event);
+}
+
+void RecordingManager::RecordInverseKinematic(Bone* Bone, vec3 LocalPoint, vec3 WorldPoint)
+{
+	if (!IsRecordingFlag)
+		return;
+
+	RecordedEvent Event = {};
+	Event.Type = InverseKinematicEvent;
+	Event.BoneName = Bone != nullptr ? Bone->GetName() : L"";
+	Event.LocalPoint = LocalPoint;
+	Event.WorldPoint = WorldPoint;
+
+	AddEvent(Event);
+}
+
+void RecordingManager::RecordPositionConstraint(Bone* Bone, bool IsActive, vec3 WorldPoint)
+{
+	if (!IsRecordingFlag)
+		return;
+
+	RecordedEvent Event = {};
+	Event.Type = PositionConstraintEvent;
+	Event.BoneName = Bone->GetName();
+	Event.IsActive = IsActive;
+	Event.WorldPoint = WorldPoint;
+
+	AddEvent(Event);
+}
+
+void RecordingManager::RecordBlocking(Bone* Bone, BlockingInfo Blocking)
+{
+	if (!IsRecordingFlag)
+		return;
+
+	RecordedEvent Event = {};
+	Event.Type = BlockingEvent;
+	Event.BoneName = Bone->GetName();
+	Event.Blocking = Blocking;
+
+	AddEvent(Event);
+}
+
+void RecordingManager::RecordAngles(Bone* Bone, vec3 Angles)
+{
+	if (!IsRecordingFlag)
+		return;
+
+	RecordedEvent Event = {};
+	Event.Type = AnglesEvent;
+	Event.BoneName = Bone->GetName();
+	Event.Angles = Angles;
+
+	AddEvent(Event);
+}
+
+void RecordingManager::RecordState(void)
+{
+	if (!IsRecordingFlag)
+		return;
+
+	RecordedEvent Event = {};
+	Event.Type = StateEvent;
+
+	CharacterManager::GetInstance().Serialize(Event.CharState);
+	PoseManager::GetInstance().Serialize(Event.PoseState);
+
+	AddEvent(Event);
+}
+
+void RecordingManager::ApplyEvent(RecordedEvent& Event)
+{
+	Character* Char = CharacterManager::GetInstance().GetCharacter();
+
+	Bone* Bone = Event.BoneName.empty() ? nullptr : Char->FindBone(Event.BoneName);
+
+	switch (Event.Type) {
+	case InverseKinematicEvent:
+		if (Bone != nullptr)
+			PoseManager::GetInstance().InverseKinematic(Bone, Event.LocalPoint, Event.WorldPoint);
+		else
+			PoseManager::GetInstance().CancelInverseKinematic();
+		break;
+	case PositionConstraintEvent:
+		if (Bone == nullptr)
+			break;
+		if (Event.IsActive)
+			PoseManager::GetInstance().ConstrainBonePosition(Bone, Event.WorldPoint);
+		else
+			PoseManager::GetInstance().RemoveBonePositionConstraint(Bone);
+		break;
+	case BlockingEvent:
+		if (Bone != nullptr)
+			PoseManager::GetInstance().SetBoneBlocking(Bone, Event.Blocking);
+		break;
+	case AnglesEvent:
+		if (Bone != nullptr)
+			PhysicsManager::GetInstance().SetBoneAngles(Bone, Event.Angles);
+		break;
+	case StateEvent: {
+
+		PhysicsSnapshot Snapshot;
+
+		CharacterManager::GetInstance().Deserialize(Event.CharState);
+		PoseManager::GetInstance().Deserialize(Event.PoseState, Snapshot);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+int RecordingManager::Replay(const wstring FileName)
+{
+	if (!LoadFromFile(FileName)) {
+		printf("Failed to load recording %ls\n", FileName.c_str());
+		return -1;
+	}
+
+	PhysicsManager& Physics = PhysicsManager::GetInstance();
+
+	// the recorded session adapted to its machine, replays take every step on every machine
+	Physics.SetTickBudget(UnlimitedTickBudget);
+
+	double ClockTime = 0;
+	Physics.SetFixedClock(ClockTime);
+
+	PhysicsSnapshot Snapshot;
+
+	CharacterManager::GetInstance().Deserialize(InitialCharState);
+	PoseManager::GetInstance().Deserialize(InitialPoseState, Snapshot);
+
+	Physics.ResetRunStatistics();
+
+	vector<double> TickTimes;
+	vector<uint64> TickSteps;
+
+	for (RecordedEvent& Event : Events) {
+
+		if (Event.Type != TickEvent) {
+			ApplyEvent(Event);
+			continue;
+		}
+
+		ClockTime += Event.dt;
+		Physics.SetFixedClock(ClockTime);
+
+		double StartTime = GetPreciseTime();
+
+		PoseManager::GetInstance().Tick(Event.dt);
+
+		TickTimes.push_back(GetPreciseTime() - StartTime);
+		TickSteps.push_back(Physics.GetLastStepCount());
+	}
+
+	PrintReport(TickTimes, TickSteps, FileName);
+
+	return 0;
+}
+
+void RecordingManager::PrintReport(vector<double>& TickTimes, vector<uint64>& TickSteps, const wstring FileName)
+{
+	wstring ReportFileName = FileName + L".csv";
+
+	FILE* File = _wfopen(ReportFileName.c_str(), L"w");
+	if (File != nullptr) {
+
+		fprintf(File, "Tick,SolveTimeUs,Steps\n");
+
+		for (size_t Tick = 0; Tick < TickTimes.size(); Tick++)
+			fprintf(File, "%d,%.1f,%llu\n", (int32)Tick, TickTimes[Tick] * 1000000.0, TickSteps[Tick]);
+
+		fclose(File);
+	}
+
+	double TotalTime = 0;
+	uint64 TotalSteps = 0;
+
+	for (size_t Tick = 0; Tick < TickTimes.size(); Tick++) {
+		TotalTime += TickTimes[Tick];
+		TotalSteps += TickSteps[Tick];
+	}
+
+	vector<double> SortedTimes = TickTimes;
+	sort(SortedTimes.begin(), SortedTimes.end());
+
+	double MedianTime = SortedTimes.empty() ? 0 : SortedTimes[SortedTimes.size() / 2];
+	double P95Time = SortedTimes.empty() ? 0 : SortedTimes[SortedTimes.size() * 95 / 100];
+	double MaxTime = SortedTimes.empty() ? 0 : SortedTimes.back();
+
+	// live sessions run on an adaptive budget, so this is the drift from the recording, not from other replays
+	Character* Char = CharacterManager::GetInstance().GetCharacter();
+
+	CharacterSerializedState ReplayedCharState;
+	CharacterManager::GetInstance().Serialize(ReplayedCharState);
+
+	float PositionError = distance(ReplayedCharState.Position, FinalCharState.Position);
+	float RotationError = 0;
+
+	for (SerializedBone& Replayed : ReplayedCharState.Bones)
+		for (SerializedBone& Recorded : FinalCharState.Bones)
+			if (Replayed.Name == Recorded.Name) {
+				float Dot = std::min(fabs(dot(Replayed.Rotation, Recorded.Rotation)), 1.0f);
+				RotationError = std::max(RotationError, 2.0f * acos(Dot));
+				break;
+			}
+
+	printf("Replay: %d ticks, %llu steps (%.1f per tick), solve time %.1f ms total, %.1f us median, %.1f us p95, %.1f us max\n",
+		(int32)TickTimes.size(), TotalSteps, TickTimes.empty() ? 0.0 : TotalSteps / (double)TickTimes.size(),
+		TotalTime * 1000.0, MedianTime * 1000000.0, P95Time * 1000000.0, MaxTime * 1000000.0);
+
+	printf("Replay: final pose differs from the recording by %.2f mm (root) and %.2f degrees (worst of %d bones)\n",
+		PositionError * 1000.0f, degrees(RotationError), (int32)Char->Bones.size());
+
+	PhysicsManager& Physics = PhysicsManager::GetInstance();
+	const PhysicsManager::RunStatistics& Run = Physics.GetRunStatistics();
+
+	const char* BackendName = Physics.IsMultiBody() ? "multibody" : "rigid bodies";
+	const char* BroadphaseName = Physics.GetBroadphase() == PhysicsManager::SweepAndPruneBroadphase ? "sweep and prune" : "dynamic tree";
+	const char* PredictionName = Physics.IsTargetPredictionEnabled() ? "on" : "off";
+
+	double StepCost = Run.StepCount > 0 ? Run.StepTime / Run.StepCount * 1000000.0 : 0.0;
+	double BroadphaseCost = Run.StepCount > 0 ? Run.BroadphaseTime / Run.StepCount * 1000000.0 : 0.0;
+	double PairCount = Run.StepCount > 0 ? Run.PairSum / (double)Run.StepCount : 0.0;
+	double MeanError = Run.ErrorCount > 0 ? Run.ErrorSum / Run.ErrorCount * 1000.0 : 0.0;
+	double SettleSteps = Run.ConvergedCount > 0 ? Run.ConvergenceStepSum / (double)Run.ConvergedCount : 0.0;
+
+	printf("Replay: %s, %s broadphase, prediction %s, %.1f us per step (broadphase %.1f us, %.1f pairs), IK error %.2f mm mean, %.2f mm max, IK settles in %.1f steps (%llu moves settled)\n",
+		BackendName, BroadphaseName, PredictionName, StepCost, BroadphaseCost, PairCount, MeanError, Run.MaxError * 1000.0, SettleSteps, Run.ConvergedCount);
+
+	// one row per run, replaying the same recording with other options adds the rows to compare
+	wstring SummaryFileName = FileName + L".runs.csv";
+
+	bool IsNewSummary = GetFileAttributesW(SummaryFileName.c_str()) == INVALID_FILE_ATTRIBUTES;
+
+	File = _wfopen(SummaryFileName.c_str(), L"a");
+	if (File == nullptr)
+		return;
+
+	if (IsNewSummary)
+		fprintf(File, "Backend,Broadphase,Prediction,Bones,Ticks,Steps,StepUs,BroadphaseUs,Pairs,SolveTimeMs,IKErrorMeanMm,IKErrorMaxMm,SettleSteps,DriftMm,DriftDegrees\n");
+
+	fprintf(File, "%s,%s,%s,%d,%d,%llu,%.2f,%.2f,%.1f,%.1f,%.3f,%.3f,%.1f,%.3f,%.3f\n",
+		BackendName, BroadphaseName, PredictionName, (int32)Char->Bones.size(), (int32)TickTimes.size(), Run.StepCount, StepCost, BroadphaseCost, PairCount, TotalTime * 1000.0,
+		MeanError, Run.MaxError * 1000.0, SettleSteps, PositionError * 1000.0f, degrees(RotationError));
+
+	fclose(File);
+}
+
+// Files
+
+void RecordingManager::SaveToFile(const wstring FileName)
+{
+	XMLDocument Document;
+
+	XMLNode* Root = Document.NewElement("Recording");
+	Document.InsertFirstChild(Root);
+
+	XMLElement* Initial = Document.NewElement("Initial");
+	InitialCharState.SaveToXML(Document, Initial);
+	InitialPoseState.SaveToXML(Document, Initial);
+	Root->InsertEndChild(Initial);
+
+	XMLElement* EventsElement = Document.NewElement("Events");
+	for (RecordedEvent& Event : Events)
+		Event.SaveToXML(Document, EventsElement);
+	Root->InsertEndChild(EventsElement);
+
+	XMLElement* Final = Document.NewElement("Final");
+	FinalCharState.SaveToXML(Document, Final);
+	Root->InsertEndChild(Final);
+
+	FILE* File = _wfopen(FileName.c_str(), L"wb");
+	if (File == nullptr) {
+		printf("Failed to save recording %ls\n", FileName.c_str());
+		return;
+	}
+
+	Document.SaveFile(File, false);
+	fclose(File);
+}
+
+bool RecordingManager::LoadFromFile(const wstring FileName)
+{
+	FILE* File = _wfopen(FileName.c_str(), L"rb");
+	if (File == nullptr)
+		return false;
+
+	XMLDocument Document;
+	XMLError Result = Document.LoadFile(File);
+	fclose(File);
+
+	if (Result != XML_SUCCESS)
+		return false;
+
+	XMLNode* Root = Document.FirstChildElement("Recording");
+	if (Root == nullptr)
+		return false;
+
+	XMLElement* Initial = Root->FirstChildElement("Initial");
+	if (Initial == nullptr || !InitialCharState.LoadFromXML(Document, Initial))
+		return false;
+
+	InitialPoseState.LoadFromXML(Document, Initial);
+
+	XMLElement* Final = Root->FirstChildElement("Final");
+	if (Final == nullptr || !FinalCharState.LoadFromXML(Document, Final))
+		return false;
+
+	Events.clear();
+
+	XMLElement* EventsElement = Root->FirstChildElement("Events");
+	if (EventsElement == nullptr)
+		return false;
+
+	for (XMLElement* Element = EventsElement->FirstChildElement(); Element != nullptr; Element = Element->NextSiblingElement()) {
+
+		RecordedEvent Event = {};
+
+		if (Event.LoadFromXML(Element))
+			Events.push_back(Event);
+	}
+
+	return true;
+}
+
+// RecordedEvent
+
+static const char* EventNames[] = { "Tick", "InverseKinematic", "PositionConstraint", "Blocking", "Angles", "State" };
+
+void RecordedEvent::SaveToXML(XMLDocument& Document, XMLNode* Root)
+{
+	XMLElement* Element = Document.NewElement(EventNames[Type]);
+
+	switch (Type) {
+	case TickEvent:
+		Element->SetAttribute("dt", dt);
+		break;
+	case InverseKinematicEvent:
+	case PositionConstraintEvent: {
+
+		Element->SetAttribute("Bone", ws2s(BoneName).c_str());
+		Element->SetAttribute("IsActive", IsActive);
+
+		XMLElement* Local = Document.NewElement("LocalPoint");
+		Local->SetAttribute("X", LocalPoint.x);
+		Local->SetAttribute("Y", LocalPoint.y);
+		Local->SetAttribute("Z", LocalPoint.z);
+		Element->InsertEndChild(Local);
+
+		XMLElement* World = Document.NewElement("WorldPoint");
+		World->SetAttribute("X", WorldPoint.x);
+		World->SetAttribute("Y", WorldPoint.y);
+		World->SetAttribute("Z", WorldPoint.z);
+		Element->InsertEndChild(World);
+		break;
+	}
+	case BlockingEvent:
+		Element->SetAttribute("Bone", ws2s(BoneName).c_str());
+		Element->SetAttribute("XPos", Blocking.XPos);
+		Element->SetAttribute("YPos", Blocking.YPos);
+		Element->SetAttribute("ZPos", Blocking.ZPos);
+		Element->SetAttribute("XAxis", Blocking.XAxis);
+		Element->SetAttribute("YAxis", Blocking.YAxis);
+		Element->SetAttribute("ZAxis", Blocking.ZAxis);
+		break;
+	case AnglesEvent:
+		// NaN marks axes that are not degrees of freedom
+		Element->SetAttribute("Bone", ws2s(BoneName).c_str());
+		Element->SetAttribute("X", Angles.x);
+		Element->SetAttribute("Y", Angles.y);
+		Element->SetAttribute("Z", Angles.z);
+		break;
+	case StateEvent:
+		CharState.SaveToXML(Document, Element);
+		PoseState.SaveToXML(Document, Element);
+		break;
+	}
+
+	Root->InsertEndChild(Element);
+}
+
+bool RecordedEvent::LoadFromXML(XMLElement* Element)
+{
+	int32 TypeIndex = -1;
+
+	for (int32 Index = 0; Index < (int32)(sizeof(EventNames) / sizeof(EventNames[0])); Index++)
+		if (strcmp(Element->Name(), EventNames[Index]) == 0)
+			TypeIndex = Index;
+
+	if (TypeIndex == -1)
+		return false;
+
+	Type = (RecordedEventType)TypeIndex;
+
+	switch (Type) {
+	case TickEvent:
+		return Element->QueryDoubleAttribute("dt", &dt) == XML_SUCCESS;
+	case InverseKinematicEvent:
+	case PositionConstraintEvent: {
+
+		BoneName = s2ws(attribute_value(Element, "Bone"));
+		IsActive = attribute_bool_value(Element, "IsActive", true);
+
+		XMLElement* Local = Element->FirstChildElement("LocalPoint");
+		if (Local != nullptr)
+			LocalPoint = { attribute_float_value(Local, "X", 0), attribute_float_value(Local, "Y", 0), attribute_float_value(Local, "Z", 0) };
+
+		XMLElement* World = Element->FirstChildElement("WorldPoint");
+		if (World != nullptr)
+			WorldPoint = { attribute_float_value(World, "X", 0), attribute_float_value(World, "Y", 0), attribute_float_value(World, "Z", 0) };
+
+		return true;
+	}
+	case BlockingEvent:
+		BoneName = s2ws(attribute_value(Element, "Bone"));
+		Blocking.XPos  = attribute_bool_value(Element, "XPos", true);
+		Blocking.YPos  = attribute_bool_value(Element, "YPos", true);
+		Blocking.ZPos  = attribute_bool_value(Element, "ZPos", true);
+		Blocking.XAxis = attribute_bool_value(Element, "XAxis", true);
+		Blocking.YAxis = attribute_bool_value(Element, "YAxis", true);
+		Blocking.ZAxis = attribute_bool_value(Element, "ZAxis", true);
+		return true;
+	case AnglesEvent: {
+
+		float NaN = nanf("");
+
+		BoneName = s2ws(attribute_value(Element, "Bone"));
+		Angles = { attribute_float_value(Element, "X", NaN), attribute_float_value(Element, "Y", NaN), attribute_float_value(Element, "Z", NaN) };
+		return true;
+	}
+	case StateEvent: {
+
+		XMLDocument* Document = Element->GetDocument();
+
+		if (!CharState.LoadFromXML(*Document, Element))
+			return false;
+
+		PoseState.LoadFromXML(*Document, Element);
+		return true;
+	}
+	}
+
+	return false;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <tinyxml2.h>
+
+#include "Character.hpp"
+#include "PoseManager.hpp"
+#include "SerializationManager.hpp"
+
+using namespace std;
+using namespace glm;
+using namespace tinyxml2;
+
+typedef enum RecordedEventType {
+	TickEvent,
+	InverseKinematicEvent,
+	PositionConstraintEvent,
+	BlockingEvent,
+	AnglesEvent,
+	// the pose was replaced outside of the solver (undo, history switch, mirror, resets)
+	StateEvent
+} RecordedEventType;
+
+typedef struct RecordedEvent {
+	RecordedEventType Type;
+
+	double dt;
+
+	// empty when the inverse kinematic is cancelled
+	wstring BoneName;
+	bool IsActive;
+	vec3 LocalPoint, WorldPoint, Angles;
+	BlockingInfo Blocking;
+
+	CharacterSerializedState CharState;
+	PoseSerializedState PoseState;
+
+	void SaveToXML(XMLDocument& Document, XMLNode* Root);
+	bool LoadFromXML(XMLElement* Element);
+} RecordedEvent;
+
+// Captures everything that drives posing so a session can be replayed without a window. Replays run
+// synchronously with a fixed clock and an unlimited tick budget, so every run takes the same steps.
+typedef class RecordingManager {
+private:
+	RecordingManager(void) { };
+
+	// large enough to never limit a step, small enough to keep the step count math finite
+	const double UnlimitedTickBudget = 1000000.0;
+
+	bool IsRecordingFlag;
+	wstring RecordingFileName;
+
+	CharacterSerializedState InitialCharState, FinalCharState;
+	PoseSerializedState InitialPoseState;
+
+	vector<RecordedEvent> Events;
+
+	void AddEvent(RecordedEvent& Event);
+	void ApplyEvent(RecordedEvent& Event);
+
+	bool LoadFromFile(const wstring FileName);
+	void SaveToFile(const wstring FileName);
+
+	void PrintReport(vector<double>& TickTimes, vector<uint64>& TickSteps, const wstring FileName);
+public:
+	static RecordingManager& GetInstance(void) {
+		static RecordingManager Instance;
+
+		return Instance;
+	}
+
+	RecordingManager(RecordingManager const&) = delete;
+	void operator=(RecordingManager const&) = delete;
+
+	void StartRecording(const wstring FileName);
+	void StopRecording(void);
+	bool IsRecording(void);
+
+	void RecordTick(double dt);
+	void RecordInverseKinematic(Bone* Bone, vec3 LocalPoint, vec3 WorldPoint);
+	void RecordPositionConstraint(Bone* Bone, bool IsActive, vec3 WorldPoint);
+	void RecordBlocking(Bone* Bone, BlockingInfo Blocking);
+	void RecordAngles(Bone* Bone, vec3 Angles);
+	void RecordState(void);
+
+	// headless, needs only the character, physics and pose managers; returns the process exit code
+	int Replay(const wstring FileName);
+} RecordingManager;
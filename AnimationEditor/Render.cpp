@@ -38,6 +38,8 @@ void Render::DrawScene(void) {
 		DrawAxes();
 
 		DrawPickedPoint();
+
+		DrawMarquee();
 	}
 
 	glFlush();
@@ -137,6 +139,34 @@ void Render::DrawPickedPoint(void) {
 	}
 }
 
+void Render::DrawMarquee(void) {
+
+	LONG x1, y1, x2, y2;
+
+	if (!InputManager::GetInstance().GetMarquee(x1, y1, x2, y2))
+		return;
+
+	// corners are drawn just behind the near plane so the rectangle stays in front of the scene
+	LONG X[4] = { x1, x2, x2, x1 };
+	LONG Y[4] = { y1, y1, y2, y2 };
+	vec3 Corners[4];
+
+	for (int Index = 0; Index < 4; Index++) {
+
+		vec3 Point, Direction;
+		GetPointAndDirectionFromScreenPoint(X[Index], Y[Index], Point, Direction);
+
+		Corners[Index] = Point + Direction * 0.01f;
+	}
+
+	EnableLighting(false);
+	SetWireframeMode(false);
+	SetColors({ 1, 1, 1, 0.8 });
+
+	for (int Index = 0; Index < 4; Index++)
+		DrawLine(Corners[Index], Corners[(Index + 1) % 4]);
+}
+
 void Render::DrawCharacterGrid(void) {
 
 	SetWireframeMode(false);
@@ -240,11 +270,74 @@ void Render::GetScreenPointFromPoint(vec3 Point, LONG& x, LONG& y) {
 
 void Render::GetBoneFromScreenPoint(LONG x, LONG y, Bone*& TouchedBone, vec3& WorldPoint, vec3& WorldNormal) {
 
-	vec3 Point, Direction;
+	PickingRay Ray;
+
+	GetPointAndDirectionFromScreenPoint(x, y, Ray.Start, Ray.Direction);
 
-	GetPointAndDirectionFromScreenPoint(x, y, Point, Direction);
+	PickingHit Hit;
 
-	return PhysicsManager::GetInstance().GetBoneFromRay(Point, Direction, TouchedBone, WorldPoint, WorldNormal);
+	Picker->CastRay(Ray, Hit);
+
+	TouchedBone = Hit.TouchedBone;
+	WorldPoint = Hit.WorldPoint;
+	WorldNormal = Hit.WorldNormal;
+}
+
+void Render::GetBonesInScreenRect(LONG x1, LONG y1, LONG x2, LONG y2, vector<Bone*>& Bones) {
+
+	vec3 Points[4], Directions[4];
+
+	GetPointAndDirectionFromScreenPoint(x1, y1, Points[0], Directions[0]);
+	GetPointAndDirectionFromScreenPoint(x2, y1, Points[1], Directions[1]);
+	GetPointAndDirectionFromScreenPoint(x2, y2, Points[2], Directions[2]);
+	GetPointAndDirectionFromScreenPoint(x1, y2, Points[3], Directions[3]);
+
+	vec3 Center = (Points[0] + Points[1] + Points[2] + Points[3]) * 0.25f;
+	vec3 Direction = normalize(Directions[0] + Directions[1] + Directions[2] + Directions[3]);
+
+	// side planes go through two neighbouring corner rays, the near plane through the corners
+	vector<vec4> Planes;
+
+	for (int Index = 0; Index < 4; Index++) {
+
+		int Next = (Index + 1) % 4;
+
+		vec3 Normal = cross(Directions[Index], Directions[Next]);
+		if (length(Normal) == 0)
+			return;
+
+		Normal = normalize(Normal);
+		if (dot(Normal, Center + Direction - Points[Index]) < 0)
+			Normal = -Normal;
+
+		Planes.push_back(vec4(Normal, -dot(Normal, Points[Index])));
+	}
+
+	Planes.push_back(vec4(Direction, -dot(Direction, Center)));
+
+	vector<Bone*> Candidates;
+	Picker->QueryVolume(Planes, Candidates);
+
+	if (Candidates.empty())
+		return;
+
+	// keep the bones whose centre is not hidden behind another bone, all rays go out in one batch
+	vector<PickingRay> Rays(Candidates.size());
+
+	for (size_t Index = 0; Index < Candidates.size(); Index++) {
+
+		vec3 BoneCenter = vec3((Candidates[Index]->WorldTransform * Candidates[Index]->MiddleTranslation)[3]);
+
+		Rays[Index].Start = CameraPosition;
+		Rays[Index].Direction = normalize(BoneCenter - CameraPosition);
+	}
+
+	vector<PickingHit> Hits;
+	Picker->CastRays(Rays, Hits);
+
+	for (size_t Index = 0; Index < Candidates.size(); Index++)
+		if (Hits[Index].TouchedBone == Candidates[Index])
+			Bones.push_back(Candidates[Index]);
 }
 
 void Render::Serialize(RenderSerializedState & State)
@@ -534,6 +627,8 @@ void Render::Initialize(HWND WindowHandle) {
 
 	LoadPrimitiveModels();
 
+	Picker = new PickingTree(CharacterManager::GetInstance().GetCharacter());
+
 	glClearColor(1, 1, 1, 1);
 
 	glEnableVertexAttribArray(0);
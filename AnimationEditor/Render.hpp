@@ -9,6 +9,7 @@
 #include <glm/glm.hpp>
 
 #include "Character.hpp"
+#include "PickingTree.hpp"
 #include "SerializationManager.hpp"
 
 #pragma comment (lib, "opengl32.lib")
@@ -44,6 +45,8 @@ private:
 	vec3 CameraPosition;
 	float CameraAngleX, CameraAngleZ;
 
+	PickingTree* Picker;
+
 	void LoadPrimitiveModel(const wchar_t* ModelName, Vertex* Buffer, uint32 BufferSize, uint32 &DestIndex, uint32 &ResultIndex, uint32& ResultSize);
 	void LoadPrimitiveModels(void);
 
@@ -62,6 +65,7 @@ private:
 	void DrawCharacter(Character* Char, bool IsKinematic);
 	void DrawFloor(void);
 	void DrawPickedPoint(void);
+	void DrawMarquee(void);
 	void DrawCharacterGrid(void);
 	void DrawAxes(void);
 
@@ -95,6 +99,7 @@ public:
 	void GetPointAndDirectionFromScreenPoint(LONG x, LONG y, vec3& Point, vec3& Direction);
 	void GetScreenPointFromPoint(vec3 Point, LONG& x, LONG& y);
 	void GetBoneFromScreenPoint(LONG x, LONG y, Bone*& TouchedBone, vec3& WorldPoint, vec3& WorldNormal);
+	void GetBonesInScreenRect(LONG x1, LONG y1, LONG x2, LONG y2, vector<Bone*>& Bones);
 
 	void Serialize(RenderSerializedState& State);
 	void Deserialize(RenderSerializedState& State);
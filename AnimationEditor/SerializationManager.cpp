@@ -3,6 +3,7 @@
 #include <locale>
 #include <codecvt>
 #include <algorithm>
+#include <ppl.h>
 
 #include <tixml2ex.h>
 
@@ -11,6 +12,14 @@
 #include "PoseManager.hpp"
 #include "Render.hpp"
 #include "Form.hpp"
+#include "RecordingManager.hpp"
+#include "ProjectFile.hpp"
+#include "XMLStreamReader.hpp"
+#include "ProjectJournal.hpp"
+#include "BackupStore.hpp"
+
+wstring ChangeFileExt(const wstring& FileName, const wstring& NewExt);
+wstring GetUnusedProjectFileName(const wstring& FileName, const wstring& Tag);
 
 void SerializationManager::Initialize(const wstring WorkingDirectory)
 {
@@ -18,6 +27,10 @@ void SerializationManager::Initialize(const wstring WorkingDirectory)
 
 	NextStateHistoryID = 1;
 
+	IsCompressionEnabled = true;
+
+	InitializeCriticalSection(&FileMutex);
+
 	LoadSettings();
 
 	StartBackgroundThread();
@@ -28,6 +41,8 @@ void SerializationManager::Serialize(void)
 	if (!HaveCurrentHistory())
 		return;
 
+	GetCurrentHistory()->Journal.IsJournaled = false;
+
 	SingleSerializedState& State = GetCurrentHistory()->CurrentState;
 
 	if (State.HaveCharState)
@@ -36,8 +51,10 @@ void SerializationManager::Serialize(void)
 	if (State.HaveInputState)
 		InputManager::GetInstance().Serialize(State.InputState);
 
-	if (State.HavePoseState)
+	if (State.HavePoseState) {
 		PoseManager::GetInstance().Serialize(State.PoseState);
+		PhysicsManager::GetInstance().CreateSnapshot(State.Physics);
+	}
 
 	if (State.HaveRenderState)
 		Render::GetInstance().Serialize(State.RenderState);
@@ -62,7 +79,9 @@ void SerializationManager::Deserialize(void)
 		InputManager::GetInstance().Deserialize(State.InputState);
 
 	if (State.HavePoseState)
-		PoseManager::GetInstance().Deserialize(State.PoseState);
+		PoseManager::GetInstance().Deserialize(State.PoseState, State.Physics);
+
+	RecordingManager::GetInstance().RecordState();
 }
 
 void SerializationManager::Serialize(SerializeSerializedState& State)
@@ -95,8 +114,95 @@ void SerializationManager::Deserialize(SerializeSerializedState & State)
 
 void SerializationManager::Autosave(bool Delay)
 {
-	if (IsFileOpen())
+	if (!IsFileOpen())
+		return;
+
+	// a full save compacts the journal into the project file
+	if (!Delay || !IsJournalStarted || JournalCommitCount >= MaxJournalCommits)
 		SaveToFile(LastFileName, Delay);
+	else
+		AppendToJournal();
+}
+
+void SerializationManager::AppendToJournal(void)
+{
+	SerializeCurrentHistory();
+
+	FileSaveRequest* Request = new FileSaveRequest();
+	Serialize(Request->State);
+	Request->FileName = ChangeFileExt(LastFileName, ProjectJournal::Extension);
+	Request->IsJournalCommit = true;
+	Request->Generation = SaveGeneration;
+
+	for (SerializedStateHistory& History : Histories) {
+
+		Request->Order.push_back(History.ID);
+
+		if (IsHistoryJournaled(History))
+			continue;
+
+		SerializedStateHistory Change = {};
+		Change.ID = History.ID;
+		Change.IsDeleted = History.IsDeleted;
+		Change.CurrentState = History.CurrentState;
+		Change.PreviousStates.Append(History.PreviousStates, History.Journal.Previous.Kept);
+		Change.FutureStates.Append(History.FutureStates, History.Journal.Future.Kept);
+		Change.Journal = History.Journal;
+
+		Request->Histories.push_back(std::move(Change));
+
+		SetHistoryJournaled(History);
+	}
+
+	DelayedFileSaveRequests.enqueue(Request);
+
+	JournalCommitCount++;
+
+	LastAutosaveTime = GetTickCount64();
+}
+
+void SerializationManager::ExportToXML(void)
+{
+	if (!IsFileOpen())
+		return;
+
+	// brings the current history up to date first
+	Autosave();
+
+	FileSaveRequest* Request = new FileSaveRequest();
+	Request->Histories = Histories;
+	Serialize(Request->State);
+	Request->FileName = ChangeFileExt(LastFileName, L".xml");
+	Request->IsExplicit = true;
+
+	DelayedFileSaveRequests.enqueue(Request);
+}
+
+void SerializationManager::ListBackups(void)
+{
+	if (!IsFileOpen())
+		return;
+
+	vector<BackupStore::BackupInfo> Backups;
+	BackupStore::List(LastFileName, Backups);
+
+	printf("%d backups of %ls, open one to restore it into a new project\n", (int)Backups.size(), LastFileName.c_str());
+
+	for (size_t Index = 0; Index < Backups.size() && Index < MaxListedBackups; Index++) {
+
+		BackupStore::BackupInfo& Backup = Backups[Index];
+
+		FILETIME Time;
+		Time.dwLowDateTime = (DWORD)Backup.Time;
+		Time.dwHighDateTime = (DWORD)(Backup.Time >> 32);
+
+		SYSTEMTIME SystemTime, LocalTime;
+		FileTimeToSystemTime(&Time, &SystemTime);
+		SystemTimeToTzSpecificLocalTime(nullptr, &SystemTime, &LocalTime);
+
+		printf("%04d-%02d-%02d %02d:%02d:%02d  %d histories  %ls\n", LocalTime.wYear, LocalTime.wMonth, LocalTime.wDay,
+			LocalTime.wHour, LocalTime.wMinute, LocalTime.wSecond, Backup.HistoryCount, Backup.FileName.c_str());
+	}
 }
 
 void SerializationManager::Tick(double dt)
@@ -149,30 +255,62 @@ void SerializationManager::InternalPushStateFrame(bool Forward)
 	State.HaveRenderState = false;
 	Serialize();
 
-	vector<SingleSerializedState>& DestStates =
+	SerializedStateStack& DestStates =
 		Forward ? GetCurrentHistory()->FutureStates : GetCurrentHistory()->PreviousStates;
 
-	DestStates.push_back(State);
+	DestStates.Push(State);
 
-	LimitFrames(DestStates, MaxFrames);
+	HistoryJournalState& Journal = GetCurrentHistory()->Journal;
+	LimitFrames(DestStates, MaxFrames, Forward ? &Journal.Future : &Journal.Previous);
 
 	State.PendingID = PendingNone;
 	PendingLastTime = 0;
 }
 
-void SerializationManager::LimitFrames(vector<SingleSerializedState>& Frames, int Limit)
+void SerializationManager::LimitFrames(SerializedStateStack& Frames, int Limit, JournaledFrames* Journaled)
 {
-	if (Frames.size() > Limit) {
-		move(Frames.end() - Limit, Frames.end(), Frames.begin());
-		Frames.resize(Limit);
+	if (Frames.Size() > Limit) {
+
+		// the oldest frames go first, those are the journaled ones
+		if (Journaled != nullptr) {
+			uint32 Dropped = std::min(Journaled->Kept, (uint32)(Frames.Size() - Limit));
+			Journaled->Kept -= Dropped;
+			Journaled->Dropped += Dropped;
+		}
+
+		Frames.RemoveFront(Frames.Size() - Limit);
 	}
 }
 
+void SerializationManager::UpdateJournaledFrames(SerializedStateStack& Frames, JournaledFrames& Journaled)
+{
+	Journaled.Kept = std::min(Journaled.Kept, (uint32)Frames.Size());
+}
+
+bool SerializationManager::IsHistoryJournaled(SerializedStateHistory& History)
+{
+	HistoryJournalState& Journal = History.Journal;
+
+	return Journal.IsJournaled &&
+		Journal.Previous.Dropped == 0 && Journal.Previous.Kept == History.PreviousStates.Size() &&
+		Journal.Future.Dropped == 0 && Journal.Future.Kept == History.FutureStates.Size();
+}
+
+void SerializationManager::SetHistoryJournaled(SerializedStateHistory& History)
+{
+	History.Journal.IsJournaled = true;
+	History.Journal.Previous = { 0, (uint32)History.PreviousStates.Size() };
+	History.Journal.Future = { 0, (uint32)History.FutureStates.Size() };
+}
+
 void SerializationManager::CreateNewFile(void)
 {
 	CancelKinematicMode();
 
 	Histories.clear();
+	LastAddedKeyframes = {};
+
+	IsJournalStarted = false;
 
 	CharacterManager::GetInstance().Reset();
 
@@ -220,7 +358,10 @@ int32 SerializationManager::CreateCopyOfCurrentState(void)
 	SerializedStateHistory Copy = *GetCurrentHistory();
 
 	Copy.ID = NextStateHistoryID++;
+	Copy.Journal = {};
 	Copy.CurrentState.CharState = CharState;
+	// the snapshot holds the bodies of the kinematic pose, not of CharState
+	Copy.CurrentState.Physics = {};
 
 	Histories.push_back(Copy);
 
@@ -285,6 +426,7 @@ void SerializationManager::DeleteHistory(int32 ID)
 		bool ShouldReloadCurrentHistory = HaveCurrentHistory() && History->ID == GetCurrentHistoryID();
 
 		History->IsDeleted = true;
+		History->Journal.IsJournaled = false;
 
 		if (GetDeletedHistoryCount() <= 3)
 			rotate(Histories.begin(), History, History + 1);
@@ -315,6 +457,7 @@ void SerializationManager::UndoLastHistoryDeletion(void)
 			return;
 
 		LastDeletedHistory->IsDeleted = false;
+		LastDeletedHistory->Journal.IsJournaled = false;
 
 		rotate(LastDeletedHistory, LastDeletedHistory + 1, Histories.end());
 
@@ -324,6 +467,157 @@ void SerializationManager::UndoLastHistoryDeletion(void)
 	}
 }
 
+void SerializationManager::MirrorAllHistories(void)
+{
+	Form::UpdateLock Lock;
+
+	CancelKinematicMode();
+
+	SingleSerializedState& CurrentState = GetCurrentHistory()->CurrentState;
+	CurrentState.HaveCharState = true;
+	CurrentState.HaveInputState = true;
+	CurrentState.HavePoseState = true;
+	CurrentState.HaveRenderState = false;
+	Serialize();
+
+	vector<SingleSerializedState*> States;
+
+	// undo frames are decoded, mirrored and pushed again
+	vector<SerializedStateStack*> Stacks;
+
+	for (SerializedStateHistory& History : Histories) {
+
+		// every frame changes
+		History.Journal = {};
+
+		Stacks.push_back(&History.PreviousStates);
+		Stacks.push_back(&History.FutureStates);
+
+		States.push_back(&History.CurrentState);
+	}
+
+	vector<vector<SingleSerializedState>> StackFrames(Stacks.size());
+
+	for (size_t Index = 0; Index < Stacks.size(); Index++) {
+
+		vector<SingleSerializedState>& Frames = StackFrames[Index];
+
+		Stacks[Index]->ForEach([&Frames](const SingleSerializedState& Frame) {
+			Frames.push_back(Frame);
+		});
+	}
+
+	for (vector<SingleSerializedState>& Frames : StackFrames)
+		for (SingleSerializedState& Frame : Frames)
+			States.push_back(&Frame);
+
+	// states don't share anything, the character is only read
+	concurrency::parallel_for(size_t(0), States.size(), [&States](size_t Index) {
+
+		SingleSerializedState* State = States[Index];
+		if (!State->HaveCharState)
+			return;
+
+		CharacterManager::GetInstance().Mirror(State->CharState);
+
+		// bodies in the snapshot still hold the unmirrored pose
+		State->Physics = {};
+	});
+
+	for (size_t Index = 0; Index < Stacks.size(); Index++) {
+
+		Stacks[Index]->Clear();
+
+		for (SingleSerializedState& Frame : StackFrames[Index])
+			Stacks[Index]->Push(std::move(Frame));
+	}
+
+	ReloadCurrentHistory();
+
+	Form::GetInstance().UpdateTimeline();
+}
+
+void SerializationManager::AddKeyframes(vector<CharacterSerializedState>& Keyframes)
+{
+	if (!HaveCurrentHistory() || Keyframes.empty())
+		return;
+
+	// undoing this frame takes the keyframes out again
+	PushStateFrame(L"AddKeyframes");
+
+	// pinpoints and blocking the pose was baked with
+	SingleSerializedState& CurrentState = GetCurrentHistory()->CurrentState;
+
+	AddedKeyframes Added = {};
+	Added.HistoryID = GetCurrentHistoryID();
+
+	float Length = GetAnimationLength();
+
+	for (CharacterSerializedState& Keyframe : Keyframes) {
+
+		SerializedStateHistory History = {};
+
+		History.ID = NextStateHistoryID++;
+
+		History.CurrentState.CharState = Keyframe;
+		History.CurrentState.InputState = CurrentState.InputState;
+		History.CurrentState.PoseState = CurrentState.PoseState;
+		History.CurrentState.HaveCharState = true;
+		History.CurrentState.HaveInputState = true;
+		History.CurrentState.HavePoseState = true;
+		History.CurrentState.HaveRenderState = false;
+
+		Added.IDs.push_back(History.ID);
+
+		// the current history is always the last one
+		Histories.insert(GetLatestHistory(), History);
+
+		Length = std::max(Length, Keyframe.AnimationTimestamp / 1000.0f);
+	}
+
+	Added.FrameCount = GetCurrentHistory()->PreviousStates.Size();
+
+	LastAddedKeyframes = std::move(Added);
+
+	if (Length > GetAnimationLength())
+		SetAnimationLength(Length);
+	else
+		Form::GetInstance().UpdateTimeline();
+}
+
+void SerializationManager::SaveKeyframesToFile(vector<CharacterSerializedState>& Keyframes, const wstring Suffix)
+{
+	wstring FileName = IsFileOpen() ? LastFileName : SettingsFileName.substr(0, SettingsFileName.find_last_of(L"\\") + 1) + L"Untitled" + ProjectFile::Extension;
+
+	FileSaveRequest* Request = new FileSaveRequest();
+
+	for (CharacterSerializedState& Keyframe : Keyframes) {
+
+		SerializedStateHistory History = {};
+
+		History.ID = (int32)Request->Histories.size() + 1;
+
+		History.CurrentState.CharState = Keyframe;
+		History.CurrentState.HaveCharState = true;
+		History.CurrentState.HaveInputState = true;
+		History.CurrentState.HavePoseState = true;
+		History.CurrentState.HaveRenderState = false;
+
+		Request->Histories.push_back(History);
+	}
+
+	Serialize(Request->State);
+	Request->State.AnimationLength = std::max(Request->State.AnimationLength, Keyframes.back().AnimationTimestamp / 1000.0f);
+	Request->State.KinematicModeFlag = false;
+	Request->State.PlayAnimaionFlag = false;
+
+	Request->FileName = ChangeFileExt(FileName, Suffix + ProjectFile::Extension);
+	Request->IsExplicit = true;
+	Request->IsCompressed = IsCompressionEnabled;
+
+	DelayedFileSaveRequests.enqueue(Request);
+}
+
 void SerializationManager::ReloadCurrentHistory(void)
 {
 	CancelKinematicMode();
@@ -446,22 +740,107 @@ wstring ChangeFileExt(const wstring& FileName, const wstring& NewExt) {
 	return NoExt + NewExt;
 }
 
+// FileName unless it or its journal exists, otherwise FileName with Tag and the local time before the extension
+wstring GetUnusedProjectFileName(const wstring& FileName, const wstring& Tag) {
+
+	auto IsUsed = [](const wstring& Name) {
+		return GetFileAttributesW(Name.c_str()) != INVALID_FILE_ATTRIBUTES ||
+			GetFileAttributesW(ChangeFileExt(Name, ProjectJournal::Extension).c_str()) != INVALID_FILE_ATTRIBUTES;
+	};
+
+	if (!IsUsed(FileName))
+		return FileName;
+
+	SYSTEMTIME Time;
+	GetLocalTime(&Time);
+
+	wchar_t Stamp[32];
+	swprintf(Stamp, 32, L"%04d%02d%02d-%02d%02d%02d", Time.wYear, Time.wMonth, Time.wDay, Time.wHour, Time.wMinute, Time.wSecond);
+
+	wstring NoExt = ChangeFileExt(FileName, L"." + Tag + L"-" + Stamp);
+	wstring Result = NoExt + ProjectFile::Extension;
+
+	for (int32 Index = 2; IsUsed(Result); Index++)
+		Result = NoExt + L"-" + to_wstring(Index) + ProjectFile::Extension;
+
+	return Result;
+}
+
 void SerializationManager::SafeSaveDocumentToFile(XMLDocument& Document, const wstring FileName, int BackupCount)
 {
 
 	wstring TempFileName = ChangeFileExt(FileName, L".tmp");
-	wstring XmlFileName = ChangeFileExt(FileName, L".xml");
-	wstring BackupFileName = ChangeFileExt(FileName, L".backup");
 
 	FILE* File = _wfopen(TempFileName.c_str(), L"wb");
+	if (File == nullptr) {
+		printf("Failed to write %ls\n", TempFileName.c_str());
+		return;
+	}
+
+	// tinyxml2 prints the document in small pieces
+	setvbuf(File, nullptr, _IOFBF, 1024 * 1024);
+
 	Document.SaveFile(File, false);
 	fclose(File);
 
+	SafeReplaceFile(TempFileName, ChangeFileExt(FileName, L".xml"), ChangeFileExt(FileName, L".backup"));
+}
+
+void SerializationManager::SafeSaveTextToFile(const vector<string>& Texts, const wstring FileName)
+{
+	wstring TempFileName = ChangeFileExt(FileName, L".tmp");
+
+	FILE* File = _wfopen(TempFileName.c_str(), L"wb");
+	if (File == nullptr) {
+		printf("Failed to write %ls\n", TempFileName.c_str());
+		return;
+	}
+
+	bool Result = true;
+
+	for (const string& Text : Texts)
+		Result = Result && fwrite(Text.data(), 1, Text.size(), File) == Text.size();
+
+	fclose(File);
+
+	if (!Result) {
+		printf("Failed to write %ls\n", TempFileName.c_str());
+		DeleteFileW(TempFileName.c_str());
+		return;
+	}
+
+	SafeReplaceFile(TempFileName, ChangeFileExt(FileName, L".xml"), ChangeFileExt(FileName, L".backup"));
+}
+
+void SerializationManager::SerializeCurrentHistory(void)
+{
+	if (HaveCurrentHistory()) {
+
+		SingleSerializedState& State = GetCurrentHistory()->CurrentState;
+		State.HaveCharState = true;
+		State.HaveInputState = true;
+		State.HavePoseState = true;
+		State.HaveRenderState = true;
+		Serialize();
+	}
+	else {
+
+		SingleSerializedState& State = GetLatestHistory()->CurrentState;
+
+		Render::GetInstance().Serialize(State.RenderState);
+		State.HaveRenderState = true;
+
+		GetLatestHistory()->Journal.IsJournaled = false;
+	}
+}
+
+void SerializationManager::SafeReplaceFile(const wstring TempFileName, const wstring FileName, const wstring BackupFileName)
+{
 	BOOL Result;
 
-	Result = MoveFileEx(XmlFileName.c_str(), BackupFileName.c_str(), MOVEFILE_REPLACE_EXISTING) || (GetLastError() == ERROR_FILE_NOT_FOUND);
+	Result = MoveFileEx(FileName.c_str(), BackupFileName.c_str(), MOVEFILE_REPLACE_EXISTING) || (GetLastError() == ERROR_FILE_NOT_FOUND);
 	if (Result)
-		Result = MoveFileEx(TempFileName.c_str(), XmlFileName.c_str(), MOVEFILE_REPLACE_EXISTING);
+		Result = MoveFileEx(TempFileName.c_str(), FileName.c_str(), MOVEFILE_REPLACE_EXISTING);
 
 	if (!Result)
 		printf("Failed to rename tmp file\n");
@@ -469,7 +848,7 @@ void SerializationManager::SafeSaveDocumentToFile(XMLDocument& Document, const w
 
 void SerializationManager::StartBackgroundThread(void)
 {
-	HANDLE BackgroundThreadHandle = CreateThread(NULL, 0, BackgroundStaticThreadProc, nullptr, 0, nullptr);
+	BackgroundThreadHandle = CreateThread(NULL, 0, BackgroundStaticThreadProc, nullptr, 0, nullptr);
 	if (BackgroundThreadHandle == 0)
 		printf("Failed to create a thread\n");
 }
@@ -482,134 +861,358 @@ DWORD SerializationManager::BackgroundStaticThreadProc(LPVOID lpThreadParameter)
 
 void SerializationManager::BackgroundThreadProc(void)
 {
-	while (true) {
+	const size_t MaxDequeueCount = 64;
+	FileSaveRequest* Requests[MaxDequeueCount];
 
-		FileSaveRequest* Request;
-		DelayedFileSaveRequests.wait_dequeue(Request);
+	bool IsStopping = false;
 
-		ExecuteFileSaveRequest(*Request);
-
-		delete Request;
-	}
-}
+	while (!IsStopping || !PendingFileSaveRequests.empty()) {
 
-void SerializationManager::ExecuteFileSaveRequest(FileSaveRequest& Request)
-{
-	XMLDocument Document;
+		// only blocks with nothing left to write, so requests queued during a write are seen before the next one
+		size_t Count = PendingFileSaveRequests.empty() && !IsStopping ?
+			DelayedFileSaveRequests.wait_dequeue_bulk(Requests, MaxDequeueCount) :
+			DelayedFileSaveRequests.try_dequeue_bulk(Requests, MaxDequeueCount);
 
-	XMLNode* Root = Document.NewElement("Root");
-	Document.InsertFirstChild(Root);
+		for (size_t Index = 0; Index < Count; Index++)
+			if (Requests[Index] == nullptr)
+				IsStopping = true;
+			else
+				PendingFileSaveRequests.push_back(Requests[Index]);
 
-	for (SerializedStateHistory& States : Request.Histories) {
+		CoalesceFileSaveRequests();
 
-		XMLElement* StatesElement = Document.NewElement("States");
-		Root->InsertEndChild(StatesElement);
+		vector<FileSaveRequest*> Batch;
+		TakeNextFileSaveRequests(Batch);
 
-		SaveStates(States, Document, StatesElement);
-	}
+		if (Batch.empty())
+			continue;
 
-	Request.State.SaveToXML(Document, Root);
+		if (Batch[0]->IsJournalCommit)
+			ExecuteJournalCommits(Batch);
+		else
+			ExecuteFileSaveRequest(*Batch[0]);
 
-	SafeSaveDocumentToFile(Document, Request.FileName, MaxBackupCount);
+		for (FileSaveRequest* Request : Batch)
+			delete Request;
+	}
 }
 
-void SerializationManager::PushStateFrame(const wstring Sender)
+void SerializationManager::CoalesceFileSaveRequests(void)
 {
-	if (!HaveCurrentHistory())
-		return;
-
-	printf("PUSH STATE, SENDER: %ws\n", Sender.c_str());
+	EnterCriticalSection(&FileMutex);
+	uint32 Generation = SaveGeneration;
+	LeaveCriticalSection(&FileMutex);
 
-	GetCurrentHistory()->FutureStates.clear();
+	vector<FileSaveRequest*> Kept;
 
-	InternalPushStateFrame(false);
-}
+	for (size_t Index = 0; Index < PendingFileSaveRequests.size(); Index++) {
 
-void SerializationManager::PushPendingStateFrame(SerializationPendingID PendingID, const wstring Sender)
-{
-	if (!HaveCurrentHistory())
-		return;
+		FileSaveRequest* Request = PendingFileSaveRequests[Index];
 
-	assert(PendingID != PendingNone);
+		// a later full save holds everything this one would write
+		bool IsSuperseded = Request->Generation != 0 && Request->Generation != Generation;
 
-	ULONGLONG Now = GetTickCount64();
+		// only the newest of the files written whole is kept
+		for (size_t Later = Index + 1; Later < PendingFileSaveRequests.size() && !IsSuperseded && !Request->IsJournalCommit; Later++)
+			IsSuperseded = !PendingFileSaveRequests[Later]->IsJournalCommit && PendingFileSaveRequests[Later]->FileName == Request->FileName;
 
-	if (GetCurrentHistory()->CurrentState.PendingID != PendingID || PendingLastTime + PendingTimeout <= Now)
-		PushStateFrame(L"Pending (" + Sender + L")");
+		if (IsSuperseded)
+			delete Request;
+		else
+			Kept.push_back(Request);
+	}
 
-	GetCurrentHistory()->CurrentState.PendingID = PendingID;
-	PendingLastTime = Now;
+	PendingFileSaveRequests = std::move(Kept);
 }
 
-void SerializationManager::PopAndDeserializeStateFrame(bool Forward)
+void SerializationManager::TakeNextFileSaveRequests(vector<FileSaveRequest*>& Requests)
 {
-	if (!HaveCurrentHistory())
+	vector<FileSaveRequest*>& Pending = PendingFileSaveRequests;
+
+	if (Pending.empty())
 		return;
 
-	vector<SingleSerializedState>& StackToUse = Forward ? GetCurrentHistory()->FutureStates : GetCurrentHistory()->PreviousStates;
+	// autosaves keep their order between themselves, explicit requests go to other files
+	size_t First = 0;
+	while (First < Pending.size() && !Pending[First]->IsExplicit)
+		First++;
 
-	if (!StackToUse.empty()) {
+	if (First == Pending.size())
+		First = 0;
 
-		InternalPushStateFrame(!Forward);
+	size_t End = First + 1;
 
-		GetCurrentHistory()->CurrentState = StackToUse.back();
-		StackToUse.pop_back();
+	// commits queued back to back go out together
+	if (Pending[First]->IsJournalCommit)
+		while (End < Pending.size() && Pending[End]->IsJournalCommit && Pending[End]->FileName == Pending[First]->FileName)
+			End++;
 
-		Deserialize();
-	}
+	Requests.assign(Pending.begin() + First, Pending.begin() + End);
+	Pending.erase(Pending.begin() + First, Pending.begin() + End);
 }
 
-float SerializationManager::GetAnimationPosition(void)
+void SerializationManager::ExecuteFileSaveRequest(FileSaveRequest& Request)
 {
-	return AnimationPosition;
+	EnterCriticalSection(&FileMutex);
+
+	// a later full save holds everything this one would write
+	if (Request.Generation == 0 || Request.Generation == SaveGeneration)
+		WriteFileSaveRequest(Request);
+
+	LeaveCriticalSection(&FileMutex);
 }
 
-void SerializationManager::SetAnimationPosition(float Position)
+void SerializationManager::ExecuteJournalCommits(vector<FileSaveRequest*>& Requests)
 {
-	AnimationPosition = Position;
+	EnterCriticalSection(&FileMutex);
 
-	ProcessAnimaiton();
+	vector<uint8> Commits;
 
-	Form::GetInstance().UpdateTimeline();
-}
+	for (FileSaveRequest* Request : Requests)
+		if (Request->Generation == SaveGeneration)
+			ProjectJournal::WriteCommit(Request->Histories, Request->Order, Request->State, Commits);
 
-float SerializationManager::GetAnimationLength(void)
-{
-	return AnimationLength;
+	if (!Commits.empty() && !ProjectJournal::Append(Requests[0]->FileName, Commits))
+		printf("Failed to append to %ls\n", Requests[0]->FileName.c_str());
+
+	LeaveCriticalSection(&FileMutex);
 }
 
-void SerializationManager::SetAnimationLength(float Length)
+void SerializationManager::Shutdown(void)
 {
-	AnimationLength = std::max(Length, 0.1f);
+	if (BackgroundThreadHandle == 0)
+		return;
 
-	ProcessAnimaiton();
+	DelayedFileSaveRequests.enqueue(nullptr);
 
-	Form::GetInstance().UpdateTimeline();
+	WaitForSingleObject(BackgroundThreadHandle, INFINITE);
+	CloseHandle(BackgroundThreadHandle);
+
+	BackgroundThreadHandle = 0;
 }
 
-void SerializationManager::GetStatesAndTFromPosition(float Position, float Length, CharacterSerializedState*& PrevState, CharacterSerializedState*& NextState, float& t)
+void SerializationManager::WriteFileSaveRequest(FileSaveRequest& Request)
 {
-	vector<CharacterSerializedState*> States;
+	if (Request.IsJournalCommit) {
 
-	for (SerializedStateHistory& History : Histories)
-		if (!History.IsDeleted)
-			States.push_back(&History.CurrentState.CharState);
+		vector<uint8> Commits;
+		ProjectJournal::WriteCommit(Request.Histories, Request.Order, Request.State, Commits);
+
+		if (!ProjectJournal::Append(Request.FileName, Commits))
+			printf("Failed to append to %ls\n", Request.FileName.c_str());
 
-	if (States.size() == 0) {
-		NextState = nullptr;
-		PrevState = nullptr;
-		t = 0.0f;
 		return;
 	}
 
-	if (States.size() == 1) {
+	// XML is only written on export, everything else goes to the project format
+	if (ChangeFileExt(Request.FileName, L".xml") != Request.FileName) {
 
-		PrevState = States.front();
-		NextState = States.back();
-		t = 0.0f;
+		wstring TempFileName = ChangeFileExt(Request.FileName, L".tmp");
+		wstring JournalFileName = ChangeFileExt(Request.FileName, ProjectJournal::Extension);
+
+		// the backup is taken from the same image
+		vector<uint8> Image;
+		ProjectFile::Write(Request.Histories, Request.State, Image);
+
+		uint32 Checksum = ProjectFile::SetChecksum(Image);
+
+		if (ProjectFile::SaveBuffer(Image, TempFileName, Request.IsCompressed)) {
+
+			wstring BackupFileName = ChangeFileExt(Request.FileName, wstring(ProjectFile::Extension) + L".backup");
+
+			// undo stacks not decoded yet may still read the loaded file, it can't be renamed over while mapped
+			ProjectFile::Unmap(Request.FileName);
+			ProjectFile::Unmap(BackupFileName);
+
+			SafeReplaceFile(TempFileName, Request.FileName, BackupFileName);
+
+			if (Request.Generation != 0 && !ProjectJournal::Start(JournalFileName, Checksum, Request.Order))
+				printf("Failed to write %ls\n", JournalFileName.c_str());
+
+			if (Request.Generation != 0 && !BackupStore::Add(Request.FileName, Image, Request.State, Request.IsCompressed, MaxBackupCount))
+				printf("Failed to back up %ls\n", Request.FileName.c_str());
+		}
+		else {
+			printf("Failed to write %ls\n", TempFileName.c_str());
+
+			// the commits that follow would not match the project file left in place
+			if (Request.Generation != 0)
+				DeleteFileW(JournalFileName.c_str());
+		}
+
+		return;
+	}
+
+	// every history is built and printed in a document of its own, indented as a child of Root,
+	// the file only joins the text
+	vector<string> Texts(Request.Histories.size() + 3);
+	Texts.front() = "<Root>";
+
+	concurrency::parallel_for((size_t)0, Request.Histories.size(), [this, &Request, &Texts](size_t Index) {
+
+		XMLDocument Document;
+
+		XMLElement* StatesElement = Document.NewElement("States");
+		Document.InsertFirstChild(StatesElement);
+
+		SaveStates(Request.Histories[Index], Document, StatesElement);
+
+		XMLPrinter Printer(nullptr, false, 1);
+		StatesElement->Accept(&Printer);
+
+		Texts[Index + 1] = string("\n    ") + Printer.CStr();
+	});
+
+	XMLDocument Document;
+
+	XMLNode* Root = Document.NewElement("Root");
+	Document.InsertFirstChild(Root);
+
+	Request.State.SaveToXML(Document, Root);
+
+	XMLPrinter Printer(nullptr, false, 1);
+	for (XMLNode* Node = Root->FirstChild(); Node != nullptr; Node = Node->NextSibling())
+		Node->Accept(&Printer);
+
+	Texts[Texts.size() - 2] = string("\n    ") + Printer.CStr();
+	Texts.back() = "\n</Root>\n";
+
+	SafeSaveTextToFile(Texts, Request.FileName);
+}
+
+void SerializationManager::PushStateFrame(const wstring Sender)
+{
+	if (!HaveCurrentHistory())
+		return;
+
+	printf("PUSH STATE, SENDER: %ws\n", Sender.c_str());
+
+	GetCurrentHistory()->FutureStates.Clear();
+	UpdateJournaledFrames(GetCurrentHistory()->FutureStates, GetCurrentHistory()->Journal.Future);
+
+	// the frame that would bring them back is gone
+	if (LastAddedKeyframes.IsUndone)
+		LastAddedKeyframes = {};
+
+	InternalPushStateFrame(false);
+}
+
+void SerializationManager::PushPendingStateFrame(SerializationPendingID PendingID, const wstring Sender)
+{
+	if (!HaveCurrentHistory())
+		return;
+
+	assert(PendingID != PendingNone);
+
+	ULONGLONG Now = GetTickCount64();
+
+	if (GetCurrentHistory()->CurrentState.PendingID != PendingID || PendingLastTime + PendingTimeout <= Now)
+		PushStateFrame(L"Pending (" + Sender + L")");
+
+	GetCurrentHistory()->CurrentState.PendingID = PendingID;
+	PendingLastTime = Now;
+}
+
+void SerializationManager::PopAndDeserializeStateFrame(bool Forward)
+{
+	if (!HaveCurrentHistory())
 		return;
+
+	SerializedStateStack& StackToUse = Forward ? GetCurrentHistory()->FutureStates : GetCurrentHistory()->PreviousStates;
+	JournaledFrames& JournaledStack = Forward ? GetCurrentHistory()->Journal.Future : GetCurrentHistory()->Journal.Previous;
+
+	if (!StackToUse.IsEmpty()) {
+
+		AddedKeyframes& Added = LastAddedKeyframes;
+
+		bool IsAddingKeyframes = !Added.IDs.empty() && Added.HistoryID == GetCurrentHistoryID() &&
+			Added.IsUndone == Forward && Added.FrameCount == StackToUse.Size();
+
+		InternalPushStateFrame(!Forward);
+
+		GetCurrentHistory()->CurrentState = StackToUse.Back();
+		StackToUse.Pop();
+		UpdateJournaledFrames(StackToUse, JournaledStack);
+
+		Deserialize();
+
+		if (IsAddingKeyframes)
+			ToggleAddedKeyframes();
+	}
+}
+
+void SerializationManager::ToggleAddedKeyframes(void)
+{
+	AddedKeyframes& Added = LastAddedKeyframes;
+
+	if (!Added.IsUndone) {
+
+		// keyframes deleted since stay with the deleted histories
+		for (auto History = Histories.begin(); History != Histories.end();)
+			if (!History->IsDeleted && find(Added.IDs.begin(), Added.IDs.end(), History->ID) != Added.IDs.end()) {
+				Added.Histories.push_back(std::move(*History));
+				History = Histories.erase(History);
+			}
+			else
+				History++;
+
+		Added.FrameCount = GetCurrentHistory()->FutureStates.Size();
+	}
+	else {
+
+		for (SerializedStateHistory& History : Added.Histories) {
+
+			// the journal dropped it with the undo
+			History.Journal = {};
+
+			Histories.insert(GetLatestHistory(), std::move(History));
+		}
+
+		Added.Histories.clear();
+		Added.FrameCount = GetCurrentHistory()->PreviousStates.Size();
 	}
 
+	Added.IsUndone = !Added.IsUndone;
+
+	Form::GetInstance().UpdateTimeline();
+}
+
+float SerializationManager::GetAnimationPosition(void)
+{
+	return AnimationPosition;
+}
+
+void SerializationManager::SetAnimationPosition(float Position)
+{
+	AnimationPosition = Position;
+
+	ProcessAnimaiton();
+
+	Form::GetInstance().UpdateTimeline();
+}
+
+float SerializationManager::GetAnimationLength(void)
+{
+	return AnimationLength;
+}
+
+void SerializationManager::SetAnimationLength(float Length)
+{
+	AnimationLength = std::max(Length, 0.1f);
+
+	ProcessAnimaiton();
+
+	Form::GetInstance().UpdateTimeline();
+}
+
+void SerializationManager::GetStatesAndTFromPosition(float Position, float Length, CharacterSerializedState*& PrevState, CharacterSerializedState*& NextState, float& t)
+{
+	vector<CharacterSerializedState*> States;
+
+	for (SerializedStateHistory& History : Histories)
+		if (!History.IsDeleted)
+			States.push_back(&History.CurrentState.CharState);
+
 	struct {
 		bool operator()(CharacterSerializedState*& a, CharacterSerializedState*& b) const
 		{
@@ -619,6 +1222,27 @@ void SerializationManager::GetStatesAndTFromPosition(float Position, float Lengt
 
 	sort(States.begin(), States.end(), StateComparer);
 
+	GetStatesAndTFromSortedStates(States, Position, Length, PrevState, NextState, t);
+}
+
+void SerializationManager::GetStatesAndTFromSortedStates(vector<CharacterSerializedState*>& States, float Position, float Length, 
+	CharacterSerializedState*& PrevState, CharacterSerializedState*& NextState, float& t)
+{
+	if (States.size() == 0) {
+		NextState = nullptr;
+		PrevState = nullptr;
+		t = 0.0f;
+		return;
+	}
+
+	if (States.size() == 1) {
+
+		PrevState = States.front();
+		NextState = States.back();
+		t = 0.0f;
+		return;
+	}
+
 	int StartIndex = 0;
 	int EndIndex = (int)States.size() - 1;
 
@@ -656,7 +1280,7 @@ void SerializationManager::GetStatesAndTFromPosition(float Position, float Lengt
 			}
 		}
 
-		throw new runtime_error("logical error in GetStatesAndTFromPosition");
+		throw new runtime_error("logical error in GetStatesAndTFromSortedStates");
 	}
 }
 
@@ -675,28 +1299,57 @@ void SerializationManager::ProcessAnimaiton(void)
 
 		if (PrevState != nullptr && NextState != nullptr) {
 
-			CharacterSerializedState InterpolatedState = {};
+			CharacterSerializedState InterpolatedState;
+			InterpolateStates(*PrevState, *NextState, t, InterpolatedState);
+
 			InterpolatedState.AnimationTimestamp = uint32(GetAnimationPosition() * 1000.0f);
 
-			InterpolatedState.Position = lerp(PrevState->Position, NextState->Position, t);
+			CharacterManager::GetInstance().Deserialize(InterpolatedState);
+		}
+	}
+}
 
-			for (int Index = 0; Index < PrevState->Bones.size(); Index++) {
+void SerializationManager::InterpolateStates(CharacterSerializedState& PrevState, CharacterSerializedState& NextState, float t, CharacterSerializedState& Result)
+{
+	Result = {};
 
-				SerializedBone PrevBone = PrevState->Bones[Index];
-				SerializedBone NextBone = NextState->Bones[Index];
+	Result.Position = lerp(PrevState.Position, NextState.Position, t);
 
-				SerializedBone InterpolatedBone;
-				InterpolatedBone.Name = PrevBone.Name;
-				InterpolatedBone.Rotation = slerp(PrevBone.Rotation, NextBone.Rotation, t);
+	for (int Index = 0; Index < PrevState.Bones.size(); Index++) {
 
-				InterpolatedState.Bones.push_back(InterpolatedBone);
-			}
+		SerializedBone& PrevBone = PrevState.Bones[Index];
+		SerializedBone& NextBone = NextState.Bones[Index];
 
-			CharacterManager::GetInstance().Deserialize(InterpolatedState);
-		}
+		SerializedBone InterpolatedBone;
+		InterpolatedBone.Name = PrevBone.Name;
+		InterpolatedBone.Rotation = slerp(PrevBone.Rotation, NextBone.Rotation, t);
+
+		Result.Bones.push_back(InterpolatedBone);
 	}
 }
 
+void SerializationManager::GetSortedKeyframes(vector<CharacterSerializedState>& Keyframes)
+{
+	Keyframes.clear();
+
+	for (SerializedStateHistory& History : Histories)
+		if (!History.IsDeleted)
+			Keyframes.push_back(History.CurrentState.CharState);
+
+	// the current history is only serialized on the next state change, the character is newer
+	if (!IsInKinematicMode() && !Keyframes.empty())
+		CharacterManager::GetInstance().Serialize(Keyframes.back());
+
+	struct {
+		bool operator()(const CharacterSerializedState& a, const CharacterSerializedState& b) const
+		{
+			return a.AnimationTimestamp < b.AnimationTimestamp;
+		}
+	} StateComparer;
+
+	stable_sort(Keyframes.begin(), Keyframes.end(), StateComparer);
+}
+
 vector<TimelineItem> SerializationManager::GetTimelineItems(void)
 {
 	vector<TimelineItem> Result;
@@ -720,8 +1373,10 @@ void SerializationManager::SetTimelineItems(vector<TimelineItem> Items)
 			CharacterManager::GetInstance().AnimationTimestamp = Timestamp;
 
 		auto History = GetHistoryByID(Item.ID);
-		if (History != Histories.end())
+		if (History != Histories.end()) {
 			History->CurrentState.CharState.AnimationTimestamp = Timestamp;
+			History->Journal.IsJournaled = false;
+		}
 	}
 }
 
@@ -832,52 +1487,99 @@ void SerializationManager::LoadFromFile(wstring FileName)
 
 	// fast cleanup
 	Histories.clear();
+	LastAddedKeyframes = {};
 
-	FILE* File = _wfopen(FileName.c_str(), L"rb");
-	if (File != nullptr) {
+	IsJournalStarted = false;
 
-		XMLDocument Document;
-		Document.LoadFile(File);
-		fclose(File);
+	SerializeSerializedState State;
+	bool HaveState = false, IsOpened = false, IsImported = false, IsRecovered = false, IsRestored = false, IsOutdated = false;
+
+	if (BackupStore::IsManifest(FileName)) {
+
+		IsOpened = true;
+
+		HaveState = BackupStore::Restore(FileName, Histories, State);
 
-		XMLNode* Root = Document.FirstChildElement("Root");
-		if (Root != nullptr) {
+		// restored next to the project it was taken from, the project and its journal stay as they are
+		FileName = GetUnusedProjectFileName(BackupStore::GetProjectFileName(FileName), L"restored");
+		IsRestored = true;
+
+		if (HaveState)
+			printf("Restored into %ls\n", FileName.c_str());
+
+		for (SerializedStateHistory& History : Histories)
+			History.ID = NextStateHistoryID++;
+	}
+	else
+	if (ProjectFile::IsProjectFile(FileName)) {
 
-			for (auto StatesElement : selection(Root->ToElement(), "States")) {
+		IsOpened = true;
 
-				SerializedStateHistory States;
+		uint32 Checksum;
+		HaveState = ProjectFile::Load(FileName, Histories, State, &Checksum, &IsOutdated);
 
-				LoadStates(States, Document, StatesElement);
+		// autosaves made after the last full save, left there by a crash
+		if (HaveState) {
 
-				Histories.push_back(States);
+			uint32 CommitCount = ProjectJournal::Replay(ChangeFileExt(FileName, ProjectJournal::Extension), Checksum, Histories, State);
+			if (CommitCount > 0) {
+				printf("Recovered %d autosaves from the journal\n", CommitCount);
+				IsRecovered = true;
 			}
+		}
 
-			struct {
-				bool operator()(SerializedStateHistory& a, SerializedStateHistory& b) const
-				{
-					if (a.IsDeleted && !b.IsDeleted)
-						return true;
+		if (HaveState && IsOutdated)
+			printf("Converting %ls to the current project file version\n", FileName.c_str());
 
-					if (!a.IsDeleted && b.IsDeleted)
-						return false;
+		for (SerializedStateHistory& History : Histories)
+			History.ID = NextStateHistoryID++;
+	}
+	else {
 
-					return a.ID < b.ID;
-				}
-			} HistoryComparer;
+		FILE* File = _wfopen(FileName.c_str(), L"rb");
+		if (File != nullptr) {
 
-			sort(Histories.begin(), Histories.end(), HistoryComparer);
+			IsOpened = true;
 
-			if (!Histories.empty()) {
+			if (!LoadHistoriesFromXML(File, State, HaveState))
+				printf("%ls is not a valid project file\n", FileName.c_str());
 
-				GetCurrentHistory()->CurrentState.InputState.State = None;
-				Deserialize();
+			fclose(File);
+
+			// imported, saving goes to the project format next to it without replacing a project already there
+			FileName = GetUnusedProjectFileName(ChangeFileExt(FileName, ProjectFile::Extension), L"imported");
+			IsImported = true;
+
+			printf("Imported into %ls\n", FileName.c_str());
+		}
+	}
+
+	if (IsOpened) {
+
+		struct {
+			bool operator()(SerializedStateHistory& a, SerializedStateHistory& b) const
+			{
+				if (a.IsDeleted && !b.IsDeleted)
+					return true;
+
+				if (!a.IsDeleted && b.IsDeleted)
+					return false;
+
+				return a.ID < b.ID;
 			}
+		} HistoryComparer;
+
+		sort(Histories.begin(), Histories.end(), HistoryComparer);
+
+		if (!Histories.empty()) {
 
-			SerializeSerializedState State;
-			if (State.LoadFromXML(Document, Root))
-				Deserialize(State);
+			GetCurrentHistory()->CurrentState.InputState.State = None;
+			Deserialize();
 		}
 
+		if (HaveState)
+			Deserialize(State);
+
 		LastAutosaveTime = GetTickCount64();
 	}
 
@@ -896,47 +1598,47 @@ void SerializationManager::LoadFromFile(wstring FileName)
 		SaveSettings();
 	}
 
+	// the project file has to exist before the next start opens it, a recovered or restored one starts a new journal
+	// and an outdated one is converted
+	if (IsImported || IsRecovered || IsRestored || IsOutdated)
+		Autosave();
+
 	Form::GetInstance().UpdateTimeline();
 }
 
 void SerializationManager::SaveToFile(wstring FileName, bool Delay)
 {
-	FileName = ChangeFileExt(FileName, L".xml");
+	FileName = ChangeFileExt(FileName, ProjectFile::Extension);
 
-	if (HaveCurrentHistory()) {
+	SerializeCurrentHistory();
 
-		SingleSerializedState& State = GetCurrentHistory()->CurrentState;
-		State.HaveCharState = true;
-		State.HaveInputState = true;
-		State.HavePoseState = true;
-		State.HaveRenderState = true;
-		Serialize();
-	}
-	else {
-
-		SingleSerializedState& State = GetLatestHistory()->CurrentState;
+	FileSaveRequest* Request = new FileSaveRequest();
+	Request->Histories = Histories;
+	Serialize(Request->State);
+	Request->FileName = FileName;
+	Request->IsCompressed = IsCompressionEnabled;
 
-		Render::GetInstance().Serialize(State.RenderState);
-		State.HaveRenderState = true;
-	}
+	for (SerializedStateHistory& History : Histories)
+		Request->Order.push_back(History.ID);
 
-	if (Delay) {
-		FileSaveRequest* Request = new FileSaveRequest();
-		Request->Histories = Histories;
-		Serialize(Request->State);
-		Request->FileName = FileName;
+	EnterCriticalSection(&FileMutex);
+	Request->Generation = ++SaveGeneration;
+	LeaveCriticalSection(&FileMutex);
 
+	if (Delay)
 		DelayedFileSaveRequests.enqueue(Request);
-	}
 	else {
-		FileSaveRequest Request;
-		Request.Histories = Histories;
-		Serialize(Request.State);
-		Request.FileName = FileName;
-
-		ExecuteFileSaveRequest(Request);
+		ExecuteFileSaveRequest(*Request);
+		delete Request;
 	}
 
+	// the journal starts over from this file
+	for (SerializedStateHistory& History : Histories)
+		SetHistoryJournaled(History);
+
+	IsJournalStarted = true;
+	JournalCommitCount = 0;
+
 	if (LastFileName != FileName) {
 
 		LastFileName = FileName;
@@ -963,6 +1665,10 @@ void SerializationManager::LoadSettings(void)
 		XMLElement* LastFile = Settings->FirstChildElement("LastFile");
 		if (LastFile != nullptr)
 			LastFileName = s2ws(attribute_value(LastFile, "Name"));
+
+		XMLElement* Compression = Settings->FirstChildElement("Compression");
+		if (Compression != nullptr)
+			IsCompressionEnabled = Compression->BoolAttribute("Enabled", true);
 	}
 
 	LoadFromFile(LastFileName);
@@ -979,34 +1685,14 @@ void SerializationManager::SaveSettings(void)
 	Settings->InsertEndChild(LastFile);
 	LastFile->SetAttribute("Name", ws2s(LastFileName).c_str());
 
-	SafeSaveDocumentToFile(Document, SettingsFileName, 0);
-}
-
-void SerializationManager::LoadState(SingleSerializedState& State, XMLDocument& Document, XMLNode* Root)
-{
-	State.HaveCharState = false;
-	State.HaveInputState = false;
-	State.HavePoseState = false;
-	State.HaveRenderState = false;
-
-	XMLElement* Pending = Root->FirstChildElement("Pending");
-	if (Pending != nullptr)
-		State.PendingID = (SerializationPendingID)attribute_uint32_value(Pending, "ID");
-
-	if (State.CharState.LoadFromXML(Document, Root))
-		State.HaveCharState = true;
+	XMLElement* Compression = Document.NewElement("Compression");
+	Settings->InsertEndChild(Compression);
+	Compression->SetAttribute("Enabled", IsCompressionEnabled);
 
-	if (State.InputState.LoadFromXML(Document, Root))
-		State.HaveInputState = true;
-
-	if (State.PoseState.LoadFromXML(Document, Root))
-		State.HavePoseState = true;
-
-	if (State.RenderState.LoadFromXML(Document, Root))
-		State.HaveRenderState = true;
+	SafeSaveDocumentToFile(Document, SettingsFileName, 0);
 }
 
-void SerializationManager::SaveState(SingleSerializedState& State, XMLDocument& Document, XMLNode* Root)
+void SerializationManager::SaveState(const SingleSerializedState& State, XMLDocument& Document, XMLNode* Root)
 {
 	XMLElement* PendingState = Document.NewElement("Pending");
 	PendingState->SetAttribute("ID", (uint32)State.PendingID);
@@ -1022,73 +1708,582 @@ void SerializationManager::SaveState(SingleSerializedState& State, XMLDocument&
 		State.RenderState.SaveToXML(Document, Root);
 }
 
-void SerializationManager::LoadStates(SerializedStateHistory& States, XMLDocument& Document, XMLNode* Root)
+bool SerializationManager::LoadHistoriesFromXML(FILE* File, SerializeSerializedState& State, bool& HaveState)
 {
-	XMLElement* CurrentStateElement = Root->FirstChildElement("CurrentState");
-	if (CurrentStateElement != nullptr) {
+	XMLStreamReader Reader(File);
+
+	auto ReadVector = [&Reader](void) {
+		return vec3(Reader.GetFloatAttribute("X"), Reader.GetFloatAttribute("Y"), Reader.GetFloatAttribute("Z"));
+	};
+
+	// names of the open elements, Root first
+	vector<string> Path;
+
+	SerializedStateHistory History = {};
+	SingleSerializedState* Current = nullptr;
+
+	// undo frames are pushed once complete
+	SingleSerializedState Frame;
+
+	HaveState = false;
+
+	while (true) {
+
+		XMLStreamEvent Event = Reader.Next();
 
-		LoadState(States.CurrentState, Document, CurrentStateElement);
+		if (Event == XMLStreamEnd)
+			return Path.empty();
 
-		States.PreviousStates.clear();
-		for (auto PreviousStateElement : selection(Root->ToElement(), "PreviousState")) {
+		if (Event == XMLStreamError)
+			return false;
 
-			SingleSerializedState PreviousState;
+		const string& Name = Reader.GetName();
 
-			LoadState(PreviousState, Document, PreviousStateElement);
+		if (Event == XMLElementEnd) {
 
-			States.PreviousStates.push_back(PreviousState);
+			if (Path.empty() || Path.back() != Name)
+				return false;
+
+			Path.pop_back();
+
+			if (Path.size() == 2 && Path[1] == "States") {
+
+				if (Name == "PreviousState")
+					History.PreviousStates.Push(std::move(Frame));
+				else
+				if (Name == "FutureState")
+					History.FutureStates.Push(std::move(Frame));
+
+				Current = nullptr;
+			}
+			else
+			if (Path.size() == 1 && Name == "States") {
+
+				LimitFrames(History.PreviousStates, MaxFrames);
+				LimitFrames(History.FutureStates, MaxFrames);
+
+				History.ID = NextStateHistoryID++;
+
+				Histories.push_back(std::move(History));
+				History = {};
+			}
+
+			continue;
 		}
 
-		LimitFrames(States.PreviousStates, MaxFrames);
+		size_t Depth = Path.size();
+		Path.push_back(Name);
+
+		if (Depth == 0) {
+			if (Name != "Root")
+				return false;
+		}
+		else
+		if (Depth == 1) {
 
-		States.FutureStates.clear();
-		for (auto FutureStateElement : selection(Root->ToElement(), "FutureState")) {
+			if (Name == "States")
+				History.IsDeleted = Reader.GetBoolAttribute("IsDeleted", false);
+			else
+			if (Name == "SerializeState") {
+				State = {};
+				HaveState = true;
+			}
+		}
+		else
+		if (Depth == 2) {
 
-			SingleSerializedState FutureState;
+			if (Path[1] == "States") {
 
-			LoadState(FutureState, Document, FutureStateElement);
+				if (Name == "PreviousState" || Name == "FutureState") {
+					Frame = {};
+					Current = &Frame;
+				}
+				else
+				if (Name == "CurrentState") {
+					History.CurrentState = {};
+					Current = &History.CurrentState;
+				}
+			}
+			else
+			if (Path[1] == "SerializeState" && Name == "Animation") {
+				State.AnimationPosition = Reader.GetFloatAttribute("Position");
+				State.AnimationLength = Reader.GetFloatAttribute("Length");
+				State.KinematicModeFlag = Reader.GetBoolAttribute("KinematicMode", false);
+				State.LoopAnimationFlag = Reader.GetBoolAttribute("Loop", false);
+				State.PlayAnimaionFlag = Reader.GetBoolAttribute("Play", false);
+				State.PlaySpeed = Reader.GetFloatAttribute("Speed", 1);
+			}
+		}
+		else
+		if (Current == nullptr)
+			continue;
+		else
+		if (Depth == 3) {
 
-			States.FutureStates.push_back(FutureState);
+			if (Name == "Pending")
+				Current->PendingID = (SerializationPendingID)Reader.GetUInt32Attribute("ID");
+			else
+			if (Name == "CharState") {
+				Current->CharState = {};
+				Current->HaveCharState = true;
+			}
+			else
+			if (Name == "InputState") {
+				Current->InputState = {};
+				Current->HaveInputState = true;
+			}
+			else
+			if (Name == "PoseState") {
+				Current->PoseState = {};
+				Current->HavePoseState = true;
+			}
+			else
+			if (Name == "RenderState") {
+				Current->RenderState = {};
+				Current->HaveRenderState = true;
+			}
 		}
-		LimitFrames(States.FutureStates, MaxFrames);
-	}
-	else
-		States = { };
+		else
+		if (Depth == 4) {
+
+			const string& Section = Path[3];
+
+			if (Section == "CharState") {
+
+				CharacterSerializedState& CharState = Current->CharState;
 
-	States.IsDeleted = attribute_bool_value(Root->ToElement(), "IsDeleted", false);
+				if (Name == "Animation")
+					CharState.AnimationTimestamp = Reader.GetUInt32Attribute("Timestamp");
+				else
+				if (Name == "Position")
+					CharState.Position = ReadVector();
+				else
+				if (Name == "Bone") {
 
-	States.ID = NextStateHistoryID++;
+					SerializedBone SerializedBone = { };
+					SerializedBone.Name = s2ws(Reader.GetAttribute("Name"));
+
+					CharState.Bones.push_back(SerializedBone);
+				}
+			}
+			else
+			if (Section == "InputState") {
+
+				InputSerializedState& InputState = Current->InputState;
+
+				if (Name == "Bone")
+					InputState.BoneName = s2ws(Reader.GetAttribute("Name"));
+				else
+				if (Name == "State")
+					InputState.State = Reader.GetUInt32Attribute("Value");
+				else
+				if (Name == "PlaneMode")
+					InputState.PlaneMode = Reader.GetUInt32Attribute("Value");
+				else
+				if (Name == "LocalPoint")
+					InputState.LocalPoint = ReadVector();
+				else
+				if (Name == "WorldPoint")
+					InputState.WorldPoint = ReadVector();
+			}
+			else
+			if (Section == "PoseState" && Name == "Context") {
+
+				SerializedPoseContext SerializedContext = {};
+				SerializedContext.BoneName = s2ws(Reader.GetAttribute("Name"));
+
+				Current->PoseState.Contexts.push_back(SerializedContext);
+			}
+			else
+			if (Section == "RenderState") {
+
+				RenderSerializedState& RenderState = Current->RenderState;
+
+				if (Name == "CameraPosition")
+					RenderState.CameraPosition = ReadVector();
+				else
+				if (Name == "CameraAngle") {
+					RenderState.CameraAngleX = radians(Reader.GetFloatAttribute("X"));
+					RenderState.CameraAngleZ = radians(Reader.GetFloatAttribute("Z"));
+				}
+			}
+		}
+		else
+		if (Depth == 5) {
+
+			const string& Section = Path[3];
+			const string& Parent = Path[4];
+
+			if (Section == "CharState" && Parent == "Bone" && Name == "Rotation") {
+
+				quat& Rotation = Current->CharState.Bones.back().Rotation;
+				Rotation.x = Reader.GetFloatAttribute("X");
+				Rotation.y = Reader.GetFloatAttribute("Y");
+				Rotation.z = Reader.GetFloatAttribute("Z");
+				Rotation.w = Reader.GetFloatAttribute("W");
+			}
+			else
+			if (Section == "PoseState" && Parent == "Context") {
+
+				SerializedPoseContext& SerializedContext = Current->PoseState.Contexts.back();
+
+				if (Name == "Blocking") {
+					SerializedContext.Blocking.XPos = Reader.GetBoolAttribute("XPos");
+					SerializedContext.Blocking.YPos = Reader.GetBoolAttribute("YPos");
+					SerializedContext.Blocking.ZPos = Reader.GetBoolAttribute("ZPos");
+					SerializedContext.Blocking.XAxis = Reader.GetBoolAttribute("XAxis");
+					SerializedContext.Blocking.YAxis = Reader.GetBoolAttribute("YAxis");
+					SerializedContext.Blocking.ZAxis = Reader.GetBoolAttribute("ZAxis");
+				}
+				else
+				if (Name == "Pinpoint")
+					SerializedContext.IsActive = Reader.GetBoolAttribute("IsActive");
+				else
+				if (Name == "SrcLocalPoint")
+					SerializedContext.SrcLocalPoint = ReadVector();
+				else
+				if (Name == "DestWorldPoint")
+					SerializedContext.DestWorldPoint = ReadVector();
+			}
+		}
+	}
 }
 
 void SerializationManager::SaveStates(SerializedStateHistory& States, XMLDocument& Document, XMLNode* Root)
 {
 	Root->ToElement()->SetAttribute("IsDeleted", States.IsDeleted);
 
-	for (SingleSerializedState& State : States.PreviousStates) {
+	States.PreviousStates.ForEach([this, &Document, Root](const SingleSerializedState& State) {
 
 		XMLNode* PreviousState = Document.NewElement("PreviousState");
 		Root->InsertEndChild(PreviousState);
 
 		SaveState(State, Document, PreviousState);
-	}
+	});
 
 	XMLNode* CurrentState = Document.NewElement("CurrentState");
 	Root->InsertEndChild(CurrentState);
 
 	SaveState(States.CurrentState, Document, CurrentState);
 
-	for (SingleSerializedState& State : States.FutureStates) {
+	States.FutureStates.ForEach([this, &Document, Root](const SingleSerializedState& State) {
 
 		XMLNode* FutureState = Document.NewElement("FutureState");
 		Root->InsertEndChild(FutureState);
 
 		SaveState(State, Document, FutureState);
+	});
+}
+
+// SerializedStateStack
+
+void SerializedStateStack::Materialize(void) const
+{
+	if (Pending == nullptr)
+		return;
+
+	PendingFrames& Source = *Pending;
+
+	call_once(Source.IsLoaded, [&Source]() {
+
+		SerializedStateStack Stack;
+		Source.Load(Stack);
+
+		Source.Items = Stack.Items;
+		// releases what the loader holds on to
+		Source.Load = nullptr;
+	});
+
+	Items = Source.Items;
+	Pending = nullptr;
+}
+
+SerializedStateStack::Frames& SerializedStateStack::GetWritableItems(void)
+{
+	Materialize();
+
+	if (Items == nullptr)
+		Items = make_shared<Frames>();
+	else
+	// another copy of the stack still sees the frames as they are
+	if (Items.use_count() > 1)
+		Items = make_shared<Frames>(*Items);
+
+	return *Items;
+}
+
+shared_ptr<const SerializedStateStack::Frame> SerializedStateStack::CreateKeyframe(SingleSerializedState&& State)
+{
+	shared_ptr<Frame> Result = make_shared<Frame>();
+	Result->State = std::move(State);
+	Result->KeyframeDistance = 0;
+
+	return Result;
+}
+
+bool SerializedStateStack::IsSameContext(const SerializedPoseContext& A, const SerializedPoseContext& B)
+{
+	return A.Blocking.XAxis == B.Blocking.XAxis && A.Blocking.YAxis == B.Blocking.YAxis && A.Blocking.ZAxis == B.Blocking.ZAxis &&
+		A.Blocking.XPos == B.Blocking.XPos && A.Blocking.YPos == B.Blocking.YPos && A.Blocking.ZPos == B.Blocking.ZPos &&
+		A.IsActive == B.IsActive && A.SrcLocalPoint == B.SrcLocalPoint && A.DestWorldPoint == B.DestWorldPoint;
+}
+
+void SerializedStateStack::ApplyFrame(const Frame& Delta, SingleSerializedState& State)
+{
+	const SingleSerializedState& Source = Delta.State;
+
+	State.PendingID = Source.PendingID;
+
+	State.CharState.AnimationTimestamp = Source.CharState.AnimationTimestamp;
+	State.CharState.Position = Source.CharState.Position;
+	State.InputState = Source.InputState;
+	State.RenderState = Source.RenderState;
+
+	State.HaveCharState = Source.HaveCharState;
+	State.HaveInputState = Source.HaveInputState;
+	State.HavePoseState = Source.HavePoseState;
+	State.HaveRenderState = Source.HaveRenderState;
+
+	for (const pair<uint32, quat>& Change : Delta.ChangedBones)
+		State.CharState.Bones[Change.first].Rotation = Change.second;
+
+	for (const pair<uint32, SerializedPoseContext>& Change : Delta.ChangedContexts)
+		State.PoseState.Contexts[Change.first] = Change.second;
+}
+
+void SerializedStateStack::Decode(size_t Index, SingleSerializedState& State) const
+{
+	Materialize();
+
+	const Frames& Entries = *Items;
+
+	size_t First = Index;
+	while (Entries[First]->KeyframeDistance != 0)
+		First--;
+
+	State = Entries[First]->State;
+
+	for (size_t Next = First + 1; Next <= Index; Next++)
+		ApplyFrame(*Entries[Next], State);
+
+	State.Physics = Entries[Index]->State.Physics;
+}
+
+bool SerializedStateStack::GetChanges(const SingleSerializedState& Base, const SingleSerializedState& State, vector<uint32>& ChangedBones, vector<uint32>& ChangedContexts)
+{
+	const vector<SerializedBone>& BaseBones = Base.CharState.Bones;
+	const vector<SerializedBone>& Bones = State.CharState.Bones;
+
+	const vector<SerializedPoseContext>& BaseContexts = Base.PoseState.Contexts;
+	const vector<SerializedPoseContext>& Contexts = State.PoseState.Contexts;
+
+	if (BaseBones.size() != Bones.size() || BaseContexts.size() != Contexts.size())
+		return false;
+
+	ChangedBones.clear();
+	ChangedContexts.clear();
+
+	for (size_t Index = 0; Index < Bones.size(); Index++) {
+
+		if (Bones[Index].Name != BaseBones[Index].Name)
+			return false;
+
+		if (Bones[Index].Rotation != BaseBones[Index].Rotation)
+			ChangedBones.push_back((uint32)Index);
+	}
+
+	for (size_t Index = 0; Index < Contexts.size(); Index++) {
+
+		if (Contexts[Index].BoneName != BaseContexts[Index].BoneName)
+			return false;
+
+		if (!IsSameContext(Contexts[Index], BaseContexts[Index]))
+			ChangedContexts.push_back((uint32)Index);
+	}
+
+	return true;
+}
+
+size_t SerializedStateStack::Size(void) const
+{
+	if (Pending != nullptr)
+		return Pending->Count;
+
+	return Items != nullptr ? Items->size() : 0;
+}
+
+bool SerializedStateStack::IsEmpty(void) const
+{
+	return Size() == 0;
+}
+
+void SerializedStateStack::SetPending(size_t Count, function<void(SerializedStateStack& Stack)> Load)
+{
+	Items = nullptr;
+	Pending = nullptr;
+
+	if (Count == 0)
+		return;
+
+	Pending = make_shared<PendingFrames>();
+	Pending->Count = Count;
+	Pending->Load = std::move(Load);
+}
+
+SingleSerializedState SerializedStateStack::Back(void) const
+{
+	SingleSerializedState Result;
+	Decode(Size() - 1, Result);
+
+	return Result;
+}
+
+void SerializedStateStack::ForEach(const function<void(const SingleSerializedState& State)>& Visitor) const
+{
+	Materialize();
+
+	if (Items == nullptr)
+		return;
+
+	SingleSerializedState State;
+
+	for (const shared_ptr<const Frame>& Entry : *Items) {
+
+		if (Entry->KeyframeDistance == 0)
+			State = Entry->State;
+		else {
+			ApplyFrame(*Entry, State);
+			State.Physics = Entry->State.Physics;
+		}
+
+		Visitor(State);
 	}
 }
 
+void SerializedStateStack::Push(const SingleSerializedState& State)
+{
+	Push(SingleSerializedState(State));
+}
+
+void SerializedStateStack::Push(SingleSerializedState&& State)
+{
+	Frames& Entries = GetWritableItems();
+
+	shared_ptr<Frame> Entry = make_shared<Frame>();
+	Entry->KeyframeDistance = 0;
+
+	if (!Entries.empty() && Entries.back()->KeyframeDistance + 1 < KeyframeInterval) {
+
+		SingleSerializedState Base;
+		Decode(Entries.size() - 1, Base);
+
+		vector<uint32> ChangedBones, ChangedContexts;
+
+		if (GetChanges(Base, State, ChangedBones, ChangedContexts)) {
+
+			Entry->KeyframeDistance = Entries.back()->KeyframeDistance + 1;
+
+			for (uint32 Index : ChangedBones)
+				Entry->ChangedBones.push_back({ Index, State.CharState.Bones[Index].Rotation });
+
+			for (uint32 Index : ChangedContexts)
+				Entry->ChangedContexts.push_back({ Index, State.PoseState.Contexts[Index] });
+		}
+	}
+
+	Entry->State = std::move(State);
+
+	if (Entry->KeyframeDistance != 0) {
+		Entry->State.CharState.Bones = vector<SerializedBone>();
+		Entry->State.PoseState.Contexts = vector<SerializedPoseContext>();
+	}
+
+	Entries.push_back(Entry);
+
+	// the frame falling behind the newest ones gives up its snapshot
+	if (Entries.size() > SnapshotFrames) {
+
+		shared_ptr<const Frame>& Older = Entries[Entries.size() - 1 - SnapshotFrames];
+
+		if (!Older->State.Physics.Bodies.empty()) {
+			shared_ptr<Frame> Stripped = make_shared<Frame>(*Older);
+			Stripped->State.Physics = {};
+			Older = Stripped;
+		}
+	}
+}
+
+void SerializedStateStack::Append(const SerializedStateStack& Other, size_t Index)
+{
+	if (Index >= Other.Size())
+		return;
+
+	Other.Materialize();
+
+	shared_ptr<Frames> Source = Other.Items;
+
+	Frames& Destination = GetWritableItems();
+
+	// the first frame is a delta against one that isn't taken
+	if ((*Source)[Index]->KeyframeDistance != 0) {
+
+		SingleSerializedState First;
+		Other.Decode(Index, First);
+
+		Destination.push_back(CreateKeyframe(std::move(First)));
+		Index++;
+	}
+
+	Destination.insert(Destination.end(), Source->begin() + Index, Source->end());
+}
+
+void SerializedStateStack::Pop(void)
+{
+	GetWritableItems().pop_back();
+}
+
+void SerializedStateStack::Clear(void)
+{
+	Items = nullptr;
+	Pending = nullptr;
+}
+
+void SerializedStateStack::RemoveFront(size_t Count)
+{
+	if (Count == 0)
+		return;
+
+	if (Count >= Size()) {
+		Clear();
+		return;
+	}
+
+	Frames& Writable = GetWritableItems();
+
+	// the new bottom frame becomes a keyframe
+	if (Writable[Count]->KeyframeDistance != 0) {
+
+		SingleSerializedState Front;
+		Decode(Count, Front);
+
+		Writable[Count] = CreateKeyframe(std::move(Front));
+	}
+
+	Writable.erase(Writable.begin(), Writable.begin() + Count);
+}
+
+void SerializedStateStack::Truncate(size_t Count)
+{
+	if (Count >= Size())
+		return;
+
+	Frames& Writable = GetWritableItems();
+	Writable.erase(Writable.begin() + Count, Writable.end());
+}
+
 // CharacterSerializedState
 
-void CharacterSerializedState::SaveToXML(XMLDocument& Document, XMLNode *Root)
+void CharacterSerializedState::SaveToXML(XMLDocument& Document, XMLNode *Root) const
 {
 	XMLNode* CharState = Document.NewElement("CharState");
 
@@ -1102,7 +2297,7 @@ void CharacterSerializedState::SaveToXML(XMLDocument& Document, XMLNode *Root)
 	Position->SetAttribute("Z", this->Position.z);
 	CharState->InsertEndChild(Position);
 
-	for (SerializedBone& Bone : Bones) {
+	for (const SerializedBone& Bone : Bones) {
 
 		XMLElement* BoneElement = Document.NewElement("Bone");
 		BoneElement->SetAttribute("Name", ws2s(Bone.Name).c_str());
@@ -1160,7 +2355,7 @@ bool CharacterSerializedState::LoadFromXML(XMLDocument& Document, XMLNode* Root)
 
 // InputSerializedState
 
-void InputSerializedState::SaveToXML(XMLDocument & Document, XMLNode* Root)
+void InputSerializedState::SaveToXML(XMLDocument & Document, XMLNode* Root) const
 {
 	XMLNode* InputState = Document.NewElement("InputState");
 
@@ -1230,11 +2425,11 @@ bool InputSerializedState::LoadFromXML(XMLDocument& Document, XMLNode* Root)
 
 // PoseSerializedState
 
-void PoseSerializedState::SaveToXML(XMLDocument& Document, XMLNode* Root)
+void PoseSerializedState::SaveToXML(XMLDocument& Document, XMLNode* Root) const
 {
 	XMLNode* PoseState = Document.NewElement("PoseState");
 
-	for (SerializedPoseContext& Context : Contexts) {
+	for (const SerializedPoseContext& Context : Contexts) {
 
 		XMLElement* ContextElement = Document.NewElement("Context");
 		ContextElement->SetAttribute("Name", ws2s(Context.BoneName).c_str());
@@ -1319,7 +2514,7 @@ bool PoseSerializedState::LoadFromXML(XMLDocument& Document, XMLNode* Root)
 
 // RenderSerializedState
 
-void RenderSerializedState::SaveToXML(XMLDocument& Document, XMLNode* Root)
+void RenderSerializedState::SaveToXML(XMLDocument& Document, XMLNode* Root) const
 {
 	XMLNode* RenderState = Document.NewElement("RenderState");
 
@@ -1363,7 +2558,7 @@ bool RenderSerializedState::LoadFromXML(XMLDocument& Document, XMLNode* Root)
 
 // SerializeSerializedState
 
-void SerializeSerializedState::SaveToXML(XMLDocument& Document, XMLNode* Root)
+void SerializeSerializedState::SaveToXML(XMLDocument& Document, XMLNode* Root) const
 {
 	XMLNode* SerializeState = Document.NewElement("SerializeState");
 
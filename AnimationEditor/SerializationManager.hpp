@@ -1,5 +1,8 @@
 #pragma once
 
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -14,6 +17,7 @@
 #include "blockingconcurrentqueue.h"
 
 #include "ExternalGUI.hpp"
+#include "PhysicsManager.hpp"
 
 using namespace std;
 using namespace glm;
@@ -32,7 +36,7 @@ typedef struct CharacterSerializedState {
 	vec3 Position;
 	vector<SerializedBone> Bones;
 
-	void SaveToXML(XMLDocument& Document, XMLNode *Root);
+	void SaveToXML(XMLDocument& Document, XMLNode *Root) const;
 	bool LoadFromXML(XMLDocument& Document, XMLNode *Root);
 } CharacterSerializedState;
 
@@ -43,7 +47,7 @@ typedef struct InputSerializedState {
 	wstring BoneName;
 	vec3 LocalPoint, WorldPoint;
 
-	void SaveToXML(XMLDocument& Document, XMLNode *Root);
+	void SaveToXML(XMLDocument& Document, XMLNode *Root) const;
 	bool LoadFromXML(XMLDocument& Document, XMLNode *Root);
 } InputSerializedState;
 
@@ -62,7 +66,7 @@ typedef struct SerializedPoseContext {
 typedef struct PoseSerializedState {
 	vector<SerializedPoseContext> Contexts;
 
-	void SaveToXML(XMLDocument& Document, XMLNode *Root);
+	void SaveToXML(XMLDocument& Document, XMLNode *Root) const;
 	bool LoadFromXML(XMLDocument& Document, XMLNode *Root);
 } PoseSerializedState;
 
@@ -70,7 +74,7 @@ typedef struct RenderSerializedState {
 	vec3 CameraPosition;
 	float CameraAngleX, CameraAngleZ;
 
-	void SaveToXML(XMLDocument& Document, XMLNode *Root);
+	void SaveToXML(XMLDocument& Document, XMLNode *Root) const;
 	bool LoadFromXML(XMLDocument& Document, XMLNode *Root);
 } RenderSerializedState;
 
@@ -78,7 +82,7 @@ typedef struct SerializeSerializedState {
 	float AnimationPosition, AnimationLength, PlaySpeed;
 	bool KinematicModeFlag, PlayAnimaionFlag, LoopAnimationFlag;
 
-	void SaveToXML(XMLDocument& Document, XMLNode *Root);
+	void SaveToXML(XMLDocument& Document, XMLNode *Root) const;
 	bool LoadFromXML(XMLDocument& Document, XMLNode *Root);
 } SerializeSerializedState;
 
@@ -98,14 +102,111 @@ typedef struct SingleSerializedState {
 	RenderSerializedState RenderState;
 
 	bool HaveCharState, HaveInputState, HavePoseState, HaveRenderState;
+
+	// taken together with PoseState, only kept in memory
+	PhysicsSnapshot Physics;
 } SingleSerializedState;
 
+// Undo frames of a history. Frames don't change once pushed and are shared between copies of
+// the stack, so a save request takes the stacks without copying a frame; a stack still shared
+// copies its frame pointers on the first change. A frame only keeps the bones and contexts that
+// changed since the frame below it, a whole state is kept every KeyframeInterval frames, at the
+// bottom of the stack and whenever the bones themselves change.
+// A stack read from a project file can be left pending: it only knows its size until a frame is
+// needed, the copies made meanwhile decode it once between them.
+typedef class SerializedStateStack {
+private:
+	typedef struct Frame {
+		// without bones and contexts unless this is a keyframe
+		SingleSerializedState State;
+		// frames since the last keyframe, 0 for a keyframe
+		uint32 KeyframeDistance;
+		// by index into the bones and contexts of the frame below
+		vector<pair<uint32, quat>> ChangedBones;
+		vector<pair<uint32, SerializedPoseContext>> ChangedContexts;
+	} Frame;
+
+	typedef vector<shared_ptr<const Frame>> Frames;
+
+	typedef struct PendingFrames {
+		size_t Count;
+		// pushes the frames onto the stack it's given
+		function<void(SerializedStateStack& Stack)> Load;
+
+		once_flag IsLoaded;
+		shared_ptr<Frames> Items;
+	} PendingFrames;
+
+	// null while empty, both are only changed by the thread owning this copy of the stack
+	mutable shared_ptr<Frames> Items;
+	// null once the frames are decoded
+	mutable shared_ptr<PendingFrames> Pending;
+
+	// everything but Size reads the frames through it
+	void Materialize(void) const;
+
+	Frames& GetWritableItems(void);
+
+	static shared_ptr<const Frame> CreateKeyframe(SingleSerializedState&& State);
+	static bool IsSameContext(const SerializedPoseContext& A, const SerializedPoseContext& B);
+	// everything but the physics snapshot
+	static void ApplyFrame(const Frame& Delta, SingleSerializedState& State);
+
+	void Decode(size_t Index, SingleSerializedState& State) const;
+public:
+	static const uint32 KeyframeInterval = 32;
+	// only the newest frames keep their physics snapshot, older ones are restored without one
+	static const size_t SnapshotFrames = 16;
+
+	// false when State doesn't have the bones and contexts of Base in the same order
+	static bool GetChanges(const SingleSerializedState& Base, const SingleSerializedState& State, vector<uint32>& ChangedBones, vector<uint32>& ChangedContexts);
+
+	size_t Size(void) const;
+	bool IsEmpty(void) const;
+
+	// replaces the frames with Count frames that Load decodes the first time any of them is needed,
+	// Load has to push exactly Count frames
+	void SetPending(size_t Count, function<void(SerializedStateStack& Stack)> Load);
+
+	// decoded from the keyframe below it
+	SingleSerializedState Back(void) const;
+	// decodes every frame once, oldest first
+	void ForEach(const function<void(const SingleSerializedState& State)>& Visitor) const;
+
+	void Push(const SingleSerializedState& State);
+	void Push(SingleSerializedState&& State);
+	// shares the frames of Other from Index on
+	void Append(const SerializedStateStack& Other, size_t Index = 0);
+
+	void Pop(void);
+	void Clear(void);
+	// drops the first Count frames
+	void RemoveFront(size_t Count);
+	// keeps the first Count frames
+	void Truncate(size_t Count);
+} SerializedStateStack;
+
+// frames of an undo stack already written to the journal, the ones still in the stack
+// are its first Kept frames and were at Dropped in the journaled stack
+typedef struct JournaledFrames {
+	uint32 Dropped, Kept;
+} JournaledFrames;
+
+// zero for a history the journal hasn't seen yet
+typedef struct HistoryJournalState {
+	bool IsJournaled;
+	JournaledFrames Previous, Future;
+} HistoryJournalState;
+
 typedef struct SerializedStateHistory {
 	int32 ID;
 	bool IsDeleted;
 
-	vector<SingleSerializedState> PreviousStates, FutureStates;
+	SerializedStateStack PreviousStates, FutureStates;
 	SingleSerializedState CurrentState;
+
+	// only kept in memory
+	HistoryJournalState Journal;
 } SerializedStateHistory;
 
 typedef class SerializationManager {
@@ -122,6 +223,9 @@ private:
 
 	wstring SettingsFileName;
 
+	// project files are written compressed, set in the settings file
+	bool IsCompressionEnabled;
+
 	float AnimationPosition, AnimationLength, PlaySpeed;
 	bool KinematicModeFlag, PlayAnimaionFlag, LoopAnimationFlag;
 
@@ -130,9 +234,50 @@ private:
 		SerializeSerializedState State;
 
 		wstring FileName;
+
+		// IDs of all histories in order, for the project file and its journal
+		vector<int32> Order;
+		// Histories only hold what changed since the previous commit
+		bool IsJournalCommit;
+		// dropped once a later full save is requested, 0 for files other than the project
+		uint32 Generation;
+		// asked for by the user, written ahead of the autosaves still waiting
+		bool IsExplicit;
+		// for project files
+		bool IsCompressed;
 	} FileSaveRequest;
 
+	// a null request stops the background thread once everything queued before it is written
 	BlockingConcurrentQueue<FileSaveRequest*> DelayedFileSaveRequests;
+	// taken off the queue but not written yet, only used by the background thread
+	vector<FileSaveRequest*> PendingFileSaveRequests;
+
+	HANDLE BackgroundThreadHandle;
+
+	// keyframes inserted by the last AddKeyframes, undone and redone together with the frame pushed before them
+	typedef struct AddedKeyframes {
+		int32 HistoryID;
+		// size of the stack holding that frame, the previous frames until undone, the future frames after
+		size_t FrameCount;
+		bool IsUndone;
+
+		vector<int32> IDs;
+		// taken out of Histories while undone
+		vector<SerializedStateHistory> Histories;
+	} AddedKeyframes;
+
+	AddedKeyframes LastAddedKeyframes;
+
+	// called once the frame pushed with them was undone or redone
+	void ToggleAddedKeyframes(void);
+
+	// autosaves between full saves only append the changes to the journal next to the project
+	bool IsJournalStarted;
+	uint32 JournalCommitCount;
+
+	// keeps the main thread and the background thread off the same files
+	CRITICAL_SECTION FileMutex;
+	uint32 SaveGeneration;
 
 	SerializationManager(void) { };
 
@@ -145,20 +290,31 @@ private:
 	void Serialize(SerializeSerializedState& State);
 	void Deserialize(SerializeSerializedState& State);
 
-	void LoadState(SingleSerializedState& State, XMLDocument& Document, XMLNode* Root);
-	void SaveState(SingleSerializedState& State, XMLDocument& Document, XMLNode* Root);
-
-	void LoadStates(SerializedStateHistory& States, XMLDocument& Document, XMLNode* Root);
+	void SaveState(const SingleSerializedState& State, XMLDocument& Document, XMLNode* Root);
 	void SaveStates(SerializedStateHistory& States, XMLDocument& Document, XMLNode* Root);
 
+	// fills Histories while the file is read, no document is built
+	bool LoadHistoriesFromXML(FILE* File, SerializeSerializedState& State, bool& HaveState);
+
 	void InternalPushStateFrame(bool Forward);
-	void LimitFrames(vector<SingleSerializedState>& Frames, int Limit);
+	void LimitFrames(SerializedStateStack& Frames, int Limit, JournaledFrames* Journaled = nullptr);
+
+	// after frames were taken off the back of a stack
+	static void UpdateJournaledFrames(SerializedStateStack& Frames, JournaledFrames& Journaled);
+	static bool IsHistoryJournaled(SerializedStateHistory& History);
+	static void SetHistoryJournaled(SerializedStateHistory& History);
 
 	const int AutosaveInterval = 30 * 1000;
 
+	// backups kept in the store next to the project, older ones are pruned
 	const int MaxBackupCount = 1000;
+	// printed by ListBackups, newest first
+	const size_t MaxListedBackups = 20;
 
-	const int MaxFrames = 100;
+	const int MaxFrames = 2000;
+
+	// 30 minutes of autosaves before the project file is written in full again
+	const uint32 MaxJournalCommits = 60;
 
 	bool IsFileOpen(void);
 
@@ -170,11 +326,22 @@ private:
 	void ProcessAnimaiton(void);
 
 	void SafeSaveDocumentToFile(XMLDocument& Document, const wstring FileName, int BackupCount);
+	// the texts one after another, replaced the same way as a document
+	void SafeSaveTextToFile(const vector<string>& Texts, const wstring FileName);
+	void SafeReplaceFile(const wstring TempFileName, const wstring FileName, const wstring BackupFileName);
+
+	void SerializeCurrentHistory(void);
+	void AppendToJournal(void);
 
 	void StartBackgroundThread(void);
 	static DWORD WINAPI BackgroundStaticThreadProc(LPVOID lpThreadParameter);
 	void BackgroundThreadProc(void);
+	void CoalesceFileSaveRequests(void);
+	void TakeNextFileSaveRequests(vector<FileSaveRequest*>& Requests);
 	void ExecuteFileSaveRequest(FileSaveRequest& Request);
+	// commits of one journal, appended in a single write
+	void ExecuteJournalCommits(vector<FileSaveRequest*>& Requests);
+	void WriteFileSaveRequest(FileSaveRequest& Request);
 public:
 	static SerializationManager& GetInstance(void) {
 		static SerializationManager Instance;
@@ -190,7 +357,14 @@ public:
 	void LoadFromFile(wstring FileName);
 	void SaveToFile(wstring FileName, bool Delay);
 
+	// appends the changes to the journal, the project file is written in full without Delay and after MaxJournalCommits
 	void Autosave(bool Delay = true);
+	// the open project as XML next to it, in the background
+	void ExportToXML(void);
+	// prints the newest backups of the open project
+	void ListBackups(void);
+	// writes what is still queued and stops the background thread
+	void Shutdown(void);
 
 	void Tick(double dt);
 
@@ -206,6 +380,12 @@ public:
 	bool HaveCurrentHistory(void);
 	int32 GetCurrentHistoryID(void);
 	void SetCurrentHistoryByID(int32 ID);
+	void MirrorAllHistories(void);
+
+	// one new history per keyframe, the current history stays selected
+	void AddKeyframes(vector<CharacterSerializedState>& Keyframes);
+	// writes the keyframes as a file of their own next to the open one, in the background
+	void SaveKeyframesToFile(vector<CharacterSerializedState>& Keyframes, const wstring Suffix);
 	
 	void SetupKinematicMode(void);
 	void CancelKinematicMode(void);
@@ -223,6 +403,14 @@ public:
 	float GetAnimationLength(void);
 	void SetAnimationLength(float Length);
 
+	// keyframes of the animation (current pose included) ordered by timestamp
+	void GetSortedKeyframes(vector<CharacterSerializedState>& Keyframes);
+
+	// playback interpolation, only reads the states so it can run on any thread
+	static void GetStatesAndTFromSortedStates(vector<CharacterSerializedState*>& States, float Position, float Length,
+		CharacterSerializedState*& PrevState, CharacterSerializedState*& NextState, float& t);
+	static void InterpolateStates(CharacterSerializedState& PrevState, CharacterSerializedState& NextState, float t, CharacterSerializedState& Result);
+
 	vector<TimelineItem> GetTimelineItems(void);
 	void SetTimelineItems(vector<TimelineItem> Items);
 
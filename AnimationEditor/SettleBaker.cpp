@@ -0,0 +1,340 @@
+#include "SettleBaker.hpp"
+
+#include <algorithm>
+#include <ppl.h>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "CharacterManager.hpp"
+
+// SettleWorld
+
+SettleWorld::SettleWorld(Character* Char, int SolverIterations)
+{
+	this->Char = Char;
+
+	CollisionConfiguration = new btDefaultCollisionConfiguration();
+	Dispatcher = new btCollisionDispatcher(CollisionConfiguration);
+	Broadphase = new btDbvtBroadphase();
+	Solver = new btSequentialImpulseConstraintSolver;
+
+	World = new btDiscreteDynamicsWorld(Dispatcher, Broadphase, Solver, CollisionConfiguration);
+
+	World->getSolverInfo().m_numIterations = SolverIterations;
+	World->setGravity(btVector3(0, 0, -Gravity));
+
+	Filter.Build(Char);
+	World->getPairCache()->setOverlapFilterCallback(&Filter);
+
+	PhysicsManager& Physics = PhysicsManager::GetInstance();
+
+	Floor = AddBox(translate(mat4(1.0f), Physics.GetFloorPosition()), Physics.GetFloorSize(), 0.0f);
+
+	Bodies.resize(Char->Bones.size(), nullptr);
+	Constraints.resize(Char->Bones.size(), nullptr);
+
+	for (Bone* Bone : Char->Bones) {
+
+		btRigidBody* Body = AddBox(Bone->WorldTransform * Bone->MiddleTranslation, Bone->Size, Bone->Mass);
+		Body->setUserIndex(Bone->ID);
+		Body->setDamping(LinearDamping, AngularDamping);
+
+		World->addRigidBody(Body);
+
+		Bodies[Bone->ID] = Body;
+	}
+
+	World->addRigidBody(Floor);
+
+	for (Bone* Child : Char->Bones)
+		CreateConstraint(Child);
+}
+
+SettleWorld::~SettleWorld(void)
+{
+	for (btTypedConstraint* Constraint : Constraints)
+		if (Constraint != nullptr) {
+			World->removeConstraint(Constraint);
+			delete Constraint;
+		}
+
+	Bodies.push_back(Floor);
+
+	for (btRigidBody* Body : Bodies) {
+		World->removeRigidBody(Body);
+		delete Body->getMotionState();
+		delete Body->getCollisionShape();
+		delete Body;
+	}
+
+	delete World;
+	delete Solver;
+	delete Broadphase;
+	delete Dispatcher;
+	delete CollisionConfiguration;
+}
+
+btRigidBody* SettleWorld::AddBox(mat4 Transform, vec3 Size, float Mass)
+{
+	Size *= 0.5f;
+	btCollisionShape* Shape = new btBoxShape(btVector3(Size.x, Size.y, Size.z));
+
+	btVector3 LocalInertia(0, 0, 0);
+	if (Mass > 0)
+		Shape->calculateLocalInertia(Mass, LocalInertia);
+
+	btDefaultMotionState* MotionState = new btDefaultMotionState(GLMToBullet(Transform));
+	btRigidBody::btRigidBodyConstructionInfo BodyDef(Mass, MotionState, Shape, LocalInertia);
+	btRigidBody* Body = new btRigidBody(BodyDef);
+
+	Body->setFriction(1.0);
+	Body->setRestitution(0.0);
+
+	return Body;
+}
+
+void SettleWorld::CreateConstraint(Bone* Child)
+{
+	const PhysicsManager::JointDescriptor& Joint = PhysicsManager::GetInstance().GetJointDescriptor(Child);
+
+	btRigidBody* ParentBody = Child->Parent != nullptr ? Bodies[Child->Parent->ID] : nullptr;
+	btRigidBody* ChildBody = Bodies[Child->ID];
+
+	btTypedConstraint* Result = nullptr;
+
+	// same joints as PhysicsManager::UpdateBoneConstraint with nothing blocked
+	switch (Joint.Kind) {
+	case PhysicsManager::RootJoint:
+		break;
+
+	case PhysicsManager::FixedJoint:
+		Result = new btFixedConstraint(*ParentBody, *ChildBody, Joint.ParentFrame, Joint.ChildFrame);
+		break;
+
+	case PhysicsManager::HingeJoint: {
+
+		btVector3 Axis(0, 0, 0);
+		Axis[Joint.HingeAxis] = 1;
+
+		btHingeConstraint* Constraint = new btHingeConstraint(*ParentBody, *ChildBody, Joint.ParentFrame.getOrigin(), Joint.ChildFrame.getOrigin(),
+			Axis, Axis);
+
+		Constraint->setLimit(Joint.LowLimit[Joint.HingeAxis], Joint.HighLimit[Joint.HingeAxis]);
+
+		Result = Constraint;
+		break;
+	}
+
+	case PhysicsManager::GenericJoint: {
+
+		btGeneric6DofSpring2Constraint* Constraint = new btGeneric6DofSpring2Constraint(*ParentBody, *ChildBody, Joint.ParentFrame, Joint.ChildFrame);
+
+		Constraint->setLinearLowerLimit(btVector3(0, 0, 0));
+		Constraint->setLinearUpperLimit(btVector3(0, 0, 0));
+
+		for (int i = 0; i < 6; i++)
+			Constraint->setStiffness(i, 0);
+
+		Constraint->setAngularLowerLimit(GLMToBullet(Joint.LowLimit));
+		Constraint->setAngularUpperLimit(GLMToBullet(Joint.HighLimit));
+
+		Result = Constraint;
+		break;
+	}
+	}
+
+	if (Result != nullptr)
+		World->addConstraint(Result, true);
+
+	Constraints[Child->ID] = Result;
+}
+
+void SettleWorld::SetPose(SettlePose& Pose, SettleVariation& Variation)
+{
+	vector<mat4> WorldTransforms;
+
+	Char->CalculateWorldTransforms(Pose.Position + vec3(0, 0, Variation.DropHeight), Pose.Rotations, WorldTransforms);
+
+	for (Bone* Bone : Char->Bones) {
+
+		btRigidBody* Body = Bodies[Bone->ID];
+
+		btTransform Transform = GLMToBullet(WorldTransforms[Bone->ID] * Bone->MiddleTranslation);
+
+		Body->setWorldTransform(Transform);
+		Body->getMotionState()->setWorldTransform(Transform);
+
+		Body->setLinearVelocity(GLMToBullet(Variation.LinearVelocity));
+		Body->setAngularVelocity(GLMToBullet(Variation.AngularVelocity));
+		Body->clearForces();
+		Body->setFriction(Variation.Friction);
+
+		Body->activate(true);
+	}
+
+	Floor->setFriction(Variation.Friction);
+}
+
+void SettleWorld::GetPose(vector<wstring>& BoneNames, CharacterSerializedState& State)
+{
+	vector<quat> WorldRotations(Char->Bones.size());
+
+	State.Bones.clear();
+
+	// same decomposition as Bone::UpdateRotationFromWorldTransform
+	for (Bone* Bone : Char->Bones) {
+
+		mat4 WorldTransform = BulletToGLM(Bodies[Bone->ID]->getWorldTransform()) * inverse(Bone->MiddleTranslation);
+
+		WorldRotations[Bone->ID] = quat_cast(mat3(WorldTransform));
+
+		quat Rotation = WorldRotations[Bone->ID];
+
+		if (Bone->Parent != nullptr)
+			Rotation = inverse(WorldRotations[Bone->Parent->ID]) * Rotation;
+		else
+			State.Position = WorldTransform[3];
+
+		State.Bones.push_back({ BoneNames[Bone->ID], Rotation });
+	}
+}
+
+float SettleWorld::GetMaxBoneSpeed(void)
+{
+	float Result = 0;
+
+	for (btRigidBody* Body : Bodies)
+		Result = std::max(Result, (float)Body->getLinearVelocity().length());
+
+	return Result;
+}
+
+void SettleWorld::Simulate(SettlePose& Pose, SettleVariation& Variation, vector<wstring>& BoneNames, uint32 StartTimestamp, SettleResult& Result)
+{
+	SettleBaker& Baker = SettleBaker::GetInstance();
+
+	SetPose(Pose, Variation);
+
+	// contacts of the previous variation would warm start this one
+	for (btRigidBody* Body : Bodies)
+		World->getPairCache()->cleanProxyFromPairs(Body->getBroadphaseHandle(), Dispatcher);
+
+	Solver->reset();
+
+	Result.Keyframes.clear();
+	Result.IsSettled = false;
+	Result.SettleTime = Baker.MaxDuration;
+
+	double Time = 0, NextKeyframeTime = 0, SettledSince = 0;
+
+	while (true) {
+
+		if (Time >= NextKeyframeTime - Baker.StepDt * 0.5) {
+
+			CharacterSerializedState State;
+			State.AnimationTimestamp = StartTimestamp + (uint32)(Time * 1000.0 + 0.5);
+
+			GetPose(BoneNames, State);
+
+			Result.Keyframes.push_back(State);
+
+			NextKeyframeTime += Baker.KeyframeInterval;
+		}
+
+		if (Result.IsSettled || Time >= Baker.MaxDuration)
+			break;
+
+		World->stepSimulation((btScalar)Baker.StepDt, 0, (btScalar)Baker.StepDt);
+
+		Time += Baker.StepDt;
+
+		if (GetMaxBoneSpeed() > Baker.SettledSpeed)
+			SettledSince = Time;
+		else
+		if (Time - SettledSince >= Baker.SettledDuration) {
+
+			Result.IsSettled = true;
+			Result.SettleTime = Time;
+
+			// the settled pose always ends the sequence
+			NextKeyframeTime = Time;
+		}
+	}
+}
+
+// SettleBaker
+
+vector<SettleVariation> SettleBaker::GenerateVariations(int32 Count)
+{
+	vector<SettleVariation> Result;
+
+	// fixed seed, a bake can be repeated
+	uint32 Seed = 12345;
+
+	auto Random = [&Seed](float Min, float Max) {
+		Seed = Seed * 1664525u + 1013904223u;
+		return Min + (Max - Min) * ((Seed >> 8) / (float)(1 << 24));
+	};
+
+	for (int32 Index = 0; Index < Count; Index++) {
+
+		SettleVariation Variation = {};
+		Variation.Friction = 1.0f;
+
+		// the first variation is a plain drop
+		if (Index > 0) {
+			Variation.LinearVelocity = { Random(-1.5f, 1.5f), Random(-1.5f, 1.5f), Random(0.0f, 1.0f) };
+			Variation.AngularVelocity = { Random(-2.0f, 2.0f), Random(-2.0f, 2.0f), Random(-1.0f, 1.0f) };
+			Variation.DropHeight = Random(0.0f, 0.3f);
+			Variation.Friction = Random(0.5f, 1.0f);
+		}
+
+		Result.push_back(Variation);
+	}
+
+	return Result;
+}
+
+void SettleBaker::Bake(CharacterSerializedState& Start, vector<SettleVariation>& Variations, vector<SettleResult>& Results)
+{
+	Character* Char = CharacterManager::GetInstance().GetCharacter();
+
+	SettlePose Pose;
+	Pose.Position = Start.Position;
+	Pose.Rotations.assign(Char->Bones.size(), quat(1, 0, 0, 0));
+
+	vector<wstring> BoneNames(Char->Bones.size());
+
+	for (Bone* Bone : Char->Bones)
+		BoneNames[Bone->ID] = Bone->GetName();
+
+	for (SerializedBone& SerializedBone : Start.Bones) {
+
+		Bone* Bone = Char->FindBone(SerializedBone.Name);
+		if (Bone != nullptr)
+			Pose.Rotations[Bone->ID] = SerializedBone.Rotation;
+	}
+
+	Results.clear();
+	Results.resize(Variations.size());
+
+	// worlds are built once per worker thread and reused for the variations it picks up
+	concurrency::combinable<SettleWorld*> Worlds;
+
+	concurrency::parallel_for(size_t(0), Variations.size(), [&](size_t Index) {
+
+		SettleWorld*& World = Worlds.local();
+		if (World == nullptr)
+			World = new SettleWorld(Char, SolverIterations);
+
+		World->Simulate(Pose, Variations[Index], BoneNames, Start.AnimationTimestamp, Results[Index]);
+	});
+
+	Worlds.combine_each([](SettleWorld* World) {
+		delete World;
+	});
+
+	for (size_t Index = 0; Index < Results.size(); Index++)
+		printf("Settle variation %d: %d keyframes, %s after %.2f s\n", (int32)Index, (int32)Results[Index].Keyframes.size(),
+			Results[Index].IsSettled ? "settled" : "still moving", Results[Index].SettleTime);
+}
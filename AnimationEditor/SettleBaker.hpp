@@ -0,0 +1,108 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include <btBulletDynamicsCommon.h>
+
+#include "Character.hpp"
+#include "PhysicsManager.hpp"
+#include "SerializationManager.hpp"
+
+using namespace std;
+using namespace glm;
+
+typedef struct SettleVariation {
+	// given to every bone at the start, the pose is thrown instead of dropped
+	vec3 LinearVelocity, AngularVelocity;
+	// lifts the pose above its keyframe before the drop
+	float DropHeight;
+	float Friction;
+} SettleVariation;
+
+typedef struct SettlePose {
+	vec3 Position;
+	// indexed by bone ID
+	vector<quat> Rotations;
+} SettlePose;
+
+typedef struct SettleResult {
+	// one keyframe per KeyframeInterval, the last one is the settled pose
+	vector<CharacterSerializedState> Keyframes;
+	bool IsSettled;
+	double SettleTime;
+} SettleResult;
+
+// Ragdoll of one character in a world of its own, with gravity and the floor. Joints and limits come
+// from the joint descriptors of PhysicsManager, blocking and pinpoints of the editor are not applied.
+// Only reads the character, so any number of them can simulate at once on different threads.
+typedef class SettleWorld {
+private:
+	const float Gravity = 9.81f;
+
+	const float LinearDamping = 0.05f;
+	const float AngularDamping = 0.1f;
+
+	Character* Char;
+
+	btDefaultCollisionConfiguration* CollisionConfiguration;
+	btCollisionDispatcher* Dispatcher;
+	btBroadphaseInterface* Broadphase;
+	btSequentialImpulseConstraintSolver* Solver;
+	btDiscreteDynamicsWorld* World;
+
+	PhysicsManager::BoneFilterCallback Filter;
+
+	btRigidBody* Floor;
+
+	// indexed by bone ID
+	vector<btRigidBody*> Bodies;
+	vector<btTypedConstraint*> Constraints;
+
+	btRigidBody* AddBox(mat4 Transform, vec3 Size, float Mass);
+	void CreateConstraint(Bone* Child);
+
+	void SetPose(SettlePose& Pose, SettleVariation& Variation);
+	void GetPose(vector<wstring>& BoneNames, CharacterSerializedState& State);
+
+	float GetMaxBoneSpeed(void);
+public:
+	SettleWorld(Character* Char, int SolverIterations);
+	~SettleWorld(void);
+
+	void Simulate(SettlePose& Pose, SettleVariation& Variation, vector<wstring>& BoneNames, uint32 StartTimestamp, SettleResult& Result);
+} SettleWorld;
+
+// Bakes fall and settle animations offline, one SettleWorld per worker thread, variations in parallel.
+typedef class SettleBaker {
+private:
+	SettleBaker(void) { };
+
+	const int32 SolverIterations = 30;
+public:
+	static SettleBaker& GetInstance(void) {
+		static SettleBaker Instance;
+
+		return Instance;
+	}
+
+	SettleBaker(SettleBaker const&) = delete;
+	void operator=(SettleBaker const&) = delete;
+
+	const double StepDt = 1.0 / 240.0;
+	const double KeyframeInterval = 0.1;
+	const double MaxDuration = 5.0;
+
+	// every bone slower than this for SettledDuration ends the simulation
+	const float SettledSpeed = 0.02f;
+	const double SettledDuration = 0.25;
+
+	// variations used by the bulk bake, the same count always gives the same variations
+	const int32 BulkVariationCount = 16;
+
+	vector<SettleVariation> GenerateVariations(int32 Count);
+
+	void Bake(CharacterSerializedState& Start, vector<SettleVariation>& Variations, vector<SettleResult>& Results);
+} SettleBaker;
@@ -0,0 +1,310 @@
+#include "XMLStreamReader.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+
+XMLStreamReader::XMLStreamReader(FILE* File)
+{
+	this->File = File;
+
+	Buffer.resize(ChunkSize);
+	Position = 0;
+	Size = 0;
+
+	AttributeCount = 0;
+	IsEndPending = false;
+}
+
+bool XMLStreamReader::Fill(void)
+{
+	Position = 0;
+	Size = File != nullptr ? fread(Buffer.data(), 1, Buffer.size(), File) : 0;
+
+	return Size > 0;
+}
+
+int XMLStreamReader::Peek(void)
+{
+	if (Position == Size && !Fill())
+		return EOF;
+
+	return (unsigned char)Buffer[Position];
+}
+
+int XMLStreamReader::Get(void)
+{
+	int Result = Peek();
+	if (Result != EOF)
+		Position++;
+
+	return Result;
+}
+
+void XMLStreamReader::SkipWhitespace(void)
+{
+	int c = Peek();
+
+	while (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+		Position++;
+		c = Peek();
+	}
+}
+
+bool XMLStreamReader::SkipPast(const char* Terminator)
+{
+	size_t Length = strlen(Terminator), Matched = 0;
+
+	while (Matched < Length) {
+
+		int c = Get();
+		if (c == EOF)
+			return false;
+
+		if (c == Terminator[Matched]) {
+			Matched++;
+			continue;
+		}
+
+		// what was matched is a prefix of the terminator, so the longest part of it and c that starts
+		// the terminator again is found within the terminator itself; "--->" still ends a comment
+		size_t Restart = Matched;
+
+		while (Restart > 0 && !(Terminator[Restart - 1] == c && strncmp(Terminator, Terminator + Matched - Restart + 1, Restart - 1) == 0))
+			Restart--;
+
+		Matched = Restart;
+	}
+
+	return true;
+}
+
+void XMLStreamReader::ReadName(string& Result)
+{
+	Result.clear();
+
+	int c = Peek();
+
+	while (c != EOF && c != ' ' && c != '\t' && c != '\r' && c != '\n' && c != '/' && c != '>' && c != '=') {
+		Result.push_back((char)c);
+		Position++;
+		c = Peek();
+	}
+}
+
+bool XMLStreamReader::ReadValue(string& Result, char Quote)
+{
+	Result.clear();
+
+	while (true) {
+
+		int c = Get();
+		if (c == EOF)
+			return false;
+
+		if (c == Quote)
+			return true;
+
+		if (c != '&') {
+			Result.push_back((char)c);
+			continue;
+		}
+
+		string Entity;
+
+		for (c = Get(); c != ';'; c = Get()) {
+			if (c == EOF || c == Quote)
+				return false;
+			Entity.push_back((char)c);
+		}
+
+		if (Entity == "amp")
+			Result.push_back('&');
+		else
+		if (Entity == "lt")
+			Result.push_back('<');
+		else
+		if (Entity == "gt")
+			Result.push_back('>');
+		else
+		if (Entity == "quot")
+			Result.push_back('"');
+		else
+		if (Entity == "apos")
+			Result.push_back('\'');
+		else
+		if (!Entity.empty() && Entity[0] == '#') {
+
+			// names are read byte-wise like s2ws does, so only single byte characters are kept
+			unsigned long Code = Entity.size() > 1 && (Entity[1] == 'x' || Entity[1] == 'X') ?
+				strtoul(Entity.c_str() + 2, nullptr, 16) : strtoul(Entity.c_str() + 1, nullptr, 10);
+
+			Result.push_back(Code < 256 ? (char)Code : '?');
+		}
+		else
+			Result += "&" + Entity + ";";
+	}
+}
+
+XMLStreamEvent XMLStreamReader::Next(void)
+{
+	if (IsEndPending) {
+		IsEndPending = false;
+		return XMLElementEnd;
+	}
+
+	while (true) {
+
+		// text between elements is not part of the schema
+		int c;
+		do {
+			c = Get();
+		} while (c != EOF && c != '<');
+
+		if (c == EOF)
+			return XMLStreamEnd;
+
+		c = Peek();
+
+		if (c == '?') {
+			if (!SkipPast("?>"))
+				return XMLStreamError;
+			continue;
+		}
+
+		if (c == '!') {
+
+			Position++;
+
+			bool IsComment = Get() == '-' && Get() == '-';
+			if (!SkipPast(IsComment ? "-->" : ">"))
+				return XMLStreamError;
+			continue;
+		}
+
+		if (c == '/') {
+
+			Position++;
+
+			ReadName(Name);
+			if (!SkipPast(">"))
+				return XMLStreamError;
+
+			return XMLElementEnd;
+		}
+
+		ReadName(Name);
+		if (Name.empty())
+			return XMLStreamError;
+
+		AttributeCount = 0;
+
+		while (true) {
+
+			SkipWhitespace();
+
+			c = Get();
+
+			if (c == '>')
+				return XMLElementStart;
+
+			if (c == '/') {
+
+				if (Get() != '>')
+					return XMLStreamError;
+
+				IsEndPending = true;
+
+				return XMLElementStart;
+			}
+
+			if (c == EOF)
+				return XMLStreamError;
+
+			Position--;
+
+			if (AttributeCount == Attributes.size())
+				Attributes.push_back(Attribute());
+
+			Attribute& Current = Attributes[AttributeCount++];
+
+			ReadName(Current.Name);
+
+			SkipWhitespace();
+			if (Get() != '=')
+				return XMLStreamError;
+
+			SkipWhitespace();
+
+			int Quote = Get();
+			if (Quote != '"' && Quote != '\'')
+				return XMLStreamError;
+
+			if (!ReadValue(Current.Value, (char)Quote))
+				return XMLStreamError;
+		}
+	}
+}
+
+const string& XMLStreamReader::GetName(void)
+{
+	return Name;
+}
+
+const string* XMLStreamReader::FindAttribute(const char* AttributeName)
+{
+	for (size_t Index = 0; Index < AttributeCount; Index++)
+		if (Attributes[Index].Name == AttributeName)
+			return &Attributes[Index].Value;
+
+	return nullptr;
+}
+
+string XMLStreamReader::GetAttribute(const char* AttributeName)
+{
+	const string* Value = FindAttribute(AttributeName);
+
+	return Value != nullptr ? *Value : string();
+}
+
+float XMLStreamReader::GetFloatAttribute(const char* AttributeName, float DefaultValue)
+{
+	const string* Value = FindAttribute(AttributeName);
+	if (Value == nullptr)
+		return DefaultValue;
+
+	char* End;
+	float Result = strtof(Value->c_str(), &End);
+
+	return End != Value->c_str() ? Result : DefaultValue;
+}
+
+bool XMLStreamReader::GetBoolAttribute(const char* AttributeName, bool DefaultValue)
+{
+	const string* Value = FindAttribute(AttributeName);
+	if (Value == nullptr)
+		return DefaultValue;
+
+	// same spellings as tinyxml2
+	if (*Value == "true" || *Value == "True" || *Value == "TRUE")
+		return true;
+
+	if (*Value == "false" || *Value == "False" || *Value == "FALSE")
+		return false;
+
+	char* End;
+	long Result = strtol(Value->c_str(), &End, 10);
+
+	return End != Value->c_str() ? Result != 0 : DefaultValue;
+}
+
+uint32 XMLStreamReader::GetUInt32Attribute(const char* AttributeName, uint32 DefaultValue)
+{
+	const string* Value = FindAttribute(AttributeName);
+	if (Value == nullptr)
+		return DefaultValue;
+
+	char* End;
+	unsigned long Result = strtoul(Value->c_str(), &End, 10);
+
+	return End != Value->c_str() ? (uint32)Result : DefaultValue;
+}
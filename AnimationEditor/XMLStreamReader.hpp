@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+using namespace std;
+using namespace glm;
+
+typedef enum XMLStreamEvent {
+	XMLElementStart,
+	XMLElementEnd,
+	XMLStreamEnd,
+	XMLStreamError
+} XMLStreamEvent;
+
+// Pull parser over a file read in fixed-size chunks, nothing but the current element is kept.
+// Reports element starts with their attributes and element ends, a self-closing element gives
+// both; text, comments and declarations are skipped. Enough of XML for the files tinyxml2 writes.
+typedef class XMLStreamReader {
+private:
+	static const size_t ChunkSize = 64 * 1024;
+
+	FILE* File;
+
+	vector<char> Buffer;
+	size_t Position, Size;
+
+	string Name;
+
+	typedef struct Attribute {
+		string Name, Value;
+	} Attribute;
+
+	// reused between elements, only the first AttributeCount are valid
+	vector<Attribute> Attributes;
+	size_t AttributeCount;
+
+	bool IsEndPending;
+
+	bool Fill(void);
+	int Peek(void);
+	int Get(void);
+
+	void SkipWhitespace(void);
+	bool SkipPast(const char* Terminator);
+	void ReadName(string& Result);
+	bool ReadValue(string& Result, char Quote);
+
+	const string* FindAttribute(const char* AttributeName);
+public:
+	XMLStreamReader(FILE* File);
+
+	XMLStreamEvent Next(void);
+
+	// name of the element just started or ended
+	const string& GetName(void);
+
+	string GetAttribute(const char* AttributeName);
+	float GetFloatAttribute(const char* AttributeName, float DefaultValue = 0.0f);
+	bool GetBoolAttribute(const char* AttributeName, bool DefaultValue = true);
+	uint32 GetUInt32Attribute(const char* AttributeName, uint32 DefaultValue = 0);
+} XMLStreamReader;
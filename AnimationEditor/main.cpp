@@ -10,6 +10,7 @@
 #include "InputManager.hpp"
 #include "PhysicsManager.hpp"
 #include "PoseManager.hpp"
+#include "RecordingManager.hpp"
 
 void OpenConsole(void) {
 
@@ -61,11 +62,49 @@ wstring GetWorkingDirectory(void) {
 	return NPath;
 }
 
+// value of -option=<value>, up to the next space unless quoted
+wstring GetCommandLineValue(LPWSTR lpCmdLine, const wchar_t* Option) {
+
+	const wchar_t* Start = wcsstr(lpCmdLine, Option);
+	if (Start == nullptr)
+		return L"";
+
+	Start += wcslen(Option);
+
+	wchar_t Terminator = L' ';
+	if (*Start == L'"')
+		Terminator = *Start++;
+
+	const wchar_t* End = wcschr(Start, Terminator);
+	if (End == nullptr)
+		End = Start + wcslen(Start);
+
+	return wstring(Start, End);
+}
+
 int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
 	_In_ LPWSTR lpCmdLine, _In_ int nCmdShow)
 {
 	UNREFERENCED_PARAMETER(hPrevInstance);
-	UNREFERENCED_PARAMETER(lpCmdLine);
+
+	bool UseMultiBody = wcsstr(lpCmdLine, L"-multibody") != nullptr;
+
+	// -budget=<ms>: CPU time the physics may take per frame
+	const wchar_t* BudgetOption = wcsstr(lpCmdLine, L"-budget=");
+	if (BudgetOption != nullptr)
+		PhysicsManager::GetInstance().SetTickBudget(_wtof(BudgetOption + wcslen(L"-budget=")) / 1000.0);
+
+	// -broadphase=sap: sweep and prune over the floor bounds instead of the dynamic AABB tree
+	if (GetCommandLineValue(lpCmdLine, L"-broadphase=") == L"sap")
+		PhysicsManager::GetInstance().SetBroadphase(PhysicsManager::SweepAndPruneBroadphase);
+
+	// -noprediction: IK chases the raw mouse target, for comparing convergence
+	if (wcsstr(lpCmdLine, L"-noprediction") != nullptr)
+		PhysicsManager::GetInstance().SetTargetPrediction(false);
+
+	// -record=<file>: saves everything that drives posing, -replay=<file> runs it again without a window
+	wstring RecordFileName = GetCommandLineValue(lpCmdLine, L"-record=");
+	wstring ReplayFileName = GetCommandLineValue(lpCmdLine, L"-replay=");
 
 	wstring WorkingDirectory = GetWorkingDirectory();
 
@@ -73,6 +112,15 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance
 
 	InitTime();
 
+	if (!ReplayFileName.empty()) {
+
+		CharacterManager::GetInstance().Initialize();
+		PhysicsManager::GetInstance().Initialize(UseMultiBody);
+		PoseManager::GetInstance().Initialize();
+
+		return RecordingManager::GetInstance().Replay(ReplayFileName);
+	}
+
 	if (!SetupExternalGUI())
 		return -1;
 
@@ -87,14 +135,23 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance
 	InputManager::GetInstance().SetWindow(WindowHandle);
 
 	Render::GetInstance().Initialize(WindowHandle);
-	PhysicsManager::GetInstance().Initialize();
+	PhysicsManager::GetInstance().Initialize(UseMultiBody);
 	PoseManager::GetInstance().Initialize();
 
 	SerializationManager::GetInstance().Initialize(WorkingDirectory);
 
+	if (!RecordFileName.empty())
+		RecordingManager::GetInstance().StartRecording(RecordFileName);
+
+	PhysicsManager::GetInstance().StartThread();
+
 	LastTick = GetTime();
 	aegRun();
 
+	PhysicsManager::GetInstance().StopThread();
+
+	RecordingManager::GetInstance().StopRecording();
+
 	aegFinalize();
 
 	UnloadExternalGUI();